@@ -0,0 +1,32 @@
+#ifndef MPERF_H
+#define MPERF_H
+
+/// Annotated regions for the roofline analysis.
+///
+/// Code between mperf_region_begin and mperf_region_end is reported like a
+/// loop that runs once per entry, with the operations and bytes of all the
+/// code in it. The Clang plugin replaces the calls when it instruments a
+/// file, builds without it call the no-op definitions in the collector.
+///
+/// A region ends in the function it begins in. Its begin must come before
+/// each of its ends on every path, and regions nest but do not overlap. The
+/// name must be a string literal, the loop ID of a region derives from it and
+/// the function, so the region keeps its ID across builds.
+
+#ifdef __cplusplus
+#define MPERF_NOEXCEPT noexcept
+extern "C" {
+#else
+#define MPERF_NOEXCEPT
+#endif
+
+void mperf_region_begin(const char *name) MPERF_NOEXCEPT;
+void mperf_region_end(void) MPERF_NOEXCEPT;
+
+#ifdef __cplusplus
+}
+#endif
+
+#undef MPERF_NOEXCEPT
+
+#endif // MPERF_H
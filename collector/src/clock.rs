@@ -0,0 +1,278 @@
+//! Timestamps of the collector, in nanoseconds of `CLOCK_MONOTONIC_RAW`.
+//!
+//! Many kernels do not serve the raw monotonic clock from the vDSO, so every
+//! `clock_gettime` call is a system call. Loop hooks read the constant rate
+//! counter of the CPU instead, the invariant TSC on x86-64, `cntvct_el0` on
+//! AArch64 and `rdtime` on RISC-V, converted with the frequency the CPU or the
+//! kernel reports and an offset against the monotonic clock. The frequency is
+//! only calibrated against the monotonic clock when neither reports it. This
+//! happens on the first timestamp, so processes that never enter an
+//! instrumented loop do not pay for it. Timestamps stay in the clock domain
+//! they always had.
+
+use lazy_static::lazy_static;
+
+/// Time the counter is calibrated over when its frequency is unknown. The
+/// scale is then off by about the cost of a clock read over this span, and
+/// long runs drift from the monotonic clock accordingly.
+const CALIBRATION_NS: u64 = 10_000_000;
+/// Reads taken to find the cheapest one, see `read_overhead`.
+const OVERHEAD_SAMPLES: usize = 256;
+
+lazy_static! {
+    static ref COUNTER_CLOCK: Option<CounterClock> = CounterClock::calibrate();
+    static ref READ_OVERHEAD: u64 = measure_read_overhead();
+}
+
+/// Maps counter ticks to nanoseconds of the monotonic clock.
+#[derive(Debug, Clone, Copy)]
+struct CounterClock {
+    base_ticks: u64,
+    base_ns: u64,
+    /// Nanoseconds per tick, in 32.32 fixed point.
+    scale: u64,
+}
+
+impl CounterClock {
+    fn calibrate() -> Option<Self> {
+        if !counter_is_constant_rate() {
+            return None;
+        }
+
+        let (start_ns, start_ticks) = paired_read();
+        let scale = match counter_frequency() {
+            Some(frequency) => ((1_000_000_000_u128 << 32) / u128::from(frequency)) as u64,
+            None => {
+                let (end_ns, end_ticks) = loop {
+                    let (ns, ticks) = paired_read();
+                    if ns.saturating_sub(start_ns) >= CALIBRATION_NS {
+                        break (ns, ticks);
+                    }
+                };
+                let ticks = end_ticks
+                    .checked_sub(start_ticks)
+                    .filter(|&ticks| ticks > 0)?;
+                ((u128::from(end_ns - start_ns) << 32) / u128::from(ticks)) as u64
+            }
+        };
+
+        // The offset comes from a fresh pair, the counter of the first one may
+        // be behind by the whole calibration.
+        let (base_ns, base_ticks) = paired_read();
+        (scale > 0).then_some(CounterClock {
+            base_ticks,
+            base_ns,
+            scale,
+        })
+    }
+
+    fn to_ns(self, ticks: u64) -> u64 {
+        // Counters of different cores may be a few ticks apart, a read on
+        // another core than the calibration must not wrap around.
+        let delta = ticks.saturating_sub(self.base_ticks);
+        self.base_ns
+            .saturating_add(((u128::from(delta) * u128::from(self.scale)) >> 32) as u64)
+    }
+}
+
+/// Nanoseconds of `CLOCK_MONOTONIC_RAW`.
+#[inline]
+pub fn timestamp() -> u64 {
+    match COUNTER_CLOCK.as_ref() {
+        Some(clock) => clock.to_ns(read_counter()),
+        None => monotonic_raw_ns(),
+    }
+}
+
+/// Time a `timestamp` call adds to any interval it bounds, measured as the
+/// smallest difference between two timestamps taken back to back. Loop hooks
+/// subtract it from the durations they report.
+pub fn read_overhead() -> u64 {
+    *READ_OVERHEAD
+}
+
+fn measure_read_overhead() -> u64 {
+    (0..OVERHEAD_SAMPLES)
+        .map(|_| {
+            let start = timestamp();
+            timestamp().saturating_sub(start)
+        })
+        .min()
+        .unwrap_or(0)
+}
+
+fn monotonic_raw_ns() -> u64 {
+    let mut ts: libc::timespec = libc::timespec {
+        tv_sec: 0,
+        tv_nsec: 0,
+    };
+    unsafe { libc::clock_gettime(libc::CLOCK_MONOTONIC_RAW, &mut ts) };
+    (ts.tv_sec * 1_000_000_000 + ts.tv_nsec) as u64
+}
+
+/// Reads the monotonic clock between two counter reads and returns it with
+/// the counter value halfway between them. Of a few attempts the one with
+/// the narrowest bracket wins, which leaves out reads that were preempted.
+fn paired_read() -> (u64, u64) {
+    (0..8)
+        .map(|_| {
+            let before = read_counter();
+            let ns = monotonic_raw_ns();
+            let after = read_counter();
+            let width = after.saturating_sub(before);
+            (width, ns, before + width / 2)
+        })
+        .min_by_key(|&(width, _, _)| width)
+        .map(|(_, ns, ticks)| (ns, ticks))
+        .unwrap()
+}
+
+#[cfg(target_arch = "x86_64")]
+#[inline]
+fn read_counter() -> u64 {
+    unsafe { core::arch::x86_64::_rdtsc() }
+}
+
+/// CPUID reports an invariant TSC, which runs at a fixed rate in every
+/// P-, C- and T-state.
+#[cfg(target_arch = "x86_64")]
+fn counter_is_constant_rate() -> bool {
+    use core::arch::x86_64::__cpuid;
+
+    let max_extended = unsafe { __cpuid(0x8000_0000) }.eax;
+    max_extended >= 0x8000_0007 && unsafe { __cpuid(0x8000_0007) }.edx & (1 << 8) != 0
+}
+
+/// The nominal TSC frequency of CPUID leaf 0x15, the crystal clock times the
+/// TSC to crystal ratio, or else the frequency the kernel converts perf time
+/// with.
+#[cfg(target_arch = "x86_64")]
+fn counter_frequency() -> Option<u64> {
+    use core::arch::x86_64::__cpuid;
+
+    let from_cpuid = (unsafe { __cpuid(0) }.eax >= 0x15)
+        .then(|| unsafe { __cpuid(0x15) })
+        // Several parts report the ratio but leave the crystal clock out.
+        .filter(|leaf| leaf.eax != 0 && leaf.ebx != 0 && leaf.ecx != 0)
+        .map(|leaf| u64::from(leaf.ecx) * u64::from(leaf.ebx) / u64::from(leaf.eax));
+    from_cpuid.or_else(pmu::host_time_counter_frequency)
+}
+
+#[cfg(target_arch = "aarch64")]
+#[inline]
+fn read_counter() -> u64 {
+    let value: u64;
+    unsafe {
+        core::arch::asm!(
+            "mrs {value}, cntvct_el0",
+            value = out(reg) value,
+            options(nomem, nostack, preserves_flags)
+        );
+    }
+    value
+}
+
+/// The generic timer runs at a fixed rate by definition.
+#[cfg(target_arch = "aarch64")]
+fn counter_is_constant_rate() -> bool {
+    true
+}
+
+#[cfg(target_arch = "aarch64")]
+fn counter_frequency() -> Option<u64> {
+    let frequency: u64;
+    unsafe {
+        core::arch::asm!(
+            "mrs {frequency}, cntfrq_el0",
+            frequency = out(reg) frequency,
+            options(nomem, nostack, preserves_flags)
+        );
+    }
+    // Firmware is supposed to program the register, but not all of it does.
+    (frequency > 0)
+        .then_some(frequency)
+        .or_else(pmu::host_time_counter_frequency)
+}
+
+#[cfg(target_arch = "riscv64")]
+#[inline]
+fn read_counter() -> u64 {
+    let value: u64;
+    unsafe {
+        core::arch::asm!(
+            "rdtime {value}",
+            value = out(reg) value,
+            options(nomem, nostack, preserves_flags)
+        );
+    }
+    value
+}
+
+/// The `time` CSR counts wall-clock time at a fixed rate by definition.
+#[cfg(target_arch = "riscv64")]
+fn counter_is_constant_rate() -> bool {
+    true
+}
+
+#[cfg(target_arch = "riscv64")]
+fn counter_frequency() -> Option<u64> {
+    None
+}
+
+#[cfg(not(any(
+    target_arch = "x86_64",
+    target_arch = "aarch64",
+    target_arch = "riscv64"
+)))]
+fn read_counter() -> u64 {
+    0
+}
+
+#[cfg(not(any(
+    target_arch = "x86_64",
+    target_arch = "aarch64",
+    target_arch = "riscv64"
+)))]
+fn counter_is_constant_rate() -> bool {
+    false
+}
+
+#[cfg(not(any(
+    target_arch = "x86_64",
+    target_arch = "aarch64",
+    target_arch = "riscv64"
+)))]
+fn counter_frequency() -> Option<u64> {
+    None
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{monotonic_raw_ns, read_overhead, timestamp, CounterClock};
+
+    #[test]
+    fn counter_ticks_are_scaled_from_the_calibration_point() {
+        let clock = CounterClock {
+            base_ticks: 1_000,
+            base_ns: 5_000,
+            // Two and a half nanoseconds per tick.
+            scale: 5 << 31,
+        };
+
+        assert_eq!(clock.to_ns(1_000), 5_000);
+        assert_eq!(clock.to_ns(1_400), 6_000);
+        assert_eq!(clock.to_ns(900), 5_000);
+    }
+
+    #[test]
+    fn timestamps_follow_the_monotonic_clock() {
+        let before = monotonic_raw_ns();
+        let stamp = timestamp();
+        let after = monotonic_raw_ns();
+
+        // Calibration leaves an error in the order of microseconds.
+        assert!(stamp + 100_000 >= before && stamp <= after + 100_000);
+        assert!(timestamp() >= stamp);
+        assert!(read_overhead() < 100_000);
+    }
+}
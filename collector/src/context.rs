@@ -0,0 +1,240 @@
+//! Calling contexts of outermost loop invocations.
+//!
+//! The loop entry hook gets the address of the return address of the
+//! function the loop runs in. Its direct caller is always known from there.
+//! When the function keeps a frame pointer, further callers come from a short
+//! walk along the frame pointer chain, which stops at the first frame record
+//! outside of the thread's stack. Without one the word below the return
+//! address is no frame record, and the walk would follow whatever register
+//! was spilled there. The return addresses are hashed into a context ID, and
+//! every context is sent to `mperf` once per process.
+
+use lazy_static::lazy_static;
+use parking_lot::Mutex;
+use std::{cell::RefCell, collections::HashSet, ops::Range};
+
+use mperf_data::{CallingContext, IPCMessage};
+
+use crate::send_message;
+
+/// Callers kept in a calling context, the direct caller included.
+const MAX_CONTEXT_FRAMES: usize = 4;
+
+const WORD: usize = std::mem::size_of::<usize>();
+
+lazy_static! {
+    /// Contexts this process has sent.
+    static ref SENT_CONTEXTS: Mutex<HashSet<u64>> = Mutex::new(HashSet::new());
+}
+
+thread_local! {
+    static STACK_BOUNDS: Range<usize> = current_stack_bounds();
+    /// Contexts this thread has seen, which keeps the shared set out of the
+    /// way of loop entries.
+    static SEEN_CONTEXTS: RefCell<HashSet<u64>> = RefCell::new(HashSet::new());
+    /// Context of the last entry of every loop on this thread, by mask index.
+    /// Loops are mostly entered from the same callers again and again, most
+    /// entries get by with comparing against it.
+    static LAST_CONTEXTS: RefCell<Vec<u64>> = const { RefCell::new(Vec::new()) };
+}
+
+/// Returns the calling context of the frame whose return address is stored
+/// at `return_slot`, zero if it is unknown. Callers past the direct one are
+/// only walked if `frame_pointer` tells that the frame has a frame record.
+/// `loop_index` is the mask index of the loop, if it has one.
+///
+/// # Safety
+/// `return_slot` must be null or point to the return address of a live frame
+/// of the calling thread.
+pub unsafe fn capture(
+    return_slot: *const usize,
+    frame_pointer: bool,
+    loop_index: Option<u32>,
+) -> u64 {
+    if return_slot.is_null() {
+        return 0;
+    }
+
+    // No frame record lies within empty bounds, the walk stops at the direct
+    // caller then.
+    let bounds = if frame_pointer {
+        STACK_BOUNDS.try_with(Range::clone).unwrap_or(0..0)
+    } else {
+        0..0
+    };
+    let mut frames = [0_u64; MAX_CONTEXT_FRAMES];
+    let count = walk_frames(return_slot, &bounds, &mut frames);
+    let frames = &frames[..count];
+    let id = context_id(frames);
+    if id != 0 && !loop_index.is_some_and(|index| repeats_last_context(index, id)) {
+        intern(id, frames);
+    }
+    id
+}
+
+/// Remembers `id` as the context of the latest entry of the loop and tells
+/// whether the previous entry on this thread had the same one.
+fn repeats_last_context(loop_index: u32, id: u64) -> bool {
+    LAST_CONTEXTS
+        .try_with(|last| {
+            let mut last = last.borrow_mut();
+            let index = loop_index as usize;
+            if index >= last.len() {
+                last.resize(index + 1, 0);
+            }
+            std::mem::replace(&mut last[index], id) == id
+        })
+        .unwrap_or(false)
+}
+
+/// Fills `frames` with the return address at `return_slot` and the ones of
+/// the frame records chained from the record right below it. x86-64 and
+/// AArch64 both lay out a frame record as the caller's frame pointer followed
+/// by the return address. The walk ends at a null return address or a record
+/// that is not above the previous one within `bounds`.
+///
+/// # Safety
+/// `return_slot` and the word below it must be readable.
+unsafe fn walk_frames(
+    return_slot: *const usize,
+    bounds: &Range<usize>,
+    frames: &mut [u64],
+) -> usize {
+    let mut count = 0;
+    let mut return_address = return_slot.read();
+    let mut record = return_slot.sub(1).read();
+    let mut previous = return_slot as usize;
+    while count < frames.len() && return_address != 0 {
+        frames[count] = return_address as u64;
+        count += 1;
+
+        if !cfg!(any(target_arch = "x86_64", target_arch = "aarch64"))
+            || record <= previous
+            || record & (WORD - 1) != 0
+            || !bounds.contains(&record)
+            || !bounds.contains(&(record + 2 * WORD - 1))
+        {
+            break;
+        }
+        let words = record as *const usize;
+        return_address = words.add(1).read();
+        previous = record;
+        record = words.read();
+    }
+    count
+}
+
+/// FNV-1a over the return addresses, zero is left for unknown contexts.
+fn context_id(frames: &[u64]) -> u64 {
+    if frames.is_empty() {
+        return 0;
+    }
+    let hash = frames
+        .iter()
+        .fold(0xcbf2_9ce4_8422_2325_u64, |hash, &frame| {
+            (hash ^ frame).wrapping_mul(0x0000_0100_0000_01b3)
+        });
+    hash.max(1)
+}
+
+fn intern(id: u64, frames: &[u64]) {
+    let seen = SEEN_CONTEXTS
+        .try_with(|seen| !seen.borrow_mut().insert(id))
+        .unwrap_or(false);
+    if seen || !SENT_CONTEXTS.lock().insert(id) {
+        return;
+    }
+
+    send_message(IPCMessage::Context(CallingContext {
+        id,
+        process_id: std::process::id(),
+        frames: frames.to_vec(),
+    }));
+}
+
+#[cfg(target_os = "linux")]
+fn current_stack_bounds() -> Range<usize> {
+    unsafe {
+        let mut attr: libc::pthread_attr_t = std::mem::zeroed();
+        if libc::pthread_getattr_np(libc::pthread_self(), &mut attr) != 0 {
+            return 0..0;
+        }
+        let mut addr = std::ptr::null_mut();
+        let mut size = 0;
+        let result = libc::pthread_attr_getstack(&attr, &mut addr, &mut size);
+        libc::pthread_attr_destroy(&mut attr);
+        if result != 0 {
+            return 0..0;
+        }
+        addr as usize..addr as usize + size
+    }
+}
+
+#[cfg(target_os = "macos")]
+fn current_stack_bounds() -> Range<usize> {
+    unsafe {
+        let thread = libc::pthread_self();
+        // The stack address is the top of the stack.
+        let top = libc::pthread_get_stackaddr_np(thread) as usize;
+        let size = libc::pthread_get_stacksize_np(thread);
+        top.saturating_sub(size)..top
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{context_id, repeats_last_context, walk_frames, MAX_CONTEXT_FRAMES, WORD};
+
+    #[test]
+    #[cfg(any(target_arch = "x86_64", target_arch = "aarch64"))]
+    fn frame_records_are_walked_up_the_stack() {
+        let mut stack = [0_usize; 16];
+        let base = stack.as_ptr() as usize;
+        let at = |index: usize| base + index * WORD;
+        // Return slot and saved frame pointer of the loop's function, then
+        // the frame records of two callers, the last one ends the chain.
+        stack[1] = 0x1000;
+        stack[0] = at(4);
+        stack[5] = 0x2000;
+        stack[4] = at(8);
+        stack[9] = 0x3000;
+        stack[8] = 0;
+        let bounds = base..at(stack.len());
+
+        let mut frames = [0_u64; MAX_CONTEXT_FRAMES];
+        let count = unsafe { walk_frames(stack.as_ptr().add(1), &bounds, &mut frames) };
+        assert_eq!(&frames[..count], [0x1000, 0x2000, 0x3000]);
+
+        // A frame pointer that leaves the stack keeps the direct caller only.
+        stack[0] = base + 4096;
+        let count = unsafe { walk_frames(stack.as_ptr().add(1), &bounds, &mut frames) };
+        assert_eq!(&frames[..count], [0x1000]);
+
+        // Frames without a frame record are given empty bounds.
+        let count = unsafe { walk_frames(stack.as_ptr().add(1), &(0..0), &mut frames) };
+        assert_eq!(&frames[..count], [0x1000]);
+
+        // A record below the previous one ends the walk as well.
+        stack[0] = at(4);
+        stack[4] = at(2);
+        let count = unsafe { walk_frames(stack.as_ptr().add(1), &bounds, &mut frames) };
+        assert_eq!(&frames[..count], [0x1000, 0x2000]);
+    }
+
+    #[test]
+    fn repeated_contexts_of_a_loop_are_recognized() {
+        assert!(!repeats_last_context(3, 0x10));
+        assert!(repeats_last_context(3, 0x10));
+        assert!(!repeats_last_context(3, 0x20));
+        assert!(!repeats_last_context(0, 0x20));
+        assert!(repeats_last_context(3, 0x20));
+    }
+
+    #[test]
+    fn contexts_are_told_apart_by_their_callers() {
+        assert_eq!(context_id(&[]), 0);
+        assert_ne!(context_id(&[0x1000]), 0);
+        assert_ne!(context_id(&[0x1000, 0x2000]), context_id(&[0x1000, 0x3000]));
+        assert_eq!(context_id(&[0x1000, 0x2000]), context_id(&[0x1000, 0x2000]));
+    }
+}
@@ -1,149 +1,397 @@
-use smallvec::smallvec;
-use std::ffi::CStr;
+use lazy_static::lazy_static;
+use parking_lot::{Mutex, RwLock};
+use shmem::bitmap::SharedBitmap;
+use std::{
+    cell::{Cell, RefCell},
+    collections::{HashMap, HashSet},
+    ffi::CStr,
+    sync::atomic::{AtomicU32, AtomicU64, Ordering},
+};
 
-use mperf_data::{CallFrame, Event, EventType, Location};
+use mperf_data::{
+    roofline_loop_mask_name, BasicBlockDescription, IPCLoop, IPCMessage, LoopCodegen, LoopCounters,
+    LoopStats, RooflineRecord, LOOP_FLAG_FRAME_POINTER, ROOFLINE_LOOP_MASK_BITS,
+    ROOFLINE_RECORD_COUNTERS, ROOFLINE_RECORD_INSTRUMENTED, ROOFLINE_RECORD_REGION,
+};
+use pmu::{Counter, CounterCheckpoint, EventTimer};
 
 use crate::{
-    current_thread_id, get_next_id, get_string_id, get_timestamp, profiling_enabled,
-    roofline_instrumentation_enabled, send_event,
+    aggregate_roofline_record, context, current_thread_id, get_string_id, get_timestamp,
+    profiling_enabled, roofline_aggregation_enabled, roofline_blocks_enabled,
+    roofline_counters_enabled, roofline_instrumentation_enabled, roofline_sample_period,
+    send_message, send_roofline_record, timestamp_overhead,
 };
 
-#[derive(Debug, Clone, Copy)]
+/// Mirror of the `mperf.loop_descriptor` records the Clang plugin places in
+/// the loop descriptor section.
+#[derive(Debug)]
 #[repr(C)]
-pub struct LoopInfo {
+pub struct LoopDescriptor {
+    id: u64,
+    parent_id: u64,
     line: u32,
+    flags: u32,
     filename: *const libc::c_char,
     func_name: *const libc::c_char,
+    end_line: u32,
+    codegen: LoopCodegen,
+    /// Bit of the loop in `LOOP_MASK`, assigned when the table is registered.
+    /// Until then it is `UNASSIGNED_LOOP_INDEX`. Loop entries read it instead
+    /// of looking the loop up.
+    index: AtomicU32,
+    /// Name of an annotated region, null for loops.
+    name: *const libc::c_char,
 }
 
-#[derive(Debug, Clone)]
+/// Index of a loop whose table is not registered yet. It is past the end of
+/// the mask, which reads as enabled.
+const UNASSIGNED_LOOP_INDEX: u32 = u32::MAX;
+
+/// Mirror of the `mperf.block_descriptor` records the Clang plugin places in
+/// the block section.
+#[derive(Debug, Clone, Copy)]
 #[repr(C)]
-pub struct SafeLoopInfo {
-    line: u32,
-    filename: String,
-    func_name: String,
+pub struct BlockDescriptor {
+    loop_id: u64,
+    /// The nested loop the block is the preheader of, zero for other blocks.
+    entered_loop_id: u64,
+    address: *const libc::c_void,
+    stats: LoopStats,
 }
 
-#[derive(Default, Debug, Clone, Copy)]
+/// Mirror of the `mperf.nested_loop_stats` entries an instrumented loop clone
+/// reports for the loops nested in it.
+#[derive(Debug, Clone, Copy)]
 #[repr(C)]
-pub struct LoopStats {
-    trip_count: u64,
-    bytes_load: u64,
-    bytes_store: u64,
-    scalar_int_ops: u64,
-    scalar_float_ops: u64,
-    scalar_double_ops: u64,
-    vector_int_ops: u64,
-    vector_float_ops: u64,
-    vector_double_ops: u64,
-}
-
-#[allow(dead_code)]
+pub struct NestedLoopStats {
+    loop_id: u64,
+    invocations: u64,
+    /// Sum of `mperf_roofline_internal_timestamp` deltas over all invocations.
+    loop_time: u64,
+    stats: LoopStats,
+}
+
 pub struct LoopHandle {
-    id: u128,
-    timestamp: u64,
-    info: SafeLoopInfo,
+    /// Filled in as the loop runs and sent when it exits.
+    record: RooflineRecord,
+    /// This invocation runs the instrumented clone of the loop.
+    instrumented: bool,
+    /// Records of the nested loops, sent together with `record`.
+    nested: Vec<RooflineRecord>,
+    /// Counter values at the loop entry, when the loop counters are enabled.
+    counters: Option<CounterCheckpoint>,
 }
 
-/// # Safety
-/// Shut up, clippy. There's nothing safe about what we do.
-#[no_mangle]
-pub unsafe extern "C" fn mperf_roofline_internal_notify_loop_begin(
-    info: *const LoopInfo,
-) -> *mut LoopHandle {
-    if !profiling_enabled() {
-        return std::ptr::null_mut();
-    }
-    let id = crate::get_next_id();
-    let info = unsafe { info.as_ref().unwrap() };
+thread_local! {
+    /// Handles released by loop exits on this thread, reused by the next loop
+    /// entry. The pool only grows up to the deepest loop nesting seen. Handles
+    /// are boxed because instrumented code holds on to their addresses.
+    #[allow(clippy::vec_box)]
+    static HANDLE_POOL: RefCell<Vec<Box<LoopHandle>>> = const { RefCell::new(Vec::new()) };
+    /// Number of times each loop was entered on this thread, by mask index,
+    /// used to pick the sampled invocations.
+    static LOOP_INVOCATIONS: RefCell<Vec<u64>> = const { RefCell::new(Vec::new()) };
+    /// Reads the loop counters of this thread, `None` if the host does not
+    /// let the process count its own events.
+    static LOOP_TIMER: Option<EventTimer> = open_loop_timer();
+    /// Instance of the OpenMP parallel region this thread runs, zero outside
+    /// of parallel regions.
+    static REGION_INSTANCE: Cell<u64> = const { Cell::new(0) };
+}
 
-    let info = SafeLoopInfo {
-        line: info.line,
-        filename: CStr::from_ptr(info.filename).to_str().unwrap().to_string(),
-        func_name: CStr::from_ptr(info.func_name).to_str().unwrap().to_string(),
-    };
+fn open_loop_timer() -> Option<EventTimer> {
+    // Not every PMU has a last level cache miss event.
+    EventTimer::new(&[Counter::Cycles, Counter::Instructions, Counter::LLCMisses])
+        .or_else(|_| EventTimer::new(&[Counter::Cycles, Counter::Instructions]))
+        .ok()
+}
 
-    let mut handle = Box::new(LoopHandle {
-        id,
-        timestamp: 0,
-        info,
-    });
+fn start_loop_counters() -> Option<CounterCheckpoint> {
+    LOOP_TIMER
+        .try_with(|timer| timer.as_ref()?.checkpoint().ok())
+        .ok()
+        .flatten()
+}
+
+fn read_loop_counters(checkpoint: CounterCheckpoint) -> Option<LoopCounters> {
+    let measurements = LOOP_TIMER
+        .try_with(|timer| timer.as_ref()?.since(checkpoint).ok())
+        .ok()
+        .flatten()?;
+    let value = |counter| measurements.get(&counter).map_or(0, |entry| entry.value());
+    Some(LoopCounters {
+        cycles: value(Counter::Cycles),
+        instructions: value(Counter::Instructions),
+        llc_misses: value(Counter::LLCMisses),
+    })
+}
+
+/// Picks every `period`-th invocation of a loop for instrumentation. With the
+/// periods of at least 2 `mperf` asks for, the first invocation always runs
+/// the original code, so even loops that are entered only once get a
+/// duration. A period of 1 instruments every invocation.
+fn is_sampled_invocation(invocation: u64, period: u64) -> bool {
+    invocation % period == 1 % period
+}
+
+fn should_instrument(index: u32) -> bool {
+    if roofline_instrumentation_enabled() {
+        return true;
+    }
+
+    // Loops entered before their table is registered are only timed.
+    let period = roofline_sample_period();
+    if period == 0 || index == UNASSIGNED_LOOP_INDEX {
+        return false;
+    }
 
-    handle.timestamp = get_timestamp();
+    LOOP_INVOCATIONS
+        .try_with(|invocations| {
+            let mut invocations = invocations.borrow_mut();
+            let index = index as usize;
+            if index >= invocations.len() {
+                invocations.resize(index + 1, 0);
+            }
+            let count = &mut invocations[index];
+            let invocation = *count;
+            *count += 1;
+            is_sampled_invocation(invocation, period)
+        })
+        .unwrap_or(false)
+}
 
-    // FIXME we should use the full stack frame instead
-    let filename = get_string_id(&handle.info.filename);
-    let func_name = get_string_id(&handle.info.func_name);
+fn acquire_handle(loop_id: u64) -> *mut LoopHandle {
+    let pooled = HANDLE_POOL
+        .try_with(|pool| pool.borrow_mut().pop())
+        .ok()
+        .flatten();
 
-    let start_frame = CallFrame::Location(Location {
-        function_name: func_name,
-        file_name: filename,
-        line: handle.info.line,
+    let mut handle = pooled.unwrap_or_else(|| {
+        Box::new(LoopHandle {
+            record: RooflineRecord::default(),
+            instrumented: false,
+            nested: Vec::new(),
+            counters: None,
+        })
     });
 
-    let start_event = Event {
-        unique_id: handle.id,
-        correlation_id: 0,
-        parent_id: 0,
-        ty: EventType::RooflineLoopStart,
-        thread_id: current_thread_id() as u32,
+    // Pooled handles keep the capacity of their nested records.
+    handle.nested.clear();
+    handle.instrumented = false;
+    handle.counters = None;
+    // The loop entry hook takes the start timestamp once it is done.
+    handle.record = RooflineRecord {
+        loop_id,
         process_id: std::process::id(),
-        cpu: u32::MAX,
-        time_enabled: 0,
-        time_running: 0,
-        value: 0,
-        name: 0,
-        timestamp: handle.timestamp,
-        callstack: smallvec![start_frame],
-        user_regs: None,
-        user_stack: Vec::new(),
+        thread_id: current_thread_id() as u32,
+        region_instance: current_region_instance(),
+        ..RooflineRecord::default()
     };
 
-    send_event(start_event).expect("failed to send start event");
+    Box::into_raw(handle)
+}
 
-    Box::leak(handle)
+/// # Safety
+/// `handle` must come from `acquire_handle` and must not be used afterwards.
+unsafe fn release_handle(handle: *mut LoopHandle) {
+    let handle = Box::from_raw(handle);
+    // The pool is gone once thread-local destructors have run, the handle is
+    // simply freed then.
+    let _ = HANDLE_POOL.try_with(move |pool| pool.borrow_mut().push(handle));
 }
 
+/// Tested by the dispatch code of every instrumented loop before it calls
+/// into the collector. It stays zero unless the process runs under `mperf`, so
+/// a detached binary only pays for one load and a branch per loop entry.
 #[no_mangle]
-pub extern "C" fn mperf_roofline_internal_is_instrumented_profiling() -> i32 {
-    if profiling_enabled() && roofline_instrumentation_enabled() {
-        1
-    } else {
-        0
+#[allow(non_upper_case_globals)]
+pub static mperf_roofline_enabled: AtomicU32 = AtomicU32::new(0);
+
+lazy_static! {
+    static ref REGISTERED_TABLES: Mutex<HashSet<usize>> = Mutex::new(HashSet::new());
+    /// Bit of every registered loop in `LOOP_MASK`, shared by the copies of a
+    /// loop in different binaries.
+    static ref LOOP_INDICES: Mutex<HashMap<u64, u32>> = Mutex::new(HashMap::new());
+    /// Per-loop enable bits owned by `mperf`. Without it all loops are enabled.
+    static ref LOOP_MASK: Option<SharedBitmap> = std::env::var("MPERF_COLLECTOR_SHMEM_ID")
+        .ok()
+        .and_then(|name| {
+            SharedBitmap::open(&roofline_loop_mask_name(&name), ROOFLINE_LOOP_MASK_BITS).ok()
+        });
+}
+
+fn loop_index(loop_id: u64) -> u32 {
+    let mut indices = LOOP_INDICES.lock();
+    let next = indices.len() as u32;
+    *indices.entry(loop_id).or_insert(next)
+}
+
+fn loop_enabled(index: u32) -> bool {
+    LOOP_MASK
+        .as_ref()
+        .is_none_or(|mask| mask.get(index as usize))
+}
+
+/// # Safety
+/// `start` and `stop` must delimit an array of `LoopDescriptor`s, as emitted
+/// by the Clang plugin.
+#[no_mangle]
+pub unsafe extern "C" fn mperf_roofline_internal_register_loops(
+    start: *const LoopDescriptor,
+    stop: *const LoopDescriptor,
+) {
+    if !profiling_enabled() || start.is_null() || start >= stop {
+        return;
+    }
+
+    mperf_roofline_enabled.store(1, Ordering::Relaxed);
+
+    // Every instrumented module of a binary registers the same table.
+    if !REGISTERED_TABLES.lock().insert(start as usize) {
+        return;
+    }
+
+    let count = stop.offset_from(start) as usize;
+    let descriptors = std::slice::from_raw_parts(start, count);
+
+    for desc in descriptors {
+        let filename = CStr::from_ptr(desc.filename).to_string_lossy();
+        let func_name = CStr::from_ptr(desc.func_name).to_string_lossy();
+        let index = loop_index(desc.id);
+        desc.index.store(index, Ordering::Relaxed);
+
+        send_message(IPCMessage::Loop(IPCLoop {
+            id: desc.id,
+            parent_id: desc.parent_id,
+            file_name: get_string_id(&filename),
+            function_name: get_string_id(&func_name),
+            line: desc.line,
+            end_line: desc.end_line,
+            index,
+            flags: desc.flags,
+            codegen: desc.codegen,
+            name: if desc.name.is_null() {
+                0
+            } else {
+                get_string_id(&CStr::from_ptr(desc.name).to_string_lossy())
+            },
+        }));
     }
 }
 
 /// # Safety
-/// Shut up, clippy. There's nothing safe about what we do.
+/// `start` and `stop` must both be null or delimit an array of
+/// `BlockDescriptor`s, as emitted by the Clang plugin.
 #[no_mangle]
-pub unsafe extern "C" fn mperf_roofline_internal_notify_loop_end(handle: *mut LoopHandle) {
-    if !profiling_enabled() {
+pub unsafe extern "C" fn mperf_roofline_internal_register_blocks(
+    start: *const BlockDescriptor,
+    stop: *const BlockDescriptor,
+) {
+    if !profiling_enabled() || !roofline_blocks_enabled() || start.is_null() || start >= stop {
         return;
     }
 
-    let handle = unsafe { handle.as_ref() }.unwrap();
+    if !REGISTERED_TABLES.lock().insert(start as usize) {
+        return;
+    }
 
-    let timestamp = get_timestamp();
+    let count = stop.offset_from(start) as usize;
+    let process_id = std::process::id();
+    for desc in std::slice::from_raw_parts(start, count) {
+        send_message(IPCMessage::Block(BasicBlockDescription {
+            process_id,
+            address: desc.address as u64,
+            loop_id: desc.loop_id,
+            entered_loop_id: desc.entered_loop_id,
+            stats: desc.stats,
+        }));
+    }
+}
 
-    let event = Event {
-        unique_id: get_next_id(),
-        correlation_id: handle.id,
-        parent_id: 0,
-        ty: EventType::RooflineLoopEnd,
-        thread_id: current_thread_id() as u32,
-        process_id: std::process::id(),
-        cpu: u32::MAX,
-        time_enabled: 0,
-        time_running: 0,
-        value: 0,
-        name: 0,
-        timestamp,
-        callstack: smallvec![],
-        user_regs: None,
-        user_stack: Vec::new(),
+/// # Safety
+/// `descriptor` must point to the descriptor of the loop, as emitted by the
+/// Clang plugin. `return_slot` must be null or point to the return address of
+/// the function the loop runs in, as given by `llvm.addressofreturnaddress`.
+#[no_mangle]
+pub unsafe extern "C" fn mperf_roofline_internal_notify_loop_begin(
+    descriptor: *const LoopDescriptor,
+    return_slot: *const usize,
+) -> *mut LoopHandle {
+    if !profiling_enabled() {
+        return std::ptr::null_mut();
+    }
+    let Some(descriptor) = descriptor.as_ref() else {
+        return std::ptr::null_mut();
     };
+    let index = descriptor.index.load(Ordering::Relaxed);
+    if !loop_enabled(index) {
+        return std::ptr::null_mut();
+    }
 
-    send_event(event).expect("failed to send loop end event");
+    let handle = acquire_handle(descriptor.id);
+    (*handle).record.context_id = context::capture(
+        return_slot,
+        descriptor.flags & LOOP_FLAG_FRAME_POINTER != 0,
+        (index != UNASSIGNED_LOOP_INDEX).then_some(index),
+    );
+    (*handle).instrumented = should_instrument(index);
+    // The counters of an instrumented clone mostly measure the
+    // instrumentation. Reading them last keeps the collector out of the delta.
+    if roofline_counters_enabled() && !(*handle).instrumented {
+        (*handle).counters = start_loop_counters();
+    }
+    // Taken last and read first on exit, so that the duration only covers the
+    // loop and the two timestamp reads. Their cost is subtracted on exit.
+    (*handle).record.start = get_timestamp();
+    handle
+}
+
+/// # Safety
+/// `handle` must be null or come from `mperf_roofline_internal_notify_loop_begin`.
+#[no_mangle]
+pub unsafe extern "C" fn mperf_roofline_internal_is_instrumented_profiling(
+    handle: *const LoopHandle,
+) -> i32 {
+    match unsafe { handle.as_ref() } {
+        Some(handle) if handle.instrumented => 1,
+        _ => 0,
+    }
+}
+
+/// # Safety
+/// Shut up, clippy. There's nothing safe about what we do.
+#[no_mangle]
+pub unsafe extern "C" fn mperf_roofline_internal_notify_loop_end(handle_ptr: *mut LoopHandle) {
+    if !profiling_enabled() || handle_ptr.is_null() {
+        return;
+    }
+
+    let end = get_timestamp();
+    let handle = unsafe { &mut *handle_ptr };
+    if let Some(counters) = handle.counters.take().and_then(read_loop_counters) {
+        handle.record.counters = counters;
+        handle.record.flags |= ROOFLINE_RECORD_COUNTERS;
+    }
+    handle.record.end = end
+        .saturating_sub(timestamp_overhead())
+        .max(handle.record.start);
+    handle.record.invocations = 1;
+    handle.record.loop_time = handle.record.end - handle.record.start;
+
+    // Timed invocations are always sent, their durations are kept one by one.
+    let send = if handle.record.is_instrumented() && roofline_aggregation_enabled() {
+        aggregate_roofline_record
+    } else {
+        send_roofline_record
+    };
+    send(handle.record);
+    for mut nested in handle.nested.drain(..) {
+        nested.start = handle.record.start;
+        nested.end = handle.record.end;
+        send(nested);
+    }
+
+    release_handle(handle_ptr);
 }
 
 /// # Safety
@@ -153,42 +401,203 @@ pub unsafe extern "C" fn mperf_roofline_internal_notify_loop_stats(
     handle: *mut LoopHandle,
     stats: *const LoopStats,
 ) {
-    if !profiling_enabled() {
+    if !profiling_enabled() || handle.is_null() {
         return;
     }
-    let stats = unsafe { stats.as_ref().cloned().unwrap_or_default() };
 
-    let handle = unsafe { handle.as_ref() }.unwrap();
+    let handle = unsafe { &mut *handle };
+    handle.record.stats = unsafe { stats.as_ref().cloned().unwrap_or_default() };
+    handle.record.flags |= ROOFLINE_RECORD_INSTRUMENTED;
+}
 
-    let timestamp = get_timestamp();
+/// # Safety
+/// `stats` must point to `count` entries unless `count` is zero.
+#[no_mangle]
+pub unsafe extern "C" fn mperf_roofline_internal_notify_nested_loop_stats(
+    handle: *mut LoopHandle,
+    stats: *const NestedLoopStats,
+    count: u64,
+) {
+    if !profiling_enabled() || handle.is_null() || count == 0 {
+        return;
+    }
 
-    let send_counter_event = |ty: EventType, value: u64| {
-        let event = Event {
-            unique_id: get_next_id(),
-            correlation_id: 0,
-            parent_id: handle.id,
-            ty,
-            thread_id: current_thread_id() as u32,
+    let handle = unsafe { &mut *handle };
+    let stats = unsafe { std::slice::from_raw_parts(stats, count as usize) };
+    let outer = handle.record;
+    // Every nested invocation is timed by a pair of timestamps.
+    let overhead = timestamp_overhead();
+    handle.nested.extend(stats.iter().map(|nested| {
+        RooflineRecord {
+            loop_id: nested.loop_id,
+            process_id: outer.process_id,
+            thread_id: outer.thread_id,
+            flags: ROOFLINE_RECORD_INSTRUMENTED,
+            invocations: nested.invocations,
+            loop_time: nested
+                .loop_time
+                .saturating_sub(nested.invocations * overhead),
+            region_instance: outer.region_instance,
+            context_id: outer.context_id,
+            stats: nested.stats,
+            ..RooflineRecord::default()
+        }
+    }));
+}
+
+lazy_static! {
+    /// The running instance of every OpenMP parallel region, looked up by the
+    /// threads that join it. Concurrent instances of one region, as started by
+    /// nested parallelism, share the latest instance.
+    static ref ACTIVE_REGIONS: RwLock<HashMap<u64, u64>> = RwLock::new(HashMap::new());
+}
+
+/// Zero is reserved for "no region".
+static NEXT_REGION_INSTANCE: AtomicU64 = AtomicU64::new(1);
+
+fn current_region_instance() -> u64 {
+    REGION_INSTANCE.try_with(Cell::get).unwrap_or(0)
+}
+
+pub struct RegionHandle {
+    /// Sent when the region ends.
+    record: RooflineRecord,
+    /// Instance of the same region this one replaced in `ACTIVE_REGIONS`.
+    previous: Option<u64>,
+}
+
+/// Called by the thread that forks an OpenMP parallel region, right before
+/// the fork call.
+#[no_mangle]
+pub extern "C" fn mperf_roofline_internal_parallel_begin(region_id: u64) -> *mut RegionHandle {
+    if !profiling_enabled() {
+        return std::ptr::null_mut();
+    }
+
+    let instance = NEXT_REGION_INSTANCE.fetch_add(1, Ordering::Relaxed);
+    let previous = ACTIVE_REGIONS.write().insert(region_id, instance);
+    Box::into_raw(Box::new(RegionHandle {
+        record: RooflineRecord {
+            loop_id: region_id,
             process_id: std::process::id(),
-            cpu: u32::MAX,
-            time_enabled: 0,
-            time_running: 0,
-            value,
-            name: 0,
-            timestamp,
-            callstack: smallvec![],
-            user_regs: None,
-            user_stack: Vec::new(),
-        };
+            thread_id: current_thread_id() as u32,
+            start: get_timestamp(),
+            flags: ROOFLINE_RECORD_REGION,
+            invocations: 1,
+            region_instance: instance,
+            ..RooflineRecord::default()
+        },
+        previous,
+    }))
+}
+
+/// # Safety
+/// `handle` must be null or come from `mperf_roofline_internal_parallel_begin`.
+#[no_mangle]
+pub unsafe extern "C" fn mperf_roofline_internal_parallel_end(handle: *mut RegionHandle) {
+    if handle.is_null() {
+        return;
+    }
+
+    let mut handle = Box::from_raw(handle);
+    handle.record.end = get_timestamp();
+    handle.record.loop_time = handle.record.end - handle.record.start;
 
-        send_event(event).expect("failed to send loop end event");
+    let region_id = handle.record.loop_id;
+    let mut regions = ACTIVE_REGIONS.write();
+    match handle.previous {
+        Some(previous) => regions.insert(region_id, previous),
+        None => regions.remove(&region_id),
     };
+    drop(regions);
+
+    send_roofline_record(handle.record);
+}
 
-    send_counter_event(EventType::RooflineBytesLoad, stats.bytes_load);
-    send_counter_event(EventType::RooflineBytesStore, stats.bytes_store);
-    send_counter_event(EventType::RooflineScalarIntOps, stats.scalar_int_ops);
-    send_counter_event(EventType::RooflineScalarFloatOps, stats.scalar_float_ops);
-    send_counter_event(EventType::RooflineVectorIntOps, stats.vector_int_ops);
-    send_counter_event(EventType::RooflineVectorFloatOps, stats.vector_float_ops);
-    send_counter_event(EventType::RooflineVectorDoubleOps, stats.vector_double_ops);
+/// Called by every thread on entry to an outlined parallel region. Returns
+/// the region instance of the thread to restore on exit.
+#[no_mangle]
+pub extern "C" fn mperf_roofline_internal_parallel_enter(region_id: u64) -> u64 {
+    if !profiling_enabled() {
+        return 0;
+    }
+
+    let instance = ACTIVE_REGIONS.read().get(&region_id).copied().unwrap_or(0);
+    REGION_INSTANCE
+        .try_with(|current| current.replace(instance))
+        .unwrap_or(0)
+}
+
+#[no_mangle]
+pub extern "C" fn mperf_roofline_internal_parallel_leave(previous: u64) {
+    let _ = REGION_INSTANCE.try_with(|current| current.set(previous));
+}
+
+/// Clock used by instrumented loop clones to time nested loops, in the units
+/// of `RooflineRecord::start` and `end`.
+#[no_mangle]
+pub extern "C" fn mperf_roofline_internal_timestamp() -> u64 {
+    get_timestamp()
+}
+
+/// Begins an annotated region of `mperf.h`. The Clang plugin replaces the
+/// call in the files it instruments, this definition only keeps other builds
+/// linking.
+#[no_mangle]
+pub extern "C" fn mperf_region_begin(_name: *const libc::c_char) {}
+
+/// Ends the innermost annotated region, see `mperf_region_begin`.
+#[no_mangle]
+pub extern "C" fn mperf_region_end() {}
+
+#[cfg(test)]
+mod tests {
+    use super::{
+        acquire_handle, is_sampled_invocation, mperf_roofline_internal_parallel_leave,
+        release_handle, HANDLE_POOL,
+    };
+
+    #[test]
+    fn loop_handles_are_recycled() {
+        let first = acquire_handle(1);
+        unsafe { release_handle(first) };
+
+        let second = acquire_handle(2);
+        assert_eq!(first, second);
+        assert_eq!(unsafe { (*second).record.loop_id }, 2);
+
+        let nested = acquire_handle(3);
+        assert_ne!(second, nested);
+
+        unsafe {
+            release_handle(nested);
+            release_handle(second);
+        }
+        assert_eq!(HANDLE_POOL.with_borrow(|pool| pool.len()), 2);
+    }
+
+    #[test]
+    fn loop_records_carry_the_region_instance_of_their_thread() {
+        mperf_roofline_internal_parallel_leave(7);
+        let handle = acquire_handle(1);
+        assert_eq!(unsafe { (*handle).record.region_instance }, 7);
+        unsafe { release_handle(handle) };
+
+        mperf_roofline_internal_parallel_leave(0);
+        let handle = acquire_handle(1);
+        assert_eq!(unsafe { (*handle).record.region_instance }, 0);
+        unsafe { release_handle(handle) };
+    }
+
+    #[test]
+    fn sampled_invocations_start_after_the_first_one() {
+        let sampled = |period| {
+            (0..10)
+                .filter(|&invocation| is_sampled_invocation(invocation, period))
+                .collect::<Vec<_>>()
+        };
+
+        assert_eq!(sampled(1), (0..10).collect::<Vec<_>>());
+        assert_eq!(sampled(4), [1, 5, 9]);
+    }
 }
@@ -1,47 +1,333 @@
 use lazy_static::lazy_static;
 use parking_lot::{RwLock, RwLockUpgradableReadGuard};
 use shmem::proc_channel::Sender;
-use std::{cell::RefCell, collections::HashMap, sync::Mutex};
+use std::{
+    cell::RefCell,
+    collections::HashMap,
+    sync::{
+        atomic::{AtomicU32, Ordering},
+        Arc, Mutex, Once,
+    },
+    time::Duration,
+};
 
-use mperf_data::{Event, IPCMessage, IPCString};
+use mperf_data::{
+    thread_ring_name, Event, IPCMessage, IPCString, RooflineRecord, ROOFLINE_RECORD_AGGREGATE,
+    ROOFLINE_RECORD_INSTRUMENTED, THREAD_RING_SIZE,
+};
 
+mod clock;
+mod context;
 pub mod ffi;
+
+pub(crate) use clock::{read_overhead as timestamp_overhead, timestamp as get_timestamp};
+
 const SIZE_16MB: usize = 16 * 1024 * 1024;
+/// A thread's staged messages are flushed once they take this many bytes...
+const BATCH_FLUSH_BYTES: usize = 64 * 1024;
+/// ...or once the oldest of them is this old, checked whenever an event is
+/// added and by the flush thread.
+const BATCH_FLUSH_AGE_NS: u64 = 10_000_000;
+/// A thread's aggregated roofline records are flushed once the oldest of them
+/// is this old, checked whenever a record is added and by the flush thread.
+const AGGREGATE_FLUSH_AGE_NS: u64 = 1_000_000_000;
+/// The flush thread looks for staged messages of idle threads this often.
+const FLUSH_THREAD_PERIOD: Duration = Duration::from_nanos(BATCH_FLUSH_AGE_NS);
+
+/// Index of the next thread ring created by this process.
+static NEXT_RING: AtomicU32 = AtomicU32::new(0);
 
 lazy_static! {
+    static ref CHANNEL_NAME: String = std::env::var("MPERF_COLLECTOR_SHMEM_ID")
+        .expect("MPERF_COLLECTOR_SHMEM_ID must be set by the caller");
+    /// The IPC channel created by `mperf`. Threads only send through it
+    /// directly for strings, loop descriptors and ring announcements, their
+    /// events go through their own rings.
     static ref SENDER: Mutex<Sender<IPCMessage>> = {
-        let name = std::env::var("MPERF_COLLECTOR_SHMEM_ID")
-            .expect("MPERF_COLLECTOR_SHMEM_ID must be set by the caller");
-
-        let mutex =
-            Mutex::new(Sender::attach(&name, SIZE_16MB).expect("failed to open shared memory"));
+        let mutex = Mutex::new(
+            Sender::attach(&CHANNEL_NAME, SIZE_16MB).expect("failed to open shared memory"),
+        );
 
         unsafe {
             libc::atexit(close_pipe);
         }
         mutex
     };
+    /// Staging buffers of all live threads, flushed by `close_pipe`.
+    static ref BUFFERS: Mutex<Vec<Arc<parking_lot::Mutex<EventBuffer>>>> = Mutex::new(Vec::new());
+    /// Roofline aggregates of all live threads, flushed by `close_pipe`.
+    static ref AGGREGATES: Mutex<Vec<Arc<parking_lot::Mutex<RooflineAggregates>>>> =
+        Mutex::new(Vec::new());
+    /// Rings of exited threads, reused by new threads so that short-lived
+    /// threads do not pile up rings. A ring is only ever used by one thread at
+    /// a time, which keeps it single-producer.
+    static ref FREE_RINGS: Mutex<Vec<Sender<IPCMessage>>> = Mutex::new(Vec::new());
     static ref STRINGS: RwLock<HashMap<String, u128>> = RwLock::new(HashMap::new());
     static ref PROFILING_ENABLED: bool = std::env::var("MPERF_COLLECTOR_ENABLED").is_ok();
     static ref ROOFLINE_INSTR_ENABLED: bool =
         std::env::var("MPERF_COLLECTOR_ROOFLINE_INSTRUMENTED").is_ok();
+    static ref ROOFLINE_SAMPLE_PERIOD: u64 = std::env::var("MPERF_COLLECTOR_ROOFLINE_SAMPLE_PERIOD")
+        .ok()
+        .and_then(|period| period.parse().ok())
+        .unwrap_or(0);
+    static ref ROOFLINE_COUNTERS_ENABLED: bool =
+        std::env::var("MPERF_COLLECTOR_ROOFLINE_COUNTERS").is_ok();
+    static ref ROOFLINE_AGGREGATE_ENABLED: bool =
+        std::env::var("MPERF_COLLECTOR_ROOFLINE_AGGREGATE").is_ok();
+    static ref ROOFLINE_BLOCKS_ENABLED: bool =
+        std::env::var("MPERF_COLLECTOR_ROOFLINE_BLOCKS").is_ok();
 }
 
 thread_local! {
     static LAST_ID: RefCell<u64> = const { RefCell::new(0) };
+    static LOCAL_BUFFER: LocalBuffer = LocalBuffer::register();
+    static LOCAL_AGGREGATES: LocalAggregates = LocalAggregates::register();
 }
 
-pub fn send_event(evt: Event) -> Result<(), Box<dyn std::error::Error>> {
-    let sender = SENDER.lock()?;
-    let res = sender.send_sync(IPCMessage::Event(evt));
+/// Encoded messages of one thread waiting to be sent as a single batch.
+struct EventBuffer {
+    bytes: Vec<u8>,
+    oldest_timestamp: u64,
+    /// The thread's own ring, `None` if it could not be created.
+    ring: Option<Sender<IPCMessage>>,
+}
 
-    if res.is_err() {
-        eprintln!("Lost an event IPC message due to an error {:?}", res.err());
+impl EventBuffer {
+    fn push(&mut self, message: &IPCMessage) {
+        let now = get_timestamp();
+        if self.bytes.is_empty() {
+            self.oldest_timestamp = now;
+        }
+
+        message.encode_into(&mut self.bytes);
+
+        if self.bytes.len() >= BATCH_FLUSH_BYTES || self.is_stale(now) {
+            self.flush();
+        }
     }
 
+    fn is_stale(&self, now: u64) -> bool {
+        !self.bytes.is_empty() && now.saturating_sub(self.oldest_timestamp) >= BATCH_FLUSH_AGE_NS
+    }
+
+    fn flush(&mut self) {
+        if self.bytes.is_empty() {
+            return;
+        }
+
+        let bytes = std::mem::replace(&mut self.bytes, Vec::with_capacity(BATCH_FLUSH_BYTES));
+        let Some(ring) = &self.ring else {
+            send_message(IPCMessage::Batch(bytes));
+            return;
+        };
+        if let Err(error) = ring.send_sync(IPCMessage::Batch(bytes)) {
+            eprintln!("Lost an IPC message due to an error {error:?}");
+        }
+    }
+}
+
+/// Takes the ring of an exited thread or creates a new one and announces it
+/// to `mperf`.
+fn acquire_ring() -> Option<Sender<IPCMessage>> {
+    if let Some(ring) = FREE_RINGS.lock().ok()?.pop() {
+        return Some(ring);
+    }
+
+    let index = NEXT_RING.fetch_add(1, Ordering::Relaxed);
+    let ring = Sender::new(&thread_ring_name(&CHANNEL_NAME, index), THREAD_RING_SIZE).ok()?;
+    // The announcement goes out before anything is sent through the ring.
+    send_message(IPCMessage::Ring(index));
+    Some(ring)
+}
+
+/// Thread-local handle to the staging buffer, which flushes it and drops it
+/// from the registry when the thread exits.
+struct LocalBuffer(Arc<parking_lot::Mutex<EventBuffer>>);
+
+impl LocalBuffer {
+    fn register() -> Self {
+        // The sender installs the `atexit` hook that flushes staged events.
+        lazy_static::initialize(&SENDER);
+
+        let buffer = Arc::new(parking_lot::Mutex::new(EventBuffer {
+            bytes: Vec::with_capacity(BATCH_FLUSH_BYTES),
+            oldest_timestamp: 0,
+            ring: acquire_ring(),
+        }));
+        BUFFERS.lock().unwrap().push(buffer.clone());
+        start_flush_thread();
+        LocalBuffer(buffer)
+    }
+}
+
+impl Drop for LocalBuffer {
+    fn drop(&mut self) {
+        let ring = {
+            let mut buffer = self.0.lock();
+            buffer.flush();
+            buffer.ring.take()
+        };
+        if let (Some(ring), Ok(mut rings)) = (ring, FREE_RINGS.lock()) {
+            rings.push(ring);
+        }
+        if let Ok(mut buffers) = BUFFERS.lock() {
+            buffers.retain(|buffer| !Arc::ptr_eq(buffer, &self.0));
+        }
+    }
+}
+
+/// Instrumented roofline records of one thread, summed per loop and calling
+/// context.
+#[derive(Default)]
+struct RooflineAggregates {
+    records: HashMap<(u64, u64), RooflineRecord>,
+    oldest_timestamp: u64,
+}
+
+impl RooflineAggregates {
+    fn add(&mut self, record: &RooflineRecord) {
+        if self.records.is_empty() {
+            self.oldest_timestamp = record.end;
+        }
+
+        self.records
+            .entry((record.loop_id, record.context_id))
+            .or_insert_with(|| RooflineRecord {
+                loop_id: record.loop_id,
+                process_id: record.process_id,
+                thread_id: record.thread_id,
+                context_id: record.context_id,
+                flags: ROOFLINE_RECORD_INSTRUMENTED | ROOFLINE_RECORD_AGGREGATE,
+                ..RooflineRecord::default()
+            })
+            .aggregate(record);
+
+        if self.is_stale(record.end) {
+            self.flush();
+        }
+    }
+
+    fn is_stale(&self, now: u64) -> bool {
+        !self.records.is_empty()
+            && now.saturating_sub(self.oldest_timestamp) >= AGGREGATE_FLUSH_AGE_NS
+    }
+
+    fn flush(&mut self) {
+        for (_, record) in self.records.drain() {
+            send_roofline_record(record);
+        }
+    }
+}
+
+/// Starts the thread that flushes the buffers and aggregates of threads that
+/// stopped adding to them, so that a long-running process does not hold back
+/// its last events until it exits. Staged data is still flushed lazily if the
+/// thread cannot be started.
+fn start_flush_thread() {
+    static STARTED: Once = Once::new();
+    STARTED.call_once(|| {
+        let spawned = std::thread::Builder::new()
+            .name("mperf-flush".to_string())
+            .spawn(|| loop {
+                std::thread::sleep(FLUSH_THREAD_PERIOD);
+                flush_stale();
+            });
+        if let Err(error) = spawned {
+            eprintln!("Failed to start the collector flush thread: {error:?}");
+        }
+    });
+}
+
+/// Flushes the aggregates and buffers past their age limit. Ones that their
+/// thread holds are left to it, loop hooks never wait for the flush thread.
+fn flush_stale() {
+    let now = get_timestamp();
+    // Aggregates go first, flushing them stages records in this thread's
+    // buffer, which is then flushed along with the others.
+    let aggregates = AGGREGATES.lock().map(|all| all.clone()).unwrap_or_default();
+    for aggregates in aggregates {
+        if let Some(mut aggregates) = aggregates.try_lock() {
+            if aggregates.is_stale(now) {
+                aggregates.flush();
+            }
+        }
+    }
+
+    let buffers = BUFFERS.lock().map(|all| all.clone()).unwrap_or_default();
+    for buffer in buffers {
+        if let Some(mut buffer) = buffer.try_lock() {
+            if buffer.is_stale(now) {
+                buffer.flush();
+            }
+        }
+    }
+}
+
+/// Thread-local handle to the roofline aggregates, which flushes them and
+/// drops them from the registry when the thread exits.
+struct LocalAggregates(Arc<parking_lot::Mutex<RooflineAggregates>>);
+
+impl LocalAggregates {
+    fn register() -> Self {
+        lazy_static::initialize(&SENDER);
+
+        let aggregates = Arc::new(parking_lot::Mutex::new(RooflineAggregates::default()));
+        AGGREGATES.lock().unwrap().push(aggregates.clone());
+        LocalAggregates(aggregates)
+    }
+}
+
+impl Drop for LocalAggregates {
+    fn drop(&mut self) {
+        self.0.lock().flush();
+        if let Ok(mut aggregates) = AGGREGATES.lock() {
+            aggregates.retain(|aggregate| !Arc::ptr_eq(aggregate, &self.0));
+        }
+    }
+}
+
+/// Stages a message in the calling thread's buffer. Staged messages are sent
+/// in batches, so a single ring record carries many of them.
+fn stage_message(message: IPCMessage) {
+    // Thread-local storage is unavailable while the thread is being torn
+    // down, send directly then.
+    if LOCAL_BUFFER
+        .try_with(|buffer| buffer.0.lock().push(&message))
+        .is_err()
+    {
+        send_message(message);
+    }
+}
+
+pub fn send_event(evt: Event) -> Result<(), Box<dyn std::error::Error>> {
+    stage_message(IPCMessage::Event(evt));
     Ok(())
 }
 
+pub fn send_roofline_record(record: RooflineRecord) {
+    stage_message(IPCMessage::Roofline(record));
+}
+
+/// Adds an instrumented record to the calling thread's aggregates, which
+/// only reach `mperf` once per loop and flush.
+pub fn aggregate_roofline_record(record: RooflineRecord) {
+    if LOCAL_AGGREGATES
+        .try_with(|aggregates| aggregates.0.lock().add(&record))
+        .is_err()
+    {
+        send_roofline_record(record);
+    }
+}
+
+pub fn send_message(message: IPCMessage) {
+    let sender = SENDER.lock().unwrap();
+    let res = sender.send_sync(message);
+
+    if res.is_err() {
+        eprintln!("Lost an IPC message due to an error {:?}", res.err());
+    }
+}
+
 pub fn get_string_id(string: &str) -> u128 {
     let reader = STRINGS.upgradable_read();
     if reader.contains_key(string) {
@@ -110,16 +396,97 @@ pub fn roofline_instrumentation_enabled() -> bool {
     *ROOFLINE_INSTR_ENABLED
 }
 
+/// Every this many invocations of a loop take the instrumented path, zero
+/// unless `mperf` records roofline data in a single run.
+pub fn roofline_sample_period() -> u64 {
+    *ROOFLINE_SAMPLE_PERIOD
+}
+
+/// Loop exits report the cycles, instructions and last level cache misses of
+/// the invocation.
+pub fn roofline_counters_enabled() -> bool {
+    *ROOFLINE_COUNTERS_ENABLED
+}
+
+/// Instrumented invocations are summed per loop and thread instead of being
+/// sent one by one.
+pub fn roofline_aggregation_enabled() -> bool {
+    *ROOFLINE_AGGREGATE_ENABLED
+}
+
+/// The block tables of the Clang plugin are sent to `mperf`, which estimates
+/// loop statistics from them.
+pub fn roofline_blocks_enabled() -> bool {
+    *ROOFLINE_BLOCKS_ENABLED
+}
+
 extern "C" fn close_pipe() {
+    // Threads still running at exit never get to flush their buffers. Their
+    // aggregates go first, flushing them stages more records.
+    if let Ok(aggregates) = AGGREGATES.lock() {
+        for aggregate in aggregates.iter() {
+            aggregate.lock().flush();
+        }
+    }
+    if let Ok(buffers) = BUFFERS.lock() {
+        for buffer in buffers.iter() {
+            buffer.lock().flush();
+        }
+    }
+
     let sender = SENDER.lock().unwrap();
     let _ = sender.close();
 }
 
-pub(crate) fn get_timestamp() -> u64 {
-    let mut ts: libc::timespec = libc::timespec {
-        tv_sec: 0,
-        tv_nsec: 0,
-    };
-    unsafe { libc::clock_gettime(libc::CLOCK_MONOTONIC_RAW, &mut ts) };
-    (ts.tv_sec * 1_000_000_000 + ts.tv_nsec) as u64
+#[cfg(test)]
+mod tests {
+    use super::{EventBuffer, RooflineAggregates, BATCH_FLUSH_AGE_NS};
+    use mperf_data::{LoopStats, RooflineRecord, ROOFLINE_RECORD_INSTRUMENTED};
+
+    #[test]
+    fn instrumented_records_are_summed_per_loop() {
+        let mut aggregates = RooflineAggregates::default();
+        for (loop_id, start) in [(1, 100), (2, 120), (1, 150)] {
+            aggregates.add(&RooflineRecord {
+                loop_id,
+                process_id: 10,
+                thread_id: 11,
+                start,
+                end: start + 10,
+                flags: ROOFLINE_RECORD_INSTRUMENTED,
+                invocations: 2,
+                loop_time: 8,
+                region_instance: 3,
+                stats: LoopStats {
+                    bytes_load: 64,
+                    ..LoopStats::default()
+                },
+                ..RooflineRecord::default()
+            });
+        }
+
+        assert_eq!(aggregates.records.len(), 2);
+        let record = &aggregates.records[&(1, 0)];
+        assert!(record.is_instrumented() && record.is_aggregate());
+        assert_eq!((record.process_id, record.thread_id), (10, 11));
+        assert_eq!((record.start, record.end), (100, 160));
+        assert_eq!((record.invocations, record.loop_time), (4, 16));
+        assert_eq!(record.root_span(), (2, 20));
+        assert_eq!(record.region_instance, 0);
+        assert_eq!(record.stats.bytes_load, 128);
+    }
+
+    #[test]
+    fn staged_messages_go_stale_with_their_oldest_one() {
+        let mut buffer = EventBuffer {
+            bytes: Vec::new(),
+            oldest_timestamp: 1_000,
+            ring: None,
+        };
+        assert!(!buffer.is_stale(1_000 + BATCH_FLUSH_AGE_NS));
+
+        buffer.bytes.push(0);
+        assert!(!buffer.is_stale(1_000 + BATCH_FLUSH_AGE_NS - 1));
+        assert!(buffer.is_stale(1_000 + BATCH_FLUSH_AGE_NS));
+    }
 }
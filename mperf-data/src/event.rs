@@ -42,6 +42,18 @@ pub enum EventType {
     RooflineVectorDoubleOps,
     RooflineLoopStart,
     RooflineLoopEnd,
+    RooflineScalarHalfOps,
+    RooflineScalarBfloatOps,
+    RooflineVectorHalfOps,
+    RooflineVectorBfloatOps,
+    RooflineDivOps,
+    RooflineConversionOps,
+    RooflineAtomicOps,
+    RooflineBytesInvariant,
+    RooflineBytesUnitStride,
+    RooflineBytesStrided,
+    RooflineBytesIndirect,
+    RooflineFootprintBytes,
 }
 
 #[derive(Encode, Decode, Debug, Clone, Copy, Serialize, Deserialize)]
@@ -150,6 +162,18 @@ impl EventType {
             || *self == EventType::RooflineVectorIntOps
             || *self == EventType::RooflineVectorFloatOps
             || *self == EventType::RooflineVectorDoubleOps
+            || *self == EventType::RooflineScalarHalfOps
+            || *self == EventType::RooflineScalarBfloatOps
+            || *self == EventType::RooflineVectorHalfOps
+            || *self == EventType::RooflineVectorBfloatOps
+            || *self == EventType::RooflineDivOps
+            || *self == EventType::RooflineConversionOps
+            || *self == EventType::RooflineAtomicOps
+            || *self == EventType::RooflineBytesInvariant
+            || *self == EventType::RooflineBytesUnitStride
+            || *self == EventType::RooflineBytesStrided
+            || *self == EventType::RooflineBytesIndirect
+            || *self == EventType::RooflineFootprintBytes
     }
 }
 
@@ -182,6 +206,18 @@ impl fmt::Display for EventType {
             EventType::RooflineVectorDoubleOps => f.write_str("roofline_vector_double_ops"),
             EventType::RooflineLoopStart => f.write_str("roofline_loop_start"),
             EventType::RooflineLoopEnd => f.write_str("roofline_loop_end"),
+            EventType::RooflineScalarHalfOps => f.write_str("roofline_scalar_half_ops"),
+            EventType::RooflineScalarBfloatOps => f.write_str("roofline_scalar_bfloat_ops"),
+            EventType::RooflineVectorHalfOps => f.write_str("roofline_vector_half_ops"),
+            EventType::RooflineVectorBfloatOps => f.write_str("roofline_vector_bfloat_ops"),
+            EventType::RooflineDivOps => f.write_str("roofline_div_ops"),
+            EventType::RooflineConversionOps => f.write_str("roofline_conversion_ops"),
+            EventType::RooflineAtomicOps => f.write_str("roofline_atomic_ops"),
+            EventType::RooflineBytesInvariant => f.write_str("roofline_bytes_invariant"),
+            EventType::RooflineBytesUnitStride => f.write_str("roofline_bytes_unit_stride"),
+            EventType::RooflineBytesStrided => f.write_str("roofline_bytes_strided"),
+            EventType::RooflineBytesIndirect => f.write_str("roofline_bytes_indirect"),
+            EventType::RooflineFootprintBytes => f.write_str("roofline_footprint_bytes"),
         }
     }
 }
@@ -1,6 +1,10 @@
 use bincode::{Decode, Encode};
 
-use crate::Event;
+use crate::{BasicBlockDescription, CallingContext, Event, LoopCodegen, RooflineRecord};
+
+/// Lead byte of a raw `IPCMessage::Roofline` record. bincode encodes variant
+/// indices below 251 as a single byte, so no bincode message starts with it.
+const RAW_ROOFLINE_TAG: u8 = 0xFF;
 
 #[derive(Encode, Decode, Clone, Debug)]
 pub struct IPCString {
@@ -8,21 +12,171 @@ pub struct IPCString {
     pub value: String,
 }
 
+/// Static description of an instrumented loop, sent once per loop when the
+/// collector registers the descriptor table emitted by the Clang plugin.
+#[derive(Encode, Decode, Clone, Debug)]
+pub struct IPCLoop {
+    pub id: u64,
+    /// The enclosing instrumented loop, zero for outermost loops.
+    pub parent_id: u64,
+    pub file_name: u128,
+    pub function_name: u128,
+    pub line: u32,
+    /// Last line of the loop in `file_name`.
+    pub end_line: u32,
+    /// Bit of the loop in the shared enable mask, see `roofline_loop_mask_name`.
+    pub index: u32,
+    /// `LOOP_FLAG_*` bits of the descriptor.
+    pub flags: u32,
+    pub codegen: LoopCodegen,
+    /// Name of an annotated region, zero for loops.
+    pub name: u128,
+}
+
+/// Number of loops that can be switched on and off at run time. Loops
+/// registered past it stay enabled.
+pub const ROOFLINE_LOOP_MASK_BITS: usize = 1 << 16;
+
+/// Name of the shared per-loop enable bitmap that belongs to the IPC channel
+/// `shmem_id`. `mperf` creates it with every bit set, the collector skips
+/// loops whose bit gets cleared.
+pub fn roofline_loop_mask_name(shmem_id: &str) -> String {
+    format!("{shmem_id}_loops")
+}
+
+/// Size of the ring each producer thread of the collector sends its events
+/// through.
+pub const THREAD_RING_SIZE: usize = 1 << 20;
+
+/// Name of the `index`-th thread ring that belongs to the IPC channel
+/// `shmem_id`. The collector creates the ring and announces it with
+/// `IPCMessage::Ring`, `mperf` adopts it.
+pub fn thread_ring_name(shmem_id: &str, index: u32) -> String {
+    format!("{shmem_id}_t{index}")
+}
+
 #[allow(clippy::large_enum_variant)]
 #[derive(Encode, Decode, Clone, Debug)]
 pub enum IPCMessage {
     String(IPCString),
     Event(Event),
+    Loop(IPCLoop),
+    /// Several messages packed into one ring record, each encoded with
+    /// `IPCMessage::encode_into`.
+    Batch(Vec<u8>),
+    /// Sent as `RAW_ROOFLINE_TAG` followed by the raw record bytes, bypassing
+    /// bincode.
+    Roofline(RooflineRecord),
+    /// A new thread ring, see `thread_ring_name`. Only sent through the IPC
+    /// channel itself, before any message that goes through the ring.
+    Ring(u32),
+    /// Sent through the IPC channel itself the first time a loop is entered
+    /// from a calling context.
+    Context(CallingContext),
+    /// Sent through the IPC channel itself for every entry of a registered
+    /// block table.
+    Block(BasicBlockDescription),
+}
+
+impl IPCMessage {
+    /// Appends the encoded message to a batch buffer.
+    pub fn encode_into(&self, buffer: &mut Vec<u8>) {
+        if let IPCMessage::Roofline(record) = self {
+            buffer.push(RAW_ROOFLINE_TAG);
+            buffer.extend_from_slice(record.as_bytes());
+            return;
+        }
+
+        bincode::encode_into_std_write(self, buffer, bincode::config::standard())
+            .expect("Failed to encode message");
+    }
+
+    /// Decodes one message from the start of `bytes`, returning it together
+    /// with the number of bytes consumed.
+    fn decode_one(bytes: &[u8]) -> (IPCMessage, usize) {
+        if bytes.first() == Some(&RAW_ROOFLINE_TAG) {
+            let record = RooflineRecord::from_bytes(&bytes[1..]);
+            return (IPCMessage::Roofline(record), 1 + RooflineRecord::SIZE);
+        }
+
+        bincode::decode_from_slice(bytes, bincode::config::standard())
+            .expect("Failed to decode message")
+    }
+
+    /// Splits the payload of an `IPCMessage::Batch` into individual messages.
+    pub fn decode_batch(bytes: &[u8]) -> Vec<IPCMessage> {
+        let mut messages = vec![];
+        let mut offset = 0;
+
+        while offset < bytes.len() {
+            let (message, len) = IPCMessage::decode_one(&bytes[offset..]);
+            messages.push(message);
+            offset += len;
+        }
+
+        messages
+    }
 }
 
 impl shmem::proc_channel::Sendable for IPCMessage {
     fn as_raw_bytes(&self) -> Vec<u8> {
-        bincode::encode_to_vec(self, bincode::config::standard()).expect("Failed to encode message")
+        let mut bytes = vec![];
+        self.encode_into(&mut bytes);
+        bytes
     }
 
     fn from_raw_bytes(bytes: &[u8]) -> Self {
-        bincode::decode_from_slice(bytes, bincode::config::standard())
-            .expect("Failed to decode message")
-            .0
+        IPCMessage::decode_one(bytes).0
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn batched_messages_round_trip() {
+        let mut buffer = vec![];
+        for key in 1..=3_u128 {
+            IPCMessage::String(IPCString {
+                key,
+                value: format!("string {key}"),
+            })
+            .encode_into(&mut buffer);
+        }
+
+        let messages = IPCMessage::decode_batch(&buffer);
+        assert_eq!(messages.len(), 3);
+        for (idx, message) in messages.iter().enumerate() {
+            let IPCMessage::String(string) = message else {
+                panic!("unexpected message {message:?}");
+            };
+            assert_eq!(string.key, idx as u128 + 1);
+            assert_eq!(string.value, format!("string {}", idx + 1));
+        }
+    }
+
+    #[test]
+    fn roofline_records_bypass_bincode() {
+        let record = RooflineRecord {
+            loop_id: 42,
+            end: 7,
+            ..RooflineRecord::default()
+        };
+
+        let mut buffer = vec![];
+        IPCMessage::Roofline(record).encode_into(&mut buffer);
+        IPCMessage::Roofline(record).encode_into(&mut buffer);
+        assert_eq!(buffer.len(), 2 * (1 + RooflineRecord::SIZE));
+        assert_eq!(buffer[0], RAW_ROOFLINE_TAG);
+
+        let messages = IPCMessage::decode_batch(&buffer);
+        assert_eq!(messages.len(), 2);
+        for message in messages {
+            let IPCMessage::Roofline(decoded) = message else {
+                panic!("unexpected message {message:?}");
+            };
+            assert_eq!(decoded, record);
+        }
     }
 }
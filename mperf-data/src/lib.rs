@@ -4,21 +4,46 @@ use serde::{Deserialize, Serialize};
 
 mod event;
 mod ipc;
+mod roofline;
 
 pub use event::{CallFrame, Event, EventType, IString, Location, ProcMapEntry, UserRegs};
-pub use ipc::{IPCMessage, IPCString};
+pub use ipc::{
+    roofline_loop_mask_name, thread_ring_name, IPCLoop, IPCMessage, IPCString,
+    ROOFLINE_LOOP_MASK_BITS, THREAD_RING_SIZE,
+};
+pub use roofline::{
+    BasicBlockDescription, BranchRun, CallingContext, LoopCodegen, LoopCounters, LoopDescription,
+    LoopStats, RooflineRecord, LOOP_FLAG_ANNOTATED_REGION, LOOP_FLAG_FRAME_POINTER,
+    LOOP_FLAG_HAS_REMAINDER, LOOP_FLAG_NOT_INSTRUMENTED, LOOP_FLAG_PARALLEL_REGION,
+    LOOP_FLAG_REMAINDER, LOOP_FLAG_RUNTIME_CHECKS, LOOP_FLAG_SCALABLE, LOOP_FLAG_VECTORIZED,
+    LOOP_FLAG_WORKSHARING, ROOFLINE_RECORD_AGGREGATE, ROOFLINE_RECORD_COUNTERS,
+    ROOFLINE_RECORD_INSTRUMENTED, ROOFLINE_RECORD_REGION,
+};
 
 /// Version of the on-disk results format written by this build.
 ///
 /// This covers both the JSON metadata and the bincode event stream. Increment
 /// it whenever either layout changes incompatibly.
 /// Version 2 adds the raw user registers and stack bytes used for post-hoc unwinding.
-pub const CURRENT_FORMAT_VERSION: u32 = 2;
+/// Version 3 moves roofline loop data to `roofline.bin` and `loops.json`.
+/// Version 4 adds nested loops to the roofline records.
+/// Version 5 adds half, bfloat and op class counters to the loop statistics.
+/// Version 6 adds the access pattern byte counters to the loop statistics.
+/// Version 7 adds the loop footprint and the per-invocation hardware counters.
+/// Version 8 adds OpenMP parallel regions to the roofline records.
+/// Version 9 adds roofline records aggregated by the collector.
+/// Version 10 adds calling contexts to the roofline records.
+/// Version 11 adds annotated regions to the roofline loops.
+/// Version 12 adds the block tables and branch runs of estimated roofline results.
+pub const CURRENT_FORMAT_VERSION: u32 = 12;
 
 #[derive(Clone, Debug, Copy, ValueEnum, PartialEq, Eq, Serialize, Deserialize)]
 pub enum Scenario {
     Snapshot,
     Roofline,
+    /// Roofline results estimated from last branch records, without an
+    /// instrumented run.
+    RooflineLite,
     TMA,
 }
 
@@ -32,7 +57,20 @@ pub struct SnapshotInfo {
 pub struct RooflineInfo {
     pub perf_pid: i32,
     pub counters: Vec<(EventType, String)>,
+    /// Equal to `perf_pid` when loop statistics were sampled during the PMU run.
     pub inst_pid: i32,
+    /// Every this many invocations of each loop were instrumented, zero for
+    /// recordings with a separate instrumented run.
+    #[serde(default)]
+    pub sample_period: u32,
+    /// Postprocessing keeps a row per loop invocation in `roofline_loop_runs`
+    /// and `roofline_ops` besides the per-loop aggregates.
+    #[serde(default)]
+    pub raw_invocations: bool,
+    /// Loop statistics are estimated from the block tables and branch runs of
+    /// the PMU run, and no invocation was instrumented.
+    #[serde(default)]
+    pub estimated: bool,
 }
 
 #[derive(Debug, Clone, Serialize, Deserialize)]
@@ -69,6 +107,17 @@ pub struct CoreCluster {
     pub cpus: String,
 }
 
+/// A data or unified cache level of the host, used to place loops against the
+/// memory level their working set fits in.
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub struct CacheLevel {
+    /// One for L1.
+    pub level: u32,
+    /// Size of a single instance of the cache in bytes.
+    pub size: u64,
+    pub line_size: u32,
+}
+
 #[derive(Debug, Clone, Serialize, Deserialize)]
 pub struct RecordInfo {
     /// On-disk results format. Missing means the legacy, pre-versioned format.
@@ -81,6 +130,9 @@ pub struct RecordInfo {
     /// Core clusters on a heterogeneous host (empty on homogeneous systems).
     #[serde(default)]
     pub cores: Vec<CoreCluster>,
+    /// Data caches of the host, innermost level first. Empty when unknown.
+    #[serde(default)]
+    pub caches: Vec<CacheLevel>,
     pub scenario_info: ScenarioInfo,
 }
 
@@ -119,6 +171,7 @@ impl Scenario {
         match self {
             Scenario::Snapshot => "Snapshot",
             Scenario::Roofline => "Roofline",
+            Scenario::RooflineLite => "Roofline Lite",
             Scenario::TMA => "Top-Down",
         }
     }
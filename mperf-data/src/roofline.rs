@@ -0,0 +1,499 @@
+use std::{
+    io::{Read, Write},
+    ops::AddAssign,
+};
+
+use bincode::{Decode, Encode};
+use serde::{Deserialize, Serialize};
+use shmem::proc_channel::Sendable;
+
+/// Counters accumulated by an instrumented loop clone during one invocation.
+///
+/// The layout is shared with the `LoopStats` struct emitted by the Clang plugin.
+/// Ops are counted per vector element and bucketed by element type. `div_ops`
+/// counts divisions and remainders a second time, while floating-point
+/// conversions are only counted in `conversion_ops`. The access pattern
+/// counters split `bytes_load + bytes_store` by how the address changes in
+/// the innermost loop around the access.
+#[derive(Encode, Decode, Serialize, Deserialize, Default, Debug, Clone, Copy, PartialEq, Eq)]
+#[repr(C)]
+pub struct LoopStats {
+    /// Executions of the loop header, summed over all entries of the loop.
+    pub trip_count: u64,
+    pub bytes_load: u64,
+    pub bytes_store: u64,
+    pub scalar_int_ops: u64,
+    pub scalar_float_ops: u64,
+    pub scalar_double_ops: u64,
+    pub vector_int_ops: u64,
+    pub vector_float_ops: u64,
+    pub vector_double_ops: u64,
+    pub scalar_half_ops: u64,
+    pub scalar_bfloat_ops: u64,
+    pub vector_half_ops: u64,
+    pub vector_bfloat_ops: u64,
+    pub div_ops: u64,
+    pub conversion_ops: u64,
+    /// Atomic loads, stores and read-modify-write operations.
+    pub atomic_ops: u64,
+    /// The address does not change in the loop.
+    pub bytes_invariant: u64,
+    /// Consecutive iterations access adjacent elements.
+    pub bytes_unit_stride: u64,
+    /// The address advances by a loop invariant stride larger than the
+    /// access.
+    pub bytes_strided: u64,
+    /// Gathers, scatters and addresses SCEV cannot describe.
+    pub bytes_indirect: u64,
+    /// Estimated number of distinct bytes one entry of the loop touches,
+    /// summed over all entries.
+    pub footprint_bytes: u64,
+}
+
+impl LoopStats {
+    /// Names of the counters that contribute to the arithmetic intensity, in
+    /// the order of `typed_ops`.
+    pub const TYPED_OPS: [&'static str; 10] = [
+        "scalar_int_ops",
+        "scalar_half_ops",
+        "scalar_bfloat_ops",
+        "scalar_float_ops",
+        "scalar_double_ops",
+        "vector_int_ops",
+        "vector_half_ops",
+        "vector_bfloat_ops",
+        "vector_float_ops",
+        "vector_double_ops",
+    ];
+
+    /// Names of the per op class counters, in the order of `class_ops`.
+    pub const CLASS_OPS: [&'static str; 3] = ["div_ops", "conversion_ops", "atomic_ops"];
+
+    /// Names of the access pattern counters, in the order of `access_bytes`.
+    pub const ACCESS_BYTES: [&'static str; 4] = [
+        "bytes_invariant",
+        "bytes_unit_stride",
+        "bytes_strided",
+        "bytes_indirect",
+    ];
+
+    pub fn typed_ops(&self) -> [u64; 10] {
+        [
+            self.scalar_int_ops,
+            self.scalar_half_ops,
+            self.scalar_bfloat_ops,
+            self.scalar_float_ops,
+            self.scalar_double_ops,
+            self.vector_int_ops,
+            self.vector_half_ops,
+            self.vector_bfloat_ops,
+            self.vector_float_ops,
+            self.vector_double_ops,
+        ]
+    }
+
+    pub fn class_ops(&self) -> [u64; 3] {
+        [self.div_ops, self.conversion_ops, self.atomic_ops]
+    }
+
+    pub fn access_bytes(&self) -> [u64; 4] {
+        [
+            self.bytes_invariant,
+            self.bytes_unit_stride,
+            self.bytes_strided,
+            self.bytes_indirect,
+        ]
+    }
+
+    /// The counters multiplied by `factor` and rounded, for code that ran an
+    /// estimated number of times.
+    pub fn scaled(&self, factor: f64) -> Self {
+        let mut scaled = *self;
+        for counter in scaled.counters_mut() {
+            *counter = (*counter as f64 * factor).round() as u64;
+        }
+        scaled
+    }
+
+    fn counters_mut(&mut self) -> [&mut u64; 21] {
+        [
+            &mut self.trip_count,
+            &mut self.bytes_load,
+            &mut self.bytes_store,
+            &mut self.scalar_int_ops,
+            &mut self.scalar_float_ops,
+            &mut self.scalar_double_ops,
+            &mut self.vector_int_ops,
+            &mut self.vector_float_ops,
+            &mut self.vector_double_ops,
+            &mut self.scalar_half_ops,
+            &mut self.scalar_bfloat_ops,
+            &mut self.vector_half_ops,
+            &mut self.vector_bfloat_ops,
+            &mut self.div_ops,
+            &mut self.conversion_ops,
+            &mut self.atomic_ops,
+            &mut self.bytes_invariant,
+            &mut self.bytes_unit_stride,
+            &mut self.bytes_strided,
+            &mut self.bytes_indirect,
+            &mut self.footprint_bytes,
+        ]
+    }
+}
+
+/// Sums the counters of several invocations, saturating instead of wrapping.
+impl AddAssign<&LoopStats> for LoopStats {
+    fn add_assign(&mut self, other: &LoopStats) {
+        let pairs = [
+            (&mut self.trip_count, other.trip_count),
+            (&mut self.bytes_load, other.bytes_load),
+            (&mut self.bytes_store, other.bytes_store),
+            (&mut self.scalar_int_ops, other.scalar_int_ops),
+            (&mut self.scalar_float_ops, other.scalar_float_ops),
+            (&mut self.scalar_double_ops, other.scalar_double_ops),
+            (&mut self.vector_int_ops, other.vector_int_ops),
+            (&mut self.vector_float_ops, other.vector_float_ops),
+            (&mut self.vector_double_ops, other.vector_double_ops),
+            (&mut self.scalar_half_ops, other.scalar_half_ops),
+            (&mut self.scalar_bfloat_ops, other.scalar_bfloat_ops),
+            (&mut self.vector_half_ops, other.vector_half_ops),
+            (&mut self.vector_bfloat_ops, other.vector_bfloat_ops),
+            (&mut self.div_ops, other.div_ops),
+            (&mut self.conversion_ops, other.conversion_ops),
+            (&mut self.atomic_ops, other.atomic_ops),
+            (&mut self.bytes_invariant, other.bytes_invariant),
+            (&mut self.bytes_unit_stride, other.bytes_unit_stride),
+            (&mut self.bytes_strided, other.bytes_strided),
+            (&mut self.bytes_indirect, other.bytes_indirect),
+            (&mut self.footprint_bytes, other.footprint_bytes),
+        ];
+        for (sum, value) in pairs {
+            *sum = sum.saturating_add(value);
+        }
+    }
+}
+
+/// Hardware counter deltas of a loop invocation, read in user space by the
+/// collector when the loop is entered and when it exits.
+#[derive(Encode, Decode, Default, Debug, Clone, Copy, PartialEq, Eq)]
+#[repr(C)]
+pub struct LoopCounters {
+    pub cycles: u64,
+    pub instructions: u64,
+    /// Zero when the host has no last level cache miss event.
+    pub llc_misses: u64,
+}
+
+impl AddAssign<&LoopCounters> for LoopCounters {
+    fn add_assign(&mut self, other: &LoopCounters) {
+        self.cycles = self.cycles.saturating_add(other.cycles);
+        self.instructions = self.instructions.saturating_add(other.instructions);
+        self.llc_misses = self.llc_misses.saturating_add(other.llc_misses);
+    }
+}
+
+/// The record carries `stats` collected by the instrumented loop clone.
+pub const ROOFLINE_RECORD_INSTRUMENTED: u64 = 1 << 0;
+/// The record carries `counters` of the loop invocation.
+pub const ROOFLINE_RECORD_COUNTERS: u64 = 1 << 1;
+
+/// The record times one instance of an OpenMP parallel region, `loop_id` is
+/// the region ID and `region_instance` the instance.
+pub const ROOFLINE_RECORD_REGION: u64 = 1 << 2;
+
+/// The record sums instrumented invocations of a loop on one thread, sent by
+/// a collector that aggregates in process. `invocations`, `loop_time` and
+/// `stats` are sums, `root_invocations` and `root_time` count the outermost
+/// loop invocations they were taken in, `start` and `end` are the first and
+/// the last timestamp.
+pub const ROOFLINE_RECORD_AGGREGATE: u64 = 1 << 3;
+
+/// The descriptor names an OpenMP parallel region rather than a loop.
+pub const LOOP_FLAG_PARALLEL_REGION: u32 = 1 << 0;
+/// The OpenMP runtime splits the iterations of the loop between the threads of
+/// the enclosing parallel region.
+pub const LOOP_FLAG_WORKSHARING: u32 = 1 << 1;
+/// The plugin could not version the loop. It has no records, the descriptor
+/// only tells that samples in its lines were not covered by instrumentation.
+pub const LOOP_FLAG_NOT_INSTRUMENTED: u32 = 1 << 2;
+/// The loop vectorizer produced the loop or one of the loops nested in it.
+pub const LOOP_FLAG_VECTORIZED: u32 = 1 << 3;
+/// The vectors of the loop have a multiple of `vector_width` lanes that is only
+/// known at run time.
+pub const LOOP_FLAG_SCALABLE: u32 = 1 << 4;
+/// The vector loop is only entered after runtime checks, such as pointer
+/// overlap checks, that fall back to the scalar loop.
+pub const LOOP_FLAG_RUNTIME_CHECKS: u32 = 1 << 5;
+/// A scalar loop runs the iterations the vector loop leaves over.
+pub const LOOP_FLAG_HAS_REMAINDER: u32 = 1 << 6;
+/// The loop is the scalar remainder of a vectorized loop.
+pub const LOOP_FLAG_REMAINDER: u32 = 1 << 7;
+/// The descriptor names a region the program annotated with
+/// `mperf_region_begin` and `mperf_region_end`, which runs once per entry.
+pub const LOOP_FLAG_ANNOTATED_REGION: u32 = 1 << 8;
+/// The function the loop runs in keeps a frame pointer, so the callers of its
+/// calling contexts are walked along the frame pointer chain.
+pub const LOOP_FLAG_FRAME_POINTER: u32 = 1 << 9;
+
+/// What the optimizer made of a loop, as read by the Clang plugin from the IR
+/// at the end of the pipeline. Zero for scalar loops and loops compiled before
+/// the plugin reported it.
+#[derive(Encode, Decode, Serialize, Deserialize, Default, Debug, Clone, Copy, PartialEq, Eq)]
+#[repr(C)]
+pub struct LoopCodegen {
+    /// Lanes of the vectors the loop works on, the minimum number of lanes
+    /// for scalable vectors.
+    pub vector_width: u32,
+    /// Size of those vectors in bits.
+    pub vector_bits: u32,
+    /// Copies of the vector body the loop vectorizer interleaved, zero if
+    /// unknown.
+    pub interleave_count: u32,
+    /// Values that likely do not fit the registers where register pressure
+    /// peaks, an estimate from the IR.
+    pub estimated_spills: u32,
+}
+
+/// A single loop invocation, sent by the collector when the loop exits.
+///
+/// Loops nested in an instrumented invocation get one record per outermost
+/// invocation instead, with `start` and `end` of the outermost loop and
+/// `loop_time` spread over `invocations` entries of the nested loop.
+/// Invocations on a thread running an OpenMP parallel region carry the
+/// instance of the region, zero outside of parallel regions. Nested loops
+/// share the calling context of their outermost loop.
+///
+/// The record is plain old data without padding, it travels through the IPC
+/// ring and into `roofline.bin` as raw bytes.
+#[derive(Encode, Decode, Default, Debug, Clone, Copy, PartialEq, Eq)]
+#[repr(C)]
+pub struct RooflineRecord {
+    pub loop_id: u64,
+    pub process_id: u32,
+    pub thread_id: u32,
+    pub start: u64,
+    pub end: u64,
+    pub flags: u64,
+    /// Number of times the loop was entered, one for outermost loops.
+    pub invocations: u64,
+    /// Time spent in the loop, `end - start` for outermost loops.
+    pub loop_time: u64,
+    pub region_instance: u64,
+    /// `CallingContext::id` of the outermost loop invocation, zero if unknown.
+    pub context_id: u64,
+    /// Only set in `ROOFLINE_RECORD_AGGREGATE` records.
+    pub root_invocations: u64,
+    pub root_time: u64,
+    pub counters: LoopCounters,
+    pub stats: LoopStats,
+}
+
+impl RooflineRecord {
+    pub const SIZE: usize = std::mem::size_of::<RooflineRecord>();
+
+    pub fn is_instrumented(&self) -> bool {
+        self.flags & ROOFLINE_RECORD_INSTRUMENTED != 0
+    }
+
+    pub fn has_counters(&self) -> bool {
+        self.flags & ROOFLINE_RECORD_COUNTERS != 0
+    }
+
+    pub fn is_region(&self) -> bool {
+        self.flags & ROOFLINE_RECORD_REGION != 0
+    }
+
+    pub fn is_aggregate(&self) -> bool {
+        self.flags & ROOFLINE_RECORD_AGGREGATE != 0
+    }
+
+    /// Outermost loop invocations the record covers, and the time they took.
+    pub fn root_span(&self) -> (u64, u64) {
+        if self.is_aggregate() {
+            (self.root_invocations, self.root_time)
+        } else {
+            (1, self.end.saturating_sub(self.start))
+        }
+    }
+
+    /// Adds an instrumented record, or another aggregate of the same loop, to
+    /// this aggregate record.
+    pub fn aggregate(&mut self, record: &RooflineRecord) {
+        if self.root_invocations == 0 {
+            self.start = record.start;
+        }
+        self.end = record.end;
+        self.invocations = self.invocations.saturating_add(record.invocations);
+        self.loop_time = self.loop_time.saturating_add(record.loop_time);
+        let (root_invocations, root_time) = record.root_span();
+        self.root_invocations = self.root_invocations.saturating_add(root_invocations);
+        self.root_time = self.root_time.saturating_add(root_time);
+        self.stats += &record.stats;
+    }
+
+    pub fn as_bytes(&self) -> &[u8] {
+        // All fields are integers laid out without padding.
+        unsafe { std::slice::from_raw_parts((self as *const Self).cast::<u8>(), Self::SIZE) }
+    }
+
+    pub fn from_bytes(bytes: &[u8]) -> Self {
+        <Self as Sendable>::from_raw_bytes(bytes)
+    }
+
+    pub fn write_binary(&self, writer: &mut impl Write) -> std::io::Result<()> {
+        writer.write_all(self.as_bytes())
+    }
+
+    pub fn read_all(reader: &mut impl Read) -> std::io::Result<Vec<Self>> {
+        Self::read_each(reader).collect()
+    }
+
+    /// Reads the records of `reader` one at a time, so that a file of any
+    /// size can be processed in constant memory. A truncated record at the
+    /// end is ignored, like a partially written ring buffer entry.
+    pub fn read_each(reader: &mut impl Read) -> impl Iterator<Item = std::io::Result<Self>> + '_ {
+        let mut bytes = [0_u8; Self::SIZE];
+        std::iter::from_fn(move || match reader.read_exact(&mut bytes) {
+            Ok(()) => Some(Ok(Self::from_bytes(&bytes))),
+            Err(error) if error.kind() == std::io::ErrorKind::UnexpectedEof => None,
+            Err(error) => Some(Err(error)),
+        })
+    }
+}
+
+/// Static location of a loop, persisted in `loops.json`.
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub struct LoopDescription {
+    pub id: u64,
+    /// The enclosing instrumented loop, zero for outermost loops.
+    #[serde(default)]
+    pub parent_id: u64,
+    pub file_name: u128,
+    pub function_name: u128,
+    pub line: u32,
+    /// Last line of the loop in `file_name`, zero in results recorded before
+    /// it was tracked.
+    #[serde(default)]
+    pub end_line: u32,
+    /// `LOOP_FLAG_*` bits.
+    #[serde(default)]
+    pub flags: u32,
+    #[serde(default)]
+    pub codegen: LoopCodegen,
+    /// Name of an annotated region, zero for loops.
+    #[serde(default)]
+    pub name: u128,
+}
+
+/// Callers of the function an outermost loop runs in, sent by the collector
+/// the first time a process enters a loop from them and persisted in
+/// `contexts.json`. `id` is a hash of `frames` and only unique within the
+/// process.
+#[derive(Encode, Decode, Serialize, Deserialize, Debug, Clone, PartialEq, Eq)]
+pub struct CallingContext {
+    pub id: u64,
+    pub process_id: u32,
+    /// Return addresses, the direct caller first.
+    pub frames: Vec<u64>,
+}
+
+/// Static counts of one block of an instrumented loop, from the block table
+/// of the Clang plugin. Sent by the collector when `mperf` estimates loop
+/// statistics from last branch records and persisted in `blocks.json`.
+#[derive(Encode, Decode, Serialize, Deserialize, Debug, Clone, PartialEq, Eq)]
+pub struct BasicBlockDescription {
+    pub process_id: u32,
+    /// Run-time address of the first instruction of the block.
+    pub address: u64,
+    /// The innermost instrumented loop around the block.
+    pub loop_id: u64,
+    /// The nested loop this block is the preheader of, zero for other blocks.
+    pub entered_loop_id: u64,
+    /// Counts of a single execution of the block. The header of `loop_id`
+    /// counts one trip, footprints are left out.
+    pub stats: LoopStats,
+}
+
+/// Code that ran straight through between two taken branches, from the
+/// target of one to the source of the next. Runs are summed over the last
+/// branch records of a process and persisted in `branch_runs.json`.
+#[derive(Serialize, Deserialize, Debug, Clone, PartialEq)]
+pub struct BranchRun {
+    pub process_id: u32,
+    pub start: u64,
+    /// Address of the branch that ends the run.
+    pub end: u64,
+    /// Estimated number of times the run executed.
+    pub executions: f64,
+    /// Estimated cycles spent in the run.
+    pub cycles: f64,
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn roofline_records_round_trip_through_files() {
+        let records = [1_u64, 2].map(|loop_id| RooflineRecord {
+            loop_id,
+            process_id: 10,
+            thread_id: 11,
+            start: 100,
+            end: 200,
+            flags: ROOFLINE_RECORD_INSTRUMENTED,
+            invocations: 1,
+            loop_time: 100,
+            region_instance: 3,
+            context_id: 5 * loop_id,
+            root_invocations: 4 * loop_id,
+            root_time: 400,
+            counters: LoopCounters {
+                cycles: 300 * loop_id,
+                ..LoopCounters::default()
+            },
+            stats: LoopStats {
+                bytes_load: 64 * loop_id,
+                ..LoopStats::default()
+            },
+        });
+
+        let mut file = vec![];
+        for record in &records {
+            record.write_binary(&mut file).unwrap();
+        }
+        assert_eq!(file.len(), 2 * RooflineRecord::SIZE);
+
+        let decoded = RooflineRecord::read_all(&mut file.as_slice()).unwrap();
+        assert_eq!(decoded, records);
+        assert!(decoded[0].is_instrumented());
+        assert!(!decoded[0].has_counters());
+        assert!(!decoded[0].is_region());
+
+        // A record cut short by a crash of the recorded process is dropped.
+        let truncated = &file[..file.len() - 1];
+        let streamed = RooflineRecord::read_each(&mut &truncated[..])
+            .collect::<std::io::Result<Vec<_>>>()
+            .unwrap();
+        assert_eq!(streamed, records[..1]);
+    }
+
+    #[test]
+    fn loop_stats_add_up_field_by_field() {
+        let mut sum = LoopStats {
+            trip_count: 2,
+            footprint_bytes: u64::MAX - 1,
+            ..LoopStats::default()
+        };
+        sum += &LoopStats {
+            trip_count: 3,
+            bytes_indirect: 8,
+            footprint_bytes: 4,
+            ..LoopStats::default()
+        };
+        assert_eq!(sum.trip_count, 5);
+        assert_eq!(sum.bytes_indirect, 8);
+        assert_eq!(sum.footprint_bytes, u64::MAX);
+    }
+}
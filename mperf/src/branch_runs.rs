@@ -0,0 +1,149 @@
+//! Straight-line runs of code between the taken branches of last branch
+//! records.
+//!
+//! Two consecutive entries of a record delimit a run: it starts at the target
+//! of the older branch and ends with the newer one, and everything in between
+//! ran exactly once. The cycles of an entry are the ones since the branch
+//! before it, so they belong to the run the entry ends, and the oldest entry
+//! ends a run whose start is unknown. A sample of `P` cycles whose runs took
+//! `C` cycles stands for `P / C` repetitions of the same code, runs are
+//! summed with that weight.
+
+use std::collections::HashMap;
+
+use mperf_data::BranchRun;
+use pmu::BranchRecord;
+
+/// Longest run taken for straight-line code. Longer ones come from records
+/// that cross into code the branches do not see, such as the kernel.
+const MAX_RUN_BYTES: u64 = 4096;
+
+/// Last branch records of one cycles sample.
+pub struct BranchSample {
+    pub process_id: u32,
+    /// Cycles the sample stands for.
+    pub period: u64,
+    /// The most recent branch first.
+    pub branches: Vec<BranchRecord>,
+}
+
+/// Runs summed over the samples of every process, keyed by process, start
+/// and end.
+#[derive(Default)]
+pub struct BranchRunAggregator {
+    runs: HashMap<(u32, u64, u64), (f64, f64)>,
+    /// Samples without cycle counts, which cannot be weighted.
+    skipped: u64,
+}
+
+impl BranchRunAggregator {
+    pub fn add(&mut self, sample: &BranchSample) {
+        let runs = sample
+            .branches
+            .windows(2)
+            .filter_map(|pair| {
+                let (newer, older) = (pair[0], pair[1]);
+                let valid = older.to != 0
+                    && older.to <= newer.from
+                    && newer.from - older.to < MAX_RUN_BYTES;
+                valid.then_some((older.to, newer.from, newer.cycles))
+            })
+            .collect::<Vec<_>>();
+        let cycles = runs
+            .iter()
+            .map(|&(_, _, cycles)| u64::from(cycles))
+            .sum::<u64>();
+        if cycles == 0 {
+            self.skipped += 1;
+            return;
+        }
+
+        let weight = sample.period as f64 / cycles as f64;
+        for (start, end, run_cycles) in runs {
+            let run = self
+                .runs
+                .entry((sample.process_id, start, end))
+                .or_default();
+            run.0 += weight;
+            run.1 += f64::from(run_cycles) * weight;
+        }
+    }
+
+    /// Samples left out because their branches carried no cycle counts.
+    pub fn skipped(&self) -> u64 {
+        self.skipped
+    }
+
+    pub fn into_runs(self) -> Vec<BranchRun> {
+        self.runs
+            .into_iter()
+            .map(
+                |((process_id, start, end), (executions, cycles))| BranchRun {
+                    process_id,
+                    start,
+                    end,
+                    executions,
+                    cycles,
+                },
+            )
+            .collect()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{BranchRunAggregator, BranchSample};
+    use pmu::BranchRecord;
+
+    fn branch(from: u64, to: u64, cycles: u16) -> BranchRecord {
+        BranchRecord { from, to, cycles }
+    }
+
+    #[test]
+    fn runs_are_weighted_by_the_sample_period() {
+        let mut aggregator = BranchRunAggregator::default();
+        // A loop body from 0x1000 to its back edge at 0x1040, taken twice,
+        // after a call that jumped into it.
+        aggregator.add(&BranchSample {
+            process_id: 7,
+            period: 1000,
+            branches: vec![
+                branch(0x1040, 0x1000, 6),
+                branch(0x1040, 0x1000, 4),
+                branch(0x500, 0x1000, 30),
+            ],
+        });
+
+        let runs = aggregator.into_runs();
+        assert_eq!(runs.len(), 1);
+        let run = &runs[0];
+        assert_eq!((run.process_id, run.start, run.end), (7, 0x1000, 0x1040));
+        // Both runs took 10 cycles of the 1000 the sample stands for.
+        assert_eq!(run.executions, 200.0);
+        assert_eq!(run.cycles, 1000.0);
+    }
+
+    #[test]
+    fn broken_runs_and_missing_cycles_are_left_out() {
+        let mut aggregator = BranchRunAggregator::default();
+        aggregator.add(&BranchSample {
+            process_id: 7,
+            period: 1000,
+            branches: vec![
+                // Runs backwards.
+                branch(0x1000, 0x2000, 5),
+                branch(0x3000, 0x2000, 5),
+                // Too long for straight-line code.
+                branch(0x100_0000, 0x1000, 5),
+            ],
+        });
+        aggregator.add(&BranchSample {
+            process_id: 7,
+            period: 1000,
+            branches: vec![branch(0x1040, 0x1000, 0), branch(0x1040, 0x1000, 0)],
+        });
+
+        assert_eq!(aggregator.skipped(), 2);
+        assert!(aggregator.into_runs().is_empty());
+    }
+}
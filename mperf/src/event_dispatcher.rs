@@ -4,7 +4,10 @@ use std::cell::RefCell;
 use std::collections::HashSet;
 use std::{collections::HashMap, path::Path, sync::Arc};
 
-use mperf_data::{Event, IString, ProcMapEntry};
+use mperf_data::{
+    BasicBlockDescription, CallingContext, Event, IString, LoopDescription, ProcMapEntry,
+    RooflineRecord,
+};
 use parking_lot::{RwLock, RwLockUpgradableReadGuard};
 use thread_local::ThreadLocal;
 use tokio::{
@@ -12,6 +15,8 @@ use tokio::{
     task::JoinHandle,
 };
 
+use crate::branch_runs::{BranchRunAggregator, BranchSample};
+
 pub struct EventDispatcher {
     strings: RwLock<HashMap<String, u128>>,
     proc_maps: RwLock<HashSet<u32>>,
@@ -19,12 +24,22 @@ pub struct EventDispatcher {
     events_tx: Sender<Event>,
     string_tx: Sender<(u128, String)>,
     proc_map_tx: Sender<ProcMapEntry>,
+    roofline_tx: Sender<RooflineRecord>,
+    loops_tx: Sender<LoopDescription>,
+    contexts_tx: Sender<CallingContext>,
+    blocks_tx: Sender<BasicBlockDescription>,
+    branches_tx: Sender<BranchSample>,
 }
 
 pub struct DispatcherJoinHandle {
     events_worker: JoinHandle<()>,
     string_worker: JoinHandle<()>,
     proc_map_worker: JoinHandle<()>,
+    roofline_worker: JoinHandle<()>,
+    loops_worker: JoinHandle<()>,
+    contexts_worker: JoinHandle<()>,
+    blocks_worker: JoinHandle<()>,
+    branches_worker: JoinHandle<()>,
 }
 
 impl EventDispatcher {
@@ -32,6 +47,11 @@ impl EventDispatcher {
         let (events_tx, mut event_rx) = mpsc::channel::<Event>(8192);
         let (string_tx, mut string_rx) = mpsc::channel::<(u128, String)>(8192);
         let (proc_map_tx, mut proc_map_rx) = mpsc::channel::<ProcMapEntry>(8192);
+        let (roofline_tx, mut roofline_rx) = mpsc::channel::<RooflineRecord>(8192);
+        let (loops_tx, mut loops_rx) = mpsc::channel::<LoopDescription>(8192);
+        let (contexts_tx, mut contexts_rx) = mpsc::channel::<CallingContext>(8192);
+        let (blocks_tx, mut blocks_rx) = mpsc::channel::<BasicBlockDescription>(8192);
+        let (branches_tx, mut branches_rx) = mpsc::channel::<BranchSample>(8192);
 
         let events_out_dir = output_directory.to_owned();
         let events_worker = tokio::spawn(async move {
@@ -73,6 +93,86 @@ impl EventDispatcher {
             serde_json::to_writer(&mut map_file, &proc_map).expect("failed to write proc maps");
         });
 
+        let roofline_out_dir = output_directory.to_owned();
+        let roofline_worker = tokio::spawn(async move {
+            let mut roofline_file = std::io::BufWriter::new(
+                std::fs::File::create(roofline_out_dir.join("roofline.bin"))
+                    .expect("roofline file stream creation"),
+            );
+            while let Some(record) = roofline_rx.recv().await {
+                if record.write_binary(&mut roofline_file).is_err() {
+                    eprintln!(
+                        "Failed to write roofline record for loop {}",
+                        record.loop_id
+                    );
+                }
+            }
+        });
+
+        let loops_out_dir = output_directory.to_owned();
+        let loops_worker = tokio::spawn(async move {
+            // Every recorded process registers the same loops.
+            let mut loops = HashMap::<u64, LoopDescription>::new();
+            while let Some(desc) = loops_rx.recv().await {
+                loops.insert(desc.id, desc);
+            }
+
+            let loops = loops.into_values().collect::<Vec<_>>();
+            let mut loops_file =
+                std::fs::File::create(loops_out_dir.join("loops.json")).expect("loops");
+            serde_json::to_writer(&mut loops_file, &loops).expect("failed to write loops");
+        });
+
+        let contexts_out_dir = output_directory.to_owned();
+        let contexts_worker = tokio::spawn(async move {
+            // Context IDs are only unique within a process.
+            let mut contexts = HashMap::<(u32, u64), CallingContext>::new();
+            while let Some(context) = contexts_rx.recv().await {
+                contexts.insert((context.process_id, context.id), context);
+            }
+
+            let contexts = contexts.into_values().collect::<Vec<_>>();
+            let mut contexts_file =
+                std::fs::File::create(contexts_out_dir.join("contexts.json")).expect("contexts");
+            serde_json::to_writer(&mut contexts_file, &contexts)
+                .expect("failed to write calling contexts");
+        });
+
+        let blocks_out_dir = output_directory.to_owned();
+        let blocks_worker = tokio::spawn(async move {
+            let mut blocks = HashMap::<(u32, u64), BasicBlockDescription>::new();
+            while let Some(block) = blocks_rx.recv().await {
+                blocks.insert((block.process_id, block.address), block);
+            }
+
+            let blocks = blocks.into_values().collect::<Vec<_>>();
+            let mut blocks_file =
+                std::fs::File::create(blocks_out_dir.join("blocks.json")).expect("blocks");
+            serde_json::to_writer(&mut blocks_file, &blocks).expect("failed to write blocks");
+        });
+
+        let branches_out_dir = output_directory.to_owned();
+        let branches_worker = tokio::spawn(async move {
+            // Samples are folded as they arrive, only the distinct runs are
+            // kept.
+            let mut aggregator = BranchRunAggregator::default();
+            let mut samples = 0_u64;
+            while let Some(sample) = branches_rx.recv().await {
+                aggregator.add(&sample);
+                samples += 1;
+            }
+            if samples > 0 && aggregator.skipped() == samples {
+                eprintln!(
+                    "Branch records carry no cycle counts, loop statistics cannot be estimated"
+                );
+            }
+
+            let runs = aggregator.into_runs();
+            let mut runs_file = std::fs::File::create(branches_out_dir.join("branch_runs.json"))
+                .expect("branch runs");
+            serde_json::to_writer(&mut runs_file, &runs).expect("failed to write branch runs");
+        });
+
         (
             Arc::new(EventDispatcher {
                 strings: RwLock::new(HashMap::new()),
@@ -81,11 +181,21 @@ impl EventDispatcher {
                 events_tx,
                 string_tx,
                 proc_map_tx,
+                roofline_tx,
+                loops_tx,
+                contexts_tx,
+                blocks_tx,
+                branches_tx,
             }),
             DispatcherJoinHandle {
                 events_worker,
                 string_worker,
                 proc_map_worker,
+                roofline_worker,
+                loops_worker,
+                contexts_worker,
+                blocks_worker,
+                branches_worker,
             },
         )
     }
@@ -168,6 +278,36 @@ impl EventDispatcher {
             eprintln!("lost event: {:?}", err);
         }
     }
+
+    pub async fn publish_roofline_record(&self, record: RooflineRecord) {
+        if let Err(err) = self.roofline_tx.send(record).await {
+            eprintln!("lost roofline record: {:?}", err);
+        }
+    }
+
+    pub async fn publish_loop(&self, desc: LoopDescription) {
+        if let Err(err) = self.loops_tx.send(desc).await {
+            eprintln!("lost loop description: {:?}", err);
+        }
+    }
+
+    pub async fn publish_context(&self, context: CallingContext) {
+        if let Err(err) = self.contexts_tx.send(context).await {
+            eprintln!("lost calling context: {:?}", err);
+        }
+    }
+
+    pub async fn publish_block(&self, block: BasicBlockDescription) {
+        if let Err(err) = self.blocks_tx.send(block).await {
+            eprintln!("lost basic block description: {:?}", err);
+        }
+    }
+
+    pub fn publish_branches_sync(&self, sample: BranchSample) {
+        if let Err(err) = self.branches_tx.blocking_send(sample) {
+            eprintln!("lost branch records: {:?}", err);
+        }
+    }
 }
 
 fn current_thread_id() -> u64 {
@@ -188,6 +328,15 @@ fn current_thread_id() -> u64 {
 
 impl DispatcherJoinHandle {
     pub async fn join(self) {
-        let _ = tokio::join!(self.events_worker, self.string_worker, self.proc_map_worker);
+        let _ = tokio::join!(
+            self.events_worker,
+            self.string_worker,
+            self.proc_map_worker,
+            self.roofline_worker,
+            self.loops_worker,
+            self.contexts_worker,
+            self.blocks_worker,
+            self.branches_worker
+        );
     }
 }
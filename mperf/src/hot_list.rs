@@ -0,0 +1,64 @@
+use std::path::Path;
+
+use anyhow::{Context, Result};
+
+/// Prints the functions that took at least `threshold` of the recorded
+/// cycles in the format read by the Clang plugin's `-miniperf-hot-list`.
+pub fn do_hot_list(path: &Path, threshold: f64) -> Result<()> {
+    let db_path = path.join("perf.db");
+    let connection =
+        sqlite::open(&db_path).with_context(|| format!("failed to open {}", db_path.display()))?;
+
+    println!("# Functions above {:.1}% of cycles", threshold * 100.0);
+    for function in hot_functions(&connection, threshold)? {
+        println!("func {function}");
+    }
+
+    Ok(())
+}
+
+fn hot_functions(connection: &sqlite::Connection, threshold: f64) -> Result<Vec<String>> {
+    let mut stmt = connection
+        .prepare(
+            "SELECT func_name FROM hotspots
+             WHERE total >= ? AND func_name IS NOT NULL AND func_name != '[unknown]'
+             ORDER BY total DESC;",
+        )
+        .context(
+            "the results have no hotspots, record them with the snapshot or roofline scenario",
+        )?;
+    stmt.bind((1, threshold))?;
+
+    let mut functions = vec![];
+    while let sqlite::State::Row = stmt.next()? {
+        let name = stmt.read::<String, _>("func_name")?;
+        // Entries are line based, the plugin could not match such a name.
+        if !name.is_empty() && !name.contains('\n') {
+            functions.push(name);
+        }
+    }
+    Ok(functions)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::hot_functions;
+
+    #[test]
+    fn lists_functions_above_the_threshold_hottest_first() {
+        let connection = sqlite::open(":memory:").unwrap();
+        connection
+            .execute(
+                "CREATE TABLE hotspots (func_name TEXT, total REAL);
+                 INSERT INTO hotspots VALUES
+                    ('cold', 0.001), ('kernel(float*, int)', 0.6),
+                    ('[unknown]', 0.2), ('helper', 0.05), (NULL, 0.1);",
+            )
+            .unwrap();
+
+        assert_eq!(
+            hot_functions(&connection, 0.01).unwrap(),
+            ["kernel(float*, int)", "helper"]
+        );
+    }
+}
@@ -1,7 +1,9 @@
+mod branch_runs;
 mod counter_selection;
 mod disassembly;
 mod event_dispatcher;
 mod events_export;
+mod hot_list;
 mod postprocess;
 mod processing;
 mod record;
@@ -23,8 +25,9 @@ use anyhow::Result;
 use clap::{Parser, Subcommand};
 
 use events_export::do_events_export;
+use hot_list::do_hot_list;
 use mperf_data::Scenario;
-use record::do_record;
+use record::{do_record, RooflineOptions};
 use stat::do_stat;
 
 #[derive(Parser)]
@@ -58,6 +61,27 @@ enum Commands {
         output_directory: String,
         #[arg(short, long)]
         pid: Option<u32>,
+        /// Collect roofline loop statistics in the profiling run itself by
+        /// instrumenting every N-th invocation of each loop, instead of
+        /// replaying the workload in a second, fully instrumented run. N must
+        /// be at least 2.
+        #[arg(long, value_name = "N")]
+        roofline_sample_period: Option<u32>,
+        /// Skip the roofline instrumentation of a loop, by its id in the
+        /// roofline results. May be repeated.
+        #[arg(long = "roofline-disable-loop", value_name = "ID")]
+        roofline_disabled_loops: Vec<u64>,
+        /// Read cycles, instructions and LLC misses in user space around every
+        /// timed loop invocation. The extra counters may be multiplexed with
+        /// the sampled ones on PMUs with few counters.
+        #[arg(long)]
+        roofline_loop_counters: bool,
+        /// Keep a database row per loop invocation besides the per-loop
+        /// aggregates. The collector then sends every instrumented invocation
+        /// instead of summing them, and postprocessing memory grows with the
+        /// number of invocations.
+        #[arg(long)]
+        roofline_raw_invocations: bool,
         #[arg(last = true)]
         command: Vec<String>,
     },
@@ -67,6 +91,13 @@ enum Commands {
     EventsExport {
         result_directory: String,
     },
+    /// Print the hot functions of a recording as a Clang plugin hot list.
+    HotList {
+        result_directory: String,
+        /// Minimum share of the recorded cycles, from 0 to 1.
+        #[arg(long, default_value_t = 0.01)]
+        threshold: f64,
+    },
 }
 
 #[tokio::main(flavor = "multi_thread", worker_threads = 8)]
@@ -91,6 +122,10 @@ async fn main() -> Result<()> {
             scenario,
             output_directory,
             pid,
+            roofline_sample_period,
+            roofline_disabled_loops,
+            roofline_loop_counters,
+            roofline_raw_invocations,
             command,
         } => {
             if std::fs::exists(&output_directory)? {
@@ -104,7 +139,19 @@ async fn main() -> Result<()> {
 
             let output_directory = PathBuf::from_str(&output_directory)?;
 
-            return do_record(scenario, &output_directory, pid, command).await;
+            return do_record(
+                scenario,
+                &output_directory,
+                pid,
+                RooflineOptions {
+                    sample_period: roofline_sample_period,
+                    disabled_loops: roofline_disabled_loops,
+                    loop_counters: roofline_loop_counters,
+                    raw_invocations: roofline_raw_invocations,
+                },
+                command,
+            )
+            .await;
         }
         Commands::Show { result_directory } => {
             let path = Path::new(&result_directory);
@@ -114,6 +161,13 @@ async fn main() -> Result<()> {
             let path = Path::new(&result_directory);
             do_events_export(path);
         }
+        Commands::HotList {
+            result_directory,
+            threshold,
+        } => {
+            let path = Path::new(&result_directory);
+            return do_hot_list(path, threshold);
+        }
     }
 
     Ok(())
@@ -8,7 +8,10 @@ use anyhow::Result;
 use kdam::BarExt;
 use memmap2::{Advice, Mmap};
 use mperf_data::{
-    CallFrame, Event, EventType, IString, ProcMapEntry, RecordInfo, Scenario, ScenarioInfo,
+    BasicBlockDescription, BranchRun, CacheLevel, CallFrame, CallingContext, Event, EventType,
+    IString, Location, LoopCodegen, LoopCounters, LoopDescription, LoopStats, ProcMapEntry,
+    RecordInfo, RooflineRecord, Scenario, ScenarioInfo, LOOP_FLAG_NOT_INSTRUMENTED,
+    LOOP_FLAG_PARALLEL_REGION,
 };
 use object::{Object, ObjectSymbol, SymbolKind};
 use smallvec::SmallVec;
@@ -54,11 +57,14 @@ pub async fn perform_postprocessing(res_dir: &Path, pb: kdam::Bar) -> Result<()>
             process_disassembly(&connection, res_dir, &mut pb).await?;
             create_hotspots_view(&connection).await?;
         }
-        Scenario::Roofline => {
+        Scenario::Roofline | Scenario::RooflineLite => {
             process_pmu_counters(&connection, &info.scenario_info, res_dir, &mut pb).await?;
             process_disassembly(&connection, res_dir, &mut pb).await?;
             create_hotspots_view(&connection).await?;
-            create_roofline_view(&connection).await?;
+            create_roofline_view(&connection, &info.caches).await?;
+            create_parallel_regions_view(&connection).await?;
+            create_roofline_callers_view(&connection).await?;
+            create_loop_coverage_view(&connection).await?;
         }
         Scenario::TMA => {
             process_pmu_counters(&connection, &info.scenario_info, res_dir, &mut pb).await?;
@@ -227,29 +233,139 @@ struct ResolvedIp {
 
 #[derive(Default)]
 struct RooflineLoopInfo {
-    id: u128,
+    loop_id: u64,
     pid: u32,
     tid: u32,
-    file_name: u128,
-    func_name: u128,
-    line: u32,
     start: u64,
-    bytes_load: u64,
-    bytes_store: u64,
-    scalar_int_ops: u64,
-    scalar_float_ops: u64,
-    scalar_double_ops: u64,
-    vector_int_ops: u64,
-    vector_float_ops: u64,
-    vector_double_ops: u64,
+    end: u64,
+    invocations: u64,
+    loop_time: u64,
+    /// Instance of the parallel region the invocation ran in, zero outside of
+    /// parallel regions.
+    region_instance: u64,
+    /// Calling context of the outermost loop invocation, zero if unknown.
+    context_id: u64,
+    /// Outermost loop invocations the info covers and the time they took,
+    /// more than one for records the collector aggregated.
+    root_invocations: u64,
+    root_time: u64,
+    /// Hardware counters of an invocation of the original code.
+    counters: Option<LoopCounters>,
+    stats: LoopStats,
+}
+
+/// Position of a loop in the loop tree.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+struct LoopTreeNode {
+    /// The outermost loop the node is nested in, the node itself for roots.
+    root_id: u64,
+    /// One for outermost loops.
+    depth: u32,
+}
+
+/// Timed invocations are aggregated per loop, thread and instance of the
+/// enclosing parallel region. The load imbalance of a region needs the busy
+/// time of every thread in every instance. Invocations from different
+/// callers are kept apart as well.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+struct RunKey {
+    loop_id: u64,
+    pid: u32,
+    tid: u32,
+    region_instance: u64,
+    context_id: u64,
+}
+
+/// Timed invocations of the original code of a loop under one `RunKey`.
+#[derive(Debug, Default, Clone, PartialEq, Eq)]
+struct RunAggregate {
+    runs: u64,
+    total_duration: u64,
+    min_duration: u64,
+    max_duration: u64,
+    /// Invocations that read the loop counters, `counters` sums over them.
+    counted: u64,
+    counters: LoopCounters,
+}
+
+impl RunAggregate {
+    fn add(&mut self, run: &RooflineLoopInfo) {
+        let duration = run.end.saturating_sub(run.start);
+        self.min_duration = if self.runs == 0 {
+            duration
+        } else {
+            self.min_duration.min(duration)
+        };
+        self.max_duration = self.max_duration.max(duration);
+        self.runs += 1;
+        self.total_duration = self.total_duration.saturating_add(duration);
+        if let Some(counters) = &run.counters {
+            self.counted += 1;
+            self.counters += counters;
+        }
+    }
 }
 
+/// Bucket `b` of a duration histogram counts the invocations that took from
+/// `2^(b-1)` up to `2^b - 1` nanoseconds, bucket 0 the ones that took none.
+const DURATION_BUCKETS: usize = u64::BITS as usize + 1;
+
+fn duration_bucket(duration: u64) -> usize {
+    (u64::BITS - duration.leading_zeros()) as usize
+}
+
+/// Instrumented invocations of a loop, with their counts summed.
+#[derive(Debug, Default, Clone, PartialEq, Eq)]
+struct OpsAggregate {
+    /// Outermost loop invocations the records were taken in, one per record
+    /// unless the collector aggregated them.
+    records: u64,
+    invocations: u64,
+    loop_time: u64,
+    /// Time of the outermost loop invocations the records were taken in.
+    root_time: u64,
+    stats: LoopStats,
+}
+
+impl OpsAggregate {
+    fn add(&mut self, ops: &RooflineLoopInfo) {
+        self.records = self.records.saturating_add(ops.root_invocations);
+        self.invocations = self.invocations.saturating_add(ops.invocations);
+        self.loop_time = self.loop_time.saturating_add(ops.loop_time);
+        self.root_time = self.root_time.saturating_add(ops.root_time);
+        self.stats += &ops.stats;
+    }
+}
+
+/// Loop invocations are folded into per-loop aggregates as they are read,
+/// so memory grows with the number of loops rather than with the number of
+/// invocations. Raw invocations are only kept when the recording asked for
+/// them.
 struct RooflineData {
     baseline_pid: i32,
     instrumented_pid: i32,
+    descriptions: HashMap<u64, LoopDescription>,
     loops: HashMap<u128, RooflineLoopInfo>,
-    runs: Vec<(RooflineLoopInfo, u64)>,
-    ops: Vec<RooflineLoopInfo>,
+    runs: HashMap<RunKey, RunAggregate>,
+    /// Duration histogram of the timed invocations of every loop.
+    run_histograms: HashMap<u64, [u64; DURATION_BUCKETS]>,
+    ops: HashMap<u64, OpsAggregate>,
+    /// Instrumented invocations per loop, process and calling context.
+    context_ops: HashMap<(u64, u32, u64), OpsAggregate>,
+    /// Return addresses of the calling contexts of every process.
+    contexts: HashMap<(u32, u64), Vec<u64>>,
+    /// Folded caller stacks of the contexts, see `resolve_contexts`.
+    context_stacks: HashMap<(u32, u64), String>,
+    raw_invocations: bool,
+    raw_runs: Vec<RooflineLoopInfo>,
+    raw_ops: Vec<RooflineLoopInfo>,
+    /// Instances of OpenMP parallel regions, `loop_id` is the region ID.
+    regions: Vec<RooflineLoopInfo>,
+    /// Loop statistics are estimated from `blocks` and `branch_runs` rather
+    /// than counted by an instrumented run.
+    estimated: bool,
+    blocks: Vec<BasicBlockDescription>,
+    branch_runs: Vec<BranchRun>,
 }
 
 impl RooflineData {
@@ -260,12 +376,224 @@ impl RooflineData {
         Some(Self {
             baseline_pid: info.perf_pid,
             instrumented_pid: info.inst_pid,
+            descriptions: HashMap::new(),
             loops: HashMap::new(),
-            runs: Vec::new(),
-            ops: Vec::new(),
+            runs: HashMap::new(),
+            run_histograms: HashMap::new(),
+            ops: HashMap::new(),
+            context_ops: HashMap::new(),
+            contexts: HashMap::new(),
+            context_stacks: HashMap::new(),
+            raw_invocations: info.raw_invocations,
+            raw_runs: Vec::new(),
+            raw_ops: Vec::new(),
+            regions: Vec::new(),
+            estimated: info.estimated,
+            blocks: Vec::new(),
+            branch_runs: Vec::new(),
         })
     }
 
+    fn add_run(&mut self, run: RooflineLoopInfo) {
+        let key = RunKey {
+            loop_id: run.loop_id,
+            pid: run.pid,
+            tid: run.tid,
+            region_instance: run.region_instance,
+            context_id: run.context_id,
+        };
+        self.runs.entry(key).or_default().add(&run);
+        let bucket = duration_bucket(run.end.saturating_sub(run.start));
+        self.run_histograms
+            .entry(run.loop_id)
+            .or_insert([0; DURATION_BUCKETS])[bucket] += 1;
+        if self.raw_invocations {
+            self.raw_runs.push(run);
+        }
+    }
+
+    fn add_ops(&mut self, ops: RooflineLoopInfo) {
+        self.ops.entry(ops.loop_id).or_default().add(&ops);
+        if ops.context_id != 0 {
+            self.context_ops
+                .entry((ops.loop_id, ops.pid, ops.context_id))
+                .or_default()
+                .add(&ops);
+        }
+        if self.raw_invocations {
+            self.raw_ops.push(ops);
+        }
+    }
+
+    /// Reads the loop records written by the dispatcher. Results from before
+    /// format version 3 keep roofline data in the event stream instead.
+    fn load_records(&mut self, res_dir: &Path) -> Result<()> {
+        let loops_path = res_dir.join("loops.json");
+        if loops_path.exists() {
+            let loops: Vec<LoopDescription> =
+                serde_json::from_reader(std::fs::File::open(loops_path)?)?;
+            self.descriptions
+                .extend(loops.into_iter().map(|desc| (desc.id, desc)));
+        }
+
+        let contexts_path = res_dir.join("contexts.json");
+        if contexts_path.exists() {
+            let contexts: Vec<CallingContext> =
+                serde_json::from_reader(std::fs::File::open(contexts_path)?)?;
+            self.contexts.extend(
+                contexts
+                    .into_iter()
+                    .map(|context| ((context.process_id, context.id), context.frames)),
+            );
+        }
+
+        let records_path = res_dir.join("roofline.bin");
+        if records_path.exists() {
+            let mut file = std::io::BufReader::new(std::fs::File::open(records_path)?);
+            for record in RooflineRecord::read_each(&mut file) {
+                self.consume_record(&record?)?;
+            }
+        }
+
+        if self.estimated {
+            let blocks_path = res_dir.join("blocks.json");
+            if blocks_path.exists() {
+                self.blocks = serde_json::from_reader(std::fs::File::open(blocks_path)?)?;
+            }
+            let runs_path = res_dir.join("branch_runs.json");
+            if runs_path.exists() {
+                self.branch_runs = serde_json::from_reader(std::fs::File::open(runs_path)?)?;
+            }
+            self.estimate_ops();
+        }
+
+        Ok(())
+    }
+
+    /// Stands in for the instrumented invocations of a roofline-lite
+    /// recording with one estimate per loop over the whole run. The counts of
+    /// every block, times the number of times it ran, are added to its loop
+    /// and to the loops around it, trips only to its own loop. Nested loops
+    /// are entered as often as their preheader ran, and their time is their
+    /// share of the cycles of their outermost loop.
+    ///
+    /// The estimate covers every timed invocation of an outermost loop. Its
+    /// footprint is all the bytes the loop moved, so the working set is an
+    /// upper bound. Counts the block tables cannot know in advance, such as
+    /// the lengths of memory intrinsics, are missing.
+    fn estimate_ops(&mut self) {
+        let mut blocks = std::mem::take(&mut self.blocks);
+        if blocks.is_empty() {
+            eprintln!(
+                "No block tables were recorded, build with -mllvm -miniperf-block-table to \
+                 estimate loop statistics"
+            );
+        }
+        let frequencies = estimate_block_frequencies(&mut blocks, &self.branch_runs);
+        let tree = self.loop_tree();
+
+        let mut stats = HashMap::<u64, LoopStats>::new();
+        let mut cycles = HashMap::<u64, f64>::new();
+        let mut entries = HashMap::<u64, f64>::new();
+        for (block, &(executions, block_cycles)) in blocks.iter().zip(&frequencies) {
+            if executions <= 0.0 {
+                continue;
+            }
+            if block.entered_loop_id != 0 {
+                *entries.entry(block.entered_loop_id).or_default() += executions;
+            }
+            let mut counts = block.stats.scaled(executions);
+            let depth = tree.get(&block.loop_id).map_or(1, |node| node.depth);
+            let mut loop_id = block.loop_id;
+            for _ in 0..depth {
+                *stats.entry(loop_id).or_default() += &counts;
+                *cycles.entry(loop_id).or_default() += block_cycles;
+                counts.trip_count = 0;
+                loop_id = self
+                    .descriptions
+                    .get(&loop_id)
+                    .map_or(0, |desc| desc.parent_id);
+            }
+        }
+
+        let mut timed_runs = HashMap::<u64, u64>::new();
+        for (key, runs) in &self.runs {
+            *timed_runs.entry(key.loop_id).or_default() += runs.runs;
+        }
+
+        for (loop_id, mut loop_stats) in stats {
+            let Some(node) = tree.get(&loop_id) else {
+                continue;
+            };
+            let records = timed_runs.get(&node.root_id).copied().unwrap_or(0);
+            let invocations = if node.depth == 1 {
+                records
+            } else {
+                entries
+                    .get(&loop_id)
+                    .map_or(0, |entries| entries.round() as u64)
+            };
+            loop_stats.footprint_bytes = loop_stats.bytes_load + loop_stats.bytes_store;
+            self.add_ops(RooflineLoopInfo {
+                loop_id,
+                pid: self.baseline_pid as u32,
+                invocations,
+                loop_time: cycles
+                    .get(&loop_id)
+                    .map_or(0, |cycles| cycles.round() as u64),
+                root_invocations: records,
+                root_time: cycles
+                    .get(&node.root_id)
+                    .map_or(0, |cycles| cycles.round() as u64),
+                stats: loop_stats,
+                ..RooflineLoopInfo::default()
+            });
+        }
+    }
+
+    fn consume_record(&mut self, record: &RooflineRecord) -> Result<()> {
+        if !self.descriptions.contains_key(&record.loop_id) {
+            anyhow::bail!("roofline record references unknown loop {}", record.loop_id);
+        }
+        let (root_invocations, root_time) = record.root_span();
+        let loop_info = RooflineLoopInfo {
+            loop_id: record.loop_id,
+            pid: record.process_id,
+            tid: record.thread_id,
+            start: record.start,
+            end: record.end,
+            invocations: record.invocations,
+            loop_time: record.loop_time,
+            region_instance: record.region_instance,
+            context_id: record.context_id,
+            root_invocations,
+            root_time,
+            counters: record.has_counters().then_some(record.counters),
+            stats: record.stats,
+        };
+
+        if record.is_region() {
+            // Regions of a separate instrumented run are slowed down by the
+            // instrumentation, like its loops.
+            if record.process_id as i32 != self.instrumented_pid
+                || self.instrumented_pid == self.baseline_pid
+            {
+                self.regions.push(loop_info);
+            }
+            return Ok(());
+        }
+
+        // Instrumented invocations run slower than the original code, so only
+        // their counts are kept. This holds both for a separate instrumented
+        // run and for invocations sampled during the PMU run.
+        if record.is_instrumented() {
+            self.add_ops(loop_info);
+        } else {
+            self.add_run(loop_info);
+        }
+        Ok(())
+    }
+
     fn consume(&mut self, event: &Event) -> Result<()> {
         match event.ty {
             EventType::RooflineLoopStart => {
@@ -274,56 +602,77 @@ impl RooflineData {
                     .first()
                     .ok_or_else(|| anyhow::anyhow!("roofline loop start has no location"))?
                     .as_loc();
+                // Legacy results have no loop IDs, loops are told apart by
+                // their location only.
+                let loop_id = legacy_loop_id(&location);
+                self.descriptions
+                    .entry(loop_id)
+                    .or_insert_with(|| LoopDescription {
+                        id: loop_id,
+                        parent_id: 0,
+                        file_name: location.file_name,
+                        function_name: location.function_name,
+                        line: location.line,
+                        end_line: location.line,
+                        flags: 0,
+                        codegen: LoopCodegen::default(),
+                        name: 0,
+                    });
                 self.loops.insert(
                     event.unique_id,
                     RooflineLoopInfo {
-                        id: event.unique_id,
+                        loop_id,
                         pid: event.process_id,
                         tid: event.thread_id,
-                        file_name: location.file_name,
-                        func_name: location.function_name,
-                        line: location.line,
                         start: event.timestamp,
+                        invocations: 1,
                         ..RooflineLoopInfo::default()
                     },
                 );
             }
             EventType::RooflineLoopEnd => {
-                let loop_info = self.loops.remove(&event.correlation_id).ok_or_else(|| {
+                let mut loop_info = self.loops.remove(&event.correlation_id).ok_or_else(|| {
                     anyhow::anyhow!(
                         "roofline loop end references unknown loop {}",
                         event.correlation_id
                     )
                 })?;
+                loop_info.end = event.timestamp;
+                loop_info.loop_time = loop_info.end.saturating_sub(loop_info.start);
+                loop_info.root_invocations = 1;
+                loop_info.root_time = loop_info.loop_time;
                 if event.process_id as i32 == self.baseline_pid {
-                    self.runs.push((loop_info, event.timestamp));
+                    self.add_run(loop_info);
                 } else if event.process_id as i32 == self.instrumented_pid {
-                    self.ops.push(loop_info);
+                    self.add_ops(loop_info);
                 }
             }
-            EventType::RooflineBytesLoad => {
-                self.loop_mut(event)?.bytes_load = event.value;
-            }
-            EventType::RooflineBytesStore => {
-                self.loop_mut(event)?.bytes_store = event.value;
-            }
-            EventType::RooflineScalarIntOps => {
-                self.loop_mut(event)?.scalar_int_ops = event.value;
-            }
-            EventType::RooflineScalarFloatOps => {
-                self.loop_mut(event)?.scalar_float_ops = event.value;
-            }
-            EventType::RooflineScalarDoubleOps => {
-                self.loop_mut(event)?.scalar_double_ops = event.value;
-            }
-            EventType::RooflineVectorIntOps => {
-                self.loop_mut(event)?.vector_int_ops = event.value;
-            }
-            EventType::RooflineVectorFloatOps => {
-                self.loop_mut(event)?.vector_float_ops = event.value;
-            }
-            EventType::RooflineVectorDoubleOps => {
-                self.loop_mut(event)?.vector_double_ops = event.value;
+            ty if ty.is_roofline() => {
+                let stats = &mut self.loop_mut(event)?.stats;
+                let counter = match ty {
+                    EventType::RooflineBytesLoad => &mut stats.bytes_load,
+                    EventType::RooflineBytesStore => &mut stats.bytes_store,
+                    EventType::RooflineScalarIntOps => &mut stats.scalar_int_ops,
+                    EventType::RooflineScalarHalfOps => &mut stats.scalar_half_ops,
+                    EventType::RooflineScalarBfloatOps => &mut stats.scalar_bfloat_ops,
+                    EventType::RooflineScalarFloatOps => &mut stats.scalar_float_ops,
+                    EventType::RooflineScalarDoubleOps => &mut stats.scalar_double_ops,
+                    EventType::RooflineVectorIntOps => &mut stats.vector_int_ops,
+                    EventType::RooflineVectorHalfOps => &mut stats.vector_half_ops,
+                    EventType::RooflineVectorBfloatOps => &mut stats.vector_bfloat_ops,
+                    EventType::RooflineVectorFloatOps => &mut stats.vector_float_ops,
+                    EventType::RooflineVectorDoubleOps => &mut stats.vector_double_ops,
+                    EventType::RooflineDivOps => &mut stats.div_ops,
+                    EventType::RooflineConversionOps => &mut stats.conversion_ops,
+                    EventType::RooflineAtomicOps => &mut stats.atomic_ops,
+                    EventType::RooflineBytesInvariant => &mut stats.bytes_invariant,
+                    EventType::RooflineBytesUnitStride => &mut stats.bytes_unit_stride,
+                    EventType::RooflineBytesStrided => &mut stats.bytes_strided,
+                    EventType::RooflineBytesIndirect => &mut stats.bytes_indirect,
+                    EventType::RooflineFootprintBytes => &mut stats.footprint_bytes,
+                    _ => return Ok(()),
+                };
+                *counter = event.value;
             }
             _ => {}
         }
@@ -338,6 +687,86 @@ impl RooflineData {
             )
         })
     }
+
+    /// Folds the return addresses of every calling context into a caller
+    /// stack, outermost caller first, like the flamegraph stacks. Context IDs
+    /// depend on where the process was loaded, so contexts of the PMU run and
+    /// of a separate instrumented run are only matched by their stacks.
+    fn resolve_contexts(&mut self, mut resolve: impl FnMut(u32, &[CallFrame]) -> String) {
+        for (&(pid, id), frames) in &self.contexts {
+            let frames = frames
+                .iter()
+                .map(|&ip| CallFrame::IP(ip))
+                .collect::<Vec<_>>();
+            self.context_stacks.insert((pid, id), resolve(pid, &frames));
+        }
+    }
+
+    /// Places every known loop in the loop tree. Loops whose parent is
+    /// unknown are treated as outermost loops.
+    fn loop_tree(&self) -> HashMap<u64, LoopTreeNode> {
+        let mut tree = HashMap::with_capacity(self.descriptions.len());
+        for desc in self.descriptions.values() {
+            let mut node = LoopTreeNode {
+                root_id: desc.id,
+                depth: 1,
+            };
+            let mut parent_id = desc.parent_id;
+            // Bounded in case of a malformed descriptor table with a cycle.
+            while node.depth as usize <= self.descriptions.len() {
+                let Some(parent) = self.descriptions.get(&parent_id) else {
+                    break;
+                };
+                node.root_id = parent.id;
+                node.depth += 1;
+                parent_id = parent.parent_id;
+            }
+            tree.insert(desc.id, node);
+        }
+        tree
+    }
+}
+
+/// Sorts `blocks` by process and address and returns how often each of them
+/// ran and the cycles it took, from the branch runs that cover its first
+/// instruction. The cycles of a run are split over the blocks it covers by
+/// their size within the run.
+fn estimate_block_frequencies(
+    blocks: &mut [BasicBlockDescription],
+    runs: &[BranchRun],
+) -> Vec<(f64, f64)> {
+    blocks.sort_by_key(|block| (block.process_id, block.address));
+    let mut frequencies = vec![(0.0, 0.0); blocks.len()];
+    for run in runs {
+        if run.end < run.start {
+            continue;
+        }
+        let first = blocks.partition_point(|block| {
+            (block.process_id, block.address) < (run.process_id, run.start)
+        });
+        let last = blocks.partition_point(|block| {
+            (block.process_id, block.address) <= (run.process_id, run.end)
+        });
+        let span = (run.end - run.start + 1) as f64;
+        for index in first..last {
+            let next = blocks
+                .get(index + 1)
+                .filter(|next| next.process_id == run.process_id)
+                .map_or(run.end + 1, |next| next.address.min(run.end + 1));
+            let size = next - blocks[index].address;
+            frequencies[index].0 += run.executions;
+            frequencies[index].1 += run.cycles * size as f64 / span;
+        }
+    }
+    frequencies
+}
+
+fn legacy_loop_id(location: &Location) -> u64 {
+    use std::hash::{Hash, Hasher};
+
+    let mut hasher = std::collections::hash_map::DefaultHasher::new();
+    (location.file_name, location.function_name, location.line).hash(&mut hasher);
+    hasher.finish()
 }
 
 async fn process_pmu_counters(
@@ -619,7 +1048,11 @@ async fn process_pmu_counters(
             )?;
         }
 
-        if let Some(roofline) = roofline.take() {
+        if let Some(mut roofline) = roofline.take() {
+            roofline.load_records(res_dir)?;
+            roofline.resolve_contexts(|pid, frames| {
+                resolve_folded_stack(&resolved_pm, &mut resolved_ips, pid, frames)
+            });
             persist_roofline_data(connection, roofline)?;
         }
         pb.update_to(map.len())?;
@@ -708,81 +1141,325 @@ fn resolve_folded_stack(
     functions.join(";")
 }
 
+/// Columns of `roofline_op_stats` and `roofline_ops` taken from `LoopStats`,
+/// in bind order.
+fn roofline_stat_columns() -> impl Iterator<Item = &'static str> {
+    ["trip_count", "bytes_load", "bytes_store"]
+        .into_iter()
+        .chain(LoopStats::TYPED_OPS)
+        .chain(LoopStats::CLASS_OPS)
+        .chain(LoopStats::ACCESS_BYTES)
+        .chain(["footprint_bytes"])
+}
+
+/// `roofline_run_stats` and `roofline_op_stats` aggregate the timed and the
+/// instrumented invocations of every loop, `roofline_run_histogram` counts
+/// the timed invocations by their duration, rounded down to a power of two
+/// in `duration_ns`. `roofline_context_op_stats` splits the instrumented
+/// invocations by their calling context, `roofline_contexts` holds the caller
+/// stack of every context. `roofline_loop_runs` and `roofline_ops` only get a
+/// row per invocation when the recording kept raw invocations.
 fn create_roofline_tables(connection: &sqlite::Connection) -> Result<()> {
-    connection.execute(
+    let stat_columns = roofline_stat_columns()
+        .map(|column| format!("{column} INTEGER NOT NULL"))
+        .collect::<Vec<_>>()
+        .join(", ");
+    connection.execute(format!(
         "
+        CREATE TABLE roofline_loops(
+            loop_id INTEGER PRIMARY KEY, parent_id INTEGER NOT NULL, root_id INTEGER NOT NULL,
+            depth INTEGER NOT NULL, file_name BINARY(128) NOT NULL,
+            function_name BINARY(128) NOT NULL, line INTEGER NOT NULL,
+            end_line INTEGER NOT NULL, flags INTEGER NOT NULL,
+            vector_width INTEGER NOT NULL, vector_bits INTEGER NOT NULL,
+            interleave_count INTEGER NOT NULL, estimated_spills INTEGER NOT NULL,
+            name BINARY(128) NOT NULL
+        );
+        CREATE TABLE roofline_run_stats(
+            loop_id INTEGER NOT NULL, process_id INTEGER NOT NULL, thread_id INTEGER NOT NULL,
+            region_instance INTEGER NOT NULL, context_id INTEGER NOT NULL, runs INTEGER NOT NULL,
+            total_duration INTEGER NOT NULL, min_duration INTEGER NOT NULL,
+            max_duration INTEGER NOT NULL, counted INTEGER NOT NULL, cycles INTEGER NOT NULL,
+            instructions INTEGER NOT NULL, llc_misses INTEGER NOT NULL
+        );
+        CREATE TABLE roofline_run_histogram(
+            loop_id INTEGER NOT NULL, duration_ns INTEGER NOT NULL, runs INTEGER NOT NULL
+        );
+        CREATE TABLE roofline_op_stats(
+            loop_id INTEGER PRIMARY KEY, records INTEGER NOT NULL,
+            invocations INTEGER NOT NULL, loop_time INTEGER NOT NULL,
+            root_time INTEGER NOT NULL, {stat_columns}
+        );
+        CREATE TABLE roofline_context_op_stats(
+            loop_id INTEGER NOT NULL, process_id INTEGER NOT NULL, context_id INTEGER NOT NULL,
+            records INTEGER NOT NULL, invocations INTEGER NOT NULL, loop_time INTEGER NOT NULL,
+            root_time INTEGER NOT NULL, {stat_columns}
+        );
+        CREATE TABLE roofline_contexts(
+            process_id INTEGER NOT NULL, context_id INTEGER NOT NULL, call_stack TEXT NOT NULL
+        );
         CREATE TABLE roofline_ops(
-            unique_id BINARY(128), process_id INTEGER NOT NULL, thread_id INTEGER NOT NULL,
-            file_name BINARY(128) NOT NULL, function_name BINARY(128) NOT NULL,
-            line INTEGER NOT NULL, bytes_load INTEGER NOT NULL, bytes_store INTEGER NOT NULL,
-            scalar_int_ops INTEGER NOT NULL, scalar_float_ops INTEGER NOT NULL,
-            scalar_double_ops INTEGER NOT NULL, vector_int_ops INTEGER NOT NULL,
-            vector_float_ops INTEGER NOT NULL, vector_double_ops INTEGER NOT NULL
+            loop_id INTEGER NOT NULL, process_id INTEGER NOT NULL, thread_id INTEGER NOT NULL,
+            loop_start_ts INTEGER NOT NULL, loop_end_ts INTEGER NOT NULL,
+            region_instance INTEGER NOT NULL, invocations INTEGER NOT NULL,
+            loop_time INTEGER NOT NULL, {stat_columns}
         );
         CREATE TABLE roofline_loop_runs(
-            unique_id BINARY(128), process_id INTEGER NOT NULL, thread_id INTEGER NOT NULL,
-            file_name BINARY(128) NOT NULL, function_name BINARY(128) NOT NULL,
-            line INTEGER NOT NULL, loop_start_ts INTEGER NOT NULL, loop_end_ts INTEGER NOT NULL
+            loop_id INTEGER NOT NULL, process_id INTEGER NOT NULL, thread_id INTEGER NOT NULL,
+            loop_start_ts INTEGER NOT NULL, loop_end_ts INTEGER NOT NULL,
+            region_instance INTEGER NOT NULL,
+            cycles INTEGER, instructions INTEGER, llc_misses INTEGER
+        );
+        CREATE TABLE roofline_regions(
+            region_id INTEGER PRIMARY KEY, file_name BINARY(128) NOT NULL,
+            function_name BINARY(128) NOT NULL, line INTEGER NOT NULL
+        );
+        CREATE TABLE roofline_region_runs(
+            region_id INTEGER NOT NULL, process_id INTEGER NOT NULL, thread_id INTEGER NOT NULL,
+            region_instance INTEGER NOT NULL, region_start_ts INTEGER NOT NULL,
+            region_end_ts INTEGER NOT NULL
         );",
-    )?;
+    ))?;
     Ok(())
 }
 
 fn persist_roofline_data(connection: &sqlite::Connection, data: RooflineData) -> Result<()> {
+    let tree = data.loop_tree();
+    let mut loop_stmt = connection.prepare(
+        "INSERT INTO roofline_loops (
+            loop_id, parent_id, root_id, depth, file_name, function_name, line, end_line,
+            flags, vector_width, vector_bits, interleave_count, estimated_spills, name
+         ) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?);",
+    )?;
+    let mut region_stmt = connection.prepare(
+        "INSERT INTO roofline_regions (region_id, file_name, function_name, line)
+         VALUES (?, ?, ?, ?);",
+    )?;
+    for desc in data.descriptions.values() {
+        if desc.flags & LOOP_FLAG_PARALLEL_REGION != 0 {
+            region_stmt.reset()?;
+            region_stmt.bind((1, desc.id as i64))?;
+            region_stmt.bind((2, desc.file_name as f64))?;
+            region_stmt.bind((3, desc.function_name as f64))?;
+            region_stmt.bind((4, desc.line as i64))?;
+            region_stmt.next()?;
+            continue;
+        }
+
+        let node = tree[&desc.id];
+        let parent_id = if node.depth > 1 { desc.parent_id } else { 0 };
+        // Loop IDs are hashes, they are stored as their two's complement.
+        loop_stmt.reset()?;
+        loop_stmt.bind((1, desc.id as i64))?;
+        loop_stmt.bind((2, parent_id as i64))?;
+        loop_stmt.bind((3, node.root_id as i64))?;
+        loop_stmt.bind((4, node.depth as i64))?;
+        loop_stmt.bind((5, desc.file_name as f64))?;
+        loop_stmt.bind((6, desc.function_name as f64))?;
+        loop_stmt.bind((7, desc.line as i64))?;
+        loop_stmt.bind((8, desc.end_line as i64))?;
+        loop_stmt.bind((9, desc.flags as i64))?;
+        loop_stmt.bind((10, desc.codegen.vector_width as i64))?;
+        loop_stmt.bind((11, desc.codegen.vector_bits as i64))?;
+        loop_stmt.bind((12, desc.codegen.interleave_count as i64))?;
+        loop_stmt.bind((13, desc.codegen.estimated_spills as i64))?;
+        loop_stmt.bind((14, desc.name as f64))?;
+        loop_stmt.next()?;
+    }
+
+    let mut run_stats_stmt = connection.prepare(
+        "INSERT INTO roofline_run_stats (
+            loop_id, process_id, thread_id, region_instance, context_id, runs,
+            total_duration, min_duration, max_duration, counted, cycles, instructions,
+            llc_misses
+         ) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?);",
+    )?;
+    for (key, runs) in &data.runs {
+        run_stats_stmt.reset()?;
+        run_stats_stmt.bind((1, key.loop_id as i64))?;
+        run_stats_stmt.bind((2, key.pid as i64))?;
+        run_stats_stmt.bind((3, key.tid as i64))?;
+        let values = [
+            key.region_instance,
+            key.context_id,
+            runs.runs,
+            runs.total_duration,
+            runs.min_duration,
+            runs.max_duration,
+            runs.counted,
+            runs.counters.cycles,
+            runs.counters.instructions,
+            runs.counters.llc_misses,
+        ];
+        for (index, value) in values.into_iter().enumerate() {
+            run_stats_stmt.bind((4 + index, value as i64))?;
+        }
+        run_stats_stmt.next()?;
+    }
+
+    let mut histogram_stmt = connection.prepare(
+        "INSERT INTO roofline_run_histogram (loop_id, duration_ns, runs) VALUES (?, ?, ?);",
+    )?;
+    for (loop_id, histogram) in &data.run_histograms {
+        for (bucket, &runs) in histogram.iter().enumerate() {
+            if runs == 0 {
+                continue;
+            }
+            let duration = if bucket == 0 {
+                0
+            } else {
+                1_u64 << (bucket - 1)
+            };
+            histogram_stmt.reset()?;
+            histogram_stmt.bind((1, *loop_id as i64))?;
+            histogram_stmt.bind((2, duration as i64))?;
+            histogram_stmt.bind((3, runs as i64))?;
+            histogram_stmt.next()?;
+        }
+    }
+
+    let stat_columns = roofline_stat_columns().collect::<Vec<_>>();
+    let mut op_stats_stmt = connection.prepare(format!(
+        "INSERT INTO roofline_op_stats (
+            loop_id, records, invocations, loop_time, root_time, {}
+         ) VALUES ({});",
+        stat_columns.join(", "),
+        vec!["?"; 5 + stat_columns.len()].join(", ")
+    ))?;
+    for (loop_id, ops) in &data.ops {
+        op_stats_stmt.reset()?;
+        op_stats_stmt.bind((1, *loop_id as i64))?;
+        let values = [ops.records, ops.invocations, ops.loop_time, ops.root_time]
+            .into_iter()
+            .chain(stat_values(&ops.stats));
+        for (index, value) in values.enumerate() {
+            op_stats_stmt.bind((2 + index, value as i64))?;
+        }
+        op_stats_stmt.next()?;
+    }
+
+    let mut context_op_stats_stmt = connection.prepare(format!(
+        "INSERT INTO roofline_context_op_stats (
+            loop_id, process_id, context_id, records, invocations, loop_time, root_time, {}
+         ) VALUES ({});",
+        stat_columns.join(", "),
+        vec!["?"; 7 + stat_columns.len()].join(", ")
+    ))?;
+    for (&(loop_id, pid, context_id), ops) in &data.context_ops {
+        context_op_stats_stmt.reset()?;
+        context_op_stats_stmt.bind((1, loop_id as i64))?;
+        context_op_stats_stmt.bind((2, pid as i64))?;
+        let values = [
+            context_id,
+            ops.records,
+            ops.invocations,
+            ops.loop_time,
+            ops.root_time,
+        ]
+        .into_iter()
+        .chain(stat_values(&ops.stats));
+        for (index, value) in values.enumerate() {
+            context_op_stats_stmt.bind((3 + index, value as i64))?;
+        }
+        context_op_stats_stmt.next()?;
+    }
+
+    let mut context_stmt = connection.prepare(
+        "INSERT INTO roofline_contexts (process_id, context_id, call_stack) VALUES (?, ?, ?);",
+    )?;
+    for ((pid, context_id), call_stack) in &data.context_stacks {
+        context_stmt.reset()?;
+        context_stmt.bind((1, *pid as i64))?;
+        context_stmt.bind((2, *context_id as i64))?;
+        context_stmt.bind((3, call_stack.as_str()))?;
+        context_stmt.next()?;
+    }
+
+    let mut region_run_stmt = connection.prepare(
+        "INSERT INTO roofline_region_runs (
+            region_id, process_id, thread_id, region_instance, region_start_ts, region_end_ts
+         ) VALUES (?, ?, ?, ?, ?, ?);",
+    )?;
+    for region in data.regions {
+        region_run_stmt.reset()?;
+        region_run_stmt.bind((1, region.loop_id as i64))?;
+        region_run_stmt.bind((2, region.pid as i64))?;
+        region_run_stmt.bind((3, region.tid as i64))?;
+        region_run_stmt.bind((4, region.region_instance as i64))?;
+        region_run_stmt.bind((5, region.start as i64))?;
+        region_run_stmt.bind((6, region.end as i64))?;
+        region_run_stmt.next()?;
+    }
+
     let mut run_stmt = connection.prepare(
         "INSERT INTO roofline_loop_runs (
-            unique_id, process_id, thread_id, file_name, function_name, line,
-            loop_start_ts, loop_end_ts
-         ) VALUES (?, ?, ?, ?, ?, ?, ?, ?);",
+            loop_id, process_id, thread_id, loop_start_ts, loop_end_ts, region_instance,
+            cycles, instructions, llc_misses
+         ) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?);",
     )?;
-    for (run, end) in data.runs {
+    for run in data.raw_runs {
         run_stmt.reset()?;
-        run_stmt.bind((1, run.id as f64))?;
+        run_stmt.bind((1, run.loop_id as i64))?;
         run_stmt.bind((2, run.pid as i64))?;
         run_stmt.bind((3, run.tid as i64))?;
-        run_stmt.bind((4, run.file_name as f64))?;
-        run_stmt.bind((5, run.func_name as f64))?;
-        run_stmt.bind((6, run.line as i64))?;
-        run_stmt.bind((7, run.start as i64))?;
-        run_stmt.bind((8, end as i64))?;
+        run_stmt.bind((4, run.start as i64))?;
+        run_stmt.bind((5, run.end as i64))?;
+        run_stmt.bind((6, run.region_instance as i64))?;
+        match run.counters {
+            Some(counters) => {
+                run_stmt.bind((7, counters.cycles as i64))?;
+                run_stmt.bind((8, counters.instructions as i64))?;
+                run_stmt.bind((9, counters.llc_misses as i64))?;
+            }
+            None => {
+                run_stmt.bind((7, ()))?;
+                run_stmt.bind((8, ()))?;
+                run_stmt.bind((9, ()))?;
+            }
+        }
         run_stmt.next()?;
     }
 
-    let mut ops_stmt = connection.prepare(
+    let mut ops_stmt = connection.prepare(format!(
         "INSERT INTO roofline_ops (
-            unique_id, process_id, thread_id, file_name, function_name, line,
-            bytes_load, bytes_store, scalar_int_ops, scalar_float_ops, scalar_double_ops,
-            vector_int_ops, vector_float_ops, vector_double_ops
-         ) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?);",
-    )?;
-    for ops in data.ops {
+            loop_id, process_id, thread_id, loop_start_ts, loop_end_ts, region_instance,
+            invocations, loop_time, {}
+         ) VALUES ({});",
+        stat_columns.join(", "),
+        vec!["?"; 8 + stat_columns.len()].join(", ")
+    ))?;
+    for ops in data.raw_ops {
         ops_stmt.reset()?;
-        ops_stmt.bind((1, ops.id as f64))?;
+        ops_stmt.bind((1, ops.loop_id as i64))?;
         ops_stmt.bind((2, ops.pid as i64))?;
         ops_stmt.bind((3, ops.tid as i64))?;
-        ops_stmt.bind((4, ops.file_name as f64))?;
-        ops_stmt.bind((5, ops.func_name as f64))?;
-        ops_stmt.bind((6, ops.line as i64))?;
-        for (index, value) in [
-            ops.bytes_load,
-            ops.bytes_store,
-            ops.scalar_int_ops,
-            ops.scalar_float_ops,
-            ops.scalar_double_ops,
-            ops.vector_int_ops,
-            ops.vector_float_ops,
-            ops.vector_double_ops,
+        let values = [
+            ops.start,
+            ops.end,
+            ops.region_instance,
+            ops.invocations,
+            ops.loop_time,
         ]
         .into_iter()
-        .enumerate()
-        {
-            ops_stmt.bind((7 + index, value as i64))?;
+        .chain(stat_values(&ops.stats));
+        for (index, value) in values.enumerate() {
+            ops_stmt.bind((4 + index, value as i64))?;
         }
         ops_stmt.next()?;
     }
     Ok(())
 }
 
+/// Values of `stats` in the order of `roofline_stat_columns`.
+fn stat_values(stats: &LoopStats) -> impl Iterator<Item = u64> {
+    [stats.trip_count, stats.bytes_load, stats.bytes_store]
+        .into_iter()
+        .chain(stats.typed_ops())
+        .chain(stats.class_ops())
+        .chain(stats.access_bytes())
+        .chain([stats.footprint_bytes])
+}
+
 fn flamegraph_sample_weight(counter_delta: u64) -> Option<u64> {
     (counter_delta != 0).then_some(1)
 }
@@ -1447,8 +2124,18 @@ fn remove_load_bias(runtime: u64, load_bias: i64) -> Option<u64> {
 
 #[cfg(test)]
 mod optimized_postprocessing_tests {
-    use super::{populate_assembly_samples, sampled_disassembly_targets, RooflineData};
-    use mperf_data::{CallFrame, Event, EventType, Location, RooflineInfo, ScenarioInfo};
+    use super::{
+        create_loop_coverage_view, create_parallel_regions_view, create_roofline_callers_view,
+        create_roofline_tables, create_roofline_view, persist_roofline_data,
+        populate_assembly_samples, sampled_disassembly_targets, LoopTreeNode, RooflineData,
+    };
+    use mperf_data::{
+        BasicBlockDescription, BranchRun, CacheLevel, CallFrame, Event, EventType, Location,
+        LoopCodegen, LoopCounters, LoopDescription, LoopStats, RooflineInfo, RooflineRecord,
+        ScenarioInfo, LOOP_FLAG_NOT_INSTRUMENTED, LOOP_FLAG_PARALLEL_REGION, LOOP_FLAG_VECTORIZED,
+        LOOP_FLAG_WORKSHARING, ROOFLINE_RECORD_AGGREGATE, ROOFLINE_RECORD_COUNTERS,
+        ROOFLINE_RECORD_INSTRUMENTED, ROOFLINE_RECORD_REGION,
+    };
     use object::{Object, ObjectSymbol, SymbolKind};
     use sqlite::State;
 
@@ -1506,6 +2193,9 @@ mod optimized_postprocessing_tests {
             perf_pid: 10,
             counters: Vec::new(),
             inst_pid: 20,
+            sample_period: 0,
+            raw_invocations: false,
+            estimated: false,
         });
         let mut data = RooflineData::new(&info).unwrap();
         let mut start = event(EventType::RooflineLoopStart, 10);
@@ -1528,8 +2218,865 @@ mod optimized_postprocessing_tests {
         data.consume(&end).unwrap();
 
         assert_eq!(data.runs.len(), 1);
-        assert_eq!(data.runs[0].0.bytes_load, 64);
-        assert_eq!(data.runs[0].1, 99);
+        let (key, runs) = data.runs.iter().next().unwrap();
+        assert_eq!(runs.runs, 1);
+        assert_eq!(runs.total_duration, 99);
+        assert_eq!(data.descriptions[&key.loop_id].line, 3);
+        assert!(data.ops.is_empty());
+    }
+
+    #[test]
+    fn roofline_records_are_split_by_instrumentation() {
+        let info = ScenarioInfo::Roofline(RooflineInfo {
+            perf_pid: 10,
+            counters: Vec::new(),
+            inst_pid: 20,
+            sample_period: 0,
+            raw_invocations: false,
+            estimated: false,
+        });
+        let mut data = RooflineData::new(&info).unwrap();
+        data.descriptions.insert(
+            5,
+            LoopDescription {
+                id: 5,
+                parent_id: 0,
+                file_name: 1,
+                function_name: 2,
+                line: 3,
+                end_line: 3,
+                flags: 0,
+                codegen: LoopCodegen::default(),
+                name: 0,
+            },
+        );
+
+        let run = RooflineRecord {
+            loop_id: 5,
+            process_id: 10,
+            start: 40,
+            end: 99,
+            ..RooflineRecord::default()
+        };
+        data.consume_record(&run).unwrap();
+
+        let ops = RooflineRecord {
+            loop_id: 5,
+            process_id: 20,
+            flags: ROOFLINE_RECORD_INSTRUMENTED,
+            stats: LoopStats {
+                bytes_load: 64,
+                vector_double_ops: 8,
+                ..LoopStats::default()
+            },
+            ..RooflineRecord::default()
+        };
+        data.consume_record(&ops).unwrap();
+
+        assert_eq!(data.runs.len(), 1);
+        let runs = data.runs.values().next().unwrap();
+        assert_eq!(runs.total_duration, 59);
+        assert_eq!(data.ops.len(), 1);
+        assert_eq!(data.ops[&5].records, 1);
+        assert_eq!(data.ops[&5].stats.bytes_load, 64);
+        assert_eq!(data.ops[&5].stats.vector_double_ops, 8);
+        assert!(data.raw_runs.is_empty() && data.raw_ops.is_empty());
+
+        let unknown = RooflineRecord {
+            loop_id: 6,
+            ..RooflineRecord::default()
+        };
+        assert!(data.consume_record(&unknown).is_err());
+    }
+
+    #[test]
+    fn aggregated_records_count_their_outermost_invocations() {
+        let info = ScenarioInfo::Roofline(RooflineInfo {
+            perf_pid: 10,
+            counters: Vec::new(),
+            inst_pid: 20,
+            sample_period: 0,
+            raw_invocations: false,
+            estimated: false,
+        });
+        let mut data = RooflineData::new(&info).unwrap();
+        data.descriptions.insert(
+            5,
+            LoopDescription {
+                id: 5,
+                parent_id: 0,
+                file_name: 1,
+                function_name: 2,
+                line: 3,
+                end_line: 3,
+                flags: 0,
+                codegen: LoopCodegen::default(),
+                name: 0,
+            },
+        );
+
+        let single = RooflineRecord {
+            loop_id: 5,
+            process_id: 20,
+            flags: ROOFLINE_RECORD_INSTRUMENTED,
+            start: 0,
+            end: 10,
+            invocations: 1,
+            loop_time: 10,
+            stats: LoopStats {
+                bytes_load: 8,
+                ..LoopStats::default()
+            },
+            ..RooflineRecord::default()
+        };
+        let mut aggregate = RooflineRecord {
+            flags: ROOFLINE_RECORD_INSTRUMENTED | ROOFLINE_RECORD_AGGREGATE,
+            ..single
+        };
+        aggregate.invocations = 0;
+        aggregate.loop_time = 0;
+        aggregate.stats = LoopStats::default();
+        for _ in 0..3 {
+            aggregate.aggregate(&single);
+        }
+        assert_eq!(aggregate.root_span(), (3, 30));
+
+        data.consume_record(&single).unwrap();
+        data.consume_record(&aggregate).unwrap();
+        let ops = &data.ops[&5];
+        assert_eq!(ops.records, 4);
+        assert_eq!(ops.invocations, 4);
+        assert_eq!(ops.loop_time, 40);
+        assert_eq!(ops.root_time, 40);
+        assert_eq!(ops.stats.bytes_load, 32);
+    }
+
+    #[tokio::test]
+    async fn invocations_are_aggregated_per_loop() {
+        for raw_invocations in [false, true] {
+            let info = ScenarioInfo::Roofline(RooflineInfo {
+                perf_pid: 10,
+                counters: Vec::new(),
+                inst_pid: 10,
+                sample_period: 2,
+                raw_invocations,
+                estimated: false,
+            });
+            let mut data = RooflineData::new(&info).unwrap();
+            data.descriptions.insert(
+                5,
+                LoopDescription {
+                    id: 5,
+                    parent_id: 0,
+                    file_name: 1,
+                    function_name: 2,
+                    line: 3,
+                    end_line: 3,
+                    flags: 0,
+                    codegen: LoopCodegen::default(),
+                    name: 0,
+                },
+            );
+            for (start, duration) in [(0, 3), (10, 5), (20, 7), (30, 100)] {
+                let run = RooflineRecord {
+                    loop_id: 5,
+                    process_id: 10,
+                    start,
+                    end: start + duration,
+                    ..RooflineRecord::default()
+                };
+                data.consume_record(&run).unwrap();
+            }
+            for bytes_load in [8, 24] {
+                let ops = RooflineRecord {
+                    loop_id: 5,
+                    process_id: 10,
+                    flags: ROOFLINE_RECORD_INSTRUMENTED,
+                    invocations: 1,
+                    stats: LoopStats {
+                        bytes_load,
+                        ..LoopStats::default()
+                    },
+                    ..RooflineRecord::default()
+                };
+                data.consume_record(&ops).unwrap();
+            }
+            assert_eq!(data.runs.len(), 1);
+            assert_eq!(data.ops.len(), 1);
+
+            let connection = sqlite::open(":memory:").unwrap();
+            create_roofline_tables(&connection).unwrap();
+            persist_roofline_data(&connection, data).unwrap();
+
+            let mut statement = connection
+                .prepare(
+                    "SELECT runs, total_duration, min_duration, max_duration
+                     FROM roofline_run_stats",
+                )
+                .unwrap();
+            assert_eq!(statement.next().unwrap(), State::Row);
+            assert_eq!(statement.read::<i64, _>("runs").unwrap(), 4);
+            assert_eq!(statement.read::<i64, _>("total_duration").unwrap(), 115);
+            assert_eq!(statement.read::<i64, _>("min_duration").unwrap(), 3);
+            assert_eq!(statement.read::<i64, _>("max_duration").unwrap(), 100);
+
+            // 3 falls in [2, 4), 5 and 7 in [4, 8) and 100 in [64, 128).
+            let mut statement = connection
+                .prepare("SELECT duration_ns, runs FROM roofline_run_histogram ORDER BY 1")
+                .unwrap();
+            let mut histogram = vec![];
+            while statement.next().unwrap() == State::Row {
+                histogram.push((
+                    statement.read::<i64, _>("duration_ns").unwrap(),
+                    statement.read::<i64, _>("runs").unwrap(),
+                ));
+            }
+            assert_eq!(histogram, [(2, 1), (4, 2), (64, 1)]);
+
+            let mut statement = connection
+                .prepare("SELECT records, bytes_load FROM roofline_op_stats")
+                .unwrap();
+            assert_eq!(statement.next().unwrap(), State::Row);
+            assert_eq!(statement.read::<i64, _>("records").unwrap(), 2);
+            assert_eq!(statement.read::<i64, _>("bytes_load").unwrap(), 32);
+
+            let raw_rows = |table| {
+                let mut statement = connection
+                    .prepare(format!("SELECT COUNT(*) FROM {table}"))
+                    .unwrap();
+                statement.next().unwrap();
+                statement.read::<i64, _>(0).unwrap()
+            };
+            let expected = if raw_invocations { (4, 2) } else { (0, 0) };
+            assert_eq!(
+                (raw_rows("roofline_loop_runs"), raw_rows("roofline_ops")),
+                expected
+            );
+        }
+    }
+
+    #[tokio::test]
+    async fn sampled_roofline_ops_are_extrapolated_to_all_invocations() {
+        let info = ScenarioInfo::Roofline(RooflineInfo {
+            perf_pid: 10,
+            counters: Vec::new(),
+            inst_pid: 10,
+            sample_period: 2,
+            raw_invocations: false,
+            estimated: false,
+        });
+        let mut data = RooflineData::new(&info).unwrap();
+        data.descriptions.insert(
+            5,
+            LoopDescription {
+                id: 5,
+                parent_id: 0,
+                file_name: 1,
+                function_name: 2,
+                line: 3,
+                end_line: 3,
+                flags: LOOP_FLAG_VECTORIZED,
+                codegen: LoopCodegen {
+                    vector_width: 4,
+                    vector_bits: 256,
+                    interleave_count: 2,
+                    estimated_spills: 1,
+                },
+                name: 7,
+            },
+        );
+
+        // Two timed invocations of 100ns each and one sampled invocation.
+        // Only the first timed invocation read the hardware counters.
+        for (start, flags) in [(0, ROOFLINE_RECORD_COUNTERS), (1000, 0)] {
+            let run = RooflineRecord {
+                loop_id: 5,
+                process_id: 10,
+                start,
+                end: start + 100,
+                flags,
+                counters: LoopCounters {
+                    cycles: 300,
+                    instructions: 600,
+                    llc_misses: 3,
+                },
+                ..RooflineRecord::default()
+            };
+            data.consume_record(&run).unwrap();
+        }
+        let sampled = RooflineRecord {
+            loop_id: 5,
+            process_id: 10,
+            start: 500,
+            end: 900,
+            flags: ROOFLINE_RECORD_INSTRUMENTED,
+            invocations: 1,
+            loop_time: 400,
+            stats: LoopStats {
+                bytes_load: 80,
+                scalar_double_ops: 20,
+                footprint_bytes: 48,
+                ..LoopStats::default()
+            },
+            ..RooflineRecord::default()
+        };
+        data.consume_record(&sampled).unwrap();
+
+        let connection = sqlite::open(":memory:").unwrap();
+        connection
+            .execute(
+                "CREATE TABLE strings (id BINARY(128) NOT NULL, string TEXT NOT NULL);
+                 INSERT INTO strings VALUES (7, 'solve');",
+            )
+            .unwrap();
+        create_roofline_tables(&connection).unwrap();
+        persist_roofline_data(&connection, data).unwrap();
+        let caches = [(1, 32), (2, 64), (3, 4096)].map(|(level, size)| CacheLevel {
+            level,
+            size,
+            line_size: 64,
+        });
+        create_roofline_view(&connection, &caches).await.unwrap();
+
+        let mut statement = connection.prepare("SELECT * FROM roofline").unwrap();
+        assert_eq!(statement.next().unwrap(), State::Row);
+        // 20 ops per 100ns invocation, the instrumented duration is ignored.
+        let ops = statement.read::<f64, _>("scalar_double_ops").unwrap();
+        assert!((ops - 2e8).abs() < 1.0);
+        let ai = statement.read::<f64, _>("scalar_double_ai").unwrap();
+        assert!((ai - 0.25).abs() < 1e-9);
+        // 48 bytes do not fit the 32 byte L1.
+        assert_eq!(statement.read::<f64, _>("working_set").unwrap(), 48.0);
+        assert_eq!(statement.read::<String, _>("memory_tier").unwrap(), "L2");
+        assert_eq!(statement.read::<f64, _>("cycles_per_run").unwrap(), 300.0);
+        assert_eq!(statement.read::<f64, _>("ipc").unwrap(), 2.0);
+        assert_eq!(statement.read::<f64, _>("cache_mpki").unwrap(), 5.0);
+        assert_eq!(
+            statement.read::<i64, _>("flags").unwrap(),
+            LOOP_FLAG_VECTORIZED as i64
+        );
+        assert_eq!(statement.read::<i64, _>("vector_width").unwrap(), 4);
+        assert_eq!(statement.read::<i64, _>("vector_bits").unwrap(), 256);
+        assert_eq!(statement.read::<i64, _>("interleave_count").unwrap(), 2);
+        assert_eq!(statement.read::<i64, _>("estimated_spills").unwrap(), 1);
+        assert_eq!(statement.read::<String, _>("region_name").unwrap(), "solve");
+        assert_eq!(statement.next().unwrap(), State::Done);
+    }
+
+    #[tokio::test]
+    async fn nested_loops_get_a_share_of_their_outermost_loop() {
+        let info = ScenarioInfo::Roofline(RooflineInfo {
+            perf_pid: 10,
+            counters: Vec::new(),
+            inst_pid: 10,
+            sample_period: 2,
+            raw_invocations: false,
+            estimated: false,
+        });
+        let mut data = RooflineData::new(&info).unwrap();
+        for (id, parent_id) in [(5, 0), (6, 5), (7, 6)] {
+            data.descriptions.insert(
+                id,
+                LoopDescription {
+                    id,
+                    parent_id,
+                    file_name: 1,
+                    function_name: 2,
+                    line: id as u32,
+                    end_line: id as u32,
+                    flags: 0,
+                    codegen: LoopCodegen::default(),
+                    name: 0,
+                },
+            );
+        }
+        let tree = data.loop_tree();
+        assert_eq!(
+            tree[&5],
+            LoopTreeNode {
+                root_id: 5,
+                depth: 1
+            }
+        );
+        assert_eq!(
+            tree[&7],
+            LoopTreeNode {
+                root_id: 5,
+                depth: 3
+            }
+        );
+
+        for start in [0, 1000] {
+            let run = RooflineRecord {
+                loop_id: 5,
+                start,
+                end: start + 100,
+                ..RooflineRecord::default()
+            };
+            data.consume_record(&run).unwrap();
+        }
+        let outer = RooflineRecord {
+            loop_id: 5,
+            start: 500,
+            end: 900,
+            flags: ROOFLINE_RECORD_INSTRUMENTED,
+            invocations: 1,
+            loop_time: 400,
+            ..RooflineRecord::default()
+        };
+        data.consume_record(&outer).unwrap();
+        // The inner loop was entered four times and took a quarter of the
+        // instrumented outer invocation. Loop 7 never ran.
+        for (loop_id, invocations, loop_time) in [(6, 4, 100), (7, 0, 0)] {
+            let nested = RooflineRecord {
+                loop_id,
+                invocations,
+                loop_time,
+                stats: LoopStats {
+                    trip_count: 8 * invocations,
+                    bytes_load: 40,
+                    scalar_double_ops: 10,
+                    ..LoopStats::default()
+                },
+                ..outer
+            };
+            data.consume_record(&nested).unwrap();
+        }
+
+        let connection = sqlite::open(":memory:").unwrap();
+        connection
+            .execute("CREATE TABLE strings (id BINARY(128) NOT NULL, string TEXT NOT NULL);")
+            .unwrap();
+        create_roofline_tables(&connection).unwrap();
+        persist_roofline_data(&connection, data).unwrap();
+        create_roofline_view(&connection, &[]).await.unwrap();
+
+        let mut statement = connection
+            .prepare("SELECT * FROM roofline ORDER BY depth")
+            .unwrap();
+        assert_eq!(statement.next().unwrap(), State::Row);
+        assert_eq!(statement.read::<i64, _>("loop_id").unwrap(), 5);
+        assert_eq!(statement.next().unwrap(), State::Row);
+        assert_eq!(statement.read::<i64, _>("loop_id").unwrap(), 6);
+        assert_eq!(statement.read::<i64, _>("parent_id").unwrap(), 5);
+        assert_eq!(statement.read::<f64, _>("avg_trip_count").unwrap(), 8.0);
+        // 10 ops in a quarter of a 100ns outer invocation.
+        let ops = statement.read::<f64, _>("scalar_double_ops").unwrap();
+        assert!((ops - 4e8).abs() < 1.0);
+        assert_eq!(statement.next().unwrap(), State::Done);
+    }
+
+    #[tokio::test]
+    async fn estimated_ops_follow_block_frequencies() {
+        let info = ScenarioInfo::Roofline(RooflineInfo {
+            perf_pid: 10,
+            counters: Vec::new(),
+            inst_pid: 10,
+            sample_period: 0,
+            raw_invocations: false,
+            estimated: true,
+        });
+        let mut data = RooflineData::new(&info).unwrap();
+        for (id, parent_id) in [(5, 0), (6, 5)] {
+            data.descriptions.insert(
+                id,
+                LoopDescription {
+                    id,
+                    parent_id,
+                    file_name: 1,
+                    function_name: 2,
+                    line: id as u32,
+                    end_line: id as u32,
+                    flags: 0,
+                    codegen: LoopCodegen::default(),
+                    name: 0,
+                },
+            );
+        }
+        for start in [0, 1000] {
+            let run = RooflineRecord {
+                loop_id: 5,
+                process_id: 10,
+                start,
+                end: start + 100,
+                ..RooflineRecord::default()
+            };
+            data.consume_record(&run).unwrap();
+        }
+
+        // The header of the outer loop, the preheader of the inner loop and
+        // the header of the inner loop.
+        let block = |address, loop_id, entered_loop_id, stats| BasicBlockDescription {
+            process_id: 10,
+            address,
+            loop_id,
+            entered_loop_id,
+            stats,
+        };
+        data.blocks = vec![
+            block(
+                0x1020,
+                6,
+                0,
+                LoopStats {
+                    trip_count: 1,
+                    bytes_load: 16,
+                    scalar_double_ops: 2,
+                    ..LoopStats::default()
+                },
+            ),
+            block(
+                0x1000,
+                5,
+                0,
+                LoopStats {
+                    trip_count: 1,
+                    scalar_double_ops: 1,
+                    ..LoopStats::default()
+                },
+            ),
+            block(
+                0x1010,
+                5,
+                6,
+                LoopStats {
+                    bytes_load: 8,
+                    ..LoopStats::default()
+                },
+            ),
+        ];
+        // The outer loop runs into the inner one ten times, whose body then
+        // runs 40 times. Another process ran code at the same addresses.
+        let run = |process_id, start, end, executions, cycles| BranchRun {
+            process_id,
+            start,
+            end,
+            executions,
+            cycles,
+        };
+        data.branch_runs = vec![
+            run(10, 0x1000, 0x101f, 10.0, 100.0),
+            run(10, 0x1020, 0x103f, 40.0, 400.0),
+            run(11, 0x1000, 0x103f, 1000.0, 1000.0),
+        ];
+        data.estimate_ops();
+
+        let outer = &data.ops[&5];
+        assert_eq!((outer.records, outer.invocations), (2, 2));
+        assert_eq!((outer.loop_time, outer.root_time), (500, 500));
+        assert_eq!(outer.stats.trip_count, 10);
+        assert_eq!(outer.stats.bytes_load, 720);
+        assert_eq!(outer.stats.scalar_double_ops, 90);
+        let inner = &data.ops[&6];
+        assert_eq!((inner.records, inner.invocations), (2, 10));
+        assert_eq!((inner.loop_time, inner.root_time), (400, 500));
+        assert_eq!(inner.stats.trip_count, 40);
+
+        let connection = sqlite::open(":memory:").unwrap();
+        connection
+            .execute("CREATE TABLE strings (id BINARY(128) NOT NULL, string TEXT NOT NULL);")
+            .unwrap();
+        create_roofline_tables(&connection).unwrap();
+        persist_roofline_data(&connection, data).unwrap();
+        create_roofline_view(&connection, &[]).await.unwrap();
+
+        let mut statement = connection
+            .prepare("SELECT * FROM roofline ORDER BY depth")
+            .unwrap();
+        assert_eq!(statement.next().unwrap(), State::Row);
+        assert_eq!(statement.read::<f64, _>("avg_trip_count").unwrap(), 5.0);
+        assert_eq!(statement.read::<f64, _>("working_set").unwrap(), 360.0);
+        // 90 ops in 200ns of timed invocations.
+        let ops = statement.read::<f64, _>("scalar_double_ops").unwrap();
+        assert!((ops - 4.5e8).abs() < 1.0);
+        assert_eq!(statement.next().unwrap(), State::Row);
+        assert_eq!(statement.read::<f64, _>("avg_trip_count").unwrap(), 4.0);
+        // 80 ops in the four fifths of that time the inner loop took.
+        let ops = statement.read::<f64, _>("scalar_double_ops").unwrap();
+        assert!((ops - 5e8).abs() < 1.0);
+        assert_eq!(statement.next().unwrap(), State::Done);
+    }
+
+    #[tokio::test]
+    async fn loops_are_split_by_their_callers() {
+        let info = ScenarioInfo::Roofline(RooflineInfo {
+            perf_pid: 10,
+            counters: Vec::new(),
+            inst_pid: 11,
+            sample_period: 0,
+            raw_invocations: false,
+            estimated: false,
+        });
+        let mut data = RooflineData::new(&info).unwrap();
+        data.descriptions.insert(
+            5,
+            LoopDescription {
+                id: 5,
+                parent_id: 0,
+                file_name: 1,
+                function_name: 2,
+                line: 5,
+                end_line: 5,
+                flags: 0,
+                codegen: LoopCodegen::default(),
+                name: 0,
+            },
+        );
+        // Both runs enter the loop from the same two callers, which were
+        // loaded at different addresses.
+        for (pid, id, caller) in [
+            (10, 1, 0x100),
+            (10, 2, 0x200),
+            (11, 3, 0x1100),
+            (11, 4, 0x1200),
+        ] {
+            data.contexts.insert((pid, id), vec![caller]);
+        }
+        data.resolve_contexts(|_, frames| match frames {
+            [CallFrame::IP(0x100 | 0x1100)] => "main;solve".to_owned(),
+            [CallFrame::IP(0x200 | 0x1200)] => "main;refine".to_owned(),
+            _ => unreachable!(),
+        });
+
+        for (context_id, start, end) in [
+            (1, 0, 100),
+            (1, 1000, 1100),
+            (2, 2000, 2400),
+            (0, 3000, 3100),
+        ] {
+            let run = RooflineRecord {
+                loop_id: 5,
+                process_id: 10,
+                start,
+                end,
+                context_id,
+                ..RooflineRecord::default()
+            };
+            data.consume_record(&run).unwrap();
+        }
+        for (context_id, bytes_load) in [(3, 100), (4, 50)] {
+            let ops = RooflineRecord {
+                loop_id: 5,
+                process_id: 11,
+                end: 1000,
+                flags: ROOFLINE_RECORD_INSTRUMENTED,
+                invocations: 1,
+                loop_time: 1000,
+                context_id,
+                stats: LoopStats {
+                    bytes_load,
+                    scalar_double_ops: 100,
+                    ..LoopStats::default()
+                },
+                ..RooflineRecord::default()
+            };
+            data.consume_record(&ops).unwrap();
+        }
+        assert_eq!(data.ops[&5].records, 2);
+        assert_eq!(data.context_ops.len(), 2);
+
+        let connection = sqlite::open(":memory:").unwrap();
+        connection
+            .execute("CREATE TABLE strings (id BINARY(128) NOT NULL, string TEXT NOT NULL);")
+            .unwrap();
+        create_roofline_tables(&connection).unwrap();
+        persist_roofline_data(&connection, data).unwrap();
+        create_roofline_callers_view(&connection).await.unwrap();
+
+        let mut statement = connection
+            .prepare("SELECT * FROM roofline_callers ORDER BY call_stack")
+            .unwrap();
+        assert_eq!(statement.next().unwrap(), State::Row);
+        assert_eq!(
+            statement.read::<String, _>("call_stack").unwrap(),
+            "main;refine"
+        );
+        assert_eq!(statement.read::<i64, _>("runs").unwrap(), 1);
+        // 100 ops in one 400ns invocation.
+        assert_eq!(statement.read::<f64, _>("flops").unwrap(), 2.5e8);
+        assert_eq!(
+            statement.read::<f64, _>("arithmetic_intensity").unwrap(),
+            2.0
+        );
+        assert_eq!(statement.next().unwrap(), State::Row);
+        assert_eq!(
+            statement.read::<String, _>("call_stack").unwrap(),
+            "main;solve"
+        );
+        assert_eq!(statement.read::<i64, _>("runs").unwrap(), 2);
+        assert_eq!(statement.read::<f64, _>("flops").unwrap(), 1e9);
+        assert_eq!(statement.read::<f64, _>("bandwidth").unwrap(), 1e9);
+        assert_eq!(statement.next().unwrap(), State::Done);
+    }
+
+    #[tokio::test]
+    async fn parallel_regions_aggregate_the_loops_of_their_threads() {
+        let info = ScenarioInfo::Roofline(RooflineInfo {
+            perf_pid: 10,
+            counters: Vec::new(),
+            inst_pid: 10,
+            sample_period: 2,
+            raw_invocations: false,
+            estimated: false,
+        });
+        let mut data = RooflineData::new(&info).unwrap();
+        for (id, flags) in [(5, LOOP_FLAG_WORKSHARING), (9, LOOP_FLAG_PARALLEL_REGION)] {
+            data.descriptions.insert(
+                id,
+                LoopDescription {
+                    id,
+                    parent_id: 0,
+                    file_name: 1,
+                    function_name: 2,
+                    line: 3,
+                    end_line: 3,
+                    flags,
+                    codegen: LoopCodegen::default(),
+                    name: 0,
+                },
+            );
+        }
+
+        let region = RooflineRecord {
+            loop_id: 9,
+            process_id: 10,
+            thread_id: 1,
+            start: 0,
+            end: 200,
+            flags: ROOFLINE_RECORD_REGION,
+            region_instance: 1,
+            ..RooflineRecord::default()
+        };
+        data.consume_record(&region).unwrap();
+        // The second thread got twice the work of the first one.
+        for (thread_id, end) in [(1, 100), (2, 200)] {
+            let run = RooflineRecord {
+                loop_id: 5,
+                process_id: 10,
+                thread_id,
+                start: 0,
+                end,
+                region_instance: 1,
+                ..RooflineRecord::default()
+            };
+            data.consume_record(&run).unwrap();
+        }
+        let sampled = RooflineRecord {
+            loop_id: 5,
+            process_id: 10,
+            flags: ROOFLINE_RECORD_INSTRUMENTED,
+            invocations: 1,
+            region_instance: 2,
+            stats: LoopStats {
+                bytes_load: 100,
+                scalar_int_ops: 1000,
+                scalar_double_ops: 50,
+                ..LoopStats::default()
+            },
+            ..RooflineRecord::default()
+        };
+        data.consume_record(&sampled).unwrap();
+        assert_eq!(data.regions.len(), 1);
+
+        let connection = sqlite::open(":memory:").unwrap();
+        connection
+            .execute("CREATE TABLE strings (id BINARY(128) NOT NULL, string TEXT NOT NULL);")
+            .unwrap();
+        create_roofline_tables(&connection).unwrap();
+        persist_roofline_data(&connection, data).unwrap();
+        create_roofline_view(&connection, &[]).await.unwrap();
+        create_parallel_regions_view(&connection).await.unwrap();
+
+        let mut statement = connection.prepare("SELECT loop_id FROM roofline").unwrap();
+        assert_eq!(statement.next().unwrap(), State::Row);
+        assert_eq!(statement.read::<i64, _>("loop_id").unwrap(), 5);
+        assert_eq!(statement.next().unwrap(), State::Done);
+
+        let mut statement = connection
+            .prepare("SELECT * FROM parallel_regions")
+            .unwrap();
+        assert_eq!(statement.next().unwrap(), State::Row);
+        assert_eq!(statement.read::<i64, _>("region_id").unwrap(), 9);
+        assert_eq!(statement.read::<i64, _>("instances").unwrap(), 1);
+        assert_eq!(statement.read::<f64, _>("avg_threads").unwrap(), 2.0);
+        assert_eq!(statement.read::<f64, _>("avg_thread_time").unwrap(), 150.0);
+        let imbalance = statement.read::<f64, _>("load_imbalance").unwrap();
+        assert!((imbalance - 1.0 / 3.0).abs() < 1e-9);
+        // Two timed runs of 50 double ops and 100 bytes in 200ns, integer ops
+        // are not FLOPs.
+        let flops = statement.read::<f64, _>("flops").unwrap();
+        assert!((flops - 5e8).abs() < 1.0);
+        let bandwidth = statement.read::<f64, _>("bandwidth").unwrap();
+        assert!((bandwidth - 1e9).abs() < 1.0);
+        assert_eq!(
+            statement.read::<f64, _>("arithmetic_intensity").unwrap(),
+            0.5
+        );
+        assert_eq!(statement.next().unwrap(), State::Done);
+    }
+
+    #[tokio::test]
+    async fn loop_coverage_counts_sampled_loops_per_file() {
+        let info = ScenarioInfo::Roofline(RooflineInfo {
+            perf_pid: 10,
+            counters: Vec::new(),
+            inst_pid: 10,
+            sample_period: 2,
+            raw_invocations: false,
+            estimated: false,
+        });
+        let mut data = RooflineData::new(&info).unwrap();
+        // Loop 7 was versioned but never sampled.
+        for (id, file_name, line, end_line, flags) in [
+            (5, 1, 10, 20, 0),
+            (6, 1, 30, 35, LOOP_FLAG_NOT_INSTRUMENTED),
+            (7, 2, 1, 5, 0),
+        ] {
+            data.descriptions.insert(
+                id,
+                LoopDescription {
+                    id,
+                    parent_id: 0,
+                    file_name,
+                    function_name: 3,
+                    line,
+                    end_line,
+                    flags,
+                    codegen: LoopCodegen::default(),
+                    name: 0,
+                },
+            );
+        }
+
+        let connection = sqlite::open(":memory:").unwrap();
+        connection
+            .execute(
+                "CREATE TABLE strings (id BINARY(128) NOT NULL, string TEXT NOT NULL);
+                 CREATE TABLE proc_map (
+                    ip INTEGER, func_name TEXT, file_name TEXT, line INTEGER, module_path TEXT
+                 );
+                 CREATE TABLE pmu_counters (ip INTEGER NOT NULL);
+                 INSERT INTO strings VALUES (1, 'src/a.c'), (2, 'b.c');
+                 INSERT INTO proc_map VALUES
+                    (1, 'f', '/work/src/a.c', 12, '/tmp/a'),
+                    (2, 'f', '/work/src/a.c', 31, '/tmp/a'),
+                    (3, 'g', '/work/other.c', 12, '/tmp/a');
+                 INSERT INTO pmu_counters VALUES (1), (1), (1), (2), (3), (3);",
+            )
+            .unwrap();
+        create_roofline_tables(&connection).unwrap();
+        persist_roofline_data(&connection, data).unwrap();
+        create_loop_coverage_view(&connection).await.unwrap();
+
+        let mut statement = connection.prepare("SELECT * FROM loop_coverage").unwrap();
+        assert_eq!(statement.next().unwrap(), State::Row);
+        assert_eq!(statement.read::<String, _>("file_name").unwrap(), "src/a.c");
+        assert_eq!(statement.read::<i64, _>("sampled_loops").unwrap(), 2);
+        assert_eq!(statement.read::<i64, _>("instrumented_loops").unwrap(), 1);
+        assert_eq!(statement.read::<f64, _>("instrumented_share").unwrap(), 0.5);
+        assert_eq!(statement.read::<i64, _>("samples").unwrap(), 4);
+        assert_eq!(statement.read::<f64, _>("sample_share").unwrap(), 0.75);
+        assert_eq!(statement.next().unwrap(), State::Done);
     }
 
     fn event(ty: EventType, process_id: u32) -> Event {
@@ -1574,68 +3121,467 @@ async fn create_hotspots_view(connection: &sqlite::Connection) -> Result<()> {
     Ok(())
 }
 
-async fn create_roofline_view(connection: &sqlite::Connection) -> Result<()> {
-    connection.execute("
+/// Op counts and durations may come from different sets of invocations of a
+/// loop when only some of them were instrumented. Rates are computed from the
+/// per-invocation averages of both, which extrapolates the sampled op counts
+/// to every timed invocation.
+///
+/// Nested loops only run in instrumented invocations of their outermost loop.
+/// Their records average over those invocations as well, and their duration
+/// is the share of the outermost loop's time they took in the instrumented
+/// code.
+///
+/// `avg_trip_count` is the average number of iterations per entry of the
+/// loop, which makes short loops that spend most of their time outside the
+/// vectorized body easy to spot.
+///
+/// `flags` holds the `LOOP_FLAG_*` bits of the loop and `vector_width`,
+/// `vector_bits`, `interleave_count` and `estimated_spills` what the compiler
+/// made of it, see `LoopCodegen`.
+///
+/// Every op counter becomes a rate in ops per second. The element type
+/// counters also get an arithmetic intensity column, `<type>_ai`, the op
+/// class counters (`div_ops`, `conversion_ops`, `atomic_ops`) do not.
+///
+/// The access pattern counters become shares of all bytes moved by the loop,
+/// `bytes_unit_stride` turns into `unit_stride_share` and so on.
+///
+/// `working_set` is the estimated footprint of one entry of the loop, capped
+/// by the bytes it actually moved. `memory_tier` is the innermost level of
+/// `caches` that holds it (`L1`, `L2`, ..., `LLC` for the last level), or
+/// `DRAM`, and tells which bandwidth ceiling the loop should be compared
+/// against. It is NULL when the cache hierarchy of the host is unknown.
+///
+/// `min_duration` and `max_duration` are the extremes of the timed
+/// invocations of outermost loops, `roofline_run_histogram` has the full
+/// distribution.
+///
+/// `cycles_per_run`, `ipc` and `cache_mpki` come from the hardware counters
+/// read around the timed invocations of outermost loops, when they were
+/// recorded with `--roofline-loop-counters`, and are NULL otherwise.
+async fn create_roofline_view(
+    connection: &sqlite::Connection,
+    caches: &[CacheLevel],
+) -> Result<()> {
+    connection.execute(
+        "CREATE TABLE cache_levels(
+            level INTEGER NOT NULL, size INTEGER NOT NULL, line_size INTEGER NOT NULL
+        );",
+    )?;
+    let mut cache_stmt = connection
+        .prepare("INSERT INTO cache_levels (level, size, line_size) VALUES (?, ?, ?);")?;
+    for cache in caches {
+        cache_stmt.reset()?;
+        cache_stmt.bind((1, cache.level as i64))?;
+        cache_stmt.bind((2, cache.size as i64))?;
+        cache_stmt.bind((3, cache.line_size as i64))?;
+        cache_stmt.next()?;
+    }
+
+    let op_sums = LoopStats::TYPED_OPS
+        .into_iter()
+        .chain(LoopStats::CLASS_OPS)
+        .chain(LoopStats::ACCESS_BYTES)
+        .map(|column| format!("    SUM({column}) AS {column},\n"))
+        .collect::<String>();
+    let typed_rates = LoopStats::TYPED_OPS
+        .into_iter()
+        .map(|column| {
+            let ai = column.replace("_ops", "_ai");
+            format!(
+                "  CAST(ops.{column} AS REAL) * timed.runs * 1000000000.0 / NULLIF(ops.records * timed.duration, 0) AS {column},
+  CAST(ops.{column} AS REAL) / NULLIF(ops.bytes_load + ops.bytes_store, 0) AS {ai},\n"
+            )
+        })
+        .collect::<String>();
+    let class_rates = LoopStats::CLASS_OPS
+        .into_iter()
+        .map(|column| {
+            format!(
+                "  CAST(ops.{column} AS REAL) * timed.runs * 1000000000.0 / NULLIF(ops.records * timed.duration, 0) AS {column},\n"
+            )
+        })
+        .collect::<String>();
+    let access_shares = LoopStats::ACCESS_BYTES
+        .into_iter()
+        .map(|column| {
+            let share = format!("{}_share", column.trim_start_matches("bytes_"));
+            format!(
+                "  CAST(ops.{column} AS REAL) / NULLIF(ops.bytes_load + ops.bytes_store, 0) AS {share}"
+            )
+        })
+        .collect::<Vec<_>>()
+        .join(",\n");
+
+    let view = format!(
+        "
 CREATE VIEW roofline AS
 WITH
 ops AS (
   SELECT
-    process_id,
-    file_name,
-    function_name,
-    line,
+    loop_id,
     SUM(bytes_load) AS bytes_load,
     SUM(bytes_store) AS bytes_store,
-    SUM(scalar_int_ops) AS scalar_int_ops,
-    SUM(scalar_float_ops) AS scalar_float_ops,
-    SUM(scalar_double_ops) AS scalar_double_ops,
-    SUM(vector_int_ops) AS vector_int_ops,
-    SUM(vector_float_ops) AS vector_float_ops,
-    SUM(vector_double_ops) AS vector_double_ops
-  FROM roofline_ops
-  GROUP BY process_id, file_name, function_name, line
+{op_sums}    SUM(records) AS records,
+    SUM(invocations) AS invocations,
+    SUM(loop_time) AS loop_time,
+    SUM(trip_count) AS trip_count,
+    SUM(footprint_bytes) AS footprint_bytes,
+    SUM(root_time) AS root_time
+  FROM roofline_op_stats
+  GROUP BY loop_id
+),
+footprint AS (
+  SELECT
+    loop_id,
+    CAST(MIN(footprint_bytes, bytes_load + bytes_store) AS REAL) / NULLIF(invocations, 0) AS working_set
+  FROM ops
+),
+tier AS (
+  SELECT
+    footprint.loop_id,
+    (SELECT MIN(level) FROM cache_levels WHERE size >= footprint.working_set) AS level
+  FROM footprint
 ),
 runs AS (
   SELECT
-    process_id,
-    file_name,
-    function_name,
-    line,
-    SUM(loop_end_ts - loop_start_ts) AS total_duration
-  FROM roofline_loop_runs
-  GROUP BY process_id, file_name, function_name, line
+    loop_id,
+    SUM(total_duration) AS total_duration,
+    SUM(runs) AS invocations,
+    MIN(min_duration) AS min_duration,
+    MAX(max_duration) AS max_duration,
+    SUM(cycles) AS cycles,
+    SUM(instructions) AS instructions,
+    SUM(llc_misses) AS llc_misses,
+    SUM(counted) AS counted
+  FROM roofline_run_stats
+  GROUP BY loop_id
+),
+timed AS (
+  SELECT
+    roofline_loops.loop_id,
+    runs.invocations AS runs,
+    CASE
+      WHEN roofline_loops.depth = 1 THEN runs.total_duration
+      ELSE runs.total_duration * CAST(ops.loop_time AS REAL) / NULLIF(ops.root_time, 0)
+    END AS duration,
+    CASE WHEN roofline_loops.depth = 1 THEN runs.min_duration END AS min_duration,
+    CASE WHEN roofline_loops.depth = 1 THEN runs.max_duration END AS max_duration,
+    CASE
+      WHEN roofline_loops.depth = 1 THEN CAST(runs.cycles AS REAL) / NULLIF(runs.counted, 0)
+    END AS cycles_per_run,
+    CASE
+      WHEN roofline_loops.depth = 1 THEN CAST(runs.instructions AS REAL) / NULLIF(runs.cycles, 0)
+    END AS ipc,
+    CASE
+      WHEN roofline_loops.depth = 1 THEN runs.llc_misses * 1000.0 / NULLIF(runs.instructions, 0)
+    END AS cache_mpki
+  FROM roofline_loops
+  LEFT JOIN ops ON ops.loop_id = roofline_loops.loop_id
+  LEFT JOIN runs ON runs.loop_id = roofline_loops.root_id
 )
 SELECT
+  roofline_loops.loop_id,
+  roofline_loops.parent_id,
+  roofline_loops.depth,
   s_file.string AS file_name,
   s_func.string AS function_name,
-  runs.line,
-
-  CAST(ops.scalar_int_ops AS REAL) * 1000000000.0 / NULLIF(runs.total_duration, 0) AS scalar_int_ops,
-  CAST(ops.scalar_int_ops AS REAL) / NULLIF(ops.bytes_load + ops.bytes_store, 0) AS scalar_int_ai,
-
-  CAST(ops.scalar_float_ops AS REAL) * 1000000000.0 / NULLIF(runs.total_duration, 0) AS scalar_float_ops,
-  CAST(ops.scalar_float_ops AS REAL) / NULLIF(ops.bytes_load + ops.bytes_store, 0) AS scalar_float_ai,
-
-  CAST(ops.scalar_double_ops AS REAL) * 1000000000.0 / NULLIF(runs.total_duration, 0) AS scalar_double_ops,
-  CAST(ops.scalar_double_ops AS REAL) / NULLIF(ops.bytes_load + ops.bytes_store, 0) AS scalar_double_ai,
-
-  CAST(ops.vector_int_ops AS REAL) * 1000000000.0 / NULLIF(runs.total_duration, 0) AS vector_int_ops,
-  CAST(ops.vector_int_ops AS REAL) / NULLIF(ops.bytes_load + ops.bytes_store, 0) AS vector_int_ai,
+  s_name.string AS region_name,
+  roofline_loops.line,
+  roofline_loops.flags,
+  roofline_loops.vector_width,
+  roofline_loops.vector_bits,
+  roofline_loops.interleave_count,
+  roofline_loops.estimated_spills,
+  CAST(ops.trip_count AS REAL) / NULLIF(ops.invocations, 0) AS avg_trip_count,
+  footprint.working_set,
+  CASE
+    WHEN footprint.working_set IS NULL OR NOT EXISTS (SELECT 1 FROM cache_levels) THEN NULL
+    WHEN tier.level IS NULL THEN 'DRAM'
+    WHEN tier.level = (SELECT MAX(level) FROM cache_levels) THEN 'LLC'
+    ELSE 'L' || tier.level
+  END AS memory_tier,
+  timed.min_duration,
+  timed.max_duration,
+  timed.cycles_per_run,
+  timed.ipc,
+  timed.cache_mpki,
+{typed_rates}{class_rates}{access_shares}
+FROM roofline_loops
+INNER JOIN timed ON timed.loop_id = roofline_loops.loop_id
+LEFT JOIN ops ON ops.loop_id = roofline_loops.loop_id
+LEFT JOIN footprint ON footprint.loop_id = roofline_loops.loop_id
+LEFT JOIN tier ON tier.loop_id = roofline_loops.loop_id
+LEFT JOIN strings s_file ON roofline_loops.file_name = s_file.id
+LEFT JOIN strings s_func ON roofline_loops.function_name = s_func.id
+LEFT JOIN strings s_name ON roofline_loops.name = s_name.id
+WHERE (roofline_loops.depth = 1 AND (timed.runs IS NOT NULL OR ops.records IS NOT NULL))
+  OR ops.invocations > 0;
+    "
+    );
+    connection.execute(view).expect("failed to create a view");
+    Ok(())
+}
 
-  CAST(ops.vector_float_ops AS REAL) * 1000000000.0 / NULLIF(runs.total_duration, 0) AS vector_float_ops,
-  CAST(ops.vector_float_ops AS REAL) / NULLIF(ops.bytes_load + ops.bytes_store, 0) AS vector_float_ai,
+/// Creates the `parallel_regions` view, one row per OpenMP parallel region
+/// with at least one timed instance.
+///
+/// `flops` and `bandwidth` are the floating-point ops and bytes of the
+/// outermost loops run by the threads of the region, extrapolated from their
+/// instrumented invocations, over the wall time of the region. Thread busy
+/// times only cover those loops. `load_imbalance` is the slowest thread's
+/// busy time over the average one, minus one, averaged over the instances of
+/// the region.
+async fn create_parallel_regions_view(connection: &sqlite::Connection) -> Result<()> {
+    let flops = LoopStats::TYPED_OPS
+        .into_iter()
+        .filter(|column| !column.contains("_int_"))
+        .collect::<Vec<_>>()
+        .join(" + ");
+    let view = format!(
+        "
+CREATE VIEW parallel_regions AS
+WITH
+instances AS (
+  SELECT
+    region_id,
+    process_id,
+    region_instance,
+    region_end_ts - region_start_ts AS wall_time
+  FROM roofline_region_runs
+),
+loop_runs AS (
+  SELECT
+    instances.region_id,
+    instances.region_instance,
+    runs.loop_id,
+    runs.thread_id,
+    runs.runs,
+    runs.total_duration AS duration
+  FROM instances
+  INNER JOIN roofline_run_stats runs
+    ON runs.process_id = instances.process_id
+    AND runs.region_instance = instances.region_instance
+),
+busy AS (
+  SELECT region_id, region_instance, thread_id, SUM(duration) AS busy_time
+  FROM loop_runs
+  GROUP BY region_id, region_instance, thread_id
+),
+balance AS (
+  SELECT
+    region_id,
+    COUNT(*) AS thread_runs,
+    SUM(busy_time) AS busy_time
+  FROM busy
+  GROUP BY region_id
+),
+imbalance AS (
+  SELECT
+    region_id,
+    AVG(imbalance) AS load_imbalance,
+    AVG(threads) AS avg_threads
+  FROM (
+    SELECT
+      region_id,
+      COUNT(*) AS threads,
+      MAX(busy_time) / NULLIF(AVG(busy_time), 0) - 1.0 AS imbalance
+    FROM busy
+    GROUP BY region_id, region_instance
+  )
+  GROUP BY region_id
+),
+ops AS (
+  SELECT
+    loop_id,
+    SUM(records) AS records,
+    SUM({flops}) AS flops,
+    SUM(bytes_load + bytes_store) AS bytes
+  FROM roofline_op_stats
+  GROUP BY loop_id
+),
+work AS (
+  SELECT
+    timed.region_id,
+    SUM(CAST(ops.flops AS REAL) * timed.runs / ops.records) AS flops,
+    SUM(CAST(ops.bytes AS REAL) * timed.runs / ops.records) AS bytes
+  FROM (
+    SELECT region_id, loop_id, SUM(runs) AS runs FROM loop_runs GROUP BY region_id, loop_id
+  ) timed
+  INNER JOIN ops ON ops.loop_id = timed.loop_id
+  GROUP BY timed.region_id
+),
+timing AS (
+  SELECT
+    region_id,
+    COUNT(*) AS instances,
+    SUM(wall_time) AS wall_time
+  FROM instances
+  GROUP BY region_id
+)
+SELECT
+  roofline_regions.region_id,
+  s_file.string AS file_name,
+  s_func.string AS function_name,
+  roofline_regions.line,
+  timing.instances,
+  CAST(timing.wall_time AS REAL) / timing.instances AS avg_wall_time,
+  imbalance.avg_threads,
+  CAST(balance.busy_time AS REAL) / NULLIF(balance.thread_runs, 0) AS avg_thread_time,
+  imbalance.load_imbalance,
+  work.flops * 1000000000.0 / NULLIF(timing.wall_time, 0) AS flops,
+  work.bytes * 1000000000.0 / NULLIF(timing.wall_time, 0) AS bandwidth,
+  work.flops / NULLIF(work.bytes, 0) AS arithmetic_intensity
+FROM roofline_regions
+INNER JOIN timing ON timing.region_id = roofline_regions.region_id
+LEFT JOIN balance ON balance.region_id = roofline_regions.region_id
+LEFT JOIN imbalance ON imbalance.region_id = roofline_regions.region_id
+LEFT JOIN work ON work.region_id = roofline_regions.region_id
+LEFT JOIN strings s_file ON roofline_regions.file_name = s_file.id
+LEFT JOIN strings s_func ON roofline_regions.function_name = s_func.id;
+    "
+    );
+    connection.execute(view)?;
+    Ok(())
+}
 
-  CAST(ops.vector_double_ops AS REAL) * 1000000000.0 / NULLIF(runs.total_duration, 0) AS vector_double_ops,
-  CAST(ops.vector_double_ops AS REAL) / NULLIF(ops.bytes_load + ops.bytes_store, 0) AS vector_double_ai
+/// Creates the `roofline_callers` view, one row per loop and caller stack
+/// the loop was entered from, outermost caller first.
+///
+/// Timed and instrumented invocations are matched by their caller stacks,
+/// which stay the same across the PMU run and a separate instrumented run.
+/// Nested loops get the share of the time of their outermost loop that they
+/// took under the same callers, like in the `roofline` view. Invocations
+/// whose callers are unknown are left out.
+async fn create_roofline_callers_view(connection: &sqlite::Connection) -> Result<()> {
+    let flops = LoopStats::TYPED_OPS
+        .into_iter()
+        .filter(|column| !column.contains("_int_"))
+        .map(|column| format!("stats.{column}"))
+        .collect::<Vec<_>>()
+        .join(" + ");
+    let view = format!(
+        "
+CREATE VIEW roofline_callers AS
+WITH
+ops AS (
+  SELECT
+    stats.loop_id,
+    contexts.call_stack,
+    SUM(stats.records) AS records,
+    SUM(stats.loop_time) AS loop_time,
+    SUM(stats.root_time) AS root_time,
+    SUM({flops}) AS flops,
+    SUM(stats.bytes_load + stats.bytes_store) AS bytes
+  FROM roofline_context_op_stats stats
+  INNER JOIN roofline_contexts contexts
+    ON contexts.process_id = stats.process_id AND contexts.context_id = stats.context_id
+  GROUP BY stats.loop_id, contexts.call_stack
+),
+runs AS (
+  SELECT
+    runs.loop_id,
+    contexts.call_stack,
+    SUM(runs.runs) AS runs,
+    SUM(runs.total_duration) AS total_duration
+  FROM roofline_run_stats runs
+  INNER JOIN roofline_contexts contexts
+    ON contexts.process_id = runs.process_id AND contexts.context_id = runs.context_id
+  GROUP BY runs.loop_id, contexts.call_stack
+),
+timed AS (
+  SELECT
+    roofline_loops.loop_id,
+    ops.call_stack,
+    runs.runs,
+    CASE
+      WHEN roofline_loops.depth = 1 THEN runs.total_duration
+      ELSE runs.total_duration * CAST(ops.loop_time AS REAL) / NULLIF(ops.root_time, 0)
+    END AS duration
+  FROM roofline_loops
+  INNER JOIN ops ON ops.loop_id = roofline_loops.loop_id
+  INNER JOIN runs
+    ON runs.loop_id = roofline_loops.root_id AND runs.call_stack = ops.call_stack
+)
+SELECT
+  roofline_loops.loop_id,
+  roofline_loops.depth,
+  s_file.string AS file_name,
+  s_func.string AS function_name,
+  s_name.string AS region_name,
+  roofline_loops.line,
+  timed.call_stack,
+  timed.runs,
+  timed.duration,
+  CAST(ops.flops AS REAL) * timed.runs * 1000000000.0 / NULLIF(ops.records * timed.duration, 0) AS flops,
+  CAST(ops.bytes AS REAL) * timed.runs * 1000000000.0 / NULLIF(ops.records * timed.duration, 0) AS bandwidth,
+  CAST(ops.flops AS REAL) / NULLIF(ops.bytes, 0) AS arithmetic_intensity
+FROM roofline_loops
+INNER JOIN timed ON timed.loop_id = roofline_loops.loop_id
+INNER JOIN ops ON ops.loop_id = timed.loop_id AND ops.call_stack = timed.call_stack
+LEFT JOIN strings s_file ON roofline_loops.file_name = s_file.id
+LEFT JOIN strings s_func ON roofline_loops.function_name = s_func.id
+LEFT JOIN strings s_name ON roofline_loops.name = s_name.id;
+    "
+    );
+    connection.execute(view)?;
+    Ok(())
+}
 
-FROM runs
-LEFT JOIN ops
-  ON runs.file_name = ops.file_name
-  AND runs.function_name = ops.function_name
-  AND runs.line = ops.line
-LEFT JOIN strings s_file ON runs.file_name = s_file.id
-LEFT JOIN strings s_func ON runs.function_name = s_func.id;
-    ").expect("failed to create a view");
+/// Instrumentation coverage of every source file with sampled loops.
+///
+/// A loop is sampled when at least one PMU sample resolves to a line between
+/// the first and the last line of an outermost loop the plugin described.
+/// Loops the plugin could not version are described without records, so
+/// `instrumented_share` is the share of sampled loops that report op counts
+/// and `sample_share` the share of their samples that fell into such loops.
+/// Loops in headers are listed under the header, and loops the hot list left
+/// out are not described at all.
+///
+/// Loop file names are the ones the compiler saw, sample file names come from
+/// the debug info, a sample matches a loop if its path ends with the loop's.
+async fn create_loop_coverage_view(connection: &sqlite::Connection) -> Result<()> {
+    let view = format!(
+        "
+CREATE VIEW loop_coverage AS
+WITH
+loops AS (
+  SELECT
+    roofline_loops.loop_id,
+    s_file.string AS file_name,
+    roofline_loops.line,
+    MAX(roofline_loops.end_line, roofline_loops.line) AS end_line,
+    (roofline_loops.flags & {LOOP_FLAG_NOT_INSTRUMENTED}) = 0 AS instrumented
+  FROM roofline_loops
+  INNER JOIN strings s_file ON roofline_loops.file_name = s_file.id
+  WHERE roofline_loops.depth = 1
+),
+ip_samples AS (
+  SELECT ip, COUNT(*) AS samples FROM pmu_counters GROUP BY ip
+),
+sampled AS (
+  SELECT loops.loop_id, loops.file_name, loops.instrumented, SUM(ip_samples.samples) AS samples
+  FROM loops
+  INNER JOIN proc_map
+    ON proc_map.line BETWEEN loops.line AND loops.end_line
+    AND (proc_map.file_name = loops.file_name
+      OR proc_map.file_name LIKE '%/' || loops.file_name)
+  INNER JOIN ip_samples ON ip_samples.ip = proc_map.ip
+  GROUP BY loops.loop_id
+)
+SELECT
+  file_name,
+  COUNT(*) AS sampled_loops,
+  SUM(instrumented) AS instrumented_loops,
+  CAST(SUM(instrumented) AS REAL) / COUNT(*) AS instrumented_share,
+  SUM(samples) AS samples,
+  CAST(SUM(instrumented * samples) AS REAL) / SUM(samples) AS sample_share
+FROM sampled
+GROUP BY file_name
+ORDER BY file_name;
+    "
+    );
+    connection.execute(view)?;
     Ok(())
 }
 
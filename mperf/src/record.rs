@@ -1,19 +1,24 @@
 use anyhow::{Context, Result};
 use mperf_data::{
-    CallFrame, Event, IPCMessage, ProcMapEntry, RecordInfo, RooflineInfo, ScenarioInfo,
+    roofline_loop_mask_name, thread_ring_name, CallFrame, Event, IPCLoop, IPCMessage,
+    LoopDescription, ProcMapEntry, RecordInfo, RooflineInfo, ScenarioInfo, ROOFLINE_LOOP_MASK_BITS,
+    THREAD_RING_SIZE,
 };
+use shmem::{bitmap::SharedBitmap, proc_channel::Receiver};
 use std::{
-    collections::HashMap,
+    collections::{HashMap, HashSet},
     fs::File,
     path::{Path, PathBuf},
     sync::Arc,
 };
 
-use pmu::{Counter, Process, Record};
+use parking_lot::Mutex;
+use pmu::{BranchRecord, Counter, Process, Record};
 
 const SIZE_16MB: usize = 16 * 1024 * 1024;
 
 use crate::{
+    branch_runs::BranchSample,
     counter_selection::{get_pmu_counters, get_tma_counter_groups},
     event_dispatcher::EventDispatcher,
     postprocess::perform_postprocessing,
@@ -24,10 +29,53 @@ use crate::{
 #[cfg(target_os = "macos")]
 const VM_PROT_EXECUTE: i32 = 0x4;
 
+#[derive(Debug, Clone, Default)]
+pub struct RooflineOptions {
+    /// Instrument every N-th loop invocation during the PMU run.
+    pub sample_period: Option<u32>,
+    /// Loops that skip all notifications, by id.
+    pub disabled_loops: Vec<u64>,
+    /// Read cycles, instructions and LLC misses around every timed loop
+    /// invocation of the PMU run.
+    pub loop_counters: bool,
+    /// Persist every loop invocation, not only the per-loop aggregates.
+    pub raw_invocations: bool,
+}
+
+/// The per-loop enable bits of a recorded process, shared with its collector.
+struct LoopMask {
+    bits: SharedBitmap,
+    disabled: HashSet<u64>,
+}
+
+impl LoopMask {
+    fn create(pipe_name: &str, disabled: &[u64]) -> std::io::Result<Self> {
+        Ok(Self {
+            bits: SharedBitmap::create(
+                &roofline_loop_mask_name(pipe_name),
+                ROOFLINE_LOOP_MASK_BITS,
+            )?,
+            disabled: disabled.iter().copied().collect(),
+        })
+    }
+
+    /// Called when the collector registers a loop, the bit takes effect on
+    /// the next entry of the loop.
+    fn register(&self, desc: &IPCLoop) {
+        if self.disabled.contains(&desc.id) && !self.bits.set(desc.index as usize, false) {
+            eprintln!(
+                "Loop {} cannot be disabled, only the first {} loops are switchable",
+                desc.id, ROOFLINE_LOOP_MASK_BITS
+            );
+        }
+    }
+}
+
 pub async fn do_record(
     scenario: Scenario,
     output_directory: &Path,
     pid: Option<u32>,
+    roofline_options: RooflineOptions,
     command: Vec<String>,
 ) -> Result<()> {
     println!("Record profile with {scenario:?} scenario");
@@ -36,7 +84,10 @@ pub async fn do_record(
 
     let info = match scenario {
         Scenario::Snapshot => snapshot(dispatcher.clone(), pid, &command)?,
-        Scenario::Roofline => roofline(dispatcher.clone(), &command).await?,
+        Scenario::Roofline => roofline(dispatcher.clone(), &command, &roofline_options).await?,
+        Scenario::RooflineLite => {
+            roofline_lite(dispatcher.clone(), &command, &roofline_options).await?
+        }
         Scenario::TMA => topdown(dispatcher.clone(), &command)?,
     };
 
@@ -61,6 +112,15 @@ pub async fn do_record(
         })
         .collect();
 
+    let caches = pmu::host_data_caches()
+        .into_iter()
+        .map(|c| mperf_data::CacheLevel {
+            level: c.level,
+            size: c.size,
+            line_size: c.line_size,
+        })
+        .collect();
+
     let ri = RecordInfo {
         format_version: mperf_data::CURRENT_FORMAT_VERSION,
         scenario,
@@ -68,6 +128,7 @@ pub async fn do_record(
         cpu_model,
         cpu_vendor,
         cores,
+        caches,
         scenario_info: info,
     };
 
@@ -280,32 +341,85 @@ fn get_exe_dir() -> std::io::Result<PathBuf> {
     Ok(exe_path)
 }
 
-async fn roofline(dispatcher: Arc<EventDispatcher>, command: &[String]) -> Result<ScenarioInfo> {
+/// Lets the collector sum instrumented invocations per loop and thread, so
+/// that they no longer take a record each. Without raw invocations only the
+/// per-loop sums are persisted anyway.
+fn roofline_aggregate_env() -> (String, String) {
+    (
+        "MPERF_COLLECTOR_ROOFLINE_AGGREGATE".to_string(),
+        "1".to_string(),
+    )
+}
+
+/// Library path that lets a recorded process find the collector next to
+/// `mperf`.
+fn collector_library_path() -> std::io::Result<String> {
     let exe_path = get_exe_dir()?.to_str().unwrap().to_string();
 
     // FIXME make this platform independent
-    let ld_path = match std::env::var("LD_LIBRARY_PATH") {
+    Ok(match std::env::var("LD_LIBRARY_PATH") {
         Ok(path) => format!("{}:{}:{}/../lib", path, exe_path, exe_path),
         Err(_) => format!("{}:{}/../lib", exe_path, exe_path),
-    };
+    })
+}
 
-    println!(
-        "Run 1: collecting performance data for '{}'",
-        command.join(" ")
-    );
+async fn roofline(
+    dispatcher: Arc<EventDispatcher>,
+    command: &[String],
+    options: &RooflineOptions,
+) -> Result<ScenarioInfo> {
+    // Every invocation would run the instrumented code with a period of one,
+    // and none of them would be timed.
+    if let Some(period) = options.sample_period.filter(|&period| period < 2) {
+        anyhow::bail!(
+            "--roofline-sample-period must be at least 2, {period} leaves no invocation timed"
+        );
+    }
 
-    let (pipe_name, task) =
-        create_shmem_pipe(command[0].split("/").last().unwrap(), dispatcher.clone())?;
+    let ld_path = collector_library_path()?;
 
-    let process = Process::new(
-        command,
-        &[
-            ("MPERF_COLLECTOR_SHMEM_ID".to_string(), pipe_name.clone()),
-            ("LD_LIBRARY_PATH".to_string(), ld_path.clone()),
-            ("MPERF_COLLECTOR_ENABLED".to_string(), "1".to_string()),
-        ],
+    let sample_period = options.sample_period;
+    if sample_period.is_some() {
+        println!(
+            "Collecting performance data and sampled loop statistics for '{}'",
+            command.join(" ")
+        );
+    } else {
+        println!(
+            "Run 1: collecting performance data for '{}'",
+            command.join(" ")
+        );
+    }
+
+    let (pipe_name, task) = create_shmem_pipe(
+        command[0].split("/").last().unwrap(),
+        dispatcher.clone(),
+        &options.disabled_loops,
     )?;
 
+    let mut env = vec![
+        ("MPERF_COLLECTOR_SHMEM_ID".to_string(), pipe_name.clone()),
+        ("LD_LIBRARY_PATH".to_string(), ld_path.clone()),
+        ("MPERF_COLLECTOR_ENABLED".to_string(), "1".to_string()),
+    ];
+    if let Some(period) = sample_period {
+        env.push((
+            "MPERF_COLLECTOR_ROOFLINE_SAMPLE_PERIOD".to_string(),
+            period.to_string(),
+        ));
+    }
+    if options.loop_counters {
+        env.push((
+            "MPERF_COLLECTOR_ROOFLINE_COUNTERS".to_string(),
+            "1".to_string(),
+        ));
+    }
+    if !options.raw_invocations {
+        env.push(roofline_aggregate_env());
+    }
+
+    let process = Process::new(command, &env)?;
+
     let counters = get_pmu_counters(Scenario::Roofline);
 
     let mut driver = pmu::SamplingDriverBuilder::new()
@@ -369,28 +483,48 @@ async fn roofline(dispatcher: Arc<EventDispatcher>, command: &[String]) -> Resul
     task.await?;
 
     let perf_pid = process.pid();
+    let counters = counters
+        .iter()
+        .map(|counter| (counter_to_event_ty(counter), counter.name().to_string()))
+        .collect();
+
+    if let Some(sample_period) = sample_period {
+        return Ok(ScenarioInfo::Roofline(RooflineInfo {
+            perf_pid,
+            counters,
+            inst_pid: perf_pid,
+            sample_period,
+            raw_invocations: options.raw_invocations,
+            estimated: false,
+        }));
+    }
 
     println!(
         "Run 2: collecting loop statistics for '{}'",
         command.join(" ")
     );
 
-    let (pipe_name, task) =
-        create_shmem_pipe(command[0].split("/").last().unwrap(), roofline_dispatcher)?;
-
-    let process = Process::new(
-        command,
-        &[
-            ("MPERF_COLLECTOR_SHMEM_ID".to_string(), pipe_name.clone()),
-            ("LD_LIBRARY_PATH".to_string(), ld_path),
-            ("MPERF_COLLECTOR_ENABLED".to_string(), "1".to_string()),
-            (
-                "MPERF_COLLECTOR_ROOFLINE_INSTRUMENTED".to_string(),
-                "1".to_string(),
-            ),
-        ],
+    let (pipe_name, task) = create_shmem_pipe(
+        command[0].split("/").last().unwrap(),
+        roofline_dispatcher,
+        &options.disabled_loops,
     )?;
 
+    let mut env = vec![
+        ("MPERF_COLLECTOR_SHMEM_ID".to_string(), pipe_name.clone()),
+        ("LD_LIBRARY_PATH".to_string(), ld_path),
+        ("MPERF_COLLECTOR_ENABLED".to_string(), "1".to_string()),
+        (
+            "MPERF_COLLECTOR_ROOFLINE_INSTRUMENTED".to_string(),
+            "1".to_string(),
+        ),
+    ];
+    if !options.raw_invocations {
+        env.push(roofline_aggregate_env());
+    }
+
+    let process = Process::new(command, &env)?;
+
     process.cont();
     process.wait()?;
 
@@ -400,17 +534,255 @@ async fn roofline(dispatcher: Arc<EventDispatcher>, command: &[String]) -> Resul
 
     Ok(ScenarioInfo::Roofline(RooflineInfo {
         perf_pid,
-        counters: counters
-            .iter()
-            .map(|counter| (counter_to_event_ty(counter), counter.name().to_string()))
-            .collect(),
+        counters,
         inst_pid,
+        sample_period: 0,
+        raw_invocations: options.raw_invocations,
+        estimated: false,
+    }))
+}
+
+/// Records roofline results in a single run of the original code. Loops are
+/// timed as in the PMU run of the roofline scenario, the collector sends the
+/// block tables of the Clang plugin, and every cycles sample carries the
+/// last taken branches. Postprocessing estimates how often each block ran
+/// from the branches and derives the loop statistics from there.
+async fn roofline_lite(
+    dispatcher: Arc<EventDispatcher>,
+    command: &[String],
+    options: &RooflineOptions,
+) -> Result<ScenarioInfo> {
+    if !cfg!(all(target_os = "linux", target_arch = "x86_64")) {
+        anyhow::bail!(
+            "roofline-lite needs last branch records, which are only read on x86-64 Linux"
+        );
+    }
+    if options.sample_period.is_some() {
+        anyhow::bail!("--roofline-sample-period does not apply to roofline-lite");
+    }
+
+    let ld_path = collector_library_path()?;
+
+    println!(
+        "Collecting performance data and branch records for '{}'",
+        command.join(" ")
+    );
+
+    let (pipe_name, task) = create_shmem_pipe(
+        command[0].split("/").last().unwrap(),
+        dispatcher.clone(),
+        &options.disabled_loops,
+    )?;
+
+    let mut env = vec![
+        ("MPERF_COLLECTOR_SHMEM_ID".to_string(), pipe_name.clone()),
+        ("LD_LIBRARY_PATH".to_string(), ld_path),
+        ("MPERF_COLLECTOR_ENABLED".to_string(), "1".to_string()),
+        (
+            "MPERF_COLLECTOR_ROOFLINE_BLOCKS".to_string(),
+            "1".to_string(),
+        ),
+    ];
+    if options.loop_counters {
+        env.push((
+            "MPERF_COLLECTOR_ROOFLINE_COUNTERS".to_string(),
+            "1".to_string(),
+        ));
+    }
+
+    let process = Process::new(command, &env)?;
+
+    let counters = get_pmu_counters(Scenario::RooflineLite);
+
+    let mut driver = pmu::SamplingDriverBuilder::new()
+        .counters(&counters)
+        .process(&process)
+        .branch_records()
+        .build()
+        .context(
+            "roofline-lite needs last branch records, which this CPU or kernel does not provide",
+        )?;
+
+    // Branches are read by the group leader, the sample of its cycles
+    // counter follows with the same event ID and tells how many cycles they
+    // stand for.
+    let pending_branches = Mutex::new(None::<(u128, Vec<BranchRecord>)>);
+
+    driver.start(Arc::new(move |record| {
+        match record {
+            Record::Sample(mut sample) => {
+                let branches = std::mem::take(&mut sample.branches);
+                {
+                    let mut pending = pending_branches.lock();
+                    if !branches.is_empty() {
+                        *pending = Some((sample.event_id, branches));
+                    }
+                    if sample.counter == Counter::Cycles {
+                        if let Some((_, branches)) =
+                            pending.take_if(|(event_id, _)| *event_id == sample.event_id)
+                        {
+                            dispatcher.publish_branches_sync(BranchSample {
+                                process_id: sample.pid,
+                                period: sample.value,
+                                branches,
+                            });
+                        }
+                    }
+                }
+
+                let unique_id = uuid::Uuid::now_v7().as_u128();
+                let callstack = sample.callstack.into_iter().map(CallFrame::IP).collect();
+                let name = if let Counter::Custom(name) = &sample.counter {
+                    dispatcher.string_id(name)
+                } else {
+                    0
+                };
+                let event = Event {
+                    unique_id,
+                    correlation_id: sample.event_id,
+                    parent_id: 0,
+                    ty: counter_to_event_ty(&sample.counter),
+                    thread_id: sample.tid,
+                    process_id: sample.pid,
+                    cpu: sample.cpu,
+                    time_enabled: sample.time_enabled,
+                    time_running: sample.time_running,
+                    value: sample.value,
+                    timestamp: sample.time,
+                    name,
+                    callstack,
+                    user_regs: sample.user_regs.map(|regs| mperf_data::UserRegs {
+                        abi: regs.abi,
+                        mask: regs.mask,
+                        values: regs.values,
+                    }),
+                    user_stack: sample.user_stack,
+                };
+
+                dispatcher.publish_event_sync(event);
+            }
+            Record::ProcAddr(addr) => {
+                let entry = ProcMapEntry {
+                    filename: addr.filename,
+                    address: addr.addr as usize,
+                    size: addr.len as usize,
+                    offset: addr.pgoff as usize,
+                    pid: addr.pid,
+                };
+
+                dispatcher.publish_proc_map_sync(entry);
+            }
+        };
+    }))?;
+
+    process.cont();
+    process.wait()?;
+    driver.stop()?;
+    task.await?;
+
+    let perf_pid = process.pid();
+    let counters = counters
+        .iter()
+        .map(|counter| (counter_to_event_ty(counter), counter.name().to_string()))
+        .collect();
+
+    Ok(ScenarioInfo::Roofline(RooflineInfo {
+        perf_pid,
+        counters,
+        inst_pid: perf_pid,
+        sample_period: 0,
+        raw_invocations: options.raw_invocations,
+        estimated: true,
     }))
 }
 
+/// Forwards the messages of a recorded process's collector to the dispatcher.
+struct CollectorMessages {
+    dispatcher: Arc<EventDispatcher>,
+    loop_mask: LoopMask,
+    /// String ids of the collector mapped to the ones of the dispatcher.
+    strings: HashMap<u128, u128>,
+}
+
+impl CollectorMessages {
+    async fn handle(&mut self, message: IPCMessage) {
+        let messages = match message {
+            IPCMessage::Batch(bytes) => IPCMessage::decode_batch(&bytes),
+            message => vec![message],
+        };
+
+        for message in messages {
+            match message {
+                IPCMessage::String(string) => {
+                    let id = self.dispatcher.string_id_async(&string.value).await;
+                    self.strings.insert(string.key, id);
+                }
+                IPCMessage::Loop(desc) => {
+                    self.loop_mask.register(&desc);
+                    self.dispatcher
+                        .publish_loop(LoopDescription {
+                            id: desc.id,
+                            parent_id: desc.parent_id,
+                            file_name: self
+                                .strings
+                                .get(&desc.file_name)
+                                .cloned()
+                                .unwrap_or_default(),
+                            function_name: self
+                                .strings
+                                .get(&desc.function_name)
+                                .cloned()
+                                .unwrap_or_default(),
+                            line: desc.line,
+                            end_line: desc.end_line,
+                            flags: desc.flags,
+                            codegen: desc.codegen,
+                            name: self.strings.get(&desc.name).cloned().unwrap_or_default(),
+                        })
+                        .await;
+                }
+                IPCMessage::Roofline(record) => {
+                    self.dispatcher.publish_roofline_record(record).await;
+                }
+                IPCMessage::Context(context) => {
+                    self.dispatcher.publish_context(context).await;
+                }
+                IPCMessage::Block(block) => {
+                    self.dispatcher.publish_block(block).await;
+                }
+                IPCMessage::Event(mut event) => {
+                    for stack in event.callstack.iter_mut() {
+                        if let CallFrame::Location(loc) = stack {
+                            loc.function_name = self
+                                .strings
+                                .get(&loc.function_name)
+                                .cloned()
+                                .unwrap_or_default();
+                            loc.file_name = self
+                                .strings
+                                .get(&loc.file_name)
+                                .cloned()
+                                .unwrap_or_default();
+                        }
+                    }
+
+                    self.dispatcher.publish_event(event).await;
+                }
+                IPCMessage::Batch(_) => {
+                    eprintln!("Ignoring a nested IPC message batch");
+                }
+                IPCMessage::Ring(_) => {
+                    eprintln!("Ignoring a thread ring announced outside of the IPC channel");
+                }
+            }
+        }
+    }
+}
+
 fn create_shmem_pipe(
     prefix: &str,
     roofline_dispatcher: Arc<EventDispatcher>,
+    disabled_loops: &[u64],
 ) -> Result<(String, tokio::task::JoinHandle<()>), std::io::Error> {
     let pipe_name = format!(
         "/{}{}{}",
@@ -422,29 +794,56 @@ fn create_shmem_pipe(
             .subsec_nanos()
     );
 
-    let rx = shmem::proc_channel::Receiver::<IPCMessage>::new(&pipe_name, SIZE_16MB)?;
+    let rx = Receiver::<IPCMessage>::new(&pipe_name, SIZE_16MB)?;
+    // Lives as long as the channel, the collector opens it lazily.
+    let loop_mask = LoopMask::create(&pipe_name, disabled_loops)?;
+    let mut messages = CollectorMessages {
+        dispatcher: roofline_dispatcher,
+        loop_mask,
+        strings: HashMap::new(),
+    };
+    let channel_name = pipe_name.clone();
 
     let task = tokio::spawn(async move {
-        let mut strings = HashMap::<u128, u128>::new();
-
-        while let Some(message) = rx.recv().await {
-            match message {
-                IPCMessage::String(string) => {
-                    let id = roofline_dispatcher.string_id_async(&string.value).await;
-                    strings.insert(string.key, id);
+        let mut rings = Vec::<Receiver<IPCMessage>>::new();
+        loop {
+            // Everything sent before the collector closed the channel is read
+            // by this iteration.
+            let closed = rx.is_closed();
+
+            // Threads send strings and ring announcements through the channel
+            // before the messages that refer to them, so the thread rings are
+            // read before the channel is drained.
+            let mut pending = vec![];
+            for ring in &rings {
+                while let Some(message) = ring.try_recv() {
+                    pending.push(message);
                 }
-                IPCMessage::Event(mut event) => {
-                    for stack in event.callstack.iter_mut() {
-                        if let CallFrame::Location(loc) = stack {
-                            loc.function_name =
-                                strings.get(&loc.function_name).cloned().unwrap_or_default();
-                            loc.file_name =
-                                strings.get(&loc.file_name).cloned().unwrap_or_default();
+            }
+
+            let mut idle = pending.is_empty();
+            while let Some(message) = rx.try_recv() {
+                idle = false;
+                match message {
+                    IPCMessage::Ring(index) => {
+                        let name = thread_ring_name(&channel_name, index);
+                        match Receiver::adopt(&name, THREAD_RING_SIZE) {
+                            Ok(ring) => rings.push(ring),
+                            Err(error) => eprintln!("Failed to open thread ring {name}: {error}"),
                         }
                     }
+                    message => messages.handle(message).await,
+                }
+            }
+            for message in pending {
+                messages.handle(message).await;
+            }
 
-                    roofline_dispatcher.publish_event(event).await;
+            if idle {
+                if closed {
+                    break;
                 }
+                tokio::task::yield_now().await;
             }
         }
     });
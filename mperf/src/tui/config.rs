@@ -4,7 +4,7 @@ use pmu_data::{MetricColumnSpec, MetricsTableSpec, OrderSpec, ScenarioUi, SortDi
 pub fn scenario_ui(record: &RecordInfo) -> ScenarioUi {
     match record.scenario {
         Scenario::Snapshot => snapshot_ui(),
-        Scenario::Roofline => roofline_ui(),
+        Scenario::Roofline | Scenario::RooflineLite => roofline_ui(),
         Scenario::TMA => match &record.scenario_info {
             ScenarioInfo::TMA(tma) => tma.ui.clone().unwrap_or_else(|| tma_fallback_ui(tma)),
             _ => snapshot_ui(),
@@ -1,5 +1,9 @@
-use std::sync::Arc;
+use std::{collections::HashMap, sync::Arc};
 
+use mperf_data::{
+    LOOP_FLAG_HAS_REMAINDER, LOOP_FLAG_REMAINDER, LOOP_FLAG_RUNTIME_CHECKS, LOOP_FLAG_SCALABLE,
+    LOOP_FLAG_VECTORIZED,
+};
 use parking_lot::{Mutex, RwLock};
 use ratatui::{
     layout::Constraint,
@@ -17,22 +21,61 @@ pub struct LoopsTab {
 }
 
 #[allow(dead_code)]
+#[derive(Default)]
 struct Loop {
+    loop_id: i64,
+    /// Zero for outermost loops.
+    parent_id: i64,
+    /// One for outermost loops.
+    depth: u32,
     function_name: String,
+    /// Name of an annotated region, empty for loops.
+    region_name: String,
     file_name: String,
     line: u32,
+    /// `LOOP_FLAG_*` bits and what the compiler made of the loop.
+    flags: u32,
+    vector_width: u32,
+    vector_bits: u32,
+    interleave_count: u32,
+    estimated_spills: u32,
+    avg_trip_count: f64,
+    /// Estimated bytes touched by one entry of the loop.
+    working_set: f64,
+    /// The memory level the working set fits in, empty if unknown.
+    memory_tier: String,
+    /// Measured by the loop counters of timed invocations, if recorded.
+    ipc: Option<f64>,
+    cache_mpki: Option<f64>,
     sint_ops: f64,
     sint_ai: f64,
+    shp_ops: f64,
+    shp_ai: f64,
+    sbf_ops: f64,
+    sbf_ai: f64,
     sfp_ops: f64,
     sfp_ai: f64,
     sdp_ops: f64,
     sdp_ai: f64,
     vint_ops: f64,
     vint_ai: f64,
+    vhp_ops: f64,
+    vhp_ai: f64,
+    vbf_ops: f64,
+    vbf_ai: f64,
     vfp_ops: f64,
     vfp_ai: f64,
     vdp_ops: f64,
     vdp_ai: f64,
+    /// Divisions and remainders, in billions per second.
+    div_ops: f64,
+    conversion_ops: f64,
+    atomic_ops: f64,
+    /// Shares of the bytes moved by the loop, by access pattern.
+    invariant_share: f64,
+    unit_stride_share: f64,
+    strided_share: f64,
+    indirect_share: f64,
 }
 
 impl Widget for LoopsTab {
@@ -57,14 +100,23 @@ impl Widget for LoopsTab {
         let header = [
             Cell::from("Function"),
             Cell::from("Location"),
+            Cell::from("Codegen"),
+            Cell::from("Avg trips"),
+            Cell::from("Working set"),
+            Cell::from("IPC / LLC MPKI"),
             Cell::from("Scalar SP GFLOP/s"),
             Cell::from("Scalar SP AI"),
             Cell::from("Scalar DP GFLOP/s"),
             Cell::from("Scalar DP AI"),
+            Cell::from("Vector HP GFLOP/s"),
+            Cell::from("Vector HP AI"),
+            Cell::from("Vector BF16 GFLOP/s"),
+            Cell::from("Vector BF16 AI"),
             Cell::from("Vector SP GFLOP/s"),
             Cell::from("Vector SP AI"),
             Cell::from("Vector DP GFLOP/s"),
             Cell::from("Vector DP AI"),
+            Cell::from("Access %\ninv/unit/str/ind"),
         ]
         .into_iter()
         .collect::<Row>()
@@ -73,16 +125,25 @@ impl Widget for LoopsTab {
 
         let rows = hotspots.iter().map(|loop_| {
             [
-                Cell::from(loop_.function_name.as_str()),
+                Cell::from(tree_label(loop_)),
                 Cell::from(format!("{}:{}", loop_.file_name, loop_.line)),
+                Cell::from(codegen_label(loop_)),
+                Cell::from(format!("{:.1}", loop_.avg_trip_count)),
+                Cell::from(working_set_label(loop_)),
+                Cell::from(counters_label(loop_)),
                 Cell::from(format!("{:.2}", loop_.sfp_ops)),
                 Cell::from(format!("{:.2}", loop_.sfp_ai)),
                 Cell::from(format!("{:.2}", loop_.sdp_ops)),
                 Cell::from(format!("{:.2}", loop_.sdp_ai)),
+                Cell::from(format!("{:.2}", loop_.vhp_ops)),
+                Cell::from(format!("{:.2}", loop_.vhp_ai)),
+                Cell::from(format!("{:.2}", loop_.vbf_ops)),
+                Cell::from(format!("{:.2}", loop_.vbf_ai)),
                 Cell::from(format!("{:.2}", loop_.vfp_ops)),
                 Cell::from(format!("{:.2}", loop_.vfp_ai)),
                 Cell::from(format!("{:.2}", loop_.vdp_ops)),
                 Cell::from(format!("{:.2}", loop_.vdp_ai)),
+                Cell::from(access_mix(loop_)),
             ]
             .into_iter()
             .collect::<Row>()
@@ -91,6 +152,15 @@ impl Widget for LoopsTab {
         let widths = [
             Constraint::Max(30),
             Constraint::Min(40),
+            Constraint::Max(40),
+            Constraint::Max(12),
+            Constraint::Max(16),
+            Constraint::Max(16),
+            Constraint::Max(20),
+            Constraint::Max(20),
+            Constraint::Max(20),
+            Constraint::Max(20),
+            Constraint::Max(20),
             Constraint::Max(20),
             Constraint::Max(20),
             Constraint::Max(20),
@@ -146,11 +216,23 @@ impl LoopsTab {
                                 .map(|value| value.unwrap_or_default())
                                 .map_err(|error| error.to_string())
                         };
+                        let integer = |column| {
+                            row.try_read::<i64, _>(column)
+                                .map_err(|error| error.to_string())
+                        };
                         Ok(Loop {
+                            loop_id: integer("loop_id")?,
+                            parent_id: integer("parent_id")?,
+                            depth: integer("depth")? as u32,
                             function_name: row
                                 .try_read::<&str, _>("function_name")
                                 .map_err(|error| error.to_string())?
                                 .to_string(),
+                            region_name: row
+                                .try_read::<Option<&str>, _>("region_name")
+                                .map_err(|error| error.to_string())?
+                                .unwrap_or_default()
+                                .to_string(),
                             file_name: row
                                 .try_read::<&str, _>("file_name")
                                 .map_err(|error| error.to_string())?
@@ -159,18 +241,51 @@ impl LoopsTab {
                                 .try_read::<i64, _>("line")
                                 .map_err(|error| error.to_string())?
                                 as u32,
+                            flags: integer("flags")? as u32,
+                            vector_width: integer("vector_width")? as u32,
+                            vector_bits: integer("vector_bits")? as u32,
+                            interleave_count: integer("interleave_count")? as u32,
+                            estimated_spills: integer("estimated_spills")? as u32,
+                            avg_trip_count: float("avg_trip_count")?,
+                            working_set: float("working_set")?,
+                            memory_tier: row
+                                .try_read::<Option<&str>, _>("memory_tier")
+                                .map_err(|error| error.to_string())?
+                                .unwrap_or_default()
+                                .to_string(),
+                            ipc: row
+                                .try_read::<Option<f64>, _>("ipc")
+                                .map_err(|error| error.to_string())?,
+                            cache_mpki: row
+                                .try_read::<Option<f64>, _>("cache_mpki")
+                                .map_err(|error| error.to_string())?,
                             sint_ops: float("scalar_int_ops")? / 1_000_000_000.0,
                             sint_ai: float("scalar_int_ai")?,
+                            shp_ops: float("scalar_half_ops")? / 1_000_000_000.0,
+                            shp_ai: float("scalar_half_ai")?,
+                            sbf_ops: float("scalar_bfloat_ops")? / 1_000_000_000.0,
+                            sbf_ai: float("scalar_bfloat_ai")?,
                             sfp_ops: float("scalar_float_ops")? / 1_000_000_000.0,
                             sfp_ai: float("scalar_float_ai")?,
                             sdp_ops: float("scalar_double_ops")? / 1_000_000_000.0,
                             sdp_ai: float("scalar_double_ai")?,
                             vint_ops: float("vector_int_ops")? / 1_000_000_000.0,
                             vint_ai: float("vector_int_ai")?,
+                            vhp_ops: float("vector_half_ops")? / 1_000_000_000.0,
+                            vhp_ai: float("vector_half_ai")?,
+                            vbf_ops: float("vector_bfloat_ops")? / 1_000_000_000.0,
+                            vbf_ai: float("vector_bfloat_ai")?,
                             vfp_ops: float("vector_float_ops")? / 1_000_000_000.0,
                             vfp_ai: float("vector_float_ai")?,
                             vdp_ops: float("vector_double_ops")? / 1_000_000_000.0,
                             vdp_ai: float("vector_double_ai")?,
+                            div_ops: float("div_ops")? / 1_000_000_000.0,
+                            conversion_ops: float("conversion_ops")? / 1_000_000_000.0,
+                            atomic_ops: float("atomic_ops")? / 1_000_000_000.0,
+                            invariant_share: float("invariant_share")?,
+                            unit_stride_share: float("unit_stride_share")?,
+                            strided_share: float("strided_share")?,
+                            indirect_share: float("indirect_share")?,
                         })
                     })
                     .collect()
@@ -187,6 +302,286 @@ impl LoopsTab {
         };
 
         let mut hotspots = self.hotspots.write();
-        *hotspots = rows;
+        *hotspots = tree_order(rows);
+    }
+}
+
+/// Function name indented by the loop depth, so nested loops read as a tree.
+/// Annotated regions show their own name instead.
+fn tree_label(loop_: &Loop) -> String {
+    let name = if loop_.region_name.is_empty() {
+        &loop_.function_name
+    } else {
+        &loop_.region_name
+    };
+    if loop_.depth <= 1 {
+        return name.clone();
+    }
+    format!("{}└ {}", "  ".repeat(loop_.depth as usize - 2), name)
+}
+
+/// Working set in binary units followed by the memory level it fits in.
+fn working_set_label(loop_: &Loop) -> String {
+    let mut size = loop_.working_set;
+    let mut unit = 0;
+    const UNITS: [&str; 5] = ["B", "KiB", "MiB", "GiB", "TiB"];
+    while size >= 1024.0 && unit < UNITS.len() - 1 {
+        size /= 1024.0;
+        unit += 1;
+    }
+    format!("{size:.1} {} {}", UNITS[unit], loop_.memory_tier)
+        .trim_end()
+        .to_string()
+}
+
+/// IPC and last level cache misses per thousand instructions of the original
+/// loop, or a dash when the loop counters were not recorded.
+fn counters_label(loop_: &Loop) -> String {
+    match (loop_.ipc, loop_.cache_mpki) {
+        (Some(ipc), Some(mpki)) => format!("{ipc:.2} / {mpki:.1}"),
+        (Some(ipc), None) => format!("{ipc:.2}"),
+        _ => "-".to_string(),
+    }
+}
+
+/// Vector extension of the analysis host that has registers of `bits` bits.
+/// Results are usually looked at on the machine they were recorded on.
+fn vector_isa(bits: u32, scalable: bool) -> String {
+    let name = if cfg!(any(target_arch = "x86", target_arch = "x86_64")) {
+        match bits {
+            512 => Some("AVX-512"),
+            256 => Some("AVX"),
+            128 => Some("SSE"),
+            _ => None,
+        }
+    } else if cfg!(target_arch = "aarch64") {
+        match (scalable, bits) {
+            (true, _) => Some("SVE"),
+            (false, 128 | 64) => Some("NEON"),
+            _ => None,
+        }
+    } else if cfg!(any(target_arch = "riscv32", target_arch = "riscv64")) && scalable {
+        Some("RVV")
+    } else {
+        None
+    };
+    name.map_or_else(|| format!("{bits}-bit"), str::to_string)
+}
+
+/// What the compiler made of the loop, followed by its dominant floating
+/// point type and FLOP per byte, such as `AVX-512 VF8, f64, 0.50 FLOP/B` or
+/// `scalar, f64, 0.10 FLOP/B`. Runtime checks, a scalar remainder and likely
+/// register spills explain why a vectorized loop still runs slowly.
+fn codegen_label(loop_: &Loop) -> String {
+    let scalable = loop_.flags & LOOP_FLAG_SCALABLE != 0;
+    let mut parts = vec![];
+    if loop_.flags & LOOP_FLAG_REMAINDER != 0 {
+        parts.push("scalar remainder".to_string());
+    } else if loop_.flags & LOOP_FLAG_VECTORIZED != 0 && loop_.vector_width > 0 {
+        let lanes = if scalable {
+            format!("vscale x {}", loop_.vector_width)
+        } else {
+            loop_.vector_width.to_string()
+        };
+        let mut vector = format!("{} VF{lanes}", vector_isa(loop_.vector_bits, scalable));
+        if loop_.interleave_count > 1 {
+            vector.push_str(&format!(" x{}", loop_.interleave_count));
+        }
+        parts.push(vector);
+    } else {
+        parts.push("scalar".to_string());
+    }
+    if loop_.flags & LOOP_FLAG_RUNTIME_CHECKS != 0 {
+        parts.push("rt checks".to_string());
+    }
+    if loop_.flags & LOOP_FLAG_HAS_REMAINDER != 0 {
+        parts.push("remainder".to_string());
+    }
+    if loop_.estimated_spills > 0 {
+        parts.push(format!("~{} spills", loop_.estimated_spills));
+    }
+
+    let types = [
+        (
+            "f16",
+            loop_.shp_ops + loop_.vhp_ops,
+            loop_.shp_ai + loop_.vhp_ai,
+        ),
+        (
+            "bf16",
+            loop_.sbf_ops + loop_.vbf_ops,
+            loop_.sbf_ai + loop_.vbf_ai,
+        ),
+        (
+            "f32",
+            loop_.sfp_ops + loop_.vfp_ops,
+            loop_.sfp_ai + loop_.vfp_ai,
+        ),
+        (
+            "f64",
+            loop_.sdp_ops + loop_.vdp_ops,
+            loop_.sdp_ai + loop_.vdp_ai,
+        ),
+    ];
+    let dominant = types
+        .iter()
+        .filter(|(_, ops, _)| *ops > 0.0)
+        .max_by(|a, b| a.1.total_cmp(&b.1));
+    if let Some((name, _, _)) = dominant {
+        let intensity = types.iter().map(|(_, _, ai)| ai).sum::<f64>();
+        parts.push(name.to_string());
+        parts.push(format!("{intensity:.2} FLOP/B"));
+    }
+    parts.join(", ")
+}
+
+/// Percentages of invariant, unit-stride, strided and indirect bytes. A
+/// memory-bound loop with a large strided share usually wants a different
+/// data layout, one with a large indirect share wants fewer gathers.
+fn access_mix(loop_: &Loop) -> String {
+    [
+        loop_.invariant_share,
+        loop_.unit_stride_share,
+        loop_.strided_share,
+        loop_.indirect_share,
+    ]
+    .map(|share| format!("{:.0}", share * 100.0))
+    .join("/")
+}
+
+/// Orders loops depth-first, with every loop right below its parent. Loops
+/// whose parent is missing from the results are shown as outermost loops.
+fn tree_order(loops: Vec<Loop>) -> Vec<Loop> {
+    let ids = loops.iter().map(|loop_| loop_.loop_id).collect::<Vec<_>>();
+    let mut children = HashMap::<i64, Vec<usize>>::new();
+    let mut roots = vec![];
+    for (index, loop_) in loops.iter().enumerate() {
+        if loop_.parent_id != 0 && ids.contains(&loop_.parent_id) {
+            children.entry(loop_.parent_id).or_default().push(index);
+        } else {
+            roots.push(index);
+        }
+    }
+
+    let mut order = Vec::with_capacity(loops.len());
+    let mut stack = roots.into_iter().rev().collect::<Vec<_>>();
+    while let Some(index) = stack.pop() {
+        order.push(index);
+        if let Some(nested) = children.get(&loops[index].loop_id) {
+            stack.extend(nested.iter().rev());
+        }
+    }
+
+    let mut loops = loops.into_iter().map(Some).collect::<Vec<_>>();
+    order
+        .into_iter()
+        .filter_map(|index| loops[index].take())
+        .collect()
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn loop_(loop_id: i64, parent_id: i64, depth: u32) -> Loop {
+        Loop {
+            loop_id,
+            parent_id,
+            depth,
+            function_name: "kernel".to_string(),
+            file_name: "kernel.c".to_string(),
+            line: 1,
+            ..Loop::default()
+        }
+    }
+
+    #[test]
+    fn nested_loops_follow_their_parent() {
+        let loops = vec![
+            loop_(3, 1, 2),
+            loop_(2, 0, 1),
+            loop_(1, 0, 1),
+            loop_(4, 3, 3),
+            loop_(5, 9, 2),
+        ];
+
+        let order = tree_order(loops)
+            .iter()
+            .map(|loop_| loop_.loop_id)
+            .collect::<Vec<_>>();
+        assert_eq!(order, [2, 1, 3, 4, 5]);
+        assert_eq!(tree_label(&loop_(4, 3, 3)), "  └ kernel");
+
+        let region = Loop {
+            region_name: "solve".to_string(),
+            ..loop_(6, 1, 2)
+        };
+        assert_eq!(tree_label(&region), "└ solve");
+    }
+
+    #[test]
+    fn access_mix_lists_percentages_by_pattern() {
+        let loop_ = Loop {
+            unit_stride_share: 0.75,
+            strided_share: 0.2,
+            indirect_share: 0.05,
+            ..loop_(1, 0, 1)
+        };
+        assert_eq!(access_mix(&loop_), "0/75/20/5");
+    }
+
+    #[test]
+    fn working_set_is_shown_with_its_memory_tier() {
+        let mut loop_ = Loop {
+            working_set: 48.0 * 1024.0,
+            memory_tier: "L2".to_string(),
+            ..loop_(1, 0, 1)
+        };
+        assert_eq!(working_set_label(&loop_), "48.0 KiB L2");
+
+        loop_.memory_tier.clear();
+        loop_.working_set = 100.0;
+        assert_eq!(working_set_label(&loop_), "100.0 B");
+    }
+
+    #[test]
+    fn codegen_label_names_vectorization_and_intensity() {
+        let mut loop_ = Loop {
+            sdp_ops: 1.0,
+            sdp_ai: 0.1,
+            ..loop_(1, 0, 1)
+        };
+        assert_eq!(codegen_label(&loop_), "scalar, f64, 0.10 FLOP/B");
+
+        loop_.flags = LOOP_FLAG_VECTORIZED | LOOP_FLAG_RUNTIME_CHECKS | LOOP_FLAG_HAS_REMAINDER;
+        loop_.vector_width = 4;
+        loop_.vector_bits = 256;
+        loop_.interleave_count = 2;
+        loop_.estimated_spills = 3;
+        loop_.vfp_ops = 4.0;
+        loop_.vfp_ai = 0.4;
+        assert_eq!(
+            codegen_label(&loop_),
+            format!(
+                "{} VF4 x2, rt checks, remainder, ~3 spills, f32, 0.50 FLOP/B",
+                vector_isa(256, false)
+            )
+        );
+
+        let remainder = Loop {
+            flags: LOOP_FLAG_REMAINDER,
+            ..loop_(2, 0, 1)
+        };
+        assert_eq!(codegen_label(&remainder), "scalar remainder");
+    }
+
+    #[test]
+    fn loop_counters_are_optional() {
+        let mut loop_ = loop_(1, 0, 1);
+        assert_eq!(counters_label(&loop_), "-");
+
+        loop_.ipc = Some(1.5);
+        loop_.cache_mpki = Some(3.0);
+        assert_eq!(counters_label(&loop_), "1.50 / 3.0");
     }
 }
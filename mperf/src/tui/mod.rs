@@ -274,7 +274,7 @@ impl TabsWidget {
                     write_tabs.push(Tab::Flamegraph(FlamegraphTab::new(res_dir.clone())))
                 }
                 pmu_data::TabSpec::Loops => {
-                    if matches!(info.scenario, Scenario::Roofline) {
+                    if matches!(info.scenario, Scenario::Roofline | Scenario::RooflineLite) {
                         write_tabs.push(Tab::Loops(LoopsTab::new(connection.clone())));
                     }
                 }
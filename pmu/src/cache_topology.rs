@@ -0,0 +1,110 @@
+/// A data or unified cache level of the host CPU.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct CacheLevel {
+    /// One for the L1 data cache.
+    pub level: u32,
+    /// Size of a single instance of the cache in bytes, which is private to a
+    /// core for the inner levels.
+    pub size: u64,
+    /// Cache line size in bytes.
+    pub line_size: u32,
+}
+
+/// The data and unified caches of the first CPU, innermost level first.
+/// Returns an empty vector when the cache hierarchy is not exposed.
+#[cfg(target_os = "linux")]
+pub fn host_data_caches() -> Vec<CacheLevel> {
+    let Ok(entries) = std::fs::read_dir("/sys/devices/system/cpu/cpu0/cache") else {
+        return Vec::new();
+    };
+
+    let mut caches = entries
+        .flatten()
+        .filter(|entry| entry.file_name().to_string_lossy().starts_with("index"))
+        .filter_map(|entry| {
+            let read = |name: &str| std::fs::read_to_string(entry.path().join(name)).ok();
+            if read("type")?.trim() == "Instruction" {
+                return None;
+            }
+            Some(CacheLevel {
+                level: read("level")?.trim().parse().ok()?,
+                size: parse_cache_size(&read("size")?)?,
+                line_size: read("coherency_line_size")?.trim().parse().ok()?,
+            })
+        })
+        .collect::<Vec<_>>();
+    caches.sort_by_key(|cache| cache.level);
+    caches.dedup_by_key(|cache| cache.level);
+    caches
+}
+
+/// The data and unified caches of the performance cores, innermost level
+/// first.
+#[cfg(target_os = "macos")]
+pub fn host_data_caches() -> Vec<CacheLevel> {
+    let Some(line_size) = macos_sysctl_u64("hw.cachelinesize") else {
+        return Vec::new();
+    };
+    ["hw.l1dcachesize", "hw.l2cachesize", "hw.l3cachesize"]
+        .into_iter()
+        .zip(1..)
+        .map_while(|(name, level)| {
+            let size = macos_sysctl_u64(name).filter(|&size| size != 0)?;
+            Some(CacheLevel {
+                level,
+                size,
+                line_size: line_size as u32,
+            })
+        })
+        .collect()
+}
+
+/// The cache hierarchy is not detected on this platform.
+#[cfg(not(any(target_os = "linux", target_os = "macos")))]
+pub fn host_data_caches() -> Vec<CacheLevel> {
+    Vec::new()
+}
+
+#[cfg(target_os = "macos")]
+fn macos_sysctl_u64(name: &str) -> Option<u64> {
+    let name = std::ffi::CString::new(name).ok()?;
+    let mut value = 0_u64;
+    let mut len = std::mem::size_of::<u64>();
+    let result = unsafe {
+        libc::sysctlbyname(
+            name.as_ptr(),
+            (&mut value as *mut u64).cast(),
+            &mut len,
+            std::ptr::null_mut(),
+            0,
+        )
+    };
+    (result == 0).then_some(value)
+}
+
+/// Parses a sysfs cache size such as `"48K"` or `"2M"`.
+#[cfg_attr(not(target_os = "linux"), allow(dead_code))]
+fn parse_cache_size(size: &str) -> Option<u64> {
+    let size = size.trim();
+    let (digits, scale) = match size.as_bytes().last()? {
+        b'K' => (&size[..size.len() - 1], 1 << 10),
+        b'M' => (&size[..size.len() - 1], 1 << 20),
+        b'G' => (&size[..size.len() - 1], 1 << 30),
+        _ => (size, 1),
+    };
+    digits.parse::<u64>().ok().map(|value| value * scale)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::parse_cache_size;
+
+    #[test]
+    fn parses_sysfs_cache_sizes() {
+        assert_eq!(parse_cache_size("48K\n"), Some(48 * 1024));
+        assert_eq!(parse_cache_size("2M"), Some(2 * 1024 * 1024));
+        assert_eq!(parse_cache_size("512"), Some(512));
+        assert_eq!(parse_cache_size("K"), None);
+        assert_eq!(parse_cache_size(""), None);
+    }
+}
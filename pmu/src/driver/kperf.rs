@@ -2162,6 +2162,7 @@ fn emit_pending_sample(
             callstack: callstack.iter().copied().collect(),
             user_regs: None,
             user_stack: Vec::new(),
+            branches: Vec::new(),
         }));
     }
 }
@@ -51,6 +51,18 @@ pub struct UserRegs {
     pub values: Vec<u64>,
 }
 
+/// One taken branch of a last branch record.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct BranchRecord {
+    /// Address of the branch instruction.
+    pub from: u64,
+    /// Address the branch went to.
+    pub to: u64,
+    /// Core cycles since the previous taken branch, zero when the hardware
+    /// does not report them.
+    pub cycles: u16,
+}
+
 #[derive(Debug, Clone)]
 /// One counter value and its perf multiplexing scale.
 pub struct CounterValue {
@@ -176,6 +188,9 @@ pub struct Sample {
     pub user_regs: Option<UserRegs>,
     /// User stack bytes beginning at the sampled stack pointer.
     pub user_stack: Vec<u8>,
+    /// Taken branches leading up to the sample, the most recent first. Only
+    /// filled in when branch records were requested.
+    pub branches: Vec<BranchRecord>,
 }
 
 #[derive(Debug)]
@@ -210,6 +225,7 @@ pub struct SamplingDriverBuilder {
     unwind_mode: UnwindMode,
     stack_dump_size: u32,
     precise_ip: bool,
+    branch_records: bool,
 }
 
 impl<F: Fn(Record) + Send + Sync> SamplingCallback for F {
@@ -306,6 +322,7 @@ impl SamplingDriverBuilder {
             unwind_mode: UnwindMode::Dwarf,
             stack_dump_size: 8 * 1024,
             precise_ip: false,
+            branch_records: false,
         }
     }
 
@@ -363,6 +380,14 @@ impl SamplingDriverBuilder {
         self
     }
 
+    /// Records the most recent taken branches of user code with every sample,
+    /// from the Intel Last Branch Records on x86-64 Linux. LBR call stacks use
+    /// the same hardware, they are replaced by DWARF stacks.
+    pub fn branch_records(mut self) -> Self {
+        self.branch_records = true;
+        self
+    }
+
     /// Prefers raw CPU-family event encodings over generic perf aliases.
     pub fn prefer_raw_events(mut self) -> Self {
         self.prefer_raw_events = true;
@@ -374,9 +399,14 @@ impl SamplingDriverBuilder {
         cfg_if::cfg_if! {
             if #[cfg(target_os="linux")] {
                 if self.kind == DriverKind::Default || self.kind == DriverKind::Perf {
+                    let unwind_mode = if self.branch_records && self.unwind_mode == UnwindMode::Lbr {
+                        UnwindMode::Dwarf
+                    } else {
+                        self.unwind_mode
+                    };
                     let driver = sampling_with_fallback(
                         self.counters,
-                        self.unwind_mode,
+                        unwind_mode,
                         |counters, unwind_mode| PerfSamplingDriver::new(
                             counters,
                             self.sample_freq,
@@ -385,6 +415,7 @@ impl SamplingDriverBuilder {
                             unwind_mode,
                             self.stack_dump_size,
                             self.precise_ip,
+                            self.branch_records,
                         ),
                     )?;
                     return Ok(Box::new(driver));
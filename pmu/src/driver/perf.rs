@@ -14,10 +14,10 @@ use events::resolve_counter_for_family;
 use libc::{close, mmap, munmap, sysconf, MAP_FAILED, MAP_SHARED, PROT_READ, PROT_WRITE};
 use mmap::{EventValue, ReadFormat, Records};
 use perf_event_open_sys::bindings::{
-    perf_event_attr, PERF_SAMPLE_BRANCH_CALL_STACK, PERF_SAMPLE_BRANCH_STACK,
-    PERF_SAMPLE_BRANCH_USER, PERF_SAMPLE_CALLCHAIN, PERF_SAMPLE_CPU, PERF_SAMPLE_ID,
-    PERF_SAMPLE_IP, PERF_SAMPLE_READ, PERF_SAMPLE_REGS_USER, PERF_SAMPLE_STACK_USER,
-    PERF_SAMPLE_TID, PERF_SAMPLE_TIME,
+    perf_event_attr, PERF_SAMPLE_BRANCH_ANY, PERF_SAMPLE_BRANCH_CALL_STACK,
+    PERF_SAMPLE_BRANCH_STACK, PERF_SAMPLE_BRANCH_USER, PERF_SAMPLE_CALLCHAIN, PERF_SAMPLE_CPU,
+    PERF_SAMPLE_ID, PERF_SAMPLE_IP, PERF_SAMPLE_READ, PERF_SAMPLE_REGS_USER,
+    PERF_SAMPLE_STACK_USER, PERF_SAMPLE_TID, PERF_SAMPLE_TIME,
 };
 use perf_event_open_sys::{self as sys, bindings::PERF_SAMPLE_IDENTIFIER};
 use smallvec::SmallVec;
@@ -50,6 +50,9 @@ pub struct PerfSamplingDriver {
     enable_on_start: bool,
     sample_regs_user: u64,
     sample_branch_stack: bool,
+    /// The branch stack holds the last taken branches rather than a call
+    /// stack.
+    branch_records: bool,
 }
 
 #[derive(Debug, Clone)]
@@ -343,6 +346,7 @@ impl SamplingDriver for PerfSamplingDriver {
         let native_handles = self.native_handles.clone();
         let sample_regs_user = self.sample_regs_user;
         let sample_branch_stack = self.sample_branch_stack;
+        let branch_records = self.branch_records;
 
         #[derive(Clone, Default)]
         struct LastSample {
@@ -356,8 +360,12 @@ impl SamplingDriver for PerfSamplingDriver {
 
             loop {
                 for (idx, &mmap) in mmaps.iter().enumerate() {
-                    let records =
-                        Records::from_ptr(mmap.ptr, sample_regs_user, sample_branch_stack);
+                    let records = Records::from_ptr(
+                        mmap.ptr,
+                        sample_regs_user,
+                        sample_branch_stack,
+                        branch_records,
+                    );
 
                     for record in records.into_iter() {
                         match record {
@@ -373,10 +381,12 @@ impl SamplingDriver for PerfSamplingDriver {
                                 callstack,
                                 user_regs,
                                 user_stack,
+                                branches,
                             } => {
                                 let uid = uuid::Uuid::now_v7();
                                 let mut user_regs = user_regs;
                                 let mut user_stack = Some(user_stack);
+                                let mut branches = Some(branches);
 
                                 for value in values {
                                     let Some(handle) =
@@ -407,6 +417,7 @@ impl SamplingDriver for PerfSamplingDriver {
                                         // reuses its result for the sibling counter events.
                                         user_regs: user_regs.take(),
                                         user_stack: user_stack.take().unwrap_or_default(),
+                                        branches: branches.take().unwrap_or_default(),
                                     });
 
                                     last_samples_map.insert(
@@ -485,6 +496,7 @@ fn apply_sampling_flags(
     stack_dump_size: u32,
     enable_on_exec: bool,
     precise_ip: bool,
+    branch_records: bool,
 ) {
     attr.set_exclude_kernel(1);
     attr.set_exclude_user(0);
@@ -514,7 +526,10 @@ fn apply_sampling_flags(
             attr.sample_stack_user = stack_dump_size;
         }
     }
-    if unwind_mode == UnwindMode::Lbr && cfg!(target_arch = "x86_64") {
+    if branch_records {
+        sample_type |= PERF_SAMPLE_BRANCH_STACK as u64;
+        attr.branch_sample_type = (PERF_SAMPLE_BRANCH_ANY | PERF_SAMPLE_BRANCH_USER) as u64;
+    } else if unwind_mode == UnwindMode::Lbr && cfg!(target_arch = "x86_64") {
         sample_type |= PERF_SAMPLE_BRANCH_STACK as u64;
         attr.branch_sample_type = (PERF_SAMPLE_BRANCH_CALL_STACK | PERF_SAMPLE_BRANCH_USER) as u64;
     }
@@ -524,6 +539,7 @@ fn apply_sampling_flags(
 }
 
 impl PerfSamplingDriver {
+    #[allow(clippy::too_many_arguments)]
     pub fn new(
         counters: &[Counter],
         sample_freq: u64,
@@ -532,7 +548,11 @@ impl PerfSamplingDriver {
         unwind_mode: UnwindMode,
         stack_dump_size: u32,
         precise_ip: bool,
+        branch_records: bool,
     ) -> Result<PerfSamplingDriver, Error> {
+        // Last branch records only exist on x86-64.
+        let branch_records = branch_records && cfg!(target_arch = "x86_64");
+
         // On a heterogeneous (big.LITTLE) host, open a sampling group on each
         // cluster's PMU so the profile captures execution wherever the task
         // runs, not just on one cluster.
@@ -560,6 +580,7 @@ impl PerfSamplingDriver {
                 stack_dump_size,
                 pid.is_some(),
                 precise_ip,
+                branch_records,
             );
         }
 
@@ -574,7 +595,8 @@ impl PerfSamplingDriver {
         Self::from_handles(
             native_handles,
             dwarf_mask_for_mode(unwind_mode),
-            unwind_mode == UnwindMode::Lbr,
+            unwind_mode == UnwindMode::Lbr || branch_records,
+            branch_records,
             pid.is_none(),
         )
     }
@@ -611,6 +633,7 @@ impl PerfSamplingDriver {
                         stack_dump_size,
                         pid.is_some(),
                         precise_ip,
+                        false,
                     );
                     Ok(attr)
                 })
@@ -632,6 +655,7 @@ impl PerfSamplingDriver {
             native_handles,
             dwarf_mask_for_mode(unwind_mode),
             unwind_mode == UnwindMode::Lbr,
+            false,
             pid.is_none(),
         )
     }
@@ -641,6 +665,7 @@ impl PerfSamplingDriver {
         native_handles: Vec<NativeCounterHandle>,
         sample_regs_user: u64,
         sample_branch_stack: bool,
+        branch_records: bool,
         enable_on_start: bool,
     ) -> Result<PerfSamplingDriver, Error> {
         let page_size = unsafe { sysconf(libc::_SC_PAGE_SIZE) } as usize;
@@ -686,6 +711,7 @@ impl PerfSamplingDriver {
             thread_handle: None,
             sample_regs_user,
             sample_branch_stack,
+            branch_records,
             enable_on_start,
         })
     }
@@ -5,12 +5,14 @@ use perf_event_open_sys::bindings::{
 };
 use smallvec::{SmallVec, ToSmallVec};
 
-use crate::driver::UserRegs;
+use crate::driver::{BranchRecord, UserRegs};
 
 pub struct Records {
     metadata: *mut perf_event_mmap_page,
     sample_regs_user: u64,
     sample_branch_stack: bool,
+    /// The branch stack holds taken branches rather than an LBR call stack.
+    branch_records: bool,
 }
 
 #[repr(C)]
@@ -43,6 +45,7 @@ pub enum MmapRecord {
         callstack: SmallVec<[u64; 8]>,
         user_regs: Option<UserRegs>,
         user_stack: Vec<u8>,
+        branches: Vec<BranchRecord>,
     },
     Address {
         pid: u32,
@@ -87,11 +90,17 @@ struct ProcMmap {
 }
 
 impl Records {
-    pub fn from_ptr(ptr: *mut u8, sample_regs_user: u64, sample_branch_stack: bool) -> Records {
+    pub fn from_ptr(
+        ptr: *mut u8,
+        sample_regs_user: u64,
+        sample_branch_stack: bool,
+        branch_records: bool,
+    ) -> Records {
         Records {
             metadata: ptr as *mut perf_event_mmap_page,
             sample_regs_user,
             sample_branch_stack,
+            branch_records,
         }
     }
 
@@ -203,7 +212,10 @@ impl Iterator for Records {
                 Some(sample_format) => {
                     let values = sample_format.read_values(&record_buf);
                     let mut callstack = sample_format.read_callchain(&record_buf);
-                    if self.sample_branch_stack {
+                    let mut branches = Vec::new();
+                    if self.branch_records {
+                        branches = sample_format.read_branch_records(&record_buf);
+                    } else if self.sample_branch_stack {
                         let lbr_callstack = sample_format.read_branch_callstack(&record_buf);
                         if lbr_callstack.len() > 1 {
                             callstack = lbr_callstack;
@@ -227,6 +239,7 @@ impl Iterator for Records {
                         callstack,
                         user_regs,
                         user_stack,
+                        branches,
                     }
                 }
                 None => MmapRecord::Unknown,
@@ -352,6 +365,24 @@ impl SampleFormat {
         frames
     }
 
+    /// Taken branches of the branch stack, the most recent first.
+    fn read_branch_records(&self, record: &[u8]) -> Vec<BranchRecord> {
+        let (Some(base), Some(end)) = (self.callchain_end(record), self.branch_stack_end(record))
+        else {
+            return Vec::new();
+        };
+        (base + 8..end)
+            .step_by(std::mem::size_of::<BranchEntry>())
+            .map(|offset| BranchRecord {
+                from: read_u64(record, offset).unwrap_or_default(),
+                to: read_u64(record, offset + 8).unwrap_or_default(),
+                // The flags start with the mispredict, predicted, in_tx and
+                // abort bits, followed by 16 bits of cycles.
+                cycles: (read_u64(record, offset + 16).unwrap_or_default() >> 4) as u16,
+            })
+            .collect()
+    }
+
     fn read_user_state(
         &self,
         record: &[u8],
@@ -748,7 +779,7 @@ mod test {
             0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
         ];
 
-        let records = Records::from_ptr(test_data.as_mut_ptr(), 0, false);
+        let records = Records::from_ptr(test_data.as_mut_ptr(), 0, false, false);
         let decoded = records.into_iter().collect::<Vec<_>>();
 
         insta::assert_debug_snapshot!(decoded);
@@ -866,4 +897,61 @@ mod test {
         ]
         "###);
     }
+
+    #[test]
+    fn lbr_branch_records_fixture() {
+        use super::{ReadFormat, SampleFormat};
+        use crate::driver::BranchRecord;
+
+        let sample = SampleFormat {
+            header: perf_event_open_sys::bindings::perf_event_header::default(),
+            ip: 0x400123,
+            pid: 7,
+            tid: 8,
+            time: 9,
+            id: 10,
+            cpu: 11,
+            _res: 0,
+            read: ReadFormat {
+                nr: 0,
+                time_enabled: 12,
+                time_running: 13,
+            },
+        };
+        let sample_bytes = unsafe {
+            std::slice::from_raw_parts(
+                (&sample as *const SampleFormat).cast::<u8>(),
+                std::mem::size_of::<SampleFormat>(),
+            )
+        };
+        let mut bytes = sample_bytes.to_vec();
+        bytes.extend_from_slice(&1_u64.to_ne_bytes());
+        bytes.extend_from_slice(&0x400123_u64.to_ne_bytes());
+        bytes.extend_from_slice(&2_u64.to_ne_bytes());
+        // 12 cycles of a mispredicted branch, then 3 cycles of a predicted one.
+        for (from, to, flags) in [
+            (0x400110_u64, 0x400100_u64, (12_u64 << 4) | 1),
+            (0x4000f0, 0x400040, (3 << 4) | 2),
+        ] {
+            bytes.extend_from_slice(&from.to_ne_bytes());
+            bytes.extend_from_slice(&to.to_ne_bytes());
+            bytes.extend_from_slice(&flags.to_ne_bytes());
+        }
+
+        assert_eq!(
+            sample.read_branch_records(&bytes),
+            [
+                BranchRecord {
+                    from: 0x400110,
+                    to: 0x400100,
+                    cycles: 12,
+                },
+                BranchRecord {
+                    from: 0x4000f0,
+                    to: 0x400040,
+                    cycles: 3,
+                },
+            ]
+        );
+    }
 }
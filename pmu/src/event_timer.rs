@@ -235,8 +235,8 @@ pub struct EventTimer {
     _thread_bound: PhantomData<Rc<()>>,
 }
 
-/// Opaque starting snapshot used by feature-gated measurement integrations.
-#[cfg(feature = "criterion")]
+/// Opaque starting snapshot of an [`EventTimer`], for measurements whose begin
+/// and end are not in the same scope.
 pub struct CounterCheckpoint {
     start: backend::Snapshot,
     wall_start: Instant,
@@ -290,16 +290,16 @@ impl EventTimer {
         })
     }
 
-    #[cfg(feature = "criterion")]
-    pub(crate) fn checkpoint(&self) -> Result<CounterCheckpoint, Error> {
+    /// Begins a measurement that is finished by [`EventTimer::since`].
+    pub fn checkpoint(&self) -> Result<CounterCheckpoint, Error> {
         Ok(CounterCheckpoint {
             start: self.backend.snapshot()?,
             wall_start: Instant::now(),
         })
     }
 
-    #[cfg(feature = "criterion")]
-    pub(crate) fn since(&self, checkpoint: CounterCheckpoint) -> Result<Measurements, Error> {
+    /// Returns the counter deltas since `checkpoint` was taken by this timer.
+    pub fn since(&self, checkpoint: CounterCheckpoint) -> Result<Measurements, Error> {
         finish_measurement(
             &self.counters,
             &self.backend,
@@ -4,6 +4,7 @@
 //! [`EventTimer`] measures focused scopes, while [`QuickSampler`] records a
 //! closure into memory without the profiler's file or dispatcher machinery.
 
+mod cache_topology;
 mod capabilities;
 mod cpu_family;
 #[cfg(feature = "criterion")]
@@ -12,27 +13,28 @@ mod driver;
 mod event_timer;
 mod process;
 mod quick;
+mod time_counter;
 
+pub use cache_topology::{host_data_caches, CacheLevel};
 pub use capabilities::{capabilities, Capabilities};
 pub use cpu_family::{host_cpu_description, host_metrics};
 #[cfg(feature = "criterion")]
 pub use criterion_measurement::CriterionCounter;
 pub use driver::{
-    list_supported_counters, CoreId, CounterEntry, CounterResult, CounterValue, CountingDriver,
-    CountingDriverBuilder, DriverKind, MeasurementQuality, Record, Sample, SamplingDriver,
-    SamplingDriverBuilder, UnwindMode, UserRegs,
+    list_supported_counters, BranchRecord, CoreId, CounterEntry, CounterResult, CounterValue,
+    CountingDriver, CountingDriverBuilder, DriverKind, MeasurementQuality, Record, Sample,
+    SamplingDriver, SamplingDriverBuilder, UnwindMode, UserRegs,
 };
-#[cfg(feature = "criterion")]
-pub use event_timer::CounterCheckpoint;
 pub use event_timer::{
-    CounterStatistics, EventTimer, Measurement, MeasurementSpan, MeasurementStatistics,
-    Measurements, ReadCost, ReadMethod,
+    CounterCheckpoint, CounterStatistics, EventTimer, Measurement, MeasurementSpan,
+    MeasurementStatistics, Measurements, ReadCost, ReadMethod,
 };
 pub use pmu_data::{Metric, MetricError, MetricExpression};
 pub use process::Process;
 #[cfg(feature = "symbolize")]
 pub use quick::{top_symbols, SymbolCount};
 pub use quick::{QuickSampler, SampleBatch};
+pub use time_counter::host_time_counter_frequency;
 
 /// Returns the top-down analysis scenario for the detected host CPU, if one is defined.
 pub fn host_tma_scenario() -> Option<pmu_data::TmaScenario> {
@@ -300,6 +300,7 @@ mod tests {
             callstack: Default::default(),
             user_regs: None,
             user_stack: Vec::new(),
+            branches: Vec::new(),
         }
     }
 
@@ -0,0 +1,120 @@
+/// Frequency in hertz of the counter the kernel converts perf time from, the
+/// TSC on x86-64 and `cntvct_el0` on AArch64, as the kernel's own
+/// `time_mult` and `time_shift` give it in the perf mmap page. Returns `None`
+/// when the kernel does not let user space convert the counter, for example
+/// because the TSC is not its clock source.
+#[cfg(all(
+    target_os = "linux",
+    any(target_arch = "x86_64", target_arch = "aarch64")
+))]
+pub fn host_time_counter_frequency() -> Option<u64> {
+    use std::sync::atomic::{fence, Ordering};
+
+    use perf_event_open_sys::bindings::{perf_event_attr, perf_event_mmap_page};
+    use perf_event_open_sys::{self as sys};
+
+    let page_size = unsafe { libc::sysconf(libc::_SC_PAGE_SIZE) };
+    if page_size <= 0 {
+        return None;
+    }
+    let map_len = page_size as usize;
+
+    // The dummy event counts nothing, it only exists for its metadata page.
+    let mut attr = perf_event_attr::default();
+    attr.size = std::mem::size_of::<perf_event_attr>() as u32;
+    attr.type_ = sys::bindings::PERF_TYPE_SOFTWARE;
+    attr.config = sys::bindings::PERF_COUNT_SW_DUMMY as u64;
+    attr.set_disabled(1);
+    attr.set_exclude_kernel(1);
+    attr.set_exclude_hv(1);
+    let fd = unsafe { sys::perf_event_open(&mut attr, 0, -1, -1, 0) };
+    if fd < 0 {
+        return None;
+    }
+
+    let ptr = unsafe {
+        libc::mmap(
+            std::ptr::null_mut(),
+            map_len,
+            libc::PROT_READ,
+            libc::MAP_SHARED,
+            fd,
+            0,
+        )
+    };
+    if ptr == libc::MAP_FAILED {
+        unsafe { libc::close(fd) };
+        return None;
+    }
+
+    let page = ptr as *const perf_event_mmap_page;
+    let conversion = unsafe {
+        loop {
+            let sequence = std::ptr::read_volatile(std::ptr::addr_of!((*page).lock));
+            fence(Ordering::Acquire);
+            if sequence & 1 != 0 {
+                std::hint::spin_loop();
+                continue;
+            }
+            let capabilities = (*page).__bindgen_anon_1.__bindgen_anon_1;
+            let time_shift = std::ptr::read_volatile(std::ptr::addr_of!((*page).time_shift));
+            let time_mult = std::ptr::read_volatile(std::ptr::addr_of!((*page).time_mult));
+            fence(Ordering::Acquire);
+            if std::ptr::read_volatile(std::ptr::addr_of!((*page).lock)) == sequence {
+                break (capabilities.cap_user_time() != 0).then_some((time_mult, time_shift));
+            }
+        }
+    };
+
+    unsafe {
+        libc::munmap(ptr, map_len);
+        libc::close(fd);
+    }
+
+    let (mult, shift) = conversion?;
+    frequency_from_conversion(mult, shift)
+}
+
+/// The perf time counter is not exposed to user space on this platform.
+#[cfg(not(all(
+    target_os = "linux",
+    any(target_arch = "x86_64", target_arch = "aarch64")
+)))]
+pub fn host_time_counter_frequency() -> Option<u64> {
+    None
+}
+
+/// perf time advances by `(ticks * mult) >> shift` nanoseconds.
+#[cfg_attr(
+    not(all(
+        target_os = "linux",
+        any(target_arch = "x86_64", target_arch = "aarch64")
+    )),
+    allow(dead_code)
+)]
+fn frequency_from_conversion(mult: u32, shift: u16) -> Option<u64> {
+    if mult == 0 || shift >= 64 {
+        return None;
+    }
+    let frequency = (1_000_000_000_u128 << shift) / u128::from(mult);
+    u64::try_from(frequency)
+        .ok()
+        .filter(|&frequency| frequency > 0)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::frequency_from_conversion;
+
+    #[test]
+    fn frequency_inverts_the_kernel_conversion() {
+        // A 3 GHz counter is a third of a nanosecond per tick.
+        let shift = 31;
+        let mult = ((1_u64 << shift) / 3) as u32;
+        let frequency = frequency_from_conversion(mult, shift).unwrap();
+        assert!(frequency.abs_diff(3_000_000_000) < 10);
+
+        assert_eq!(frequency_from_conversion(0, shift), None);
+        assert_eq!(frequency_from_conversion(mult, 64), None);
+    }
+}
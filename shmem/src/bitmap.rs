@@ -0,0 +1,101 @@
+use std::{
+    io::Error,
+    sync::atomic::{AtomicU64, Ordering},
+};
+
+use crate::platform;
+
+/// A fixed-size bitmap in shared memory. Bits can be flipped by any process
+/// that has the segment open and are observed by the others without further
+/// synchronization.
+pub struct SharedBitmap {
+    shmem: platform::Shmem,
+    words: usize,
+}
+
+impl SharedBitmap {
+    /// Creates a bitmap of at least `bits` bits, all of them set.
+    pub fn create(name: &str, bits: usize) -> Result<Self, Error> {
+        let words = bits.div_ceil(64);
+        let shmem = platform::Shmem::create(name, Self::size(words))?;
+        let bitmap = Self { shmem, words };
+        for word in bitmap.words() {
+            word.store(u64::MAX, Ordering::Relaxed);
+        }
+        Ok(bitmap)
+    }
+
+    pub fn open(name: &str, bits: usize) -> Result<Self, Error> {
+        let words = bits.div_ceil(64);
+        let shmem = platform::Shmem::open(name, Self::size(words))?;
+        Ok(Self { shmem, words })
+    }
+
+    pub fn len(&self) -> usize {
+        self.words * 64
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.words == 0
+    }
+
+    /// Bits past the end of the bitmap read as set.
+    pub fn get(&self, index: usize) -> bool {
+        match self.words().get(index / 64) {
+            Some(word) => word.load(Ordering::Relaxed) & (1 << (index % 64)) != 0,
+            None => true,
+        }
+    }
+
+    /// Returns false if `index` is past the end of the bitmap.
+    pub fn set(&self, index: usize, value: bool) -> bool {
+        let Some(word) = self.words().get(index / 64) else {
+            return false;
+        };
+
+        let mask = 1 << (index % 64);
+        if value {
+            word.fetch_or(mask, Ordering::Relaxed);
+        } else {
+            word.fetch_and(!mask, Ordering::Relaxed);
+        }
+        true
+    }
+
+    fn size(words: usize) -> usize {
+        words.max(1) * std::mem::size_of::<u64>()
+    }
+
+    fn words(&self) -> &[AtomicU64] {
+        // The mapping is page aligned and outlives the returned slice.
+        unsafe { std::slice::from_raw_parts(self.shmem.as_ptr() as *const AtomicU64, self.words) }
+    }
+}
+
+unsafe impl Send for SharedBitmap {}
+unsafe impl Sync for SharedBitmap {}
+
+#[cfg(test)]
+mod tests {
+    use super::SharedBitmap;
+
+    #[test]
+    fn bits_are_shared_between_mappings() {
+        let name = format!("/shared_bitmap_{}", std::process::id());
+        let owner = SharedBitmap::create(&name, 100).expect("failed to create bitmap");
+        let other = SharedBitmap::open(&name, 100).expect("failed to open bitmap");
+
+        assert_eq!(owner.len(), 128);
+        assert!(other.get(70));
+
+        assert!(owner.set(70, false));
+        assert!(!other.get(70));
+        assert!(other.get(71));
+
+        assert!(other.set(70, true));
+        assert!(owner.get(70));
+
+        assert!(!owner.set(128, false));
+        assert!(owner.get(128));
+    }
+}
@@ -1,6 +1,7 @@
 mod posix;
 mod utils;
 
+pub mod bitmap;
 pub mod proc_channel;
 
 pub mod platform {
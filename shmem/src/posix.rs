@@ -50,6 +50,14 @@ impl Shmem {
         })
     }
 
+    /// Opens an existing shared memory object and unlinks it on drop, taking
+    /// over the cleanup from the process that created it.
+    pub fn adopt(name: &str, size: usize) -> Result<Self, std::io::Error> {
+        let mut shmem = Self::open(name, size)?;
+        shmem.is_owning = true;
+        Ok(shmem)
+    }
+
     pub fn name(&self) -> &str {
         &self.name
     }
@@ -168,6 +176,22 @@ impl Semaphore {
         })
     }
 
+    /// Opens an existing semaphore and destroys it on drop.
+    #[cfg(not(target_os = "macos"))]
+    pub fn adopt(ptr: *mut (), name: &str) -> Result<Self, std::io::Error> {
+        let mut sem = Self::open(ptr, name)?;
+        sem.is_owning = true;
+        Ok(sem)
+    }
+
+    /// Opens an existing semaphore and unlinks it on drop.
+    #[cfg(target_os = "macos")]
+    pub fn adopt(ptr: *mut (), name: &str) -> Result<Self, std::io::Error> {
+        let mut sem = Self::open(ptr, name)?;
+        sem.name = Some(CString::new(name)?);
+        Ok(sem)
+    }
+
     #[cfg(not(target_os = "macos"))]
     pub fn required_size() -> usize {
         std::mem::size_of::<libc::sem_t>()
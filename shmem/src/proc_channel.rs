@@ -32,6 +32,17 @@ pub struct DropEvent {
     pub total: usize,
 }
 
+/// How an endpoint gets hold of the channel state.
+#[derive(Clone, Copy, PartialEq, Eq)]
+enum Mode {
+    /// Initializes a new channel.
+    Create,
+    /// Joins a live channel.
+    Attach,
+    /// Joins a live channel and destroys it when dropped.
+    Adopt,
+}
+
 struct Inner {
     shmem: platform::Shmem,
     sem: platform::Semaphore,
@@ -64,7 +75,7 @@ impl Inner {
         Self::data_offset() + data_size
     }
 
-    fn new(shmem: platform::Shmem, data_size: usize, init: bool) -> Result<Self, Error> {
+    fn new(shmem: platform::Shmem, data_size: usize, mode: Mode) -> Result<Self, Error> {
         if !data_size.is_power_of_two() || data_size < 2 * std::mem::size_of::<usize>() {
             return Err(Error::new(
                 ErrorKind::InvalidInput,
@@ -74,31 +85,20 @@ impl Inner {
 
         let sem_name = Self::semaphore_name(shmem.name(), 'r');
         let finish_sem_name = Self::semaphore_name(shmem.name(), 'f');
-        let (sem, finish_sem) = if init {
-            (
-                platform::Semaphore::create(shmem.as_mut_ptr(), &sem_name)?,
-                platform::Semaphore::create(
-                    unsafe {
-                        shmem
-                            .as_mut_ptr()
-                            .byte_add(platform::Semaphore::required_size())
-                    },
-                    &finish_sem_name,
-                )?,
-            )
-        } else {
-            (
-                platform::Semaphore::open(shmem.as_mut_ptr(), &sem_name)?,
-                platform::Semaphore::open(
-                    unsafe {
-                        shmem
-                            .as_mut_ptr()
-                            .byte_add(platform::Semaphore::required_size())
-                    },
-                    &finish_sem_name,
-                )?,
-            )
+        let open_semaphore = match mode {
+            Mode::Create => platform::Semaphore::create,
+            Mode::Attach => platform::Semaphore::open,
+            Mode::Adopt => platform::Semaphore::adopt,
         };
+        let sem = open_semaphore(shmem.as_mut_ptr(), &sem_name)?;
+        let finish_sem = open_semaphore(
+            unsafe {
+                shmem
+                    .as_mut_ptr()
+                    .byte_add(platform::Semaphore::required_size())
+            },
+            &finish_sem_name,
+        )?;
 
         let sem_size = 2 * platform::Semaphore::required_size();
         let ptr = unsafe { shmem.as_mut_ptr().byte_add(Self::data_offset()) };
@@ -117,7 +117,7 @@ impl Inner {
         };
 
         // Attaching must not reset live channel state.
-        if init {
+        if mode == Mode::Create {
             unsafe {
                 AtomicUsize::from_ptr(head).store(0, Ordering::Relaxed);
                 AtomicUsize::from_ptr(tail).store(0, Ordering::Relaxed);
@@ -188,7 +188,7 @@ impl<T: Sendable> Sender<T> {
     pub fn new(name: &str, data_size: usize) -> Result<Self, Error> {
         let shmem = platform::Shmem::create(name, Inner::compute_size(data_size))?;
         Ok(Self {
-            inner: Inner::new(shmem, data_size, true)?,
+            inner: Inner::new(shmem, data_size, Mode::Create)?,
             phantom: PhantomData,
         })
     }
@@ -196,7 +196,7 @@ impl<T: Sendable> Sender<T> {
     pub fn attach(name: &str, data_size: usize) -> Result<Self, Error> {
         let shmem = platform::Shmem::open(name, Inner::compute_size(data_size))?;
         Ok(Self {
-            inner: Inner::new(shmem, data_size, false)?,
+            inner: Inner::new(shmem, data_size, Mode::Attach)?,
             phantom: PhantomData,
         })
     }
@@ -264,7 +264,7 @@ impl<T: Sendable> Receiver<T> {
     pub fn attach(name: &str, data_size: usize) -> Result<Self, Error> {
         let shmem = platform::Shmem::open(name, Inner::compute_size(data_size))?;
         Ok(Self {
-            inner: Inner::new(shmem, data_size, false)?,
+            inner: Inner::new(shmem, data_size, Mode::Attach)?,
             phantom: PhantomData,
         })
     }
@@ -272,7 +272,17 @@ impl<T: Sendable> Receiver<T> {
     pub fn new(name: &str, data_size: usize) -> Result<Self, Error> {
         let shmem = platform::Shmem::create(name, Inner::compute_size(data_size))?;
         Ok(Self {
-            inner: Inner::new(shmem, data_size, true)?,
+            inner: Inner::new(shmem, data_size, Mode::Create)?,
+            phantom: PhantomData,
+        })
+    }
+
+    /// Attaches to a channel created by its sender and destroys the channel
+    /// when dropped, so the sender may exit without cleaning it up.
+    pub fn adopt(name: &str, data_size: usize) -> Result<Self, Error> {
+        let shmem = platform::Shmem::adopt(name, Inner::compute_size(data_size))?;
+        Ok(Self {
+            inner: Inner::new(shmem, data_size, Mode::Adopt)?,
             phantom: PhantomData,
         })
     }
@@ -295,6 +305,21 @@ impl<T: Sendable> Receiver<T> {
         self.read_one()
     }
 
+    /// Returns the next message without waiting for one.
+    pub fn try_recv(&self) -> Option<T> {
+        self.inner.sem.try_wait().ok()?;
+        self.read_one()
+    }
+
+    /// The sender has closed the channel. Messages sent before that may still
+    /// be queued.
+    pub fn is_closed(&self) -> bool {
+        self.inner
+            .finish_sem
+            .counter()
+            .is_ok_and(|counter| counter > 0)
+    }
+
     pub fn empty(&self) -> bool {
         self.inner.head().load(Ordering::Relaxed) == self.inner.tail().load(Ordering::Acquire)
     }
@@ -431,6 +456,21 @@ mod tests {
         assert_eq!(receiver.recv_sync(), Some(2));
     }
 
+    #[test]
+    fn adopted_channel_reports_its_sender_closing() {
+        let name = name("adopt");
+        let sender = Sender::<u64>::new(&name, 64).unwrap();
+        let receiver = Receiver::<u64>::adopt(&name, 64).unwrap();
+        assert_eq!(receiver.try_recv(), None);
+        sender.send_sync(7).unwrap();
+        assert!(!receiver.is_closed());
+
+        sender.close().unwrap();
+        assert!(receiver.is_closed());
+        assert_eq!(receiver.try_recv(), Some(7));
+        assert_eq!(receiver.try_recv(), None);
+    }
+
     #[test]
     fn concurrent_spsc_stress_preserves_order() {
         const COUNT: usize = 100_000;
@@ -1,10 +1,18 @@
-use std::{env, path::PathBuf, process::Command};
+use std::{
+    env,
+    path::{Path, PathBuf},
+    process::Command,
+};
 
 fn main() {
     println!("cargo:rerun-if-changed=fixtures/duty_split.c");
     println!("cargo:rerun-if-changed=fixtures/known_sleeper.c");
     println!("cargo:rerun-if-changed=fixtures/pointer_chase.c");
     println!("cargo:rerun-if-changed=fixtures/branch_heavy.c");
+    println!("cargo:rerun-if-changed=fixtures/roofline_kernels.c");
+    println!("cargo:rerun-if-env-changed=TRUTH_ROOFLINE_PLUGIN");
+    println!("cargo:rerun-if-env-changed=TRUTH_ROOFLINE_COLLECTOR_DIR");
+    println!("cargo:rerun-if-env-changed=TRUTH_CLANG");
 
     let out_dir = PathBuf::from(env::var_os("OUT_DIR").expect("Cargo must set OUT_DIR"));
     let compiler = env::var_os("CC").unwrap_or_else(|| "cc".into());
@@ -15,6 +23,7 @@ fn main() {
         ("fixtures/known_sleeper.c", "known_sleeper"),
         ("fixtures/pointer_chase.c", "pointer_chase"),
         ("fixtures/branch_heavy.c", "branch_heavy"),
+        ("fixtures/roofline_kernels.c", "roofline_kernels"),
     ] {
         for (suffix, frame_pointer_flag) in [
             ("fp", "-fno-omit-frame-pointer"),
@@ -52,4 +61,44 @@ fn main() {
             println!("cargo:rustc-env={env_name}={}", output.display());
         }
     }
+
+    build_instrumented_roofline_kernels(&out_dir);
+}
+
+/// Builds `roofline_kernels` with the miniperf Clang plugin when
+/// `TRUTH_ROOFLINE_PLUGIN` points at it and `TRUTH_ROOFLINE_COLLECTOR_DIR` at
+/// the directory holding `libcollector`. The roofline truth test is skipped
+/// without them, since neither is a Cargo artifact of this crate.
+fn build_instrumented_roofline_kernels(out_dir: &Path) {
+    let (Some(plugin), Some(collector_dir)) = (
+        env::var_os("TRUTH_ROOFLINE_PLUGIN"),
+        env::var_os("TRUTH_ROOFLINE_COLLECTOR_DIR"),
+    ) else {
+        return;
+    };
+    let clang = env::var_os("TRUTH_CLANG").unwrap_or_else(|| "clang".into());
+    let collector_dir = PathBuf::from(collector_dir);
+    let output = out_dir.join("roofline_kernels-instrumented");
+
+    let mut command = Command::new(&clang);
+    command
+        .args(["-O2", "-g", "-Wall", "-Wextra", "-Werror", "-fno-inline"])
+        .arg(format!("-fpass-plugin={}", PathBuf::from(plugin).display()))
+        .args(["fixtures/roofline_kernels.c", "-o"])
+        .arg(&output)
+        .arg("-L")
+        .arg(&collector_dir)
+        .arg("-lcollector")
+        .arg(format!("-Wl,-rpath,{}", collector_dir.display()));
+    let status = command
+        .status()
+        .unwrap_or_else(|error| panic!("failed to run {:?}: {error}", clang));
+    assert!(
+        status.success(),
+        "failed to build the instrumented roofline_kernels fixture"
+    );
+    println!(
+        "cargo:rustc-env=TRUTH_ROOFLINE_KERNELS_INSTRUMENTED={}",
+        output.display()
+    );
 }
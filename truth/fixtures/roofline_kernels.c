@@ -0,0 +1,186 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Roofline ground-truth fixture: every kernel keeps its work in one
+ * outermost loop with analytically known FLOP and byte counts per call.
+ * The sizes are mirrored by `ROOFLINE_KERNELS` in src/lib.rs. */
+
+#define STREAM_N (1u << 22)
+#define DGEMM_N 256u
+#define DGEMM_BLOCK 32u
+#define STENCIL_N 128u
+#define SPMV_ROWS (1u << 16)
+#define SPMV_ROW_NNZ 16u
+#define MEMCPY_CHUNK 4096u
+#define MEMCPY_CHUNKS 8192u
+#define REPETITIONS 3
+
+#if defined(__clang__)
+/* Keeps the copy loop a loop instead of a single memcpy call. */
+#define NO_BUILTIN_MEMCPY __attribute__((no_builtin("memcpy")))
+/* Keeps the loads of the register blocked reduction as written. */
+#define NO_UNROLL _Pragma("clang loop unroll(disable) vectorize(disable)")
+#else
+#define NO_BUILTIN_MEMCPY
+#define NO_UNROLL
+#endif
+
+static volatile double sink;
+
+/* 0 FLOPs and 16 bytes per element. */
+__attribute__((noinline)) NO_BUILTIN_MEMCPY void
+stream_copy(double *restrict c, const double *restrict a, size_t n) {
+    for (size_t i = 0; i < n; ++i)
+        c[i] = a[i];
+}
+
+/* 2 FLOPs and 24 bytes per element. */
+__attribute__((noinline)) void stream_triad(double *restrict a,
+                                            const double *restrict b,
+                                            const double *restrict c,
+                                            double scalar, size_t n) {
+    for (size_t i = 0; i < n; ++i)
+        a[i] = b[i] + scalar * c[i];
+}
+
+/* 2 FLOPs and 16 bytes per multiply-add, plus a load and a store of the
+ * output element per block of the reduction. */
+__attribute__((noinline)) void dgemm_blocked(double *restrict c,
+                                             const double *restrict a,
+                                             const double *restrict b,
+                                             size_t n) {
+    for (size_t ii = 0; ii < n; ii += DGEMM_BLOCK)
+        for (size_t kk = 0; kk < n; kk += DGEMM_BLOCK)
+            for (size_t jj = 0; jj < n; jj += DGEMM_BLOCK)
+                for (size_t i = ii; i < ii + DGEMM_BLOCK; ++i)
+                    for (size_t j = jj; j < jj + DGEMM_BLOCK; ++j) {
+                        double sum = c[i * n + j];
+                        NO_UNROLL
+                        for (size_t k = kk; k < kk + DGEMM_BLOCK; ++k)
+                            sum += a[i * n + k] * b[k * n + j];
+                        c[i * n + j] = sum;
+                    }
+}
+
+/* 8 FLOPs, 7 loads and a store per interior point. */
+__attribute__((noinline)) void stencil_7point(double *restrict out,
+                                              const double *restrict in,
+                                              size_t n) {
+    const size_t plane = n * n;
+    for (size_t z = 1; z + 1 < n; ++z)
+        for (size_t y = 1; y + 1 < n; ++y)
+            for (size_t x = 1; x + 1 < n; ++x) {
+                size_t c = z * plane + y * n + x;
+                out[c] = 0.4 * in[c] +
+                         0.1 * (in[c - 1] + in[c + 1] + in[c - n] +
+                                in[c + n] + in[c - plane] + in[c + plane]);
+            }
+}
+
+/* 2 FLOPs and 20 bytes per non-zero, 16 bytes of row bounds and output per
+ * row. */
+__attribute__((noinline)) void
+spmv_gather(double *restrict y, const uint32_t *restrict row_start,
+            const uint32_t *restrict columns, const double *restrict values,
+            const double *restrict x, size_t rows) {
+    for (size_t row = 0; row < rows; ++row) {
+        double sum = 0.0;
+        for (uint32_t k = row_start[row]; k < row_start[row + 1]; ++k)
+            sum += values[k] * x[columns[k]];
+        y[row] = sum;
+    }
+}
+
+/* 0 FLOPs, the chunk is read and written, plus the 4 byte chunk index. The
+ * scattered destination keeps the loop from becoming a single memcpy. */
+__attribute__((noinline)) void memcpy_chunks(char *restrict dst,
+                                             const char *restrict src,
+                                             const uint32_t *restrict order,
+                                             size_t chunks) {
+    for (size_t i = 0; i < chunks; ++i)
+        memcpy(dst + (size_t)order[i] * MEMCPY_CHUNK, src + i * MEMCPY_CHUNK,
+               MEMCPY_CHUNK);
+}
+
+static void *checked_calloc(size_t count, size_t size) {
+    void *memory = calloc(count, size);
+    if (!memory) {
+        perror("calloc");
+        exit(2);
+    }
+    return memory;
+}
+
+static uint32_t next_random(uint32_t *state) {
+    *state = *state * 1664525u + 1013904223u;
+    return *state >> 8;
+}
+
+int main(void) {
+    uint32_t state = 1;
+
+    double *a = checked_calloc(STREAM_N, sizeof(double));
+    double *b = checked_calloc(STREAM_N, sizeof(double));
+    double *c = checked_calloc(STREAM_N, sizeof(double));
+    for (size_t i = 0; i < STREAM_N; ++i)
+        a[i] = b[i] = (double)(i & 1023);
+
+    const size_t dgemm_elements = (size_t)DGEMM_N * DGEMM_N;
+    double *ma = checked_calloc(dgemm_elements, sizeof(double));
+    double *mb = checked_calloc(dgemm_elements, sizeof(double));
+    double *mc = checked_calloc(dgemm_elements, sizeof(double));
+    for (size_t i = 0; i < dgemm_elements; ++i)
+        ma[i] = mb[i] = 1.0 / (double)(1 + (i & 63));
+
+    const size_t grid = (size_t)STENCIL_N * STENCIL_N * STENCIL_N;
+    double *in = checked_calloc(grid, sizeof(double));
+    double *out = checked_calloc(grid, sizeof(double));
+    for (size_t i = 0; i < grid; ++i)
+        in[i] = (double)(i % 17);
+
+    const size_t nnz = (size_t)SPMV_ROWS * SPMV_ROW_NNZ;
+    uint32_t *row_start = checked_calloc(SPMV_ROWS + 1, sizeof(uint32_t));
+    uint32_t *columns = checked_calloc(nnz, sizeof(uint32_t));
+    double *values = checked_calloc(nnz, sizeof(double));
+    double *x = checked_calloc(SPMV_ROWS, sizeof(double));
+    double *y = checked_calloc(SPMV_ROWS, sizeof(double));
+    for (size_t row = 0; row <= SPMV_ROWS; ++row)
+        row_start[row] = (uint32_t)(row * SPMV_ROW_NNZ);
+    for (size_t k = 0; k < nnz; ++k) {
+        columns[k] = next_random(&state) % SPMV_ROWS;
+        values[k] = 0.5;
+    }
+    for (size_t row = 0; row < SPMV_ROWS; ++row)
+        x[row] = (double)row;
+
+    const size_t copy_bytes = (size_t)MEMCPY_CHUNK * MEMCPY_CHUNKS;
+    char *src = checked_calloc(copy_bytes, 1);
+    char *dst = checked_calloc(copy_bytes, 1);
+    uint32_t *order = checked_calloc(MEMCPY_CHUNKS, sizeof(uint32_t));
+    for (uint32_t i = 0; i < MEMCPY_CHUNKS; ++i)
+        order[i] = i;
+    for (uint32_t i = MEMCPY_CHUNKS - 1; i > 0; --i) {
+        uint32_t j = next_random(&state) % (i + 1);
+        uint32_t swap = order[i];
+        order[i] = order[j];
+        order[j] = swap;
+    }
+    memset(src, 7, copy_bytes);
+
+    for (int repetition = 0; repetition < REPETITIONS; ++repetition) {
+        stream_copy(c, a, STREAM_N);
+        stream_triad(a, b, c, 3.0, STREAM_N);
+        dgemm_blocked(mc, ma, mb, DGEMM_N);
+        stencil_7point(out, in, STENCIL_N);
+        spmv_gather(y, row_start, columns, values, x, SPMV_ROWS);
+        memcpy_chunks(dst, src, order, MEMCPY_CHUNKS);
+    }
+
+    sink = a[STREAM_N - 1] + mc[dgemm_elements / 2] + out[grid / 2] +
+           y[SPMV_ROWS / 3] + dst[copy_bytes / 2];
+    printf("roofline checksum: %.3f\n", sink);
+    return 0;
+}
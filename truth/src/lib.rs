@@ -32,6 +32,96 @@ pub fn assert_f6_1_duty_split(duty_60: u64, duty_40: u64) {
     }
 }
 
+/// Analytic work of one `roofline_kernels` function per call, counted the way
+/// the Clang plugin counts it: double-precision ops per element and the bytes
+/// of every load and store issued by the outermost loop.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct RooflineKernel {
+    pub function: &'static str,
+    pub flops: u64,
+    pub bytes: u64,
+}
+
+const STREAM_N: u64 = 1 << 22;
+const DGEMM_N: u64 = 256;
+const DGEMM_BLOCK: u64 = 32;
+const STENCIL_INTERIOR: u64 = 126 * 126 * 126;
+const SPMV_ROWS: u64 = 1 << 16;
+const SPMV_NNZ: u64 = SPMV_ROWS * 16;
+const MEMCPY_CHUNK: u64 = 4096;
+const MEMCPY_CHUNKS: u64 = 8192;
+
+/// 14-ROOFLINE's expected work per kernel call, mirroring the sizes in
+/// `fixtures/roofline_kernels.c`.
+pub const ROOFLINE_KERNELS: [RooflineKernel; 6] = [
+    RooflineKernel {
+        function: "stream_copy",
+        flops: 0,
+        bytes: 16 * STREAM_N,
+    },
+    RooflineKernel {
+        function: "stream_triad",
+        flops: 2 * STREAM_N,
+        bytes: 24 * STREAM_N,
+    },
+    RooflineKernel {
+        function: "dgemm_blocked",
+        flops: 2 * DGEMM_N * DGEMM_N * DGEMM_N,
+        bytes: 16 * DGEMM_N * DGEMM_N * DGEMM_N + 16 * DGEMM_N * DGEMM_N * (DGEMM_N / DGEMM_BLOCK),
+    },
+    RooflineKernel {
+        function: "stencil_7point",
+        flops: 8 * STENCIL_INTERIOR,
+        bytes: 64 * STENCIL_INTERIOR,
+    },
+    RooflineKernel {
+        function: "spmv_gather",
+        flops: 2 * SPMV_NNZ,
+        bytes: 20 * SPMV_NNZ + 16 * SPMV_ROWS,
+    },
+    RooflineKernel {
+        function: "memcpy_chunks",
+        flops: 0,
+        bytes: (2 * MEMCPY_CHUNK + 4) * MEMCPY_CHUNKS,
+    },
+];
+/// 14-ROOFLINE's allowed relative error of the FLOP and byte counts. It
+/// absorbs loads the optimizer is free to keep in registers, such as the
+/// shared row bound of neighbouring SpMV rows.
+pub const ROOFLINE_TOLERANCE: f64 = 0.05;
+/// 14-ROOFLINE's budget for the time of an instrumented kernel call over an
+/// uninstrumented one.
+pub const ROOFLINE_MAX_SLOWDOWN: f64 = 5.0;
+
+/// Validates the FLOP and byte counts the `roofline` tables report for one
+/// call of `kernel`. Kernels without floating-point work must report none.
+pub fn assert_roofline_kernel(kernel: &RooflineKernel, flops: f64, bytes: f64) {
+    let name = kernel.function;
+    for (label, actual, expected) in [
+        ("FLOPs", flops, kernel.flops as f64),
+        ("bytes", bytes, kernel.bytes as f64),
+    ] {
+        let error = (actual - expected).abs();
+        assert!(
+            error <= ROOFLINE_TOLERANCE * expected,
+            "14-ROOFLINE {name}: {label} per call were {actual:.0}, expected {expected:.0} ± {:.0}%",
+            ROOFLINE_TOLERANCE * 100.0
+        );
+    }
+}
+
+/// Validates the instrumented-to-uninstrumented time ratio of one kernel.
+pub fn assert_roofline_slowdown(function: &str, slowdown: f64) {
+    assert!(
+        slowdown.is_finite() && slowdown > 0.0,
+        "14-ROOFLINE {function}: slowdown {slowdown} is not a positive ratio"
+    );
+    assert!(
+        slowdown <= ROOFLINE_MAX_SLOWDOWN,
+        "14-ROOFLINE {function}: instrumented calls were {slowdown:.2}x slower than uninstrumented ones, budget is {ROOFLINE_MAX_SLOWDOWN:.1}x"
+    );
+}
+
 #[cfg(test)]
 mod tests {
     use super::*;
@@ -48,4 +138,35 @@ mod tests {
         // function must make the truth suite red.
         assert_f6_1_duty_split(400, 600);
     }
+
+    #[test]
+    fn roofline_accepts_analytic_kernel_counts() {
+        for kernel in &ROOFLINE_KERNELS {
+            assert_roofline_kernel(kernel, kernel.flops as f64, kernel.bytes as f64 * 1.01);
+        }
+        assert_roofline_slowdown("stream_triad", 1.8);
+    }
+
+    #[test]
+    #[should_panic(expected = "14-ROOFLINE stream_copy: FLOPs per call")]
+    fn roofline_mutation_flops_in_copy_fails() {
+        // Mutation evidence: counting the copied elements as arithmetic must
+        // make the truth suite red.
+        let copy = &ROOFLINE_KERNELS[0];
+        assert_roofline_kernel(copy, STREAM_N as f64, copy.bytes as f64);
+    }
+
+    #[test]
+    #[should_panic(expected = "14-ROOFLINE memcpy_chunks: bytes per call")]
+    fn roofline_mutation_missing_memcpy_load_fails() {
+        // Mutation evidence: a memcpy counted as a store only must fail.
+        let chunks = &ROOFLINE_KERNELS[5];
+        assert_roofline_kernel(chunks, 0.0, chunks.bytes as f64 / 2.0);
+    }
+
+    #[test]
+    #[should_panic(expected = "14-ROOFLINE dgemm_blocked: instrumented calls")]
+    fn roofline_mutation_slowdown_over_budget_fails() {
+        assert_roofline_slowdown("dgemm_blocked", ROOFLINE_MAX_SLOWDOWN * 2.0);
+    }
 }
@@ -10,6 +10,7 @@ const TMA_FIXTURES: [&str; 2] = [
     env!("TRUTH_POINTER_CHASE_FP"),
     env!("TRUTH_BRANCH_HEAVY_FP"),
 ];
+const ROOFLINE_FIXTURE: &str = env!("TRUTH_ROOFLINE_KERNELS_FP");
 
 #[test]
 fn f6_1_fixture_variants_are_executable() {
@@ -41,4 +42,10 @@ fn f6_1_fixture_variants_are_executable() {
             "TMA fixture {fixture} failed"
         );
     }
+    // The instrumented build is only made when the plugin is available, the
+    // uninstrumented one keeps the kernels compiling under -Werror everywhere.
+    assert!(
+        Command::new(ROOFLINE_FIXTURE).status().unwrap().success(),
+        "14-ROOFLINE: fixture {ROOFLINE_FIXTURE} failed"
+    );
 }
@@ -7,12 +7,16 @@ use std::{
 };
 
 use sqlite::State;
-use truth::assert_f6_1_duty_split;
+use truth::{
+    assert_f6_1_duty_split, assert_roofline_kernel, assert_roofline_slowdown, ROOFLINE_KERNELS,
+};
 
 const DUTY_SPLIT_FP: &str = env!("TRUTH_DUTY_SPLIT_FP");
 const DUTY_SPLIT_NO_FP: &str = env!("TRUTH_DUTY_SPLIT_NO_FP");
 const POINTER_CHASE_FP: &str = env!("TRUTH_POINTER_CHASE_FP");
 const BRANCH_HEAVY_FP: &str = env!("TRUTH_BRANCH_HEAVY_FP");
+const ROOFLINE_KERNELS_INSTRUMENTED: Option<&str> =
+    option_env!("TRUTH_ROOFLINE_KERNELS_INSTRUMENTED");
 
 #[test]
 #[ignore = "requires Linux perf_event access; run `cargo build -p mperf && cargo test -p truth --test profile -- --ignored`"]
@@ -76,6 +80,119 @@ fn tma_acceptance_fixtures_have_expected_dominant_paths() {
     }
 }
 
+#[test]
+#[ignore = "requires Linux perf_event access and a plugin build; set TRUTH_ROOFLINE_PLUGIN and TRUTH_ROOFLINE_COLLECTOR_DIR, then run `cargo test -p truth --test profile -- --ignored`"]
+fn roofline_tables_match_analytic_kernels() {
+    let Some(fixture) = ROOFLINE_KERNELS_INSTRUMENTED else {
+        eprintln!(
+            "14-ROOFLINE skipped: set TRUTH_ROOFLINE_PLUGIN and TRUTH_ROOFLINE_COLLECTOR_DIR to build the instrumented kernels"
+        );
+        return;
+    };
+    if !perf_events_are_available() {
+        eprintln!("14-ROOFLINE skipped: perf_event access is unavailable");
+        return;
+    }
+    let results = unique_results_dir();
+    let log_path = results.with_extension("log");
+    let log = File::create(&log_path).expect("14-ROOFLINE: create log");
+    let status = Command::new("timeout")
+        .args(["120s"])
+        .arg(mperf_binary())
+        .args(["record", "--scenario", "roofline", "--output-directory"])
+        .arg(&results)
+        .args(["--", fixture])
+        .stdout(Stdio::from(
+            log.try_clone().expect("14-ROOFLINE: clone log"),
+        ))
+        .stderr(Stdio::from(log))
+        .status()
+        .expect("14-ROOFLINE: run mperf");
+    let log = fs::read_to_string(&log_path).expect("14-ROOFLINE: read log");
+    assert!(
+        status.success(),
+        "14-ROOFLINE: roofline record failed\n{log}"
+    );
+
+    // The instrumented pass reports the work and time of every call in
+    // roofline_op_stats, the PMU pass times the same calls without
+    // instrumentation in roofline_run_stats.
+    let connection = sqlite::open(results.join("perf.db")).expect("14-ROOFLINE: open database");
+    let mut statement = connection
+        .prepare(
+            "WITH ops AS (
+               SELECT loop_id,
+                      SUM(scalar_double_ops + vector_double_ops) * 1.0 / SUM(invocations) AS flops,
+                      SUM(bytes_load + bytes_store) * 1.0 / SUM(invocations) AS bytes,
+                      SUM(loop_time) * 1.0 / SUM(invocations) AS instrumented_ns
+               FROM roofline_op_stats GROUP BY loop_id
+             ),
+             runs AS (
+               SELECT loop_id, SUM(total_duration) * 1.0 / SUM(runs) AS baseline_ns
+               FROM roofline_run_stats GROUP BY loop_id
+             )
+             SELECT strings.string AS func_name, ops.flops, ops.bytes,
+                    ops.instrumented_ns, runs.baseline_ns
+             FROM roofline_loops
+             INNER JOIN strings ON strings.id = roofline_loops.function_name
+             INNER JOIN ops ON ops.loop_id = roofline_loops.loop_id
+             LEFT JOIN runs ON runs.loop_id = roofline_loops.loop_id
+             WHERE roofline_loops.depth = 1",
+        )
+        .expect("14-ROOFLINE: query roofline tables");
+
+    let mut measured = vec![];
+    while let Ok(State::Row) = statement.next() {
+        let read = |column: &str| {
+            statement
+                .read::<Option<f64>, _>(column)
+                .expect("14-ROOFLINE: invalid roofline value")
+        };
+        let function = statement
+            .read::<String, _>("func_name")
+            .expect("14-ROOFLINE: invalid function name");
+        let row = (
+            read("flops").unwrap_or(0.0),
+            read("bytes").unwrap_or(0.0),
+            read("instrumented_ns"),
+            read("baseline_ns"),
+        );
+        measured.push((function, row));
+    }
+
+    println!(
+        "{:<16} {:>14} {:>14} {:>10}",
+        "kernel", "baseline ns", "instr ns", "slowdown"
+    );
+    let mut slowdowns = vec![];
+    for kernel in &ROOFLINE_KERNELS {
+        let Some((_, (flops, bytes, instrumented, baseline))) = measured
+            .iter()
+            .find(|(function, _)| function == kernel.function)
+        else {
+            panic!(
+                "14-ROOFLINE {}: no outermost loop was reported",
+                kernel.function
+            );
+        };
+        assert_roofline_kernel(kernel, *flops, *bytes);
+
+        let (Some(instrumented), Some(baseline)) = (instrumented, baseline) else {
+            panic!("14-ROOFLINE {}: missing loop timings", kernel.function);
+        };
+        let slowdown = instrumented / baseline;
+        println!(
+            "{:<16} {baseline:>14.0} {instrumented:>14.0} {slowdown:>9.2}x",
+            kernel.function
+        );
+        slowdowns.push((kernel.function, slowdown));
+    }
+    for (function, slowdown) in slowdowns {
+        assert_roofline_slowdown(function, slowdown);
+    }
+    cleanup_recording(&results, &log_path, "14-ROOFLINE");
+}
+
 fn record_fixture(fixture: &str, duration: &str, milestone: &str) -> Option<(PathBuf, PathBuf)> {
     if !perf_events_are_available() {
         eprintln!(
@@ -0,0 +1,121 @@
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <chrono>
+#include <optional>
+#include <string>
+
+using namespace llvm;
+
+static cl::list<std::string> Sources(cl::Positional, cl::OneOrMore,
+                                     cl::desc("<source files>"));
+
+static cl::opt<std::string> ClangPath("clang",
+                                      cl::desc("Compiler to benchmark"),
+                                      cl::init("clang"));
+
+static cl::opt<std::string> PluginPath("plugin", cl::Required,
+                                       cl::desc("Path to miniperf_plugin"));
+
+static cl::opt<unsigned>
+    Repetitions("repetitions",
+                cl::desc("Compiles per source and configuration, the "
+                         "fastest one is reported"),
+                cl::init(5));
+
+static cl::list<std::string>
+    CompileFlags("cflag", cl::desc("Extra compiler flag, may be repeated"));
+
+/// Compiles Source Repetitions times and returns the fastest wall time in
+/// milliseconds, or std::nullopt if the compiler failed.
+static std::optional<double> timeCompile(StringRef Clang, StringRef Source,
+                                         StringRef Object, bool Instrumented) {
+  std::string PluginFlag = "-fpass-plugin=" + PluginPath;
+  SmallVector<StringRef> Args{Clang, "-O3", "-g", "-c", Source, "-o", Object};
+  for (const std::string &Flag : CompileFlags)
+    Args.push_back(Flag);
+  if (Instrumented)
+    Args.push_back(PluginFlag);
+
+  std::optional<double> Best;
+  for (unsigned I = 0; I < Repetitions; ++I) {
+    auto Start = std::chrono::steady_clock::now();
+    std::string Error;
+    int Status = sys::ExecuteAndWait(Clang, Args, std::nullopt, {}, 0, 0,
+                                     &Error);
+    auto Elapsed = std::chrono::duration<double, std::milli>(
+                       std::chrono::steady_clock::now() - Start)
+                       .count();
+    if (Status != 0) {
+      errs() << "failed to compile " << Source << ": "
+             << (Error.empty() ? "compiler error" : Error) << "\n";
+      return std::nullopt;
+    }
+    if (!Best || Elapsed < *Best)
+      Best = Elapsed;
+  }
+  return Best;
+}
+
+static void printRow(StringRef Name, double Regular, double Instrumented) {
+  outs() << left_justify(Name, 40)
+         << format(" %12.1f %12.1f %8.1f%%\n", Regular, Instrumented,
+                   (Instrumented / Regular - 1) * 100);
+}
+
+/// Prints the per translation unit compile time of an instrumented build
+/// against a regular one.
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(
+      argc, argv, "Compile time overhead of the miniperf plugin\n");
+
+  std::string Clang = ClangPath;
+  if (!sys::path::has_parent_path(Clang)) {
+    ErrorOr<std::string> Found = sys::findProgramByName(Clang);
+    if (!Found) {
+      errs() << "cannot find " << Clang << " in PATH\n";
+      return 1;
+    }
+    Clang = *Found;
+  }
+
+  SmallString<128> Object;
+  if (std::error_code EC =
+          sys::fs::createTemporaryFile("miniperf-bench", "o", Object)) {
+    errs() << "cannot create a temporary file: " << EC.message() << "\n";
+    return 1;
+  }
+
+  outs() << left_justify("source", 40) << right_justify("regular ms", 13)
+         << right_justify("instr ms", 13) << right_justify("overhead", 10)
+         << "\n";
+  double RegularTotal = 0;
+  double InstrumentedTotal = 0;
+  int Result = 0;
+  for (const std::string &Source : Sources) {
+    std::optional<double> Regular = timeCompile(Clang, Source, Object, false);
+    std::optional<double> Instrumented =
+        Regular ? timeCompile(Clang, Source, Object, true) : std::nullopt;
+    if (!Instrumented) {
+      Result = 1;
+      continue;
+    }
+
+    RegularTotal += *Regular;
+    InstrumentedTotal += *Instrumented;
+    printRow(sys::path::filename(Source), *Regular, *Instrumented);
+  }
+
+  if (RegularTotal > 0)
+    printRow("total", RegularTotal, InstrumentedTotal);
+
+  sys::fs::remove(Object);
+  return Result;
+}
@@ -0,0 +1,59 @@
+// A translation unit with many small loop nests, the shape that stresses
+// the per-function and per-loop work of the plugin.
+
+#include <stddef.h>
+
+#define KERNELS(X)                                                             \
+  X(0) X(1) X(2) X(3) X(4) X(5) X(6) X(7) X(8) X(9) X(10) X(11) X(12) X(13)    \
+      X(14) X(15) X(16) X(17) X(18) X(19) X(20) X(21) X(22) X(23) X(24) X(25)  \
+          X(26) X(27) X(28) X(29) X(30) X(31)
+
+#define DEFINE_KERNELS(N)                                                      \
+  void saxpy_##N(float *y, const float *x, float a, size_t n) {                \
+    for (size_t i = 0; i < n; ++i)                                             \
+      y[i] += a * x[i] + (float)N;                                             \
+  }                                                                            \
+                                                                               \
+  double dot_##N(const double *x, const double *y, size_t n) {                 \
+    double sum = N;                                                            \
+    for (size_t i = 0; i < n; ++i)                                             \
+      sum += x[i] * y[i];                                                      \
+    return sum;                                                                \
+  }                                                                            \
+                                                                               \
+  void matmul_##N(double *c, const double *a, const double *b, size_t n) {     \
+    for (size_t i = 0; i < n; ++i)                                             \
+      for (size_t j = 0; j < n; ++j) {                                         \
+        double sum = 0;                                                        \
+        for (size_t k = 0; k < n; ++k)                                         \
+          sum += a[i * n + k] * b[k * n + j];                                  \
+        c[i * n + j] = sum + N;                                                \
+      }                                                                        \
+  }                                                                            \
+                                                                               \
+  void stencil_##N(float *out, const float *in, size_t w, size_t h) {          \
+    for (size_t y = 1; y + 1 < h; ++y)                                         \
+      for (size_t x = 1; x + 1 < w; ++x)                                       \
+        out[y * w + x] = (in[y * w + x - 1] + in[y * w + x + 1] +              \
+                          in[(y - 1) * w + x] + in[(y + 1) * w + x]) *         \
+                         0.25f;                                                \
+  }                                                                            \
+                                                                               \
+  int histogram_##N(int *bins, const unsigned char *data, size_t n) {          \
+    int max = 0;                                                               \
+    for (size_t i = 0; i < n; ++i)                                             \
+      bins[(data[i] + N) & 255]++;                                             \
+    for (int i = 0; i < 256; ++i)                                              \
+      if (bins[i] > max)                                                       \
+        max = bins[i];                                                         \
+    return max;                                                                \
+  }                                                                            \
+                                                                               \
+  size_t search_##N(const int *list, int value) {                              \
+    size_t i = 0;                                                              \
+    while (list[i] != value && list[i] != -N - 1)                              \
+      ++i;                                                                     \
+    return i;                                                                  \
+  }
+
+KERNELS(DEFINE_KERNELS)
@@ -0,0 +1,273 @@
+#include "codegen_facts.h"
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/LoopIterator.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/PatternMatch.h"
+
+#include <algorithm>
+
+using namespace llvm;
+using namespace llvm::PatternMatch;
+
+namespace miniperf {
+
+namespace {
+
+/// The vector a value holds, or the one a store writes. Masks are left out,
+/// they take the lane count of the data they select.
+VectorType *getDataVectorType(const Instruction &I) {
+  Type *Ty = I.getType();
+  if (auto *Store = dyn_cast<StoreInst>(&I))
+    Ty = Store->getValueOperand()->getType();
+  auto *VTy = dyn_cast<VectorType>(Ty);
+  if (!VTy || VTy->getElementType()->isIntegerTy(1))
+    return nullptr;
+  return VTy;
+}
+
+bool hasVectorCode(const Loop &L) {
+  for (BasicBlock *BB : L.blocks())
+    for (Instruction &I : *BB)
+      if (getDataVectorType(I))
+        return true;
+  return false;
+}
+
+/// The loop vectorizer marks both the vector loop and the scalar loop it
+/// keeps around, only the former has vector code.
+bool isVectorizerOutput(const Loop &L) {
+  return getBooleanLoopAttribute(&L, "llvm.loop.isvectorized");
+}
+
+/// The loop vectorizer advances the canonical induction variable by VF times
+/// the interleave count on every iteration of the vector body, in multiples
+/// of vscale for scalable vectors.
+unsigned getInterleaveCount(const Loop &L, unsigned VF) {
+  if (!VF)
+    return 0;
+  for (PHINode &PHI : L.getHeader()->phis()) {
+    if (!PHI.getType()->isIntegerTy())
+      continue;
+    for (unsigned Idx = 0; Idx < PHI.getNumIncomingValues(); ++Idx) {
+      if (!L.contains(PHI.getIncomingBlock(Idx)))
+        continue;
+      Value *Inc = nullptr;
+      if (!match(PHI.getIncomingValue(Idx),
+                 m_c_Add(m_Specific(&PHI), m_Value(Inc))))
+        continue;
+      auto VScale = m_Intrinsic<Intrinsic::vscale>();
+      const APInt *Step = nullptr;
+      uint64_t Increment = 0;
+      if (match(Inc, m_APInt(Step)) ||
+          match(Inc, m_c_Mul(VScale, m_APInt(Step))))
+        Increment = Step->getZExtValue();
+      else if (match(Inc, m_Shl(VScale, m_APInt(Step))))
+        Increment = uint64_t(1) << Step->getZExtValue();
+      else if (match(Inc, VScale))
+        Increment = 1;
+      if (Increment >= VF && Increment % VF == 0)
+        return Increment / VF;
+    }
+  }
+  return 0;
+}
+
+/// The scalar remainder of Vector, which the vectorizer places behind the
+/// middle block that Vector exits to.
+Loop *findRemainder(const Loop &Vector, LoopInfo &LI) {
+  SmallVector<BasicBlock *, 8> Worklist;
+  Vector.getUniqueExitBlocks(Worklist);
+  SmallPtrSet<BasicBlock *, 8> Seen(Worklist.begin(), Worklist.end());
+  for (size_t Idx = 0; Idx < Worklist.size() && Idx < 8; ++Idx) {
+    BasicBlock *BB = Worklist[Idx];
+    Loop *Other = LI.getLoopFor(BB);
+    if (Other && Other->getHeader() == BB && isVectorizerOutput(*Other) &&
+        !hasVectorCode(*Other))
+      return Other;
+    if (Other != Vector.getParentLoop())
+      continue;
+    for (BasicBlock *Succ : successors(BB))
+      if (Seen.insert(Succ).second)
+        Worklist.push_back(Succ);
+  }
+  return nullptr;
+}
+
+/// Besides the minimum iteration count check, runtime checks add branches to
+/// the scalar loop ahead of the vector loop. They either stay separate
+/// blocks or are folded into the condition of the first one.
+bool hasRuntimeChecks(const Loop &Vector, const Loop &Remainder,
+                      const DominatorTree &DT) {
+  BasicBlock *ScalarPreheader = Remainder.getLoopPreheader();
+  if (!ScalarPreheader)
+    return false;
+
+  unsigned Bypasses = 0;
+  for (BasicBlock *Pred : predecessors(ScalarPreheader)) {
+    if (Vector.contains(Pred) || !DT.dominates(Pred, Vector.getHeader()))
+      continue;
+    auto *Br = dyn_cast<BranchInst>(Pred->getTerminator());
+    if (!Br || !Br->isConditional())
+      continue;
+    ++Bypasses;
+    if (match(Br->getCondition(), m_LogicalOr(m_Value(), m_Value())))
+      return true;
+  }
+  return Bypasses > 1;
+}
+
+/// Values that need a register of their own. Addresses that only feed loads
+/// and stores fold into the addressing mode, and conditions live in flags.
+bool needsRegister(const Value &V) {
+  Type *Ty = V.getType();
+  if (!Ty->isIntOrIntVectorTy() && !Ty->isFPOrFPVectorTy() &&
+      !Ty->isPtrOrPtrVectorTy())
+    return false;
+  if (Ty->getScalarType()->isIntegerTy(1))
+    return false;
+  if (isa<GetElementPtrInst>(V))
+    return !all_of(V.users(), [](const User *U) {
+      return isa<LoadInst>(U) || isa<StoreInst>(U);
+    });
+  return true;
+}
+
+/// Overlaps the live ranges of the values in L over its blocks laid out in
+/// reverse post-order, like the register usage estimate of the loop
+/// vectorizer. Values defined outside of L stay live through the whole loop,
+/// and so do values that are carried to the next iteration or used after L.
+unsigned estimateSpills(Loop &L, LoopInfo &LI,
+                        const TargetTransformInfo &TTI) {
+  LoopBlocksDFS DFS(&L);
+  DFS.perform(&LI);
+
+  DenseMap<const Instruction *, unsigned> Index;
+  SmallVector<Instruction *> Order;
+  for (BasicBlock *BB : make_range(DFS.beginRPO(), DFS.endRPO()))
+    for (Instruction &I : *BB)
+      if (!isa<DbgInfoIntrinsic>(I)) {
+        Index[&I] = Order.size();
+        Order.push_back(&I);
+      }
+  unsigned End = Order.size();
+
+  // Changes of the number of live values per register class, +1 where a
+  // live range starts and -1 past its end.
+  SmallDenseMap<unsigned, SmallVector<int, 0>, 4> Deltas;
+  auto AddRange = [&](Type *Ty, unsigned Start, unsigned Stop) {
+    unsigned Class = TTI.getRegisterClassForType(Ty->isVectorTy(), Ty);
+    SmallVector<int, 0> &Delta = Deltas[Class];
+    Delta.resize(End + 1, 0);
+    ++Delta[Start];
+    --Delta[Stop];
+  };
+
+  SmallPtrSet<const Value *, 16> Invariants;
+  for (Instruction *I : Order) {
+    for (Value *Op : I->operands()) {
+      auto *OpI = dyn_cast<Instruction>(Op);
+      if (((OpI && !L.contains(OpI)) || isa<Argument>(Op)) &&
+          needsRegister(*Op) && Invariants.insert(Op).second)
+        AddRange(Op->getType(), 0, End);
+    }
+    if (!needsRegister(*I))
+      continue;
+
+    unsigned Start = Index[I];
+    unsigned Stop = Start + 1;
+    for (User *U : I->users()) {
+      auto *UserI = dyn_cast<Instruction>(U);
+      if (!UserI)
+        continue;
+      auto It = Index.find(UserI);
+      if (It == Index.end() || It->second <= Start ||
+          (isa<PHINode>(UserI) && UserI->getParent() == L.getHeader())) {
+        Stop = End;
+        break;
+      }
+      Stop = std::max(Stop, It->second);
+    }
+    AddRange(I->getType(), Start, Stop);
+  }
+
+  unsigned Spills = 0;
+  for (auto &[Class, Delta] : Deltas) {
+    int Live = 0;
+    int Peak = 0;
+    for (int Change : Delta) {
+      Live += Change;
+      Peak = std::max(Peak, Live);
+    }
+    int Registers = TTI.getNumberOfRegisters(Class);
+    if (Registers > 0 && Peak > Registers)
+      Spills += Peak - Registers;
+  }
+  return Spills;
+}
+
+} // namespace
+
+CodegenFacts computeCodegenFacts(Loop &L, LoopInfo &LI,
+                                 const DominatorTree &DT,
+                                 const TargetTransformInfo &TTI,
+                                 const DataLayout &DL) {
+  // Widened instructions have VF lanes. Interleaved accesses and some
+  // reductions use wider vectors, so the most common lane count wins.
+  CodegenFacts Facts;
+  SmallDenseMap<unsigned, unsigned, 4> LaneCounts;
+  for (BasicBlock *BB : L.blocks())
+    for (Instruction &I : *BB)
+      if (VectorType *VTy = getDataVectorType(I))
+        ++LaneCounts[VTy->getElementCount().getKnownMinValue()];
+  for (auto &[Lanes, Count] : LaneCounts)
+    if (Count > LaneCounts.lookup(Facts.VectorWidth) ||
+        (Count == LaneCounts.lookup(Facts.VectorWidth) &&
+         Lanes > Facts.VectorWidth))
+      Facts.VectorWidth = Lanes;
+
+  for (BasicBlock *BB : L.blocks()) {
+    for (Instruction &I : *BB) {
+      VectorType *VTy = getDataVectorType(I);
+      if (!VTy ||
+          VTy->getElementCount().getKnownMinValue() != Facts.VectorWidth)
+        continue;
+      Type *ElemTy = VTy->getElementType();
+      unsigned ElemBits = ElemTy->isPointerTy()
+                              ? DL.getPointerTypeSizeInBits(ElemTy)
+                              : ElemTy->getScalarSizeInBits();
+      if (Facts.VectorWidth * ElemBits > Facts.VectorBits) {
+        Facts.VectorBits = Facts.VectorWidth * ElemBits;
+        Facts.Scalable = isa<ScalableVectorType>(VTy);
+      }
+    }
+  }
+
+  Facts.IsRemainder = isVectorizerOutput(L) && !hasVectorCode(L);
+  for (Loop *Sub : L.getLoopsInPreorder()) {
+    Facts.EstimatedSpills =
+        std::max(Facts.EstimatedSpills, estimateSpills(*Sub, LI, TTI));
+    if (!isVectorizerOutput(*Sub) || !hasVectorCode(*Sub))
+      continue;
+
+    if (!Facts.Vectorized)
+      Facts.InterleaveCount = getInterleaveCount(*Sub, Facts.VectorWidth);
+    Facts.Vectorized = true;
+    if (Loop *Remainder = findRemainder(*Sub, LI)) {
+      Facts.HasRemainder = true;
+      Facts.RuntimeChecks |= hasRuntimeChecks(*Sub, *Remainder, DT);
+    }
+  }
+  return Facts;
+}
+
+} // namespace miniperf
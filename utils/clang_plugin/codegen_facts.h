@@ -0,0 +1,49 @@
+#ifndef MINIPERF_CODEGEN_FACTS_H
+#define MINIPERF_CODEGEN_FACTS_H
+
+namespace llvm {
+class DataLayout;
+class DominatorTree;
+class Loop;
+class LoopInfo;
+class TargetTransformInfo;
+} // namespace llvm
+
+namespace miniperf {
+
+/// What the optimizer made of a loop, read from the IR at the end of the
+/// pipeline. Loops nested in the loop are included, a nest counts as
+/// vectorized if any of its loops was.
+struct CodegenFacts {
+  /// Lanes of the widest vector value in the loop, zero for scalar code.
+  /// Scalable vectors report their minimum number of lanes.
+  unsigned VectorWidth = 0;
+  /// Size of that vector value in bits, per vscale for scalable vectors.
+  unsigned VectorBits = 0;
+  /// Copies of the vector body the loop vectorizer interleaved, zero if it
+  /// cannot be told from the induction variable.
+  unsigned InterleaveCount = 0;
+  /// Values that do not fit the registers of their class where register
+  /// pressure peaks, summed over the register classes. This is an estimate
+  /// from the IR, instruction selection and scheduling change the numbers.
+  unsigned EstimatedSpills = 0;
+  bool Scalable = false;
+  /// The loop vectorizer produced the loop or one of the loops nested in it.
+  bool Vectorized = false;
+  /// The vector loop is only entered after runtime checks, such as pointer
+  /// overlap checks, that fall back to the scalar loop.
+  bool RuntimeChecks = false;
+  /// A scalar loop runs the iterations the vector loop leaves over.
+  bool HasRemainder = false;
+  /// The loop is the scalar remainder of a vectorized loop.
+  bool IsRemainder = false;
+};
+
+CodegenFacts computeCodegenFacts(llvm::Loop &L, llvm::LoopInfo &LI,
+                                 const llvm::DominatorTree &DT,
+                                 const llvm::TargetTransformInfo &TTI,
+                                 const llvm::DataLayout &DL);
+
+} // namespace miniperf
+
+#endif // MINIPERF_CODEGEN_FACTS_H
@@ -0,0 +1,265 @@
+#include "counters.h"
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+
+#include <limits>
+#include <numeric>
+
+using namespace llvm;
+
+namespace miniperf {
+
+namespace {
+
+/// Counter weights in wrapping arithmetic. Chord weights are differences of
+/// path sums and may be negative, only the totals at region exit are
+/// meaningful.
+using WrappingWeights = SmallVector<uint64_t, 16>;
+
+/// An edge of the region CFG extended with a virtual root node, which has
+/// index 0. The root has an edge to the region entry and an edge from every
+/// exiting block, which turns the flow through the region into a circulation.
+struct CounterEdge {
+  unsigned Src;
+  unsigned Dst;
+  uint64_t Frequency;
+  bool InTree = false;
+};
+
+class DisjointSets {
+public:
+  explicit DisjointSets(unsigned Size) : Parent(Size) {
+    std::iota(Parent.begin(), Parent.end(), 0);
+  }
+
+  unsigned find(unsigned X) {
+    while (Parent[X] != X) {
+      Parent[X] = Parent[Parent[X]];
+      X = Parent[X];
+    }
+    return X;
+  }
+
+  bool unite(unsigned A, unsigned B) {
+    A = find(A);
+    B = find(B);
+    if (A == B)
+      return false;
+    Parent[A] = B;
+    return true;
+  }
+
+private:
+  SmallVector<unsigned, 32> Parent;
+};
+
+bool hasUnsupportedControlFlow(const BasicBlock &BB) {
+  if (BB.isEHPad())
+    return true;
+  const Instruction *Term = BB.getTerminator();
+  return isa<InvokeInst>(Term) || isa<IndirectBrInst>(Term) ||
+         isa<CallBrInst>(Term) || isa<ResumeInst>(Term) ||
+         isa<CleanupReturnInst>(Term) || isa<CatchReturnInst>(Term);
+}
+
+void emitCounterUpdate(Instruction *InsertPt, ArrayRef<AllocaInst *> Counters,
+                       ArrayRef<uint64_t> Weights) {
+  IRBuilder<> Builder(InsertPt);
+  for (size_t Idx = 0; Idx < Counters.size(); ++Idx) {
+    if (Weights[Idx] == 0)
+      continue;
+
+    AllocaInst *Counter = Counters[Idx];
+    Type *Ty = Counter->getAllocatedType();
+    Value *Old = Builder.CreateLoad(Ty, Counter);
+    Value *New = Builder.CreateAdd(Old, ConstantInt::get(Ty, Weights[Idx]));
+    Builder.CreateStore(New, Counter);
+  }
+}
+
+WrappingWeights getWeights(const CounterRegion &Region, BasicBlock *BB,
+                           size_t NumCounters) {
+  WrappingWeights Result(NumCounters, 0);
+  if (!BB)
+    return Result;
+
+  auto It = Region.Weights.find(BB);
+  if (It == Region.Weights.end())
+    return Result;
+
+  for (size_t Idx = 0; Idx < NumCounters && Idx < It->second.size(); ++Idx)
+    Result[Idx] = static_cast<uint64_t>(It->second[Idx]);
+  return Result;
+}
+
+bool isZero(ArrayRef<uint64_t> Weights) {
+  return all_of(Weights, [](uint64_t W) { return W == 0; });
+}
+
+} // namespace
+
+void placeBlockCounters(const CounterRegion &Region,
+                        ArrayRef<AllocaInst *> Counters) {
+  for (BasicBlock *BB : Region.Blocks) {
+    WrappingWeights Weights = getWeights(Region, BB, Counters.size());
+    if (!isZero(Weights))
+      emitCounterUpdate(BB->getTerminator(), Counters, Weights);
+  }
+}
+
+bool placeSpanningTreeCounters(const CounterRegion &Region,
+                               ArrayRef<AllocaInst *> Counters,
+                               BlockFrequencyInfo &BFI,
+                               BranchProbabilityInfo &BPI) {
+  SmallPtrSet<BasicBlock *, 32> InRegion(Region.Blocks.begin(),
+                                         Region.Blocks.end());
+  if (!InRegion.count(Region.Entry))
+    return false;
+
+  // Only blocks reachable from the entry carry any flow.
+  SmallVector<BasicBlock *, 32> Nodes{nullptr, Region.Entry};
+  DenseMap<BasicBlock *, unsigned> NodeIdx{{Region.Entry, 1}};
+  for (size_t Idx = 1; Idx < Nodes.size(); ++Idx) {
+    BasicBlock *BB = Nodes[Idx];
+    if (hasUnsupportedControlFlow(*BB))
+      return false;
+
+    for (BasicBlock *Succ : successors(BB)) {
+      if (!InRegion.count(Succ))
+        continue;
+      if (Succ == Region.Entry)
+        return false;
+      if (NodeIdx.try_emplace(Succ, Nodes.size()).second)
+        Nodes.push_back(Succ);
+    }
+  }
+
+  SmallVector<CounterEdge, 64> Edges;
+  for (unsigned Idx = 1; Idx < Nodes.size(); ++Idx) {
+    BasicBlock *BB = Nodes[Idx];
+    bool Exits = succ_empty(BB);
+
+    SmallPtrSet<BasicBlock *, 4> Seen;
+    for (BasicBlock *Succ : successors(BB)) {
+      if (!Seen.insert(Succ).second)
+        continue;
+
+      auto It = NodeIdx.find(Succ);
+      if (It == NodeIdx.end()) {
+        Exits = true;
+        continue;
+      }
+
+      BlockFrequency Freq =
+          BFI.getBlockFreq(BB) * BPI.getEdgeProbability(BB, Succ);
+      Edges.push_back({Idx, It->second, Freq.getFrequency()});
+    }
+
+    // Exit edges never need a counter, so they always go to the tree.
+    if (Exits)
+      Edges.push_back({Idx, 0, std::numeric_limits<uint64_t>::max()});
+  }
+
+  // Hot edges go to the tree first. The root edge is taken last, and only if
+  // the region has no path to an exit. Otherwise it is a chord whose update
+  // runs once per region entry.
+  llvm::stable_sort(Edges, [](const CounterEdge &LHS, const CounterEdge &RHS) {
+    return LHS.Frequency > RHS.Frequency;
+  });
+  Edges.push_back({0, 1, 0});
+
+  DisjointSets Components(Nodes.size());
+  SmallVector<SmallVector<unsigned, 4>, 32> TreeEdges(Nodes.size());
+  for (unsigned Idx = 0; Idx < Edges.size(); ++Idx) {
+    CounterEdge &E = Edges[Idx];
+    if (!Components.unite(E.Src, E.Dst))
+      continue;
+    E.InTree = true;
+    TreeEdges[E.Src].push_back(Idx);
+    TreeEdges[E.Dst].push_back(Idx);
+  }
+
+  // Potential[N] is the sum of the signed weights along the tree path from N
+  // to the root, where an edge counts positive if the path follows its
+  // direction. The flow over a chord then accounts for the weights of its
+  // whole fundamental cycle, which is w(Dst) + Potential[Dst] -
+  // Potential[Src].
+  size_t NumCounters = Counters.size();
+  SmallVector<WrappingWeights, 32> Potential(
+      Nodes.size(), WrappingWeights(NumCounters, 0));
+  SmallVector<bool, 32> Visited(Nodes.size(), false);
+  SmallVector<unsigned, 32> Worklist{0};
+  Visited[0] = true;
+  while (!Worklist.empty()) {
+    unsigned Node = Worklist.pop_back_val();
+    for (unsigned EdgeIdx : TreeEdges[Node]) {
+      const CounterEdge &E = Edges[EdgeIdx];
+      unsigned Next = E.Src == Node ? E.Dst : E.Src;
+      if (Visited[Next])
+        continue;
+      Visited[Next] = true;
+      Worklist.push_back(Next);
+
+      WrappingWeights DstWeights =
+          getWeights(Region, Nodes[E.Dst], NumCounters);
+      for (size_t Idx = 0; Idx < NumCounters; ++Idx) {
+        if (E.Src == Next)
+          Potential[Next][Idx] = Potential[Node][Idx] + DstWeights[Idx];
+        else
+          Potential[Next][Idx] = Potential[Node][Idx] - DstWeights[Idx];
+      }
+    }
+  }
+  assert(all_of(Visited, [](bool V) { return V; }) &&
+         "Counter spanning tree does not cover the region");
+
+  struct Placement {
+    BasicBlock *Src;
+    BasicBlock *Dst;
+    WrappingWeights Weights;
+  };
+  SmallVector<Placement, 16> Placements;
+  for (const CounterEdge &E : Edges) {
+    if (E.InTree)
+      continue;
+
+    WrappingWeights Weights = getWeights(Region, Nodes[E.Dst], NumCounters);
+    for (size_t Idx = 0; Idx < NumCounters; ++Idx)
+      Weights[Idx] += Potential[E.Dst][Idx] - Potential[E.Src][Idx];
+
+    if (!isZero(Weights))
+      Placements.push_back({Nodes[E.Src], Nodes[E.Dst], std::move(Weights)});
+  }
+
+  for (Placement &P : Placements) {
+    Instruction *InsertPt;
+    if (!P.Src) {
+      // The entry runs once per region invocation.
+      InsertPt = P.Dst->getTerminator();
+    } else if (P.Src->getUniqueSuccessor()) {
+      InsertPt = P.Src->getTerminator();
+    } else if (P.Dst->getUniquePredecessor()) {
+      InsertPt = &*P.Dst->getFirstInsertionPt();
+    } else {
+      auto Options = CriticalEdgeSplittingOptions().setMergeIdenticalEdges();
+      BasicBlock *EdgeBB = SplitCriticalEdge(P.Src, P.Dst, Options);
+      assert(EdgeBB && "Failed to split a critical counter edge");
+      InsertPt = EdgeBB->getTerminator();
+    }
+
+    emitCounterUpdate(InsertPt, Counters, P.Weights);
+  }
+
+  return true;
+}
+
+} // namespace miniperf
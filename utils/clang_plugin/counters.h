@@ -0,0 +1,53 @@
+#ifndef MINIPERF_COUNTERS_H
+#define MINIPERF_COUNTERS_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+
+namespace llvm {
+class AllocaInst;
+class BasicBlock;
+class BlockFrequencyInfo;
+class BranchProbabilityInfo;
+} // namespace llvm
+
+namespace miniperf {
+
+/// Amount added to each counter every time a block executes.
+using CounterWeights = llvm::SmallVector<int64_t, 16>;
+
+/// A single-entry region whose blocks are counted. Control enters at Entry,
+/// which must not be a successor of any region block, and leaves through
+/// edges to blocks outside of the region or through blocks without
+/// successors.
+struct CounterRegion {
+  llvm::ArrayRef<llvm::BasicBlock *> Blocks;
+  llvm::BasicBlock *Entry;
+  /// Blocks missing from the map do not contribute to any counter.
+  const llvm::DenseMap<llvm::BasicBlock *, CounterWeights> &Weights;
+};
+
+/// Adds the weights of each block to Counters at the end of the block. This
+/// works for any CFG.
+void placeBlockCounters(const CounterRegion &Region,
+                        llvm::ArrayRef<llvm::AllocaInst *> Counters);
+
+/// Places counter updates only on the chords of a maximum spanning tree of
+/// the region CFG (Knuth, "Optimal measurement points for program
+/// frequency counts"). Every chord carries the sum of the weights of its
+/// fundamental cycle, so the counters hold the same totals as with
+/// placeBlockCounters at loop exit while hot edges stay free of updates.
+///
+/// Critical chords are split. Returns false without changing the IR if the
+/// region has control flow the placement cannot handle (exception handling,
+/// indirect branches); the caller should then fall back to
+/// placeBlockCounters.
+bool placeSpanningTreeCounters(const CounterRegion &Region,
+                               llvm::ArrayRef<llvm::AllocaInst *> Counters,
+                               llvm::BlockFrequencyInfo &BFI,
+                               llvm::BranchProbabilityInfo &BPI);
+
+} // namespace miniperf
+
+#endif // MINIPERF_COUNTERS_H
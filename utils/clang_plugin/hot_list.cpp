@@ -0,0 +1,88 @@
+#include "hot_list.h"
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/Demangle/Demangle.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+using namespace llvm;
+
+namespace miniperf {
+
+namespace {
+
+/// Drops the parameter list of a demangled name, which the symbolizer and
+/// the demangler do not always spell the same way.
+StringRef stripParameters(StringRef Name) {
+  return Name.take_until([](char C) { return C == '('; }).rtrim();
+}
+
+bool pathsMatch(StringRef A, StringRef B) {
+  if (A.size() < B.size())
+    std::swap(A, B);
+  if (B.empty() || !A.ends_with(B))
+    return false;
+  return A.size() == B.size() || A[A.size() - B.size() - 1] == '/';
+}
+
+} // namespace
+
+Expected<HotList> HotList::load(StringRef Path) {
+  ErrorOr<std::unique_ptr<MemoryBuffer>> Buffer = MemoryBuffer::getFile(Path);
+  if (!Buffer)
+    return createStringError(Buffer.getError(),
+                             "cannot read hot list '" + Path + "'");
+  return parse((*Buffer)->getBuffer());
+}
+
+Expected<HotList> HotList::parse(StringRef Contents) {
+  HotList List;
+  unsigned LineNo = 0;
+  SmallVector<StringRef, 64> Lines;
+  Contents.split(Lines, '\n');
+  for (StringRef Line : Lines) {
+    ++LineNo;
+    Line = Line.trim();
+    if (Line.empty() || Line.starts_with("#"))
+      continue;
+
+    auto [Kind, Value] = Line.split(' ');
+    Value = Value.trim();
+    if (Kind == "func" && !Value.empty()) {
+      List.Functions.insert(Value);
+      List.Functions.insert(stripParameters(Value));
+      continue;
+    }
+
+    unsigned LoopLine = 0;
+    auto [File, LineStr] = Value.rsplit(':');
+    if (Kind == "loop" && !File.empty() &&
+        !LineStr.getAsInteger(10, LoopLine)) {
+      List.Loops.push_back({File.str(), LoopLine});
+      continue;
+    }
+
+    return createStringError(inconvertibleErrorCode(),
+                             "malformed hot list entry at line " +
+                                 Twine(LineNo) + ": '" + Line + "'");
+  }
+  return List;
+}
+
+bool HotList::containsFunction(StringRef Name) const {
+  if (Name.empty())
+    return false;
+  if (Functions.contains(Name))
+    return true;
+
+  std::string Demangled = demangle(Name.str());
+  return Functions.contains(Demangled) ||
+         Functions.contains(stripParameters(Demangled));
+}
+
+bool HotList::containsLoop(StringRef File, unsigned Line) const {
+  return any_of(Loops, [&](const std::pair<std::string, unsigned> &Entry) {
+    return Entry.second == Line && pathsMatch(Entry.first, File);
+  });
+}
+
+} // namespace miniperf
@@ -0,0 +1,39 @@
+#ifndef MINIPERF_HOT_LIST_H
+#define MINIPERF_HOT_LIST_H
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Support/Error.h"
+
+#include <string>
+#include <utility>
+
+namespace miniperf {
+
+/// Functions and loops selected for instrumentation, usually generated with
+/// `mperf hot-list` from an earlier recording. One entry per line:
+///
+///   # comment
+///   func <name>          every loop of the function
+///   loop <file>:<line>   the loop that starts at the given line
+///
+/// Function names may be mangled or demangled, with or without the parameter
+/// list. A file matches any path it is a suffix of, so relative and absolute
+/// spellings of the same file select the same loops.
+class HotList {
+public:
+  static llvm::Expected<HotList> load(llvm::StringRef Path);
+  static llvm::Expected<HotList> parse(llvm::StringRef Contents);
+
+  bool containsFunction(llvm::StringRef Name) const;
+  bool containsLoop(llvm::StringRef File, unsigned Line) const;
+
+private:
+  llvm::StringSet<> Functions;
+  llvm::SmallVector<std::pair<std::string, unsigned>> Loops;
+};
+
+} // namespace miniperf
+
+#endif // MINIPERF_HOT_LIST_H
@@ -1,20 +1,33 @@
+#include "codegen_facts.h"
+#include "counters.h"
+#include "hot_list.h"
+
 #include "llvm/Pass.h"
+#include "llvm/ADT/MapVector.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/Analysis/AssumptionCache.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
 #include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Analysis/MemorySSA.h"
 #include "llvm/Analysis/MemorySSAUpdater.h"
-#include "llvm/Analysis/RegionInfo.h"
 #include "llvm/Analysis/ScalarEvolution.h"
 #include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
 #include "llvm/Config/llvm-config.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DebugInfo.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Dominators.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/InstIterator.h"
 #include "llvm/IR/GlobalValue.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/PassInstrumentation.h"
 #include "llvm/IR/PassManager.h"
@@ -22,13 +35,59 @@
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
 #include "llvm/Support/Alignment.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+#include "llvm/TargetParser/Triple.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Transforms/Utils/Cloning.h"
 #include "llvm/Transforms/Utils/CodeExtractor.h"
+#include "llvm/Transforms/Utils/LoopSimplify.h"
 #include "llvm/Transforms/Utils/LoopUtils.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#include "llvm/Transforms/Utils/PromoteMemToReg.h"
+#include "llvm/Transforms/Utils/ScalarEvolutionExpander.h"
 #include <llvm/IR/DataLayout.h>
 
+#include <cstdlib>
+#include <optional>
+
 using namespace llvm;
+using namespace miniperf;
+
+static cl::opt<bool> SpanningTreeCounters(
+    "miniperf-spanning-tree-counters",
+    cl::desc("Only update roofline counters on the chords of a spanning tree "
+             "of the loop CFG"),
+    cl::init(true));
+
+static cl::opt<bool>
+    OptNoneClones("miniperf-optnone-clones",
+                  cl::desc("Do not optimize instrumented loop clones"),
+                  cl::init(false));
+
+static cl::opt<unsigned> MaxLoopDepth(
+    "miniperf-max-loop-depth",
+    cl::desc("Report loops nested up to this depth separately, deeper loops "
+             "are attributed to their parent"),
+    cl::init(3));
+
+static cl::opt<bool> VerifyClones(
+    "miniperf-verify",
+    cl::desc("Verify every instrumented loop clone, for debugging the plugin"),
+    cl::init(false));
+
+static cl::opt<bool> BlockTable(
+    "miniperf-block-table",
+    cl::desc("Describe the blocks of instrumented loops, for roofline-lite "
+             "estimates from last branch records"),
+    cl::init(false));
+
+static cl::opt<std::string> HotListPath(
+    "miniperf-hot-list",
+    cl::desc("Only instrument the loops and functions listed in this file, "
+             "defaults to $MPERF_PLUGIN_HOT_LIST"),
+    cl::value_desc("path"));
 
 namespace {
 
@@ -37,432 +96,2033 @@ static void markFunctionNoOptimize(Function *F) {
   F->addFnAttr(Attribute::NoInline);
 }
 
-unsigned getVectorBytes(Type *Ty, DataLayout &DL) {
-  auto VecTy = cast<VectorType>(Ty);
-  if (VecTy->isScalableTy()) {
-    auto ElementTy = VecTy->getElementType();
-    return 8 * DL.getTypeAllocSize(ElementTy);
-  } else {
-    return VecTy->getElementCount().getFixedValue();
+static StructType *getOrCreateStructType(LLVMContext &Ctx, StringRef Name,
+                                         ArrayRef<Type *> Elements) {
+  if (auto *Ty = StructType::getTypeByName(Ctx, Name))
+    return Ty;
+  return StructType::create(Ctx, Elements, Name);
+}
+
+/// Loop descriptors are collected by the linker into a single section per
+/// binary. The collector walks the whole table once at startup, so the per
+/// entry hook only needs the loop ID.
+static StringRef getLoopDescriptorSection(const Triple &TT) {
+  if (TT.isOSBinFormatMachO())
+    return "__DATA,__mperf_loops";
+  return "mperf_loops";
+}
+
+/// Block tables are only read along with last branch records, which perf
+/// provides on x86-64 Linux.
+static bool hasBlockTable(const Triple &TT) {
+  return BlockTable && TT.getArch() == Triple::x86_64 && TT.isOSBinFormatELF();
+}
+
+static GlobalVariable *createPrivateString(Module &M, StringRef Str,
+                                           const Twine &Name) {
+  Constant *Init = ConstantDataArray::getString(M.getContext(), Str);
+  auto *GV = new GlobalVariable(M, Init->getType(), true,
+                                GlobalValue::PrivateLinkage, Init, Name);
+  GV->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+  GV->setAlignment(Align(1));
+  return GV;
+}
+
+/// Private string constants of a module, one per distinct string. Loops of
+/// the same function and functions of the same file share their names.
+class StringPool {
+public:
+  explicit StringPool(Module &M) : M(M) {}
+
+  GlobalVariable *get(StringRef Str) {
+    GlobalVariable *&GV = Strings[Str];
+    if (!GV)
+      GV = createPrivateString(M, Str, "mperf.str");
+    return GV;
   }
+
+private:
+  Module &M;
+  StringMap<GlobalVariable *> Strings;
+};
+
+/// Computes an ID that stays the same across rebuilds of the same source, so
+/// results from different runs can be matched loop by loop.
+static uint64_t computeLoopId(StringRef Filename, StringRef FuncName,
+                              unsigned Line, unsigned Col,
+                              const Twine &Ordinal) {
+  std::string Key;
+  raw_string_ostream OS(Key);
+  OS << Filename << ":" << FuncName << ":" << Line << ":" << Col << ":"
+     << Ordinal;
+  uint64_t Id = xxHash64(OS.str());
+  // Zero is reserved for "no loop" on the collector side.
+  return Id == 0 ? 1 : Id;
 }
 
-static Function *cloneInstrumentedFunction(Function *Extracted) {
-  FunctionType *OrigTy = Extracted->getFunctionType();
+/// Region IDs only depend on the name of the region and the function it is
+/// in, so they stay the same as the code of the region changes.
+static uint64_t computeRegionId(StringRef Filename, StringRef FuncName,
+                                StringRef Name) {
+  return computeLoopId(Filename, FuncName, 0, 0, "region:" + Name);
+}
 
-  llvm::SmallVector<Type *> Args{OrigTy->param_begin(), OrigTy->param_end()};
-  Args.push_back(PointerType::get(Extracted->getContext(), 0));
+/// Bits of the descriptor flags, mirrored by the collector.
+enum DescriptorFlags : uint32_t {
+  /// The descriptor names an OpenMP parallel region rather than a loop.
+  ParallelRegionDescriptor = 1 << 0,
+  /// The OpenMP runtime splits the iterations of the loop between the threads
+  /// of the enclosing parallel region.
+  WorksharingLoop = 1 << 1,
+  /// The loop could not be versioned, it is only described so that samples in
+  /// it show up as missing coverage.
+  NotInstrumentedLoop = 1 << 2,
+  /// The loop vectorizer produced the loop or a loop nested in it.
+  VectorizedLoop = 1 << 3,
+  /// The vector width is a multiple of vscale.
+  ScalableVectorLoop = 1 << 4,
+  /// Runtime checks guard the vector loop.
+  RuntimeCheckedLoop = 1 << 5,
+  /// A scalar loop runs the iterations the vector loop leaves over.
+  RemainderFollowsLoop = 1 << 6,
+  /// The loop is the scalar remainder of a vectorized loop.
+  RemainderLoop = 1 << 7,
+  /// The loop is a region the program annotated with mperf_region_begin and
+  /// mperf_region_end, it runs once per entry.
+  AnnotatedRegionLoop = 1 << 8,
+  /// The function the loop runs in sets up a frame record, the collector can
+  /// walk its callers along the frame pointer chain.
+  FramePointerLoop = 1 << 9,
+};
 
-  auto NewTy = FunctionType::get(OrigTy->getReturnType(), Args, false);
+static uint32_t getCodegenFlags(const CodegenFacts &Facts) {
+  return (Facts.Vectorized ? VectorizedLoop : 0) |
+         (Facts.Scalable ? ScalableVectorLoop : 0) |
+         (Facts.RuntimeChecks ? RuntimeCheckedLoop : 0) |
+         (Facts.HasRemainder ? RemainderFollowsLoop : 0) |
+         (Facts.IsRemainder ? RemainderLoop : 0);
+}
 
-  auto *F = Function::Create(NewTy, Extracted->getLinkage(),
-                             Extracted->getName() + ".instrumented",
-                             Extracted->getParent());
-  ValueToValueMapTy VMap;
+/// Name of F in loop IDs and descriptors. ThinLTO promotes internal functions
+/// of a module by appending `.llvm.<hash>`, which would give the same loop a
+/// different ID before and after linking.
+static StringRef getStableFunctionName(const Function &F) {
+  constexpr StringLiteral Promoted = ".llvm.";
+  StringRef Name = F.getName();
+  size_t Suffix = Name.rfind(Promoted);
+  if (Suffix == StringRef::npos)
+    return Name;
+  StringRef Hash = Name.drop_front(Suffix + Promoted.size());
+  if (Hash.empty() || Hash.find_first_not_of("0123456789") != StringRef::npos)
+    return Name;
+  return Name.take_front(Suffix);
+}
 
-  for (const auto &Arg : enumerate(Extracted->args())) {
-    VMap[&Arg.value()] = F->getArg(Arg.index());
+/// Emits a constant descriptor for a single loop into the descriptor section.
+/// ParentId is zero for outermost loops. Line and EndLine delimit the loop in
+/// Filename, samples between them are attributed to the loop. Facts describe
+/// the optimized loop and add to Flags. Name is the name of an annotated
+/// region, empty for loops. Returns the descriptor, which the collector
+/// completes with the loop's bit in its enable mask when it registers the
+/// table.
+///
+/// Descriptors are keyed by the loop ID across modules: a function that is
+/// compiled into several modules, such as an inline function defined in a
+/// header or one imported by ThinLTO, describes each of its loops once per
+/// module, and the linker keeps a single copy of every descriptor.
+static GlobalVariable *
+emitLoopDescriptor(Module &M, StringPool &Strings, uint64_t Id,
+                   uint64_t ParentId, unsigned Line, unsigned EndLine,
+                   StringRef Filename, StringRef FuncName, uint32_t Flags = 0,
+                   const CodegenFacts &Facts = {}, StringRef Name = {}) {
+  LLVMContext &Ctx = M.getContext();
+  auto *PtrTy = PointerType::get(Ctx, 0);
+  Type *I32Ty = Type::getInt32Ty(Ctx);
+  auto *DescriptorTy = getOrCreateStructType(
+      Ctx, "mperf.loop_descriptor",
+      {Type::getInt64Ty(Ctx), Type::getInt64Ty(Ctx), I32Ty, I32Ty, PtrTy,
+       PtrTy, I32Ty, I32Ty, I32Ty, I32Ty, I32Ty, I32Ty, PtrTy});
+
+  Constant *Init = ConstantStruct::get(
+      DescriptorTy,
+      {ConstantInt::get(Type::getInt64Ty(Ctx), Id),
+       ConstantInt::get(Type::getInt64Ty(Ctx), ParentId),
+       ConstantInt::get(I32Ty, Line),
+       ConstantInt::get(I32Ty, Flags | getCodegenFlags(Facts)),
+       Strings.get(Filename), Strings.get(FuncName),
+       ConstantInt::get(I32Ty, EndLine),
+       ConstantInt::get(I32Ty, Facts.VectorWidth),
+       ConstantInt::get(I32Ty, Facts.VectorBits),
+       ConstantInt::get(I32Ty, Facts.InterleaveCount),
+       ConstantInt::get(I32Ty, Facts.EstimatedSpills),
+       // Mask index, unassigned until the table is registered.
+       ConstantInt::get(I32Ty, UINT32_MAX),
+       Name.empty() ? ConstantPointerNull::get(PtrTy)
+                    : static_cast<Constant *>(Strings.get(Name))});
+
+  std::string GVName = ("mperf.loop." + Twine::utohexstr(Id)).str();
+  if (GlobalVariable *Existing = M.getNamedGlobal(GVName))
+    return Existing;
+
+  Triple TT(M.getTargetTriple());
+  auto *GV = new GlobalVariable(M, DescriptorTy, false,
+                                GlobalValue::LinkOnceODRLinkage, Init, GVName);
+  GV->setVisibility(GlobalValue::HiddenVisibility);
+  if (!TT.isOSBinFormatMachO())
+    GV->setComdat(M.getOrInsertComdat(GVName));
+  GV->setSection(getLoopDescriptorSection(TT));
+  GV->setAlignment(Align(8));
+  appendToUsed(M, {GV});
+  return GV;
+}
+
+/// Emits a constructor that hands the descriptor table of the current binary
+/// to the collector, along with the block table where there is one. Every
+/// instrumented module gets one, the collector ignores repeated registrations
+/// of the same table.
+static void emitLoopRegistration(Module &M) {
+  if (M.getFunction("mperf.register_loops"))
+    return;
+
+  LLVMContext &Ctx = M.getContext();
+  auto *PtrTy = PointerType::get(Ctx, 0);
+  Triple TT(M.getTargetTriple());
+
+  std::string StartName, StopName;
+  if (TT.isOSBinFormatMachO()) {
+    StartName = "\1section$start$__DATA$__mperf_loops";
+    StopName = "\1section$end$__DATA$__mperf_loops";
+  } else {
+    StartName = "__start_mperf_loops";
+    StopName = "__stop_mperf_loops";
   }
 
-  SmallVector<ReturnInst *, 4> Returns;
-  CloneFunctionInto(F, Extracted, VMap,
-                    CloneFunctionChangeType::LocalChangesOnly, Returns);
+  auto GetBound = [&](StringRef Name, GlobalValue::LinkageTypes Linkage =
+                                          GlobalValue::ExternalLinkage) {
+    auto *GV = M.getGlobalVariable(Name);
+    if (!GV) {
+      GV = new GlobalVariable(M, Type::getInt8Ty(Ctx), true, Linkage, nullptr,
+                              Name);
+      if (!TT.isOSBinFormatMachO())
+        GV->setVisibility(GlobalValue::HiddenVisibility);
+    }
+    return GV;
+  };
+
+  FunctionCallee Register = M.getOrInsertFunction(
+      "mperf_roofline_internal_register_loops",
+      FunctionType::get(Type::getVoidTy(Ctx), {PtrTy, PtrTy}, false));
+
+  auto *Ctor = Function::Create(
+      FunctionType::get(Type::getVoidTy(Ctx), false),
+      GlobalValue::InternalLinkage, "mperf.register_loops", M);
+  Ctor->setMetadata("miniperf.generated",
+                    MDNode::get(Ctx, MDString::get(Ctx, "true")));
+
+  IRBuilder<> Builder(BasicBlock::Create(Ctx, "", Ctor));
+  Builder.CreateCall(Register, {GetBound(StartName), GetBound(StopName)});
+  // The bounds are null in binaries without a block table.
+  if (hasBlockTable(TT)) {
+    FunctionCallee RegisterBlocks = M.getOrInsertFunction(
+        "mperf_roofline_internal_register_blocks",
+        FunctionType::get(Type::getVoidTy(Ctx), {PtrTy, PtrTy}, false));
+    Builder.CreateCall(
+        RegisterBlocks,
+        {GetBound("__start_mperf_blocks", GlobalValue::ExternalWeakLinkage),
+         GetBound("__stop_mperf_blocks", GlobalValue::ExternalWeakLinkage)});
+  }
+  Builder.CreateRetVoid();
 
-  stripDebugInfo(*F);
-  markFunctionNoOptimize(F);
+  // Registration only sends the table, nothing needs it to run before the
+  // initializers of the binary itself.
+  appendToGlobalCtors(M, Ctor, 65535);
+}
 
-  return F;
+/// Indices of the LoopStats fields.
+enum StatIndex : unsigned {
+  TripCount,
+  BytesLoad,
+  BytesStore,
+  ScalarIntOps,
+  ScalarFloatOps,
+  ScalarDoubleOps,
+  VectorIntOps,
+  VectorFloatOps,
+  VectorDoubleOps,
+  ScalarHalfOps,
+  ScalarBFloatOps,
+  VectorHalfOps,
+  VectorBFloatOps,
+  DivOps,
+  ConversionOps,
+  AtomicOps,
+  BytesInvariant,
+  BytesUnitStride,
+  BytesStrided,
+  BytesIndirect,
+  FootprintBytes,
+  NumStats,
+};
+
+/// Picks the op counter of a value of type Ty, by element type and by
+/// whether it is a vector. Pointers count as integers, wider floating-point
+/// types as doubles.
+static StatIndex getOpStat(Type *Ty) {
+  bool IsVector = Ty->isVectorTy();
+  Type *ElementTy = Ty->getScalarType();
+  if (ElementTy->isHalfTy())
+    return IsVector ? VectorHalfOps : ScalarHalfOps;
+  if (ElementTy->isBFloatTy())
+    return IsVector ? VectorBFloatOps : ScalarBFloatOps;
+  if (ElementTy->isFloatTy())
+    return IsVector ? VectorFloatOps : ScalarFloatOps;
+  if (ElementTy->isFloatingPointTy())
+    return IsVector ? VectorDoubleOps : ScalarDoubleOps;
+  return IsVector ? VectorIntOps : ScalarIntOps;
 }
 
-struct MiniperfInstr : PassInfoMixin<MiniperfInstr> {
-  PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
-    if (F.hasMetadata("miniperf.generated"))
-      return PreservedAnalyses::all();
+/// Number of elements of a value of type Ty, in multiples of vscale for
+/// scalable vectors.
+static ElementCount getElementCount(Type *Ty) {
+  if (auto *VecTy = dyn_cast<VectorType>(Ty))
+    return VecTy->getElementCount();
+  return ElementCount::getFixed(1);
+}
 
-    auto &LoopInfo = FAM.getResult<LoopAnalysis>(F);
-    auto &RI = FAM.getResult<RegionInfoAnalysis>(F);
-    auto &DT = FAM.getResult<DominatorTreeAnalysis>(F);
+/// Element-wise ops of an instruction with the given opcode, or of a call to
+/// the intrinsic ID, as pairs of a stat and the number of ops per element.
+/// Ty is the type the op works on, the operand type for comparisons.
+static SmallVector<std::pair<StatIndex, unsigned>, 2>
+getElementOps(unsigned Opcode, Intrinsic::ID ID, Type *Ty) {
+  switch (Opcode) {
+  case Instruction::UDiv:
+  case Instruction::SDiv:
+  case Instruction::URem:
+  case Instruction::SRem:
+  case Instruction::FDiv:
+  case Instruction::FRem:
+    return {{DivOps, 1}, {getOpStat(Ty), 1}};
+  case Instruction::Add:
+  case Instruction::Sub:
+  case Instruction::Mul:
+  case Instruction::Shl:
+  case Instruction::LShr:
+  case Instruction::AShr:
+  case Instruction::And:
+  case Instruction::Or:
+  case Instruction::Xor:
+  case Instruction::FAdd:
+  case Instruction::FSub:
+  case Instruction::FMul:
+  case Instruction::FNeg:
+  case Instruction::ICmp:
+  case Instruction::FCmp:
+    return {{getOpStat(Ty), 1}};
+  case Instruction::FPTrunc:
+  case Instruction::FPExt:
+  case Instruction::FPToUI:
+  case Instruction::FPToSI:
+  case Instruction::UIToFP:
+  case Instruction::SIToFP:
+    return {{ConversionOps, 1}};
+  case Instruction::Call:
+    break;
+  default:
+    return {};
+  }
 
-    CodeExtractorAnalysisCache CEAC(F);
-
-    IRBuilder<> Builder(F.getContext());
-
-    auto LoopInfoTy = StructType::create(F.getContext(),
-                                         {Type::getInt32Ty(F.getContext()),
-                                          PointerType::get(F.getContext(), 0),
-                                          PointerType::get(F.getContext(), 0)},
-                                         "LoopInfo");
-
-    auto LoopStatsTy = StructType::create(F.getContext(),
-                                          {
-                                              // Trip count
-                                              Type::getInt64Ty(F.getContext()),
-                                              // Bytes load
-                                              Type::getInt64Ty(F.getContext()),
-                                              // Bytes store
-                                              Type::getInt64Ty(F.getContext()),
-                                              // Scalar int ops
-                                              Type::getInt64Ty(F.getContext()),
-                                              // Scalar float ops
-                                              Type::getInt64Ty(F.getContext()),
-                                              // Scalar double ops
-                                              Type::getInt64Ty(F.getContext()),
-                                              // Vector int ops
-                                              Type::getInt64Ty(F.getContext()),
-                                              // Vector float ops
-                                              Type::getInt64Ty(F.getContext()),
-                                              // Vector double ops
-                                              Type::getInt64Ty(F.getContext()),
-                                          },
-                                          "LoopStats");
-
-    Function *NotifyBegin =
-        F.getParent()->getFunction("mperf_roofline_internal_notify_loop_begin");
-    if (!NotifyBegin) {
-      auto FuncTy = FunctionType::get(PointerType::get(F.getContext(), 0),
-                                      {PointerType::get(F.getContext(), 0)}, 0);
-      NotifyBegin = Function::Create(
-          FuncTy, llvm::GlobalValue::ExternalLinkage,
-          "mperf_roofline_internal_notify_loop_begin", F.getParent());
-    }
+  switch (ID) {
+  case Intrinsic::fmuladd:
+  case Intrinsic::fma:
+    return {{getOpStat(Ty), 2}};
+  case Intrinsic::minnum:
+  case Intrinsic::minimum:
+  case Intrinsic::maxnum:
+  case Intrinsic::maximum:
+  case Intrinsic::sqrt:
+  case Intrinsic::smin:
+  case Intrinsic::smax:
+  case Intrinsic::umin:
+  case Intrinsic::umax:
+  case Intrinsic::abs:
+    return {{getOpStat(Ty), 1}};
+  case Intrinsic::fptosi_sat:
+  case Intrinsic::fptoui_sat:
+    return {{ConversionOps, 1}};
+  default:
+    return {};
+  }
+}
+
+/// Classifies an access of type AccessTy at Ptr by how its address changes
+/// in the innermost loop around I. Returns the access pattern counter.
+static StatIndex classifyAccess(Instruction &I, Value *Ptr, Type *AccessTy,
+                                ScalarEvolution &SE, LoopInfo &LI) {
+  Loop *L = LI.getLoopFor(I.getParent());
+  // Vectors of pointers are gathers and scatters.
+  if (!L || !SE.isSCEVable(Ptr->getType()))
+    return BytesIndirect;
+
+  const SCEV *Addr = SE.getSCEV(Ptr);
+  if (SE.isLoopInvariant(Addr, L))
+    return BytesInvariant;
+  auto *AddRec = dyn_cast<SCEVAddRecExpr>(Addr);
+  if (!AddRec || AddRec->getLoop() != L || !AddRec->isAffine())
+    return BytesIndirect;
+
+  const SCEV *Step = AddRec->getStepRecurrence(SE);
+  const SCEV *Size = SE.getStoreSizeOfExpr(Step->getType(), AccessTy);
+  if (Step == Size || Step == SE.getNegativeSCEV(Size))
+    return BytesUnitStride;
+  return BytesStrided;
+}
+
+/// A masked access moves the elements of DataTy selected by Mask.
+struct MaskedAccess {
+  Value *Ptr;
+  Value *Mask;
+  Type *DataTy;
+  bool IsStore;
+};
+
+/// Recognizes masked loads and stores, gathers and scatters, and expanding
+/// loads and compressing stores.
+static std::optional<MaskedAccess> getMaskedAccess(const IntrinsicInst &II) {
+  switch (II.getIntrinsicID()) {
+  case Intrinsic::masked_load:
+  case Intrinsic::masked_gather:
+    return MaskedAccess{II.getArgOperand(0), II.getArgOperand(2),
+                        II.getType(), false};
+  case Intrinsic::masked_expandload:
+    return MaskedAccess{II.getArgOperand(0), II.getArgOperand(1),
+                        II.getType(), false};
+  case Intrinsic::masked_store:
+  case Intrinsic::masked_scatter:
+    return MaskedAccess{II.getArgOperand(1), II.getArgOperand(3),
+                        II.getArgOperand(0)->getType(), true};
+  case Intrinsic::masked_compressstore:
+    return MaskedAccess{II.getArgOperand(1), II.getArgOperand(2),
+                        II.getArgOperand(0)->getType(), true};
+  default:
+    return std::nullopt;
+  }
+}
+
+/// Number of set lanes of a constant fixed-width mask.
+static std::optional<uint64_t> getConstantActiveLanes(Value *Mask) {
+  auto *C = dyn_cast<Constant>(Mask);
+  auto *MaskTy = dyn_cast<FixedVectorType>(Mask->getType());
+  if (!C || !MaskTy)
+    return std::nullopt;
+
+  uint64_t Lanes = 0;
+  for (unsigned Idx = 0; Idx < MaskTy->getNumElements(); ++Idx) {
+    auto *Lane = dyn_cast_or_null<ConstantInt>(C->getAggregateElement(Idx));
+    if (!Lane)
+      return std::nullopt;
+    Lanes += Lane->isOne();
+  }
+  return Lanes;
+}
 
-    Function *NotifyEnd =
-        F.getParent()->getFunction("mperf_roofline_internal_notify_loop_end");
-    if (!NotifyEnd) {
-      auto FuncTy = FunctionType::get(Type::getVoidTy(F.getContext()),
-                                      {PointerType::get(F.getContext(), 0)}, 0);
-      NotifyEnd = Function::Create(FuncTy, llvm::GlobalValue::ExternalLinkage,
-                                   "mperf_roofline_internal_notify_loop_end",
-                                   F.getParent());
+/// Computes how much a single execution of BB adds to each LoopStats field.
+/// The first NumStats weights are fixed, the next NumStats are multiplied by
+/// vscale, which is only known at run time.
+///
+/// Every access also adds its bytes to one of the access pattern counters,
+/// see classifyAccess. Memory intrinsics move a contiguous block and count
+/// as unit-stride.
+///
+/// Arithmetic, bitwise and comparison instructions count as ops of their
+/// operand type. Divisions and remainders are also counted in DivOps, as
+/// they are much slower than the other ops. Floating-point conversions only
+/// go to ConversionOps, they do not contribute to the arithmetic intensity.
+/// Atomic accesses count as memory traffic and in AtomicOps, a
+/// read-modify-write also as a load, a store and, unless it is a plain
+/// exchange, an op.
+static CounterWeights computeBlockWeights(BasicBlock &BB,
+                                          const DataLayout &DL,
+                                          ScalarEvolution &SE, LoopInfo &LI) {
+  CounterWeights Weights(2 * NumStats, 0);
+  auto Add = [&](StatIndex Stat, ElementCount Count, uint64_t PerElement) {
+    unsigned Idx = Count.isScalable() ? NumStats + Stat : Stat;
+    Weights[Idx] += Count.getKnownMinValue() * PerElement;
+  };
+  auto AddOps = [&](Type *Ty, unsigned OpsPerElement) {
+    Add(getOpStat(Ty), getElementCount(Ty), OpsPerElement);
+  };
+  auto AddBytes = [&](StatIndex Stat, Instruction &I, Value *Ptr, Type *Ty) {
+    ElementCount Count = getElementCount(Ty);
+    uint64_t ElementBytes = DL.getTypeAllocSize(Ty->getScalarType());
+    Add(Stat, Count, ElementBytes);
+    Add(classifyAccess(I, Ptr, Ty, SE, LI), Count, ElementBytes);
+  };
+
+  for (auto &&I : BB) {
+    switch (I.getOpcode()) {
+    case Instruction::Load:
+      AddBytes(BytesLoad, I, getLoadStorePointerOperand(&I), I.getType());
+      if (cast<LoadInst>(I).isAtomic())
+        Weights[AtomicOps] += 1;
+      continue;
+    case Instruction::Store:
+      AddBytes(BytesStore, I, getLoadStorePointerOperand(&I),
+               I.getOperand(0)->getType());
+      if (cast<StoreInst>(I).isAtomic())
+        Weights[AtomicOps] += 1;
+      continue;
+    case Instruction::AtomicRMW: {
+      auto &RMW = cast<AtomicRMWInst>(I);
+      Type *Ty = RMW.getValOperand()->getType();
+      AddBytes(BytesLoad, I, RMW.getPointerOperand(), Ty);
+      AddBytes(BytesStore, I, RMW.getPointerOperand(), Ty);
+      Weights[AtomicOps] += 1;
+      if (RMW.getOperation() != AtomicRMWInst::Xchg)
+        AddOps(RMW.getValOperand()->getType(), 1);
+      continue;
+    }
+    case Instruction::AtomicCmpXchg: {
+      auto &CmpXchg = cast<AtomicCmpXchgInst>(I);
+      Type *Ty = CmpXchg.getNewValOperand()->getType();
+      AddBytes(BytesLoad, I, CmpXchg.getPointerOperand(), Ty);
+      AddBytes(BytesStore, I, CmpXchg.getPointerOperand(), Ty);
+      Weights[AtomicOps] += 1;
+      AddOps(CmpXchg.getNewValOperand()->getType(), 1);
+      continue;
+    }
+    default:
+      break;
     }
 
-    Function *NotifyStats =
-        F.getParent()->getFunction("mperf_roofline_internal_notify_loop_stats");
-    if (!NotifyStats) {
-      auto FuncTy = FunctionType::get(Type::getVoidTy(F.getContext()),
-                                      {PointerType::get(F.getContext(), 0),
-                                       PointerType::get(F.getContext(), 0)},
-                                      0);
-      NotifyStats = Function::Create(
-          FuncTy, llvm::GlobalValue::ExternalLinkage,
-          "mperf_roofline_internal_notify_loop_stats", F.getParent());
+    // Accesses and vector-predicated ops whose size is only known at run
+    // time are counted by emitDynamicCounts.
+    Intrinsic::ID ID = Intrinsic::not_intrinsic;
+    if (auto *II = dyn_cast<IntrinsicInst>(&I)) {
+      ID = II->getIntrinsicID();
+      if (isa<VPIntrinsic>(II))
+        continue;
+      if (auto *MI = dyn_cast<AnyMemIntrinsic>(II)) {
+        if (auto *Length = dyn_cast<ConstantInt>(MI->getLength())) {
+          uint64_t Bytes = Length->getZExtValue();
+          bool Transfer = isa<AnyMemTransferInst>(MI);
+          if (Transfer)
+            Weights[BytesLoad] += Bytes;
+          Weights[BytesStore] += Bytes;
+          Weights[BytesUnitStride] += Transfer ? 2 * Bytes : Bytes;
+        }
+        continue;
+      }
+      if (auto Access = getMaskedAccess(*II)) {
+        Type *ElementTy = Access->DataTy->getScalarType();
+        if (auto Lanes = getConstantActiveLanes(Access->Mask)) {
+          uint64_t Bytes = *Lanes * DL.getTypeAllocSize(ElementTy);
+          Weights[Access->IsStore ? BytesStore : BytesLoad] += Bytes;
+          Weights[classifyAccess(I, Access->Ptr, Access->DataTy, SE, LI)] +=
+              Bytes;
+        }
+        continue;
+      }
     }
 
-    Function *IsInstrEnabled = F.getParent()->getFunction(
-        "mperf_roofline_internal_is_instrumented_profiling");
-    if (!IsInstrEnabled) {
-      auto FuncTy = FunctionType::get(Type::getInt32Ty(F.getContext()), {}, 0);
-      IsInstrEnabled = Function::Create(
-          FuncTy, llvm::GlobalValue::ExternalLinkage,
-          "mperf_roofline_internal_is_instrumented_profiling", F.getParent());
+    // The result of a comparison is a mask, the op works on the operand type.
+    Type *Ty = isa<CmpInst>(I) ? I.getOperand(0)->getType() : I.getType();
+    for (auto [Stat, OpsPerElement] : getElementOps(I.getOpcode(), ID, Ty))
+      Add(Stat, getElementCount(Ty), OpsPerElement);
+  }
+  return Weights;
+}
+
+/// Emits the block table of an instrumented loop nest. Every block of the
+/// original version is described by the weights of its clone and attributed
+/// to the innermost reported loop around it. The header of a reported loop
+/// adds one trip, the preheader of a nested loop an invocation of it. mperf
+/// multiplies the counts by block executions from last branch records, which
+/// estimates loop stats without running the instrumented version. Counts that
+/// emitDynamicCounts adds at run time and footprints are left out.
+///
+/// Entries refer to their block by address, which keeps the block in place
+/// through code generation. The table lives in the comdat of F, so that the
+/// linker drops it along with the function.
+static void
+emitBlockTable(Function &F, ArrayRef<BasicBlock *> Blocks,
+               ValueToValueMapTy &VMap, ArrayRef<Loop *> SlotLoops,
+               ArrayRef<uint64_t> SlotIds,
+               const DenseMap<BasicBlock *, CounterWeights> &Weights) {
+  Module &M = *F.getParent();
+  LLVMContext &Ctx = M.getContext();
+  Type *I64Ty = Type::getInt64Ty(Ctx);
+  auto *EntryTy = getOrCreateStructType(
+      Ctx, "mperf.block_descriptor",
+      {I64Ty, I64Ty, PointerType::get(Ctx, 0),
+       ArrayType::get(I64Ty, NumStats)});
+
+  SmallVector<Constant *> Entries;
+  for (BasicBlock *BB : Blocks) {
+    auto *Clone = cast_or_null<BasicBlock>(VMap.lookup(BB));
+    auto It = Weights.find(Clone);
+    if (It == Weights.end() || BB->isEHPad())
+      continue;
+
+    // Slots are in preorder, the last one that contains the block is the
+    // innermost.
+    unsigned Slot = 0;
+    uint64_t EnteredId = 0;
+    for (unsigned Idx = 1; Idx < SlotLoops.size(); ++Idx) {
+      if (SlotLoops[Idx]->contains(Clone))
+        Slot = Idx;
+      if (SlotLoops[Idx]->getLoopPreheader() == Clone)
+        EnteredId = SlotIds[Idx];
     }
 
-    SmallVector<Loop *> TopLevelLoops;
-    llvm::copy_if(LoopInfo, std::back_inserter(TopLevelLoops), [](Loop *L) {
-      // Only consider outermost loops
-      if (L->getParentLoop())
-        return false;
+    SmallVector<uint64_t, NumStats> Stats(It->second.begin(),
+                                          It->second.begin() + NumStats);
+    if (SlotLoops[Slot]->getHeader() == Clone)
+      Stats[TripCount] += 1;
+    Entries.push_back(ConstantStruct::get(
+        EntryTy, {ConstantInt::get(I64Ty, SlotIds[Slot]),
+                  ConstantInt::get(I64Ty, EnteredId),
+                  BlockAddress::get(&F, BB),
+                  ConstantDataArray::get(Ctx, Stats)}));
+  }
+  if (Entries.empty())
+    return;
+
+  auto *TableTy = ArrayType::get(EntryTy, Entries.size());
+  auto *GV = new GlobalVariable(M, TableTy, true, GlobalValue::PrivateLinkage,
+                                ConstantArray::get(TableTy, Entries),
+                                "mperf.blocks");
+  GV->setSection("mperf_blocks");
+  GV->setAlignment(Align(8));
+  GV->setComdat(F.getComdat());
+  appendToUsed(M, {GV});
+}
+
+/// Number of set lanes of Mask as an i64.
+static Value *emitActiveLanes(IRBuilder<> &Builder, Value *Mask) {
+  auto *MaskTy = cast<VectorType>(Mask->getType());
+  if (auto *FixedTy = dyn_cast<FixedVectorType>(MaskTy)) {
+    Value *Bits = Builder.CreateBitCast(
+        Mask, Builder.getIntNTy(FixedTy->getNumElements()));
+    return Builder.CreateZExtOrTrunc(
+        Builder.CreateUnaryIntrinsic(Intrinsic::ctpop, Bits),
+        Builder.getInt64Ty());
+  }
+  return Builder.CreateAddReduce(Builder.CreateZExt(
+      Mask,
+      VectorType::get(Builder.getInt64Ty(), MaskTy->getElementCount())));
+}
+
+/// Number of lanes a vector-predicated intrinsic works on as an i64, the
+/// lanes below the explicit vector length that are set in the mask.
+static Value *emitEnabledLanes(IRBuilder<> &Builder, VPIntrinsic &VPI) {
+  Value *EVL = VPI.getVectorLengthParam();
+  Value *Mask = VPI.getMaskParam();
+  auto *AllLanes = dyn_cast_or_null<Constant>(Mask);
+  if (!Mask || (AllLanes && AllLanes->isAllOnesValue()))
+    return Builder.CreateZExtOrTrunc(EVL, Builder.getInt64Ty());
+
+  ElementCount Count = cast<VectorType>(Mask->getType())->getElementCount();
+  Value *Lanes = Builder.CreateStepVector(
+      VectorType::get(EVL->getType(), Count));
+  Value *BelowEVL =
+      Builder.CreateICmpULT(Lanes, Builder.CreateVectorSplat(Count, EVL));
+  return emitActiveLanes(Builder, Builder.CreateAnd(Mask, BelowEVL));
+}
 
-      if (!L->getLoopPreheader()) {
-        errs() << "Found a loop without a preheader at " << L->getLocStr()
-               << ". Skipping.\n";
-        return false;
+/// Counts the parts of the loop body whose weight is only known at run time,
+/// right before they run, into the counters of every slot that contains
+/// them: bytes of memory intrinsics with a non-constant length, of masked
+/// accesses with a non-constant mask and of vector-predicated accesses, and
+/// ops of vector-predicated intrinsics. Masked and vector-predicated
+/// intrinsics count the enabled lanes only, which is how the tail of a loop
+/// vectorized with an explicit vector length (e.g. vsetvli on RISC-V) is
+/// accounted for.
+static void emitDynamicCounts(ArrayRef<Loop *> SlotLoops,
+                              ArrayRef<AllocaInst *> Counters,
+                              const DataLayout &DL, ScalarEvolution &SE,
+                              LoopInfo &LI) {
+  SmallVector<IntrinsicInst *> Intrinsics;
+  for (BasicBlock *BB : SlotLoops[0]->getBlocks())
+    for (Instruction &I : *BB)
+      if (auto *II = dyn_cast<IntrinsicInst>(&I))
+        Intrinsics.push_back(II);
+
+  for (IntrinsicInst *II : Intrinsics) {
+    IRBuilder<> Builder(II);
+    auto AddCount = [&](StatIndex Stat, Value *Count) {
+      for (unsigned Slot = 0; Slot < SlotLoops.size(); ++Slot) {
+        if (!SlotLoops[Slot]->contains(II))
+          continue;
+        AllocaInst *Counter = Counters[Slot * NumStats + Stat];
+        Value *Old = Builder.CreateLoad(Builder.getInt64Ty(), Counter);
+        Builder.CreateStore(Builder.CreateAdd(Old, Count), Counter);
       }
+    };
+    auto AddElements = [&](StatIndex Stat, Value *Lanes, uint64_t PerLane) {
+      AddCount(Stat, Builder.CreateMul(Lanes, Builder.getInt64(PerLane)));
+    };
 
-      if (!L->getExitBlock()) {
-        errs() << "Found a loop without an exit block at " << L->getLocStr()
-               << ". Skipping.\n";
-        return false;
+    if (auto *MI = dyn_cast<AnyMemIntrinsic>(II)) {
+      if (isa<ConstantInt>(MI->getLength()))
+        continue;
+      Value *Bytes =
+          Builder.CreateZExtOrTrunc(MI->getLength(), Builder.getInt64Ty());
+      if (isa<AnyMemTransferInst>(MI)) {
+        AddCount(BytesLoad, Bytes);
+        AddCount(BytesUnitStride, Bytes);
       }
+      AddCount(BytesStore, Bytes);
+      AddCount(BytesUnitStride, Bytes);
+    } else if (auto Access = getMaskedAccess(*II)) {
+      if (getConstantActiveLanes(Access->Mask))
+        continue;
+      Value *Lanes = emitActiveLanes(Builder, Access->Mask);
+      uint64_t ElementBytes =
+          DL.getTypeAllocSize(Access->DataTy->getScalarType());
+      AddElements(Access->IsStore ? BytesStore : BytesLoad, Lanes,
+                  ElementBytes);
+      AddElements(classifyAccess(*II, Access->Ptr, Access->DataTy, SE, LI),
+                  Lanes, ElementBytes);
+    } else if (auto *VPI = dyn_cast<VPIntrinsic>(II)) {
+      if (!VPI->getVectorLengthParam())
+        continue;
 
-      return true;
-    });
+      Intrinsic::ID ID = VPI->getIntrinsicID();
+      if (auto PtrPos = VPIntrinsic::getMemoryPointerParamPos(ID)) {
+        auto DataPos = VPIntrinsic::getMemoryDataParamPos(ID);
+        Type *DataTy =
+            DataPos ? VPI->getArgOperand(*DataPos)->getType() : VPI->getType();
+        Value *Lanes = emitEnabledLanes(Builder, *VPI);
+        uint64_t ElementBytes = DL.getTypeAllocSize(DataTy->getScalarType());
+        // Strided accesses step through memory within a single call.
+        bool Strided = ID == Intrinsic::experimental_vp_strided_load ||
+                       ID == Intrinsic::experimental_vp_strided_store;
+        StatIndex Pattern =
+            Strided ? BytesStrided
+                    : classifyAccess(*VPI, VPI->getArgOperand(*PtrPos), DataTy,
+                                     SE, LI);
+        AddElements(DataPos ? BytesStore : BytesLoad, Lanes, ElementBytes);
+        AddElements(Pattern, Lanes, ElementBytes);
+        continue;
+      }
 
-    for (auto L : TopLevelLoops) {
-      Region *R = RI.getRegionFor(L->getHeader());
-      SmallVector<BasicBlock *> RegionBlocks(R->block_begin(), R->block_end());
-      CodeExtractor CE(RegionBlocks, &DT);
+      unsigned Opcode = Instruction::Call;
+      Intrinsic::ID FunctionalID = Intrinsic::not_intrinsic;
+      if (auto FunctionalOpcode = VPI->getFunctionalOpcode())
+        Opcode = *FunctionalOpcode;
+      else if (auto FunctionalIntrinsic = VPI->getFunctionalIntrinsicID())
+        FunctionalID = *FunctionalIntrinsic;
+      else
+        continue;
 
-      size_t LineNo = L->getStartLoc().getLine();
-      std::string Filename = L->getLocStr().substr(0, L->getLocStr().find(":"));
+      Type *Ty = isa<VPCmpIntrinsic>(VPI) ? VPI->getArgOperand(0)->getType()
+                                          : VPI->getType();
+      auto Ops = getElementOps(Opcode, FunctionalID, Ty);
+      if (Ops.empty())
+        continue;
+      Value *Lanes = emitEnabledLanes(Builder, *VPI);
+      for (auto [Stat, OpsPerElement] : Ops)
+        AddElements(Stat, Lanes, OpsPerElement);
+    }
+  }
+}
+
+/// Moves the instrumented version of a loop, the blocks reachable from Entry
+/// without passing one of Stops, into a function of its own that is not
+/// optimized. The baseline version stays in place.
+static void outlineUnoptimized(Function &F, BasicBlock *Entry,
+                               ArrayRef<BasicBlock *> Stops,
+                               DominatorTree &DT) {
+  SmallVector<BasicBlock *> Blocks{Entry};
+  SmallPtrSet<BasicBlock *, 32> Seen{Entry};
+  Seen.insert(Stops.begin(), Stops.end());
+  for (size_t Idx = 0; Idx < Blocks.size(); ++Idx)
+    for (BasicBlock *Succ : successors(Blocks[Idx]))
+      if (Seen.insert(Succ).second)
+        Blocks.push_back(Succ);
+
+  CodeExtractorAnalysisCache CEAC(F);
+  CodeExtractor CE(Blocks, &DT);
+  Function *Outlined = CE.isEligible() ? CE.extractCodeRegion(CEAC) : nullptr;
+  if (!Outlined) {
+    errs() << "Failed to outline an instrumented loop of " << F.getName()
+           << ", it stays optimized.\n";
+    return;
+  }
+  Outlined->setMetadata("miniperf.generated",
+                        MDNode::get(F.getContext(),
+                                    MDString::get(F.getContext(), "true")));
+  markFunctionNoOptimize(Outlined);
+}
+
+/// The address and the type of a load or store, an atomic access, a masked
+/// load or store, or a vector-predicated load or store. Memory intrinsics are
+/// not included.
+struct MemoryAccess {
+  Value *Ptr;
+  Type *AccessTy;
+};
+
+static std::optional<MemoryAccess> getMemoryAccess(Instruction &I) {
+  if (auto *Load = dyn_cast<LoadInst>(&I))
+    return MemoryAccess{Load->getPointerOperand(), Load->getType()};
+  if (auto *Store = dyn_cast<StoreInst>(&I))
+    return MemoryAccess{Store->getPointerOperand(),
+                        Store->getValueOperand()->getType()};
+  if (auto *RMW = dyn_cast<AtomicRMWInst>(&I))
+    return MemoryAccess{RMW->getPointerOperand(),
+                        RMW->getValOperand()->getType()};
+  if (auto *CmpXchg = dyn_cast<AtomicCmpXchgInst>(&I))
+    return MemoryAccess{CmpXchg->getPointerOperand(),
+                        CmpXchg->getNewValOperand()->getType()};
+  if (auto *VPI = dyn_cast<VPIntrinsic>(&I)) {
+    Intrinsic::ID ID = VPI->getIntrinsicID();
+    auto PtrPos = VPIntrinsic::getMemoryPointerParamPos(ID);
+    if (!PtrPos)
+      return std::nullopt;
+    auto DataPos = VPIntrinsic::getMemoryDataParamPos(ID);
+    return MemoryAccess{VPI->getArgOperand(*PtrPos),
+                        DataPos ? VPI->getArgOperand(*DataPos)->getType()
+                                : VPI->getType()};
+  }
+  if (auto *II = dyn_cast<IntrinsicInst>(&I))
+    if (auto Access = getMaskedAccess(*II))
+      return MemoryAccess{Access->Ptr, Access->DataTy};
+  return std::nullopt;
+}
 
-      Function *Extracted = CE.extractCodeRegion(CEAC);
-      if (!Extracted) {
-        errs() << "Failed to outline loop at " << L->getLocStr()
-               << ". Skipping.\n";
+/// Bytes between the lowest and the highest address of Access during one
+/// invocation of L, plus the size of the access. The address must be an
+/// affine function of L and the loops nested in it, with steps and trip
+/// counts known on entry of L. Returns null otherwise.
+static const SCEV *getAccessExtent(const MemoryAccess &Access, Loop &L,
+                                   ScalarEvolution &SE) {
+  // Vectors of pointers are gathers and scatters.
+  if (!SE.isSCEVable(Access.Ptr->getType()))
+    return nullptr;
+
+  Type *IntTy = SE.getEffectiveSCEVType(Access.Ptr->getType());
+  const SCEV *Extent = SE.getStoreSizeOfExpr(IntTy, Access.AccessTy);
+  const SCEV *Addr = SE.getSCEV(Access.Ptr);
+  while (auto *AddRec = dyn_cast<SCEVAddRecExpr>(Addr)) {
+    const Loop *Inner = AddRec->getLoop();
+    if (!L.contains(Inner))
+      break;
+    if (!AddRec->isAffine())
+      return nullptr;
+
+    const SCEV *BackedgeTakenCount = SE.getBackedgeTakenCount(Inner);
+    const SCEV *Step = AddRec->getStepRecurrence(SE);
+    if (isa<SCEVCouldNotCompute>(BackedgeTakenCount) ||
+        !SE.isLoopInvariant(BackedgeTakenCount, &L) ||
+        !SE.isLoopInvariant(Step, &L))
+      return nullptr;
+
+    const SCEV *Distance = SE.getAbsExpr(
+        SE.getTruncateOrSignExtend(Step, IntTy), /*IsNSW=*/false);
+    Extent = SE.getAddExpr(
+        Extent,
+        SE.getMulExpr(Distance,
+                      SE.getTruncateOrZeroExtend(BackedgeTakenCount, IntTy)));
+    Addr = AddRec->getStart();
+  }
+
+  if (!SE.isLoopInvariant(Addr, &L))
+    return nullptr;
+  return Extent;
+}
+
+/// Estimates the bytes a single invocation of L touches, from the address
+/// range of each access, see getAccessExtent. Accesses off the same base
+/// pointer are assumed to overlap and the widest of them counts. The
+/// estimate is an i64 that can be expanded at the end of the preheader, or
+/// null if no access could be described. Accesses that are not part of it
+/// are added to Unknown.
+static const SCEV *computeFootprint(Loop &L, ScalarEvolution &SE,
+                                    SCEVExpander &Expander,
+                                    SmallVectorImpl<Instruction *> &Unknown) {
+  BasicBlock *Preheader = L.getLoopPreheader();
+  Type *I64Ty = Type::getInt64Ty(L.getHeader()->getContext());
+  MapVector<const SCEV *, const SCEV *> Bases;
+  for (BasicBlock *BB : L.getBlocks()) {
+    for (Instruction &I : *BB) {
+      auto Access = getMemoryAccess(I);
+      if (!Access)
+        continue;
+
+      const SCEV *Extent =
+          Preheader ? getAccessExtent(*Access, L, SE) : nullptr;
+      if (Extent)
+        Extent = SE.getTruncateOrZeroExtend(Extent, I64Ty);
+      if (!Extent ||
+          !Expander.isSafeToExpandAt(Extent, Preheader->getTerminator())) {
+        Unknown.push_back(&I);
+        continue;
       }
 
-      Extracted->setMetadata(
-          "miniperf.generated",
-          MDNode::get(F.getContext(), MDString::get(F.getContext(), "true")));
+      const SCEV *Base = SE.getPointerBase(SE.getSCEV(Access->Ptr));
+      auto [It, Inserted] = Bases.insert({Base, Extent});
+      if (!Inserted)
+        It->second = SE.getUMaxExpr(It->second, Extent);
+    }
+  }
+
+  if (Bases.empty())
+    return nullptr;
+  SmallVector<const SCEV *> Extents;
+  for (auto &[Base, Extent] : Bases)
+    Extents.push_back(Extent);
+  return SE.getAddExpr(Extents);
+}
 
-      // LoopInfo.erase(L);
+/// Masked accesses with a non-constant mask and vector-predicated accesses,
+/// whose enabled lanes are only known at run time.
+static bool hasRuntimeLanes(Instruction &I) {
+  if (auto *VPI = dyn_cast<VPIntrinsic>(&I))
+    return VPI->getVectorLengthParam();
+  auto *II = dyn_cast<IntrinsicInst>(&I);
+  auto Access = II ? getMaskedAccess(*II) : std::nullopt;
+  return Access && !getConstantActiveLanes(Access->Mask);
+}
 
-      ValueToValueMapTy VMap;
+/// Adds the bytes of the accesses computeFootprint could not describe and
+/// whose lanes are only known at run time to the footprint of their slot,
+/// right before they run. Only the enabled lanes count, like in
+/// emitDynamicCounts.
+static void
+emitDynamicFootprints(ArrayRef<std::pair<Instruction *, unsigned>> Accesses,
+                      ArrayRef<AllocaInst *> Counters, const DataLayout &DL) {
+  for (auto [I, Slot] : Accesses) {
+    IRBuilder<> Builder(I);
+    Value *Lanes =
+        isa<VPIntrinsic>(I)
+            ? emitEnabledLanes(Builder, *cast<VPIntrinsic>(I))
+            : emitActiveLanes(Builder,
+                              getMaskedAccess(*cast<IntrinsicInst>(I))->Mask);
+    Type *AccessTy = getMemoryAccess(*I)->AccessTy;
+    Value *Bytes = Builder.CreateMul(
+        Lanes,
+        Builder.getInt64(DL.getTypeAllocSize(AccessTy->getScalarType())));
+    AllocaInst *Counter = Counters[Slot * NumStats + FootprintBytes];
+    Value *Old = Builder.CreateLoad(Builder.getInt64Ty(), Counter);
+    Builder.CreateStore(Builder.CreateAdd(Old, Bytes), Counter);
+  }
+}
 
-      Function *Instrumented = cloneInstrumentedFunction(Extracted);
+/// Expands the number of header executions of a single invocation of L at
+/// the end of its preheader. Returns null if ScalarEvolution cannot compute it
+/// there.
+static Value *expandTripCount(Loop &L, ScalarEvolution &SE,
+                              SCEVExpander &Expander) {
+  BasicBlock *Preheader = L.getLoopPreheader();
+  if (!Preheader)
+    return nullptr;
+
+  const SCEV *BackedgeTakenCount = SE.getBackedgeTakenCount(&L);
+  if (isa<SCEVCouldNotCompute>(BackedgeTakenCount) ||
+      !BackedgeTakenCount->getType()->isIntegerTy())
+    return nullptr;
+
+  Type *I64Ty = Type::getInt64Ty(Preheader->getContext());
+  const SCEV *TripCount =
+      SE.getAddExpr(SE.getTruncateOrZeroExtend(BackedgeTakenCount, I64Ty),
+                    SE.getOne(I64Ty));
+  Instruction *InsertPt = Preheader->getTerminator();
+  if (!Expander.isSafeToExpandAt(TripCount, InsertPt))
+    return nullptr;
+
+  return Expander.expandCodeFor(TripCount, I64Ty, InsertPt);
+}
 
-      CallInst *CallSite = cast<CallInst>(*Extracted->user_begin());
+/// Key of the loop metadata that names an annotated region.
+constexpr StringLiteral RegionNameKey = "miniperf.region.name";
+
+/// Name passed to mperf_region_begin for a region turned into L, empty for
+/// other loops.
+static StringRef getRegionName(const Loop &L) {
+  MDNode *LoopID = L.getLoopID();
+  if (!LoopID)
+    return {};
+  for (const MDOperand &Op : drop_begin(LoopID->operands())) {
+    auto *Node = dyn_cast<MDNode>(Op);
+    if (!Node || Node->getNumOperands() != 2)
+      continue;
+    auto *Key = dyn_cast<MDString>(Node->getOperand(0));
+    auto *Value = dyn_cast<MDString>(Node->getOperand(1));
+    if (Key && Value && Key->getString() == RegionNameKey)
+      return Value->getString();
+  }
+  return {};
+}
 
-      BasicBlock *CallBB = CallSite->getParent();
+/// Code bracketed by mperf_region_begin and the mperf_region_end calls it
+/// dominates. Several ends close the region on different paths.
+struct AnnotatedRegion {
+  CallInst *Begin;
+  SmallVector<CallInst *, 2> Ends;
+};
 
-      SmallVector<Value *> Outs;
-      for (auto &I : *CallBB) {
-        bool HasExternalUses = false;
-        for (auto *User : I.users()) {
-          if (auto *UI = dyn_cast<Instruction>(User)) {
-            if (UI->getParent() != CallBB) {
-              HasExternalUses = true;
-              break;
-            }
-          }
-        }
+static bool isRegionMarker(const Instruction &I, StringRef Name) {
+  auto *Call = dyn_cast<CallInst>(&I);
+  Function *Callee = Call ? Call->getCalledFunction() : nullptr;
+  return Callee && Callee->getName() == Name;
+}
 
-        if (!HasExternalUses)
+/// Pairs the region markers of F along the dominator tree: an end closes the
+/// innermost region whose begin dominates it and that is still open on the
+/// path from the begin. Both markers have to be in the same loop, a region
+/// that starts in one iteration and ends in another is not one invocation.
+static SmallVector<AnnotatedRegion>
+findAnnotatedRegions(Function &F, DominatorTree &DT, LoopInfo &LI,
+                     SmallVectorImpl<CallInst *> &Markers) {
+  SmallVector<AnnotatedRegion> Regions;
+  SmallVector<std::pair<DomTreeNode *, SmallVector<unsigned, 4>>> Worklist;
+  Worklist.push_back({DT.getRootNode(), {}});
+  while (!Worklist.empty()) {
+    auto [Node, Open] = Worklist.pop_back_val();
+    BasicBlock *BB = Node->getBlock();
+    for (Instruction &I : *BB) {
+      if (isRegionMarker(I, "mperf_region_begin")) {
+        Markers.push_back(cast<CallInst>(&I));
+        Open.push_back(Regions.size());
+        Regions.push_back({cast<CallInst>(&I), {}});
+      } else if (isRegionMarker(I, "mperf_region_end")) {
+        Markers.push_back(cast<CallInst>(&I));
+        if (Open.empty() || BB->isEHPad() ||
+            LI.getLoopFor(BB) !=
+                LI.getLoopFor(Regions[Open.back()].Begin->getParent())) {
+          errs() << "Ignoring an mperf_region_end without a matching "
+                    "mperf_region_begin in "
+                 << F.getName() << ".\n";
           continue;
-
-        Outs.push_back(&I);
+        }
+        Regions[Open.back()].Ends.push_back(cast<CallInst>(&I));
+        Open.pop_back();
       }
+    }
+    for (DomTreeNode *Child : Node->children())
+      Worklist.push_back({Child, Open});
+  }
+  return Regions;
+}
 
-      ValueToValueMapTy BlockVMap;
-      BasicBlock *InstrBB = CloneBasicBlock(CallBB, BlockVMap);
+/// Turns every annotated region of F into a loop that runs once, so that it
+/// is versioned, counted and reported like any other loop. The back edge is
+/// never taken, it only exists for the loop analyses. The loop metadata
+/// carries the name of the region and the locations of its markers, which
+/// become the start and end of the loop. Returns true if F was changed.
+static bool formAnnotatedRegions(Function &F, FunctionAnalysisManager &FAM) {
+  if (none_of(instructions(F), [](const Instruction &I) {
+        return isRegionMarker(I, "mperf_region_begin") ||
+               isRegionMarker(I, "mperf_region_end");
+      }))
+    return false;
+
+  auto &DT = FAM.getResult<DominatorTreeAnalysis>(F);
+  auto &LI = FAM.getResult<LoopAnalysis>(F);
+  SmallVector<CallInst *> Markers;
+  SmallVector<AnnotatedRegion> Regions =
+      findAnnotatedRegions(F, DT, LI, Markers);
+
+  LLVMContext &Ctx = F.getContext();
+  for (const AnnotatedRegion &Region : Regions) {
+    StringRef Name;
+    if (Region.Ends.empty() ||
+        !getConstantStringInfo(Region.Begin->getArgOperand(0), Name) ||
+        Name.empty()) {
+      errs() << "Ignoring an mperf_region_begin in " << F.getName()
+             << " without a name or a matching mperf_region_end.\n";
+      continue;
+    }
 
-      F.insert(CallBB->getSingleSuccessor()->getIterator(), InstrBB);
+    SmallVector<Metadata *, 4> LoopIDOps{nullptr};
+    for (const DebugLoc &Loc :
+         {Region.Begin->getDebugLoc(), Region.Ends.front()->getDebugLoc()})
+      if (Loc)
+        LoopIDOps.push_back(Loc.get());
+    LoopIDOps.push_back(MDNode::get(
+        Ctx, {MDString::get(Ctx, RegionNameKey), MDString::get(Ctx, Name)}));
+    MDNode *LoopID = MDNode::getDistinct(Ctx, LoopIDOps);
+    LoopID->replaceOperandWith(0, LoopID);
+
+    BasicBlock *Header = SplitBlock(Region.Begin->getParent(),
+                                    Region.Begin->getNextNode());
+    for (CallInst *End : Region.Ends) {
+      BasicBlock *Latch = End->getParent();
+      BasicBlock *Exit = SplitBlock(Latch, End);
+      Instruction *Br = Latch->getTerminator();
+      IRBuilder<> Builder(Br);
+      BranchInst *Backedge =
+          Builder.CreateCondBr(Builder.getTrue(), Exit, Header);
+      Backedge->setMetadata(LLVMContext::MD_loop, LoopID);
+      Backedge->setDebugLoc(End->getDebugLoc());
+      Br->eraseFromParent();
+    }
+  }
 
-      auto DispatchBB = BasicBlock::Create(F.getContext(), "", &F, CallBB);
-      auto LandingPadBB = BasicBlock::Create(F.getContext(), "", &F,
-                                             CallBB->getSingleSuccessor());
+  for (CallInst *Marker : Markers)
+    Marker->eraseFromParent();
+  FAM.invalidate(F, PreservedAnalyses::none());
+  return true;
+}
 
-      CallBB->replaceSuccessorsPhiUsesWith(LandingPadBB);
-      CallBB->replaceAllUsesWith(DispatchBB);
-      InstrBB->replaceSuccessorsPhiUsesWith(LandingPadBB);
-      InstrBB->replaceAllUsesWith(DispatchBB);
+/// A loop nested in an outermost instrumented loop that is reported on its
+/// own.
+struct NestedLoop {
+  /// Survives versioning, so it identifies the loop in the clone.
+  BasicBlock *Header;
+  uint64_t Id;
+  /// Index of the nearest reported ancestor in the nest, where zero is the
+  /// outermost loop.
+  unsigned Parent;
+  unsigned Line;
+  unsigned EndLine;
+  StringRef Filename;
+  /// Name of an annotated region, empty for loops.
+  StringRef Name;
+  CodegenFacts Facts;
+};
 
-      Builder.SetInsertPoint(DispatchBB);
-      Value *IsEnabled = Builder.CreateCall(IsInstrEnabled);
-      Value *Cmp = Builder.CreateCmp(
-          CmpInst::ICMP_NE, IsEnabled,
-          ConstantInt::get(Type::getInt32Ty(F.getContext()), 0));
-
-      Value *InfoMem = Builder.CreateAlloca(LoopInfoTy);
-
-      Value *FilenameVar = Builder.CreateGlobalString(Filename);
-      Value *FuncNameVar = Builder.CreateGlobalString(F.getName());
-
-      Value *LineNoPtr = Builder.CreateConstGEP2_32(LoopInfoTy, InfoMem, 0, 0);
-      Value *FilenamePtr =
-          Builder.CreateConstGEP2_32(LoopInfoTy, InfoMem, 0, 1);
-      Value *FuncNamePtr =
-          Builder.CreateConstGEP2_32(LoopInfoTy, InfoMem, 0, 2);
-
-      Builder.CreateStore(FilenameVar, FilenamePtr);
-      Builder.CreateStore(FuncNameVar, FuncNamePtr);
-      Builder.CreateStore(
-          ConstantInt::get(Type::getInt32Ty(F.getContext()), LineNo),
-          LineNoPtr);
-      Value *LoopHandle = Builder.CreateCall(NotifyBegin, {InfoMem});
-
-      Builder.CreateCondBr(Cmp, InstrBB, CallBB);
-
-      Builder.SetInsertPoint(LandingPadBB);
-
-      for (auto V : Outs) {
-        PHINode *PHI = Builder.CreatePHI(V->getType(), 2);
-        PHI->addIncoming(V, CallBB);
-        PHI->addIncoming(BlockVMap[V], InstrBB);
-        V->replaceUsesOutsideBlock(PHI, LandingPadBB);
+/// Last line of L in the file it starts in. Clang attaches the end of the
+/// loop statement to the loop metadata, without it the last line of the loop
+/// body that comes from the same file and inlining context is used.
+static unsigned getLoopEndLine(const Loop &L, unsigned StartLine) {
+  Loop::LocRange Range = L.getLocRange();
+  const DebugLoc &Start = Range.getStart();
+  const DebugLoc &End = Range.getEnd();
+  if (End && End.getLine() >= StartLine)
+    return End.getLine();
+
+  unsigned EndLine = StartLine;
+  if (!Start)
+    return EndLine;
+  for (BasicBlock *BB : L.blocks())
+    for (Instruction &I : *BB)
+      if (const DebugLoc &Loc = I.getDebugLoc())
+        if (Loc->getFile() == Start->getFile() &&
+            Loc.getInlinedAt() == Start.getInlinedAt())
+          EndLine = std::max(EndLine, Loc.getLine());
+  return EndLine;
+}
+
+/// Collects the loops nested in Outermost in preorder. Loops past
+/// MaxLoopDepth or without a preheader and dedicated exits cannot be timed,
+/// they are attributed to their parent.
+static SmallVector<NestedLoop> collectNestedLoops(Loop &Outermost,
+                                                  StringRef FuncName,
+                                                  StringRef DefaultFilename,
+                                                  unsigned Ordinal) {
+  SmallVector<NestedLoop> Nest;
+  DenseMap<Loop *, unsigned> Slots{{&Outermost, 0}};
+  for (Loop *L : Outermost.getLoopsInPreorder()) {
+    if (L == &Outermost)
+      continue;
+
+    unsigned Depth = L->getLoopDepth() - Outermost.getLoopDepth() + 1;
+    if (Depth > MaxLoopDepth || !L->getLoopPreheader() ||
+        !L->hasDedicatedExits())
+      continue;
+
+    // Ancestors precede L in preorder.
+    Loop *Parent = L->getParentLoop();
+    while (!Slots.count(Parent))
+      Parent = Parent->getParentLoop();
+
+    unsigned Line = 0;
+    unsigned Col = 0;
+    StringRef Filename = DefaultFilename;
+    if (DebugLoc Loc = L->getStartLoc()) {
+      Line = Loc.getLine();
+      Col = Loc.getCol();
+      Filename = Loc->getFilename();
+    }
+
+    unsigned Slot = Nest.size() + 1;
+    StringRef RegionName = getRegionName(*L);
+    uint64_t Id = RegionName.empty()
+                      ? computeLoopId(Filename, FuncName, Line, Col,
+                                      Twine(Ordinal) + "." + Twine(Slot))
+                      : computeRegionId(Filename, FuncName, RegionName);
+    Nest.push_back({L->getHeader(), Id, Slots[Parent], Line,
+                    getLoopEndLine(*L, Line), Filename, RegionName});
+    Slots[L] = Slot;
+  }
+  return Nest;
+}
+
+/// The hot list is read once per compiler process. Returns null if none was
+/// given, every loop is instrumented then.
+static const HotList *getHotList() {
+  static const std::optional<HotList> List = []() -> std::optional<HotList> {
+    std::string Path = HotListPath;
+    if (Path.empty()) {
+      if (const char *Env = std::getenv("MPERF_PLUGIN_HOT_LIST"))
+        Path = Env;
+    }
+    if (Path.empty())
+      return std::nullopt;
+
+    Expected<HotList> Loaded = HotList::load(Path);
+    if (!Loaded)
+      report_fatal_error(Loaded.takeError(), /*gen_crash_diag=*/false);
+    return std::move(*Loaded);
+  }();
+  return List ? &*List : nullptr;
+}
+
+/// Loops inlined into F are also selected by the function they come from.
+static bool isHotLoop(const HotList &List, const Function &F, const Loop &L) {
+  if (List.containsFunction(F.getName()))
+    return true;
+
+  DebugLoc Loc = L.getStartLoc();
+  if (!Loc)
+    return false;
+  if (List.containsLoop(Loc->getFilename(), Loc.getLine()))
+    return true;
+
+  const DISubprogram *SP = Loc->getScope()->getSubprogram();
+  return SP && (List.containsFunction(SP->getLinkageName()) ||
+                List.containsFunction(SP->getName()));
+}
+
+/// Functions built with -fno-omit-frame-pointer push a frame record, and the
+/// word below their return address is the caller's frame pointer. Without
+/// one it may be any spilled register.
+static bool keepsFrameRecord(const Function &F) {
+  StringRef FramePointer = F.getFnAttribute("frame-pointer").getValueAsString();
+  return FramePointer == "all" || FramePointer == "non-leaf";
+}
+
+static Function *getOrDeclareHook(Module &M, StringRef Name,
+                                  FunctionType *Ty) {
+  if (Function *F = M.getFunction(Name))
+    return F;
+  return Function::Create(Ty, GlobalValue::ExternalLinkage, Name, M);
+}
+
+/// Declarations of the collector entry points called by instrumented loops.
+struct CollectorHooks {
+  explicit CollectorHooks(Module &M) {
+    LLVMContext &Ctx = M.getContext();
+    Type *PtrTy = PointerType::get(Ctx, 0);
+    Type *I32Ty = Type::getInt32Ty(Ctx);
+    Type *I64Ty = Type::getInt64Ty(Ctx);
+    Type *VoidTy = Type::getVoidTy(Ctx);
+
+    // Takes the descriptor of the loop and the address of the return
+    // address of the function, where the collector starts its walk of the
+    // calling context.
+    NotifyBegin =
+        getOrDeclareHook(M, "mperf_roofline_internal_notify_loop_begin",
+                         FunctionType::get(PtrTy, {PtrTy, PtrTy}, false));
+    NotifyBegin->addFnAttr(Attribute::Cold);
+    NotifyEnd = getOrDeclareHook(M, "mperf_roofline_internal_notify_loop_end",
+                                 FunctionType::get(VoidTy, {PtrTy}, false));
+    NotifyEnd->addFnAttr(Attribute::Cold);
+    NotifyStats =
+        getOrDeclareHook(M, "mperf_roofline_internal_notify_loop_stats",
+                         FunctionType::get(VoidTy, {PtrTy, PtrTy}, false));
+    NotifyNestedStats = getOrDeclareHook(
+        M, "mperf_roofline_internal_notify_nested_loop_stats",
+        FunctionType::get(VoidTy, {PtrTy, PtrTy, I64Ty}, false));
+    Timestamp = getOrDeclareHook(M, "mperf_roofline_internal_timestamp",
+                                 FunctionType::get(I64Ty, false));
+    IsInstrEnabled = getOrDeclareHook(
+        M, "mperf_roofline_internal_is_instrumented_profiling",
+        FunctionType::get(I32Ty, {PtrTy}, false));
+    // Set by the collector once it is attached to mperf.
+    EnabledWord = cast<GlobalVariable>(
+        M.getOrInsertGlobal("mperf_roofline_enabled", I32Ty));
+  }
+
+  Function *NotifyBegin;
+  Function *NotifyEnd;
+  Function *NotifyStats;
+  Function *NotifyNestedStats;
+  Function *Timestamp;
+  Function *IsInstrEnabled;
+  GlobalVariable *EnabledWord;
+};
+
+/// Tests the enable word of the collector. Every hook call of instrumented
+/// code sits behind this test, so a binary that runs without mperf only pays
+/// for one load and a branch.
+static Value *emitEnabledTest(IRBuilder<> &Builder,
+                              const CollectorHooks &Hooks) {
+  LoadInst *Enabled =
+      Builder.CreateLoad(Builder.getInt32Ty(), Hooks.EnabledWord);
+  Enabled->setAtomic(AtomicOrdering::Monotonic);
+  Enabled->setAlignment(Align(4));
+  return Builder.CreateIsNotNull(Enabled);
+}
+
+/// Whether F has a loop the pass versions: one the hot list selects, or an
+/// annotated region, formed into a loop yet or not.
+static bool hasCandidateLoops(Function &F, FunctionAnalysisManager &FAM) {
+  if (F.isDeclaration())
+    return false;
+  if (any_of(instructions(F), [](const Instruction &I) {
+        return isRegionMarker(I, "mperf_region_begin");
+      }))
+    return true;
+
+  const HotList *List = getHotList();
+  auto &LI = FAM.getResult<LoopAnalysis>(F);
+  return any_of(LI, [&](const Loop *L) {
+    return !List || isHotLoop(*List, F, *L) || !getRegionName(*L).empty();
+  });
+}
+
+/// Types, strings and collector hooks shared by every function of a module.
+/// Hooks are only declared once a loop is instrumented, so modules without
+/// hot loops are left unchanged.
+class ModuleState {
+public:
+  explicit ModuleState(Module &M)
+      : M(M), Strings(M), TLII(Triple(M.getTargetTriple())) {
+    LLVMContext &Ctx = M.getContext();
+    Type *I64Ty = Type::getInt64Ty(Ctx);
+    // Mirrors LoopStats in mperf-data, every field is one StatIndex.
+    SmallVector<Type *, NumStats> StatFields(NumStats, I64Ty);
+    LoopStatsTy = getOrCreateStructType(Ctx, "mperf.loop_stats", StatFields);
+    NestedStatsTy = getOrCreateStructType(Ctx, "mperf.nested_loop_stats",
+                                          {I64Ty, I64Ty, I64Ty, LoopStatsTy});
+  }
+
+  const CollectorHooks &getHooks() {
+    if (!Hooks)
+      Hooks.emplace(M);
+    return *Hooks;
+  }
+
+  Module &M;
+  StringPool Strings;
+  TargetLibraryInfoImpl TLII;
+  StructType *LoopStatsTy;
+  StructType *NestedStatsTy;
+
+private:
+  std::optional<CollectorHooks> Hooks;
+};
+
+/// Returns the outlined parallel region started by Call if it is an OpenMP
+/// fork call.
+static Function *getForkedRegion(const CallBase &Call) {
+  Function *Callee = Call.getCalledFunction();
+  if (!Callee || Callee->getName() != "__kmpc_fork_call" ||
+      Call.arg_size() < 3)
+    return nullptr;
+  return dyn_cast<Function>(Call.getArgOperand(2)->stripPointerCasts());
+}
+
+static bool isOutlinedParallelRegion(const Function &F) {
+  return any_of(F.users(), [&](const User *U) {
+    auto *Call = dyn_cast<CallBase>(U);
+    return Call && getForkedRegion(*Call) == &F;
+  });
+}
+
+/// Region IDs only depend on the outlined function, so the fork site and the
+/// threads running the region agree on them without passing them around.
+static uint64_t computeParallelRegionId(const Function &Outlined) {
+  StringRef Filename = Outlined.getParent()->getSourceFileName();
+  if (const DISubprogram *SP = Outlined.getSubprogram())
+    Filename = SP->getFilename();
+  return computeLoopId(Filename, getStableFunctionName(Outlined), 0, 0,
+                       "parallel");
+}
+
+/// Calls that hand a thread its share of the iterations of a worksharing
+/// loop, for static and dynamic schedules.
+static bool isWorksharingInit(const Instruction &I) {
+  auto *Call = dyn_cast<CallBase>(&I);
+  Function *Callee = Call ? Call->getCalledFunction() : nullptr;
+  if (!Callee)
+    return false;
+  StringRef Name = Callee->getName();
+  return Name.starts_with("__kmpc_for_static_init") ||
+         Name.starts_with("__kmpc_dist_for_static_init") ||
+         Name.starts_with("__kmpc_dispatch_init");
+}
+
+/// The loop a worksharing init call belongs to is the first outermost loop
+/// it dominates.
+static SmallPtrSet<Loop *, 4> findWorksharingLoops(Function &F,
+                                                   ArrayRef<Loop *> Loops,
+                                                   const DominatorTree &DT) {
+  SmallPtrSet<Loop *, 4> Worksharing;
+  for (auto &I : instructions(F)) {
+    if (!isWorksharingInit(I))
+      continue;
+    Loop *First = nullptr;
+    for (Loop *L : Loops) {
+      if (!DT.dominates(&I, L->getHeader()))
+        continue;
+      if (!First || DT.dominates(L->getHeader(), First->getHeader()))
+        First = L;
+    }
+    if (First)
+      Worksharing.insert(First);
+  }
+  return Worksharing;
+}
+
+/// Brackets the OpenMP fork calls of F with the collector hooks that time
+/// one instance of the parallel region, and describes the region to the
+/// collector. Only regions with loops to instrument are timed, the hooks run
+/// behind the enable word like the loop hooks do. Returns true if F was
+/// changed.
+static bool instrumentForkCalls(Function &F, FunctionAnalysisManager &FAM,
+                                ModuleState &State) {
+  SmallVector<CallBase *> Forks;
+  for (auto &I : instructions(F))
+    if (auto *Call = dyn_cast<CallInst>(&I);
+        Call && getForkedRegion(*Call) &&
+        hasCandidateLoops(*getForkedRegion(*Call), FAM))
+      Forks.push_back(Call);
+  if (Forks.empty())
+    return false;
+
+  Module &M = *F.getParent();
+  LLVMContext &Ctx = M.getContext();
+  auto *PtrTy = PointerType::get(Ctx, 0);
+  auto *I64Ty = Type::getInt64Ty(Ctx);
+  const CollectorHooks &Hooks = State.getHooks();
+  MDBuilder MDB(Ctx);
+  FunctionCallee Begin = M.getOrInsertFunction(
+      "mperf_roofline_internal_parallel_begin",
+      FunctionType::get(PtrTy, {I64Ty}, false));
+  FunctionCallee End = M.getOrInsertFunction(
+      "mperf_roofline_internal_parallel_end",
+      FunctionType::get(Type::getVoidTy(Ctx), {PtrTy}, false));
+
+  IRBuilder<> Builder(Ctx);
+  for (CallBase *Fork : Forks) {
+    uint64_t RegionId = computeParallelRegionId(*getForkedRegion(*Fork));
+    unsigned Line = 0;
+    StringRef Filename = "<unknown>";
+    if (const DebugLoc &Loc = Fork->getDebugLoc()) {
+      Line = Loc.getLine();
+      Filename = Loc->getFilename();
+    }
+    emitLoopDescriptor(M, State.Strings, RegionId, 0, Line, Line, Filename,
+                       getStableFunctionName(F), ParallelRegionDescriptor);
+
+    //   Head -> [Begin] -> Fork -> [End] -> Tail
+    //
+    // Begin and End are cold, End only runs if Begin returned a handle.
+    BasicBlock *Head = Fork->getParent();
+    Builder.SetInsertPoint(Fork);
+    Instruction *BeginTerm =
+        SplitBlockAndInsertIfThen(emitEnabledTest(Builder, Hooks), Fork,
+                                  false, MDB.createUnlikelyBranchWeights());
+    Builder.SetInsertPoint(BeginTerm);
+    Value *Begun =
+        Builder.CreateCall(Begin, {ConstantInt::get(I64Ty, RegionId)});
+
+    Builder.SetInsertPoint(Fork);
+    PHINode *Handle = Builder.CreatePHI(PtrTy, 2);
+    Handle->addIncoming(ConstantPointerNull::get(PtrTy), Head);
+    Handle->addIncoming(Begun, BeginTerm->getParent());
+
+    Builder.SetInsertPoint(Fork->getNextNode());
+    auto *HasHandle = cast<Instruction>(Builder.CreateIsNotNull(Handle));
+    Instruction *EndTerm =
+        SplitBlockAndInsertIfThen(HasHandle, HasHandle->getNextNode(), false,
+                                  MDB.createUnlikelyBranchWeights());
+    Builder.SetInsertPoint(EndTerm);
+    Builder.CreateCall(End, {Handle});
+  }
+  emitLoopRegistration(M);
+  return true;
+}
+
+/// Threads running an outlined parallel region tell the collector which
+/// region they are in, so the records of their loops can be matched to the
+/// instance of the region started by the fork call. The hooks run behind the
+/// enable word, a thread that did not enter the region does not leave it.
+static void instrumentOutlinedRegion(Function &F,
+                                     const CollectorHooks &Hooks) {
+  Module &M = *F.getParent();
+  LLVMContext &Ctx = M.getContext();
+  auto *I64Ty = Type::getInt64Ty(Ctx);
+  MDBuilder MDB(Ctx);
+  FunctionCallee Enter =
+      M.getOrInsertFunction("mperf_roofline_internal_parallel_enter",
+                            FunctionType::get(I64Ty, {I64Ty}, false));
+  FunctionCallee Leave = M.getOrInsertFunction(
+      "mperf_roofline_internal_parallel_leave",
+      FunctionType::get(Type::getVoidTy(M.getContext()), {I64Ty}, false));
+
+  SmallVector<ReturnInst *, 4> Returns;
+  for (auto &BB : F)
+    if (auto *Ret = dyn_cast<ReturnInst>(BB.getTerminator()))
+      Returns.push_back(Ret);
+
+  BasicBlock &Entry = F.getEntryBlock();
+  auto InsertPt = Entry.getFirstInsertionPt();
+  while (isa<AllocaInst>(*InsertPt))
+    ++InsertPt;
+  IRBuilder<> Builder(&Entry, InsertPt);
+  Instruction *EnterTerm = SplitBlockAndInsertIfThen(
+      emitEnabledTest(Builder, Hooks), &*InsertPt, false,
+      MDB.createUnlikelyBranchWeights());
+  Builder.SetInsertPoint(EnterTerm);
+  Value *Entered = Builder.CreateCall(
+      Enter, {ConstantInt::get(I64Ty, computeParallelRegionId(F))});
+
+  BasicBlock *Body = EnterTerm->getSuccessor(0);
+  Builder.SetInsertPoint(Body, Body->begin());
+  PHINode *Previous = Builder.CreatePHI(I64Ty, 2);
+  Previous->addIncoming(ConstantInt::get(I64Ty, 0), &Entry);
+  Previous->addIncoming(Entered, EnterTerm->getParent());
+  PHINode *WasEntered = Builder.CreatePHI(Builder.getInt1Ty(), 2);
+  WasEntered->addIncoming(Builder.getFalse(), &Entry);
+  WasEntered->addIncoming(Builder.getTrue(), EnterTerm->getParent());
+
+  for (ReturnInst *Ret : Returns) {
+    Instruction *LeaveTerm = SplitBlockAndInsertIfThen(
+        WasEntered, Ret, false, MDB.createUnlikelyBranchWeights());
+    Builder.SetInsertPoint(LeaveTerm);
+    Builder.CreateCall(Leave, {Previous});
+  }
+}
+
+struct MiniperfInstr : PassInfoMixin<MiniperfInstr> {
+  /// Marks functions the pass has already visited.
+  static constexpr StringLiteral InstrumentedAttr = "miniperf-instrumented";
+
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM) {
+    auto &FAM =
+        MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+    ModuleState State(M);
+
+    // Generated functions are not visited. Functions instrumented by an
+    // earlier run of the pass, such as a pre-link compile before LTO, are left
+    // alone, and so are the bodies ThinLTO imports only for inlining, their
+    // loops are described by the module that defines them.
+    SmallVector<Function *> Worklist;
+    for (Function &F : M)
+      if (!F.isDeclaration() && !F.hasAvailableExternallyLinkage() &&
+          !F.hasMetadata("miniperf.generated") &&
+          !F.hasFnAttribute(InstrumentedAttr))
+        Worklist.push_back(&F);
+
+    bool Changed = false;
+    for (Function *F : Worklist) {
+      F->addFnAttr(InstrumentedAttr);
+      if (!instrumentFunction(*F, FAM, State))
+        continue;
+      FAM.invalidate(*F, PreservedAnalyses::none());
+      Changed = true;
+    }
+    return Changed ? PreservedAnalyses::none() : PreservedAnalyses::all();
+  }
+
+  /// Returns true if F was changed.
+  static bool instrumentFunction(Function &F, FunctionAnalysisManager &FAM,
+                                 ModuleState &State) {
+    // Fork sites are bracketed even in cold functions, the loops they start
+    // live in the outlined region.
+    bool ForksInstrumented = instrumentForkCalls(F, FAM, State);
+    bool RegionsFormed = formAnnotatedRegions(F, FAM);
+
+    auto &LoopInfo = FAM.getResult<LoopAnalysis>(F);
+
+    // Only outermost loops are versioned. Loops without a preheader or with
+    // several exits are put in simplified form right before versioning.
+    SmallVector<Loop *> TopLevelLoops(LoopInfo.begin(), LoopInfo.end());
+
+    // Ordinals are assigned before the hot list is applied, so loop IDs stay
+    // the same whether or not a list is in use. Annotated regions are always
+    // instrumented.
+    SmallVector<std::pair<Loop *, unsigned>> Candidates;
+    const HotList *List = getHotList();
+    for (unsigned Ordinal = 0; Ordinal < TopLevelLoops.size(); ++Ordinal) {
+      Loop *L = TopLevelLoops[Ordinal];
+      if (!List || isHotLoop(*List, F, *L) || !getRegionName(*L).empty())
+        Candidates.push_back({L, Ordinal});
+    }
+
+    // Cold functions are left as they were, apart from the fork sites of
+    // parallel regions with loops to instrument.
+    if (Candidates.empty())
+      return ForksInstrumented || RegionsFormed;
+
+    auto &DT = FAM.getResult<DominatorTreeAnalysis>(F);
+    SmallPtrSet<Loop *, 4> Worksharing =
+        findWorksharingLoops(F, TopLevelLoops, DT);
+
+    // Versioning changes the CFG, so the loop analyses are recomputed for
+    // every candidate and the loops are found again by their header. The
+    // code generation facts are taken before any loop of F is versioned,
+    // the vectorizer's checks and remainder loops are still next to the
+    // vector loops then.
+    LLVMContext &Ctx = F.getContext();
+    IRBuilder<> Builder(Ctx);
+    const DataLayout &DL = F.getParent()->getDataLayout();
+    auto &TTI = FAM.getResult<TargetIRAnalysis>(F);
+
+    struct Version {
+      BasicBlock *Header;
+      unsigned Ordinal;
+      uint32_t Flags;
+      CodegenFacts Facts;
+    };
+    SmallVector<Version> Versions;
+    for (auto [L, Ordinal] : Candidates)
+      Versions.push_back({L->getHeader(), Ordinal,
+                          Worksharing.contains(L) ? WorksharingLoop : 0u,
+                          computeCodegenFacts(*L, LoopInfo, DT, TTI, DL)});
+    TargetLibraryInfo TLI(State.TLII);
+
+    StructType *LoopStatsTy = State.LoopStatsTy;
+    StructType *NestedStatsTy = State.NestedStatsTy;
+    const CollectorHooks &Hooks = State.getHooks();
+
+    for (const Version &V : Versions) {
+      DT.recalculate(F);
+      LoopInfo.releaseMemory();
+      LoopInfo.analyze(DT);
+      Loop *L = LoopInfo.getLoopFor(V.Header);
+      assert(L && L->getHeader() == V.Header && "Lost a candidate loop");
+
+      // Gives the loop and the loops nested in it a preheader, a single
+      // latch and exit blocks only the loop branches to.
+      simplifyLoop(L, &DT, &LoopInfo, nullptr, nullptr, nullptr, false);
+
+      unsigned LineNo = 0;
+      unsigned ColNo = 0;
+      StringRef Filename = "<unknown>";
+      if (DebugLoc StartLoc = L->getStartLoc()) {
+        LineNo = StartLoc.getLine();
+        ColNo = StartLoc.getCol();
+        Filename = StartLoc->getFilename();
+      }
+      StringRef FuncName = getStableFunctionName(F);
+      unsigned EndLine = getLoopEndLine(*L, LineNo);
+      StringRef RegionName = getRegionName(*L);
+      uint32_t Flags = V.Flags | (RegionName.empty() ? 0 : AnnotatedRegionLoop);
+      if (keepsFrameRecord(F))
+        Flags |= FramePointerLoop;
+      uint64_t LoopId =
+          RegionName.empty()
+              ? computeLoopId(Filename, FuncName, LineNo, ColNo,
+                              Twine(V.Ordinal))
+              : computeRegionId(Filename, FuncName, RegionName);
+
+      // Exits into an exception handler cannot be split, and a loop without
+      // exits never reports. Such loops are still described, samples in them
+      // count as missing coverage.
+      SmallVector<BasicBlock *, 4> Exits;
+      L->getUniqueExitBlocks(Exits);
+      if (!L->isLoopSimplifyForm() || Exits.empty() ||
+          llvm::any_of(Exits, [](BasicBlock *BB) { return BB->isEHPad(); })) {
+        errs() << "Found a loop that cannot be versioned at "
+               << L->getLocStr() << ". Skipping.\n";
+        emitLoopDescriptor(*F.getParent(), State.Strings, LoopId, 0, LineNo,
+                           EndLine, Filename, FuncName,
+                           Flags | NotInstrumentedLoop, V.Facts, RegionName);
+        emitLoopRegistration(*F.getParent());
+        continue;
       }
+      SmallVector<NestedLoop> Nest =
+          collectNestedLoops(*L, FuncName, Filename, V.Ordinal);
+      for (NestedLoop &NL : Nest)
+        NL.Facts = computeCodegenFacts(*LoopInfo.getLoopFor(NL.Header),
+                                       LoopInfo, DT, TTI, DL);
+
+      // Values that escape the loop go through phis in its exit blocks, which
+      // only the loop branches to. The preheader and every exit block are
+      // split so that the cloned loop gets a preheader and exits of its own.
+      formLCSSA(*L, DT, &LoopInfo, nullptr);
+      BasicBlock *Before = L->getLoopPreheader();
+      BasicBlock *Preheader =
+          SplitBlock(Before, Before->getTerminator(), &DT, &LoopInfo);
+      SmallVector<BasicBlock *, 4> Successors;
+      for (BasicBlock *Exit : Exits)
+        Successors.push_back(
+            SplitBlock(Exit, &*Exit->getFirstInsertionPt(), &DT, &LoopInfo));
+
+      GlobalVariable *Descriptor = emitLoopDescriptor(
+          *F.getParent(), State.Strings, LoopId, 0, LineNo, EndLine, Filename,
+          FuncName, Flags, V.Facts, RegionName);
+      emitLoopRegistration(*F.getParent());
+
+      // The instrumented version is a copy of the loop with its preheader and
+      // exit blocks, it is placed at the end of the function.
+      SmallVector<BasicBlock *> Blocks{Preheader};
+      append_range(Blocks, L->getBlocks());
+      append_range(Blocks, Exits);
+      ValueToValueMapTy VMap;
+      SmallVector<BasicBlock *> Clones;
+      for (BasicBlock *BB : Blocks) {
+        Clones.push_back(CloneBasicBlock(BB, VMap, ".instr", &F));
+        VMap[BB] = Clones.back();
+      }
+      remapInstructionsInBlocks(Clones, VMap);
+      auto *InstrPreheader = cast<BasicBlock>(VMap[Preheader]);
+
+      // Without mperf attached, the loop costs one load and a branch:
+      //
+      //   Dispatch -> Preheader -> Loop -> Exit ------------> Join -> Successor
+      //         \-> Profile -> Preheader | Instr -> InstrExit -> Join -> End
+      //
+      // Every exit gets a Join and an End block of its own. Profile and End
+      // hold the collector calls and are laid out cold.
+      auto *DispatchBB = BasicBlock::Create(Ctx, "", &F, Preheader);
+      auto *ProfileBB = BasicBlock::Create(Ctx, "", &F, Preheader);
+      Before->getTerminator()->replaceSuccessorWith(Preheader, DispatchBB);
+
+      MDBuilder MDB(Ctx);
+      Type *PtrTy = PointerType::get(Ctx, 0);
+      Constant *NoHandle = ConstantPointerNull::get(cast<PointerType>(PtrTy));
 
-      Builder.CreateCall(NotifyEnd, {LoopHandle});
+      Builder.SetInsertPoint(DispatchBB);
+      Builder.CreateCondBr(emitEnabledTest(Builder, Hooks), ProfileBB,
+                           Preheader, MDB.createUnlikelyBranchWeights());
+
+      Builder.SetInsertPoint(ProfileBB);
+      // Unlike llvm.frameaddress, this does not force a frame pointer into
+      // the function. The collector only walks further callers when the
+      // descriptor says the function keeps one.
+      Value *ReturnSlot = Builder.CreateIntrinsic(
+          Intrinsic::addressofreturnaddress, {PtrTy}, {});
+      Value *LoopHandle =
+          Builder.CreateCall(Hooks.NotifyBegin, {Descriptor, ReturnSlot});
+
+      // The runtime decides per invocation whether the instrumented version
+      // runs, only some of them are sampled in single-run roofline mode.
+      Value *IsEnabled =
+          Builder.CreateCall(Hooks.IsInstrEnabled, {LoopHandle});
+      Value *Cmp =
+          Builder.CreateCmp(CmpInst::ICMP_NE, IsEnabled,
+                            ConstantInt::get(Type::getInt32Ty(Ctx), 0));
+      Builder.CreateCondBr(Cmp, InstrPreheader, Preheader);
+
+      Builder.SetInsertPoint(Preheader, Preheader->getFirstInsertionPt());
+      PHINode *BaselineHandle = Builder.CreatePHI(PtrTy, 2);
+      BaselineHandle->addIncoming(NoHandle, DispatchBB);
+      BaselineHandle->addIncoming(LoopHandle, ProfileBB);
+
+      SmallVector<BasicBlock *, 4> InstrExits;
+      SmallVector<BasicBlock *, 4> JoinBlocks;
+      for (auto [Exit, Successor] : zip(Exits, Successors)) {
+        auto *InstrExit = cast<BasicBlock>(VMap[Exit]);
+        auto *JoinBB = BasicBlock::Create(Ctx, "", &F, Successor);
+        auto *EndBB = BasicBlock::Create(Ctx, "", &F, Successor);
+        Exit->getTerminator()->replaceSuccessorWith(Successor, JoinBB);
+        InstrExit->getTerminator()->replaceSuccessorWith(Successor, JoinBB);
+        InstrExits.push_back(InstrExit);
+        JoinBlocks.push_back(JoinBB);
+
+        Builder.SetInsertPoint(JoinBB);
+        for (PHINode &Escaping : Exit->phis()) {
+          PHINode *PHI = Builder.CreatePHI(Escaping.getType(), 2);
+          PHI->addIncoming(&Escaping, Exit);
+          PHI->addIncoming(VMap[&Escaping], InstrExit);
+          Escaping.replaceUsesOutsideBlock(PHI, JoinBB);
+        }
 
-      Builder.CreateBr(CallBB->getSingleSuccessor());
+        PHINode *JoinHandle = Builder.CreatePHI(PtrTy, 2);
+        JoinHandle->addIncoming(BaselineHandle, Exit);
+        JoinHandle->addIncoming(LoopHandle, InstrExit);
+        Builder.CreateCondBr(Builder.CreateIsNotNull(JoinHandle), EndBB,
+                             Successor, MDB.createUnlikelyBranchWeights());
 
-      cast<BranchInst>(CallBB->getTerminator())->setSuccessor(0, LandingPadBB);
-      cast<BranchInst>(InstrBB->getTerminator())->setSuccessor(0, LandingPadBB);
+        Builder.SetInsertPoint(EndBB);
+        Builder.CreateCall(Hooks.NotifyEnd, {JoinHandle});
+        Builder.CreateBr(Successor);
+      }
 
-      for (auto &&I : *InstrBB) {
-        if (auto *Call = dyn_cast<CallInst>(&I)) {
-          if (Call->getCalledFunction() == Extracted) {
-            SmallVector<Value *> Operands{Call->arg_begin(), Call->arg_end()};
-            Operands.push_back(LoopHandle);
-            Builder.SetInsertPoint(Call);
-            Builder.CreateCall(Instrumented, Operands);
-            Call->eraseFromParent();
-            break;
-          }
+      DT.recalculate(F);
+      LoopInfo.releaseMemory();
+      LoopInfo.analyze(DT);
+      Loop *OutermostLoop =
+          LoopInfo.getLoopFor(cast<BasicBlock>(VMap[V.Header]));
+      assert(OutermostLoop && OutermostLoop->isOutermost() &&
+             "Expected the cloned loop to be outermost");
+
+      // Find the nested loops in the clone. Slot zero is the outermost loop,
+      // each slot gets its own set of counters.
+      SmallVector<Loop *> SlotLoops{OutermostLoop};
+      SmallVector<uint64_t> SlotIds{LoopId};
+      SmallVector<unsigned> NestSlots{0};
+      for (const NestedLoop &NL : Nest) {
+        unsigned ParentSlot = NestSlots[NL.Parent];
+        Value *Header = VMap.lookup(NL.Header);
+        Loop *Clone = Header ? LoopInfo.getLoopFor(cast<BasicBlock>(Header))
+                             : nullptr;
+        if (!Clone || Clone->getHeader() != Header ||
+            !OutermostLoop->contains(Clone) || !Clone->getLoopPreheader() ||
+            !Clone->hasDedicatedExits()) {
+          NestSlots.push_back(ParentSlot);
+          continue;
         }
+
+        NestSlots.push_back(SlotLoops.size());
+        SlotLoops.push_back(Clone);
+        SlotIds.push_back(NL.Id);
+        emitLoopDescriptor(*F.getParent(), State.Strings, NL.Id,
+                           SlotIds[ParentSlot], NL.Line, NL.EndLine,
+                           NL.Filename, getStableFunctionName(F),
+                           NL.Name.empty() ? 0 : AnnotatedRegionLoop,
+                           NL.Facts, NL.Name);
       }
 
-      DominatorTree InstrDT(*Instrumented);
-      class LoopInfo InstrLI(InstrDT);
+      AssumptionCache AC(F);
+      ScalarEvolution SE(F, TLI, AC, DT, LoopInfo);
 
-      // FIXME: for some reason this is not working properly. Need to find a way
-      // to actually extract a loop from here.
-      if (InstrLI.begin() == InstrLI.end()) {
-        continue;
+      DenseMap<BasicBlock *, CounterWeights> BlockWeights;
+      bool HasScalable = false;
+      for (auto *BB : OutermostLoop->getBlocks()) {
+        CounterWeights &Block = BlockWeights[BB];
+        Block = computeBlockWeights(*BB, DL, SE, LoopInfo);
+        HasScalable |= llvm::any_of(drop_begin(Block, NumStats),
+                                    [](int64_t W) { return W != 0; });
+        // Footprints of scalable accesses are counted in multiples of
+        // vscale even when the block weights leave the access to
+        // emitDynamicCounts.
+        for (Instruction &I : *BB)
+          if (auto Access = getMemoryAccess(I))
+            HasScalable |= getElementCount(Access->AccessTy).isScalable();
+      }
+
+      // Counters hold NumStats entries per slot, followed by the number of
+      // invocations of every nested loop and, if the loop uses scalable
+      // vectors, by NumStats entries per slot in multiples of vscale. Counts
+      // are inclusive, a block counts towards every reported loop that
+      // contains it.
+      unsigned NumSlots = SlotLoops.size();
+      unsigned NumNested = NumSlots - 1;
+      unsigned InvocationsBase = NumSlots * NumStats;
+      unsigned ScalableBase = InvocationsBase + NumNested;
+      unsigned NumCounters = ScalableBase + (HasScalable ? InvocationsBase : 0);
+
+      DenseMap<BasicBlock *, CounterWeights> Weights;
+      for (auto &[BB, Block] : BlockWeights) {
+        CounterWeights &SlotWeights = Weights[BB];
+        SlotWeights.assign(NumCounters, 0);
+        for (unsigned Slot = 0; Slot < NumSlots; ++Slot) {
+          if (!SlotLoops[Slot]->contains(BB))
+            continue;
+          auto PerVScale = Block.begin() + NumStats;
+          std::copy(Block.begin(), PerVScale,
+                    SlotWeights.begin() + Slot * NumStats);
+          if (HasScalable)
+            std::copy(PerVScale, Block.end(),
+                      SlotWeights.begin() + ScalableBase + Slot * NumStats);
+        }
+      }
+      for (unsigned Slot = 1; Slot < NumSlots; ++Slot) {
+        CounterWeights &PreheaderWeights =
+            Weights[SlotLoops[Slot]->getLoopPreheader()];
+        PreheaderWeights.resize(NumCounters, 0);
+        PreheaderWeights[InvocationsBase + Slot - 1] += 1;
       }
 
-      auto OutermostLoop = *InstrLI.begin();
-      assert(OutermostLoop->isOutermost() &&
-             "Expected first loop to be outermost");
+      // Trip counts that are known on loop entry are added once per entry,
+      // the other loops count the executions of their header.
+      SCEVExpander Expander(SE, DL, "trip_count");
+      SmallVector<Value *> TripCounts;
+      for (unsigned Slot = 0; Slot < NumSlots; ++Slot) {
+        TripCounts.push_back(expandTripCount(*SlotLoops[Slot], SE, Expander));
+        if (!TripCounts.back())
+          Weights[SlotLoops[Slot]->getHeader()]
+                 [Slot * NumStats + StatIndex::TripCount] += 1;
+      }
 
-      Builder.SetInsertPoint(
-          Instrumented->getEntryBlock().getFirstInsertionPt());
+      // Footprints are added once per entry as well. Accesses SCEV cannot
+      // describe count every byte they move instead, which overestimates the
+      // footprint of loops that reuse data through them. The ones with lanes
+      // only known at run time are counted by emitDynamicFootprints.
+      SmallVector<Value *> Footprints;
+      SmallVector<std::pair<Instruction *, unsigned>> DynamicFootprints;
+      for (unsigned Slot = 0; Slot < NumSlots; ++Slot) {
+        Loop &L = *SlotLoops[Slot];
+        SmallVector<Instruction *> Unknown;
+        const SCEV *Footprint = computeFootprint(L, SE, Expander, Unknown);
+        Footprints.push_back(
+            Footprint ? Expander.expandCodeFor(
+                            Footprint, Type::getInt64Ty(F.getContext()),
+                            L.getLoopPreheader()->getTerminator())
+                      : nullptr);
+
+        for (Instruction *I : Unknown) {
+          if (hasRuntimeLanes(*I)) {
+            DynamicFootprints.push_back({I, Slot});
+            continue;
+          }
+          auto Access = *getMemoryAccess(*I);
+          ElementCount Count = getElementCount(Access.AccessTy);
+          unsigned Base =
+              (Count.isScalable() ? ScalableBase : 0) + Slot * NumStats;
+          Weights[I->getParent()][Base + StatIndex::FootprintBytes] +=
+              Count.getKnownMinValue() *
+              DL.getTypeAllocSize(Access.AccessTy->getScalarType());
+        }
+      }
+
+      if (hasBlockTable(Triple(F.getParent()->getTargetTriple())))
+        emitBlockTable(F, Blocks, VMap, SlotLoops, SlotIds, BlockWeights);
+
+      BasicBlock &EntryBB = F.getEntryBlock();
+      Builder.SetInsertPoint(&EntryBB, EntryBB.getFirstInsertionPt());
+
+      // Create necessary data structures in the entry block, counters are
+      // reset in the preheader of the instrumented version. Counters are
+      // promoted to registers below, the stats blocks are only written right
+      // before they are reported.
+      Type *I64Ty = Type::getInt64Ty(Ctx);
+      auto CreateCounter = [&](const Twine &Name) {
+        IRBuilder<> EntryBuilder(&EntryBB, EntryBB.getFirstInsertionPt());
+        AllocaInst *Counter = EntryBuilder.CreateAlloca(I64Ty, nullptr, Name);
+        EntryBuilder.SetInsertPoint(InstrPreheader->getTerminator());
+        EntryBuilder.CreateStore(ConstantInt::get(I64Ty, 0), Counter);
+        return Counter;
+      };
 
-      // Create necessary data structures
       Value *StatsMem =
           Builder.CreateAlloca(LoopStatsTy, nullptr, "loop_stats");
-      Builder.CreateMemSet(StatsMem,
-                           ConstantInt::get(Type::getInt8Ty(F.getContext()), 0),
-                           8 * 9, Align(8));
+      ArrayType *NestedArrayTy = ArrayType::get(NestedStatsTy, NumNested);
+      Value *NestedStatsMem =
+          NumNested ? Builder.CreateAlloca(NestedArrayTy, nullptr,
+                                           "nested_loop_stats")
+                    : nullptr;
+
+      SmallVector<AllocaInst *, NumStats> Counters;
+      for (unsigned Idx = 0; Idx < NumCounters; ++Idx)
+        Counters.push_back(CreateCounter("counter"));
+
+      // Nested loops are timed on entry and exit, which costs two clock reads
+      // per invocation of the nested loop rather than per iteration.
+      SmallVector<AllocaInst *> LoopStarts;
+      SmallVector<AllocaInst *> LoopTimes;
+      for (unsigned Slot = 1; Slot < NumSlots; ++Slot) {
+        LoopStarts.push_back(CreateCounter("loop_start"));
+        LoopTimes.push_back(CreateCounter("loop_time"));
+      }
 
-      auto UpdateStats = [&](uint64_t Counter, size_t Idx) {
-        if (Counter == 0)
+      auto AddOnEntry = [&](unsigned Slot, StatIndex Stat, Value *Count) {
+        if (!Count)
           return;
-
-        Value *Ptr =
-            Builder.CreateConstInBoundsGEP2_32(LoopStatsTy, StatsMem, 0, Idx);
-        Value *Old = Builder.CreateLoad(Type::getInt64Ty(F.getContext()), Ptr);
-        Value *New = Builder.CreateAdd(
-            Old, ConstantInt::get(Type::getInt64Ty(F.getContext()), Counter));
-        Builder.CreateStore(New, Ptr);
+        AllocaInst *Counter = Counters[Slot * NumStats + Stat];
+        BasicBlock *Preheader = SlotLoops[Slot]->getLoopPreheader();
+        Builder.SetInsertPoint(Preheader->getTerminator());
+        Builder.CreateStore(
+            Builder.CreateAdd(Builder.CreateLoad(I64Ty, Counter), Count),
+            Counter);
       };
+      for (unsigned Slot = 0; Slot < NumSlots; ++Slot) {
+        AddOnEntry(Slot, StatIndex::TripCount, TripCounts[Slot]);
+        AddOnEntry(Slot, StatIndex::FootprintBytes, Footprints[Slot]);
+      }
 
-      for (auto *BB : OutermostLoop->getBlocks()) {
-        uint64_t BytesLoad = 0;
-        uint64_t BytesStore = 0;
-        uint64_t ScalarIntOps = 0;
-        uint64_t ScalarFloatOps = 0;
-        uint64_t ScalarDoubleOps = 0;
-        uint64_t VectorIntOps = 0;
-        uint64_t VectorFloatOps = 0;
-        uint64_t VectorDoubleOps = 0;
-
-        auto DL = F.getParent()->getDataLayout();
-
-        for (auto &&I : *BB) {
-          switch (I.getOpcode()) {
-          case Instruction::Load:
-            if (I.getType()->isVectorTy()) {
-              BytesLoad += getVectorBytes(I.getType(), DL);
-            } else {
-              BytesLoad += DL.getTypeAllocSize(I.getType());
-            }
-            break;
-          case Instruction::Store:
-            if (I.getOperand(0)->getType()->isVectorTy()) {
-              BytesStore += getVectorBytes(I.getOperand(0)->getType(), DL);
-            } else {
-              BytesStore += DL.getTypeAllocSize(I.getOperand(0)->getType());
-            }
-            break;
-          case Instruction::Add:
-          case Instruction::Sub:
-          case Instruction::Shl:
-          case Instruction::Mul:
-          case Instruction::CompareUsingScalarTypes:
-            if (I.getType()->isVectorTy()) {
-              VectorIntOps += getVectorBytes(I.getType(), DL);
-            } else {
-              ScalarIntOps += 1;
-            }
-            break;
-          case Instruction::FAdd:
-          case Instruction::FMul:
-          case Instruction::FSub:
-          case Instruction::FDiv:
-          case Instruction::FRem:
-          case Instruction::FCmp:
-            if (I.getType()->isVectorTy()) {
-              auto VecTy = cast<VectorType>(I.getType());
-              auto ElementTy = VecTy->getElementType();
-              unsigned Multiplier = getVectorBytes(I.getType(), DL);
-              if (ElementTy->isFloatTy()) {
-                VectorFloatOps += Multiplier;
-              } else {
-                // FIXME this could actually be half or bfloat
-                VectorDoubleOps += Multiplier;
-              }
-            } else if (I.getType()->isFloatTy()) {
-              ScalarFloatOps += 1;
-            } else {
-              ScalarFloatOps += 1;
-            }
-            break;
-          case Instruction::Call: {
-            auto &Call = cast<CallInst>(I);
-            if (!isa<IntrinsicInst>(Call))
-              break;
-            switch (Call.getIntrinsicID()) {
-            case Intrinsic::fmuladd:
-            case Intrinsic::fma:
-              if (I.getType()->isVectorTy()) {
-                auto VecTy = cast<VectorType>(I.getType());
-                auto ElementTy = VecTy->getElementType();
-                unsigned Multiplier = getVectorBytes(I.getType(), DL);
-                if (ElementTy->isFloatTy()) {
-                  VectorFloatOps += 2 * Multiplier;
-                } else {
-                  // FIXME this could actually be half or bfloat
-                  VectorDoubleOps += 2 * Multiplier;
-                }
-              } else if (I.getType()->isFloatTy()) {
-                ScalarFloatOps += 2;
-              } else {
-                ScalarFloatOps += 2;
-              }
-              break;
-            case Intrinsic::minnum:
-            case Intrinsic::minimum:
-            case Intrinsic::maxnum:
-            case Intrinsic::maximum:
-              if (I.getType()->isVectorTy()) {
-                auto VecTy = cast<VectorType>(I.getType());
-                auto ElementTy = VecTy->getElementType();
-                unsigned Multiplier = getVectorBytes(I.getType(), DL);
-                if (ElementTy->isFloatTy()) {
-                  VectorFloatOps += Multiplier;
-                } else {
-                  // FIXME this could actually be half or bfloat
-                  VectorDoubleOps += Multiplier;
-                }
-              } else if (I.getType()->isFloatTy()) {
-                ScalarFloatOps += 1;
-              } else {
-                ScalarFloatOps += 1;
-              }
-              break;
-            }
-          }
+      for (unsigned Slot = 1; Slot < NumSlots; ++Slot) {
+        Loop *Nested = SlotLoops[Slot];
+        AllocaInst *Start = LoopStarts[Slot - 1];
+        AllocaInst *Time = LoopTimes[Slot - 1];
+
+        Builder.SetInsertPoint(Nested->getLoopPreheader()->getTerminator());
+        Builder.CreateStore(Builder.CreateCall(Hooks.Timestamp), Start);
+
+        SmallVector<BasicBlock *, 4> Exits;
+        Nested->getUniqueExitBlocks(Exits);
+        for (BasicBlock *Exit : Exits) {
+          Builder.SetInsertPoint(Exit, Exit->getFirstInsertionPt());
+          Value *Elapsed =
+              Builder.CreateSub(Builder.CreateCall(Hooks.Timestamp),
+                                Builder.CreateLoad(I64Ty, Start));
+          Value *Total = Builder.CreateLoad(I64Ty, Time);
+          Builder.CreateStore(Builder.CreateAdd(Total, Elapsed), Time);
+        }
+      }
+
+      emitDynamicCounts(SlotLoops, Counters, DL, SE, LoopInfo);
+      emitDynamicFootprints(DynamicFootprints, Counters, DL);
+
+      // The edges into the exits of the instrumented version leave the
+      // region, the stats are reported in each of them.
+      SmallVector<BasicBlock *> InstrBlocks{InstrPreheader};
+      append_range(InstrBlocks, OutermostLoop->getBlocks());
+      CounterRegion Region{InstrBlocks, InstrPreheader, Weights};
+
+      bool CountersPlaced = false;
+      if (SpanningTreeCounters) {
+        BranchProbabilityInfo BPI(F, LoopInfo);
+        BlockFrequencyInfo BFI(F, BPI, LoopInfo);
+        CountersPlaced = placeSpanningTreeCounters(Region, Counters, BFI, BPI);
+      }
+      if (!CountersPlaced)
+        placeBlockCounters(Region, Counters);
+
+      auto LoadCounter = [&](AllocaInst *Counter) {
+        return Builder.CreateLoad(Counter->getAllocatedType(), Counter);
+      };
+      Value *VScale = nullptr;
+      auto StoreStats = [&](Value *Stats, unsigned Slot) {
+        for (unsigned Idx = 0; Idx < NumStats; ++Idx) {
+          Value *Count = LoadCounter(Counters[Slot * NumStats + Idx]);
+          if (VScale) {
+            Value *PerVScale = LoadCounter(
+                Counters[ScalableBase + Slot * NumStats + Idx]);
+            Count = Builder.CreateAdd(Count,
+                                      Builder.CreateMul(PerVScale, VScale));
           }
+          Builder.CreateStore(
+              Count,
+              Builder.CreateConstInBoundsGEP2_32(LoopStatsTy, Stats, 0, Idx));
         }
-        Builder.SetInsertPoint(BB->getTerminator());
-        UpdateStats(BytesLoad, 1);
-        UpdateStats(BytesStore, 2);
-        UpdateStats(ScalarIntOps, 3);
-        UpdateStats(ScalarFloatOps, 4);
-        UpdateStats(ScalarDoubleOps, 5);
-        UpdateStats(VectorIntOps, 6);
-        UpdateStats(VectorFloatOps, 7);
-        UpdateStats(VectorDoubleOps, 8);
       };
 
-      // There's always at least one return in the generated function
-      // TODO ensure there's exactly one return
-      BasicBlock *RetBlock = &*find_if(*Instrumented, [](BasicBlock &BB) {
-        return any_of(BB, [](Instruction &I) { return isa<ReturnInst>(I); });
-      });
-
-      Value *LocalHandle = Instrumented->getArg(Instrumented->arg_size() - 1);
-      Builder.SetInsertPoint(RetBlock->getTerminator());
-      Builder.CreateCall(NotifyStats, {LocalHandle, StatsMem});
+      for (BasicBlock *InstrExit : InstrExits) {
+        Builder.SetInsertPoint(InstrExit->getTerminator());
+        if (HasScalable)
+          VScale = Builder.CreateIntrinsic(Intrinsic::vscale, {I64Ty}, {});
+        StoreStats(StatsMem, 0);
+        Builder.CreateCall(Hooks.NotifyStats, {LoopHandle, StatsMem});
 
-      if (verifyFunction(*Instrumented, &llvm::errs())) {
-        abort();
+        if (!NumNested)
+          continue;
+        for (unsigned Slot = 1; Slot < NumSlots; ++Slot) {
+          Value *Entry = Builder.CreateConstInBoundsGEP2_32(
+              NestedArrayTy, NestedStatsMem, 0, Slot - 1);
+          auto Field = [&](unsigned Idx) {
+            return Builder.CreateConstInBoundsGEP2_32(NestedStatsTy, Entry, 0,
+                                                      Idx);
+          };
+          Builder.CreateStore(ConstantInt::get(I64Ty, SlotIds[Slot]),
+                              Field(0));
+          Builder.CreateStore(
+              LoadCounter(Counters[InvocationsBase + Slot - 1]), Field(1));
+          Builder.CreateStore(LoadCounter(LoopTimes[Slot - 1]), Field(2));
+          StoreStats(Field(3), Slot);
+        }
+        Builder.CreateCall(Hooks.NotifyNestedStats,
+                           {LoopHandle, NestedStatsMem,
+                            ConstantInt::get(I64Ty, NumNested)});
       }
+
+      SmallVector<AllocaInst *> Promoted(Counters.begin(), Counters.end());
+      Promoted.append(LoopStarts.begin(), LoopStarts.end());
+      Promoted.append(LoopTimes.begin(), LoopTimes.end());
+      DominatorTree PromoteDT(F);
+      PromoteMemToReg(Promoted, PromoteDT);
+
+      if (OptNoneClones)
+        outlineUnoptimized(F, InstrPreheader, JoinBlocks, PromoteDT);
+
+      if (VerifyClones && verifyFunction(F, &llvm::errs()))
+        report_fatal_error("miniperf produced an invalid loop clone",
+                           /*gen_crash_diag=*/false);
     }
 
-    return PreservedAnalyses::none();
+    // After versioning, so every return left in F gets the leave hook.
+    if (isOutlinedParallelRegion(F))
+      instrumentOutlinedRegion(F, Hooks);
+
+    return true;
   }
 };
 
@@ -471,6 +2131,10 @@ struct MiniperfInstr : PassInfoMixin<MiniperfInstr> {
 llvm::PassPluginLibraryInfo getMiniperfPluginInfo() {
   return {LLVM_PLUGIN_API_VERSION, "miniperf", LLVM_VERSION_STRING,
           [](PassBuilder &PB) {
+            // Pre-link compiles only get the optimizer last callbacks so
+            // that clang can add passes to them, the loops are shaped by
+            // cross-module inlining later. ThinLTO runs the same callbacks
+            // again in its post-link backends, full LTO has its own.
             PB.registerOptimizerLastEPCallback([](llvm::ModulePassManager &PM,
                                                   OptimizationLevel Level
 #if LLVM_VERSION_MAJOR >= 20
@@ -478,8 +2142,17 @@ llvm::PassPluginLibraryInfo getMiniperfPluginInfo() {
                                                   ThinOrFullLTOPhase Phase
 #endif
                                                ) {
-              PM.addPass(createModuleToFunctionPassAdaptor(MiniperfInstr()));
+#if LLVM_VERSION_MAJOR >= 20
+              if (Phase == ThinOrFullLTOPhase::ThinLTOPreLink ||
+                  Phase == ThinOrFullLTOPhase::FullLTOPreLink)
+                return;
+#endif
+              PM.addPass(MiniperfInstr());
             });
+            PB.registerFullLinkTimeOptimizationLastEPCallback(
+                [](llvm::ModulePassManager &PM, OptimizationLevel Level) {
+                  PM.addPass(MiniperfInstr());
+                });
           }};
 }
 